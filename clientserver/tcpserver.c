@@ -13,6 +13,8 @@
 #include <assert.h>
 #include <math.h>
 
+#include "hgshm_scan.h"
+
 static int TRUE = 1;
 #define MB (1024 * 1024)
 #define TCPBUFLEN (4 * MB)
@@ -33,13 +35,7 @@ typedef struct _c {
 
 static int dowork(void *arg, size_t sz)
 {
-    int i;
-    char *ptr = arg;
-    int x = 0;
-    for (i = 0; i < sz; i++)
-        if (ptr[i] == 'S')
-            x++;
-    return x;
+    return hgshm_count_byte(arg, sz, 'S');
 }
 
 static void * prepare(int port, int af)
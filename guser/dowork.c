@@ -6,6 +6,10 @@
 #include <stdint.h>
 #include <assert.h>
 
+#include "hgshm_scan.h"
+
+int scan_threads = 1;
+
 static int timediff (struct timeval *t1, struct timeval *t2,
     struct timeval *diff)
 {
@@ -40,31 +44,32 @@ static int timediff (struct timeval *t1, struct timeval *t2,
     return cmp;
 }
 
-static int dowork(void *arg, size_t sz)
+static size_t dowork(void *arg, size_t sz)
 {
-    int i;
-    char *ptr = arg;
-    int x = 0;
-    for (i = 0; i < sz; i++)
-        if (ptr[i] == 'S')
-            x++;
-    return x;
+    return hgshm_count_byte_mt(arg, sz, 'S', scan_threads);
 }
 
 int main (int argc, char *argv[])
 {
     size_t sz = (32ULL << 30);
     int i;
+    if (argc < 2) {
+        printf("Usage: %s <num reducers> [scan threads]\n", argv[0]);
+        exit(1);
+    }
     int nservers = atoi(argv[1]);
+    if (argc > 2)
+        scan_threads = atoi(argv[2]);
     size_t szpervm = sz / nservers;
     size_t slicesz = (1ULL << 30) / nservers;
     if (slicesz > (256 << 20))
         slicesz = 256 << 20;
     int     count = szpervm / slicesz;
 
-    printf ("Severs: %d slicesz: %ld MB, Count: %d\n",
-        nservers, (slicesz >> 20), count);
+    printf ("Severs: %d slicesz: %ld MB, Count: %d, scan: %s x %d\n",
+        nservers, (slicesz >> 20), count, hgshm_scan_impl(), scan_threads);
     char *ptr1 = malloc (slicesz);
+    memset(ptr1, 0, slicesz);
     struct timeval start, end, elp;
     gettimeofday(&start, NULL);
     for (i = 0; i < count; i++)
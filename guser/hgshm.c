@@ -3,6 +3,16 @@
 #include <string.h>
 #include <unistd.h>
 #include "hgshm.h"
+#include "hgshm_wait.h"
+#include "hgshm_pipe.h"
+#include "hgshm_ctl.h"
+#include "hgshm_coll.h"
+#include "hgshm_scan.h"
+#include "hgshm_sched.h"
+#include "hgshm_copy.h"
+#include "hgshm_ingest.h"
+#include "hgshm_stream.h"
+#include "hgshm_outbox.h"
 #include <stdint.h>
 #include <time.h>
 #include <sys/time.h>
@@ -13,29 +23,35 @@ void *shmptr[2];
 size_t	shm_sz;
 size_t	shm_slice_sz;
 int myindex;
-int alldone;
-#define MAGIC   0xCAFEF00D
+int policy;
+int scan_threads = 1;
+int mode;       /* MODE_*, from HGSHM_SCHED */
+int window = 4; /* stream mode, from HGSHM_WINDOW */
+char *input;    /* HGSHM_INPUT file, "-" for stdin */
+hgshm_ctl_t *ctl;
+hgshm_coll_t *coll;
+hgshm_sched_t *sched;
 #define GB      (1 << 30)
 int  counter;
 
-#undef  POLLING
-#define POLLING
-
-#ifdef POLLING
-int callbackrunning = 1;
-#endif
+/* Sub-buffers per slice, the mapper fills one while the reducer works */
+#define NBUFS   2
+/* Collective slots carry {count, buffers} */
+#define COLL_SLOT   64
+/* Work stealing chunks, HGSHM_SCHED=steal */
+#define CHUNK       (1 << 20)
+/* Command telling reducers the mode, value is MODE_* */
+#define CMD_MODE    HGSHM_CTL_USER
+#define MODE_PIPE   0
+#define MODE_STEAL  1
+#define MODE_STREAM 2
+#define MODE_BCAST  3
+/* Most of slice 0 a non-zero VM maps */
+#define MAP_SLICE   (128 << 20)
 
 #define DEBUG
 #undef DEBUG
 
-typedef struct _dt { /* data transfer */
-    void    *src;
-    void    *dst;
-    size_t  size;
-    int     dindex;
-    int     *nservers;
-} dtarg_t;
-
 static int thread_create(void *function, void *arg,
     int retries, pthread_t *tid, int detachstate)
 {
@@ -54,12 +70,6 @@ static int thread_create(void *function, void *arg,
     return(res);
 }
 
-static int thread_create_detached(void *function, void *arg,
-    int retries, pthread_t *tid)
-{
-    return thread_create(function, arg, retries, tid, PTHREAD_CREATE_DETACHED);
-}
-
 static int timediff (struct timeval *t1, struct timeval *t2,
     struct timeval *diff)
 {
@@ -94,99 +104,430 @@ static int timediff (struct timeval *t1, struct timeval *t2,
     return cmp;
 }
 
-static int dowork(void *arg, size_t sz)
+static size_t dowork(void *arg, size_t sz)
 {
-    int i;
-    char *ptr = arg;
-    int x = 0;
-    for (i = 0; i < sz; i++)
-        if (ptr[i] == 'S')
-            x++;
-    return x;
+    return hgshm_count_byte_mt(arg, sz, 'S', scan_threads);
 }
 
-static void callback(void *arg)
+/*
+ * Reduce buffers until the mapper sends an empty one, then report the
+ * total and the number of buffers in our control block status.
+ */
+static void reducer(void *arg)
 {
-    int nservers = *((int *)(arg));
-#ifdef POLLING
-    while (callbackrunning) {
-#endif
-        if (myindex == 0) {
-            int j;
-            int c = 0;
-            for (j = 0; j < nservers; j++) {
-                int32_t *count = (int32_t *)(shmptr[0]);
-                //printf("count[%d]: %X\n", j, count[j * 2]);
-                if (count[j * 2] == MAGIC)
-                    c++;
-            }
-            if (c == nservers) {
-                for (j = 0; j < nservers; j++) {
-                    int32_t *count = (int32_t *)(shmptr[0]);
-                    count[j * 2] = -1;
-                }
-                alldone = 1;
-            }
-        } else {
-            int32_t *ptr = (int32_t *)shmptr[1];
-#ifdef POLLING
-            while (ptr[8192 + (myindex * 2)] != MAGIC);
-            ptr[8192 + (myindex * 2)] = 0;
-#endif
+    hgshm_pipe_t *pipe = arg;
+    uint64_t nbufs = 0;
+    int64_t total = 0;
+    size_t len;
+    void *data;
+    int buf;
+
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_READY, 0, 0);
+    while ((data = hgshm_pipe_next(pipe, &len, &buf, -1)) != NULL) {
+        if (len == 0) {
+            hgshm_pipe_release(pipe, buf, 0);
+            break;
+        }
+        if (myindex != 0)
             printf("%d INDEX: %d. Got new work\n", counter++, myindex);
-            ptr[(myindex * 2) + 1] = dowork(shmptr[0], shm_slice_sz);
-            ptr[(myindex * 2) + 0] = MAGIC;
-#ifndef POLLING
-//            printf("NOTIFY 0\n");
-            if (hgshm_notify(0) < 0)
-                printf("Could not notify index 0\n");
-#endif
+        int64_t x = dowork(data, len);
+        total += x;
+        nbufs++;
+        hgshm_pipe_release(pipe, buf, x);
+        hgshm_ctl_credit_return(ctl, myindex, 1);
+    }
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_DONE, total, nbufs);
+}
+
+/*
+ * Work stealing mode: take chunks from slice 0, ours first, until the
+ * mapper is done. Reports like reducer() with chunks for buffers.
+ */
+static void steal_reducer(void *arg)
+{
+    hgshm_sched_t *s = arg;
+    uint64_t nchunks = 0;
+    int64_t total = 0;
+    size_t len;
+    void *data;
+    int c;
+
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_READY, 0, 0);
+    while ((data = hgshm_sched_next(s, &c, &len, -1)) != NULL) {
+        int64_t x = dowork(data, len);
+        total += x;
+        nchunks++;
+        hgshm_sched_done(s, c, x);
+    }
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_DONE, total, nchunks);
+}
+
+/*
+ * Stream mode: reduce segments until the end of the stream, keeping the
+ * largest count any window of consecutive segments had. The window is
+ * the one the mapper formatted the stream with, not our HGSHM_WINDOW.
+ */
+static void stream_reducer(void *arg)
+{
+    hgshm_stream_t *s = arg;
+    /* Counts of the segments still in the window, by seq */
+    int64_t counts[HGSHM_STREAM_MAX_SEGS], total = 0, sum, peak = 0;
+    void *wdata[HGSHM_STREAM_MAX_SEGS];
+    size_t wlen[HGSHM_STREAM_MAX_SEGS];
+    uint64_t seq, last, nsegs = 0;
+    int i, n, nwin = 0;
+    size_t len;
+    void *data;
+
+    if (s != NULL)
+        nwin = hgshm_stream_window_size(s);
+    if (nwin < 1 || nwin >= HGSHM_STREAM_MAX_SEGS) {
+        printf("Reducer %d: bad stream window %d\n", myindex, nwin);
+        hgshm_ctl_post(ctl, myindex, HGSHM_CTL_DONE, 0, 0);
+        return;
+    }
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_READY, 0, 0);
+    while ((data = hgshm_stream_next(s, &seq, &len, -1)) != NULL &&
+        len != 0) {
+        int64_t x = dowork(data, len);
+        counts[seq % HGSHM_STREAM_MAX_SEGS] = x;
+        n = hgshm_stream_window(s, wdata, wlen, nwin, &last);
+        for (i = 0, sum = 0; i < n; i++)
+            sum += counts[(last - i) % HGSHM_STREAM_MAX_SEGS];
+        if (sum > peak)
+            peak = sum;
+        total += x;
+        nsegs++;
+    }
+    printf("Reducer %d: peak count %ld in %d segments\n", myindex, peak,
+        nwin);
+    hgshm_stream_print_stats(s, stdout);
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_DONE, total, nsegs);
+}
+
+/*
+ * Broadcast mode: every reducer reads every buffer of the outbox where
+ * the mapper wrote it, and gives it back.
+ */
+static void bcast_reducer(void *arg)
+{
+    hgshm_outbox_t *ob = arg;
+    uint64_t nbufs = 0;
+    int64_t total = 0;
+    hgshm_desc_t desc;
+    const void *data;
+
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_READY, 0, 0);
+    while (hgshm_outbox_next(ob, &desc, &data, -1) == 0 && desc.len) {
+        total += dowork((void *)data, desc.len);
+        nbufs++;
+        hgshm_outbox_release(ob, &desc);
+    }
+    hgshm_outbox_print_stats(ob, stdout);
+    hgshm_ctl_post(ctl, myindex, HGSHM_CTL_DONE, total, nbufs);
+}
+
+/* Sum {count, buffers} from our status line over all VMs */
+static int reduce_totals(int64_t *totals)
+{
+    hgshm_ctl_rec_t rec;
+    int64_t mine[2];
+
+    hgshm_ctl_status(ctl, myindex, &rec);
+    mine[0] = rec.value;
+    mine[1] = rec.arg;
+    return hgshm_coll_allreduce(coll, mine, totals, 2, HGSHM_COLL_INT64,
+        HGSHM_COLL_SUM, -1);
+}
+
+/* Print what every reducer reported and the sums */
+static void print_totals(int nservers)
+{
+    hgshm_ctl_rec_t rec;
+    int64_t totals[2];
+    int j;
+
+    reduce_totals(totals);
+    for (j = 0; j < nservers; j++) {
+        hgshm_ctl_status(ctl, j, &rec);
+        printf("Reducer %d: %lu buffers, count %ld\n", j, rec.arg,
+            rec.value);
+    }
+    printf("Total: %ld buffers, count %ld\n", totals[1], totals[0]);
+}
+
+static uint64_t elapsed_ms(struct timeval *start)
+{
+    struct timeval end, elp;
+
+    gettimeofday(&end, NULL);
+    timediff(start, &end, &elp);
+    return (elp.tv_sec * 1000) + (elp.tv_usec / 1000);
+}
+
+/* Read the input straight into the pipes, which then get eof */
+static void ingest_input(hgshm_pipe_t **pipes, int nservers)
+{
+    hgshm_ingest_t *in = hgshm_ingest_open(input, HGSHM_INGEST_DIRECT, 0);
+
+    if (in == NULL) {
+        printf("Could not open %s\n", input);
+        exit(1);
+    }
+    if (hgshm_ingest_run(in, pipes, nservers) < 0)
+        printf("Could not read all of %s\n", input);
+    hgshm_ingest_print_stats(in, stdout);
+    hgshm_ingest_close(in);
+}
+
+/*
+ * Static mode: one pipe per slice, slice 0's after off0. A reducer has a
+ * credit per buffer; each buffer goes to the next one with a credit left,
+ * so a slow reducer gets fewer instead of holding up the others.
+ */
+static void map_pipes(int gb, int nservers, size_t off0)
+{
+    hgshm_pipe_t *pipes[nservers];
+    hgshm_pool_t *pool;
+    struct timeval start;
+    pthread_t tid0;
+    int j;
+
+    for (j = 0; j < nservers; j++) {
+        if (j == 0)
+            pipes[j] = hgshm_pipe_create(hgshm_default_ctx(),
+                shmptr[0] + off0, shm_slice_sz - off0, NBUFS, 0, j,
+                policy);
+        else
+            pipes[j] = hgshm_pipe_create(hgshm_default_ctx(),
+                shmptr[0] + (shm_slice_sz * j), shm_slice_sz, NBUFS,
+                0, j, policy);
+        if (pipes[j] == NULL) {
+            printf("Could not create pipe %d\n", j);
+            exit(1);
         }
-#ifdef POLLING
+        hgshm_ctl_credit_init(ctl, j, NBUFS);
     }
-#endif
+    if (thread_create(reducer, hgshm_pipe_attach(hgshm_default_ctx(),
+        shmptr[0] + off0, policy, 0), 3, &tid0,
+        PTHREAD_CREATE_JOINABLE) != 0) {
+        printf ("Could not create thread\n");
+        exit(1);
+    }
+    if ((pool = hgshm_pool_create(nservers, 1)) == NULL) {
+        printf ("Could not create copy threads\n");
+        exit(1);
+    }
+
+    hgshm_coll_barrier(coll, -1);
+
+    /* Slice 0 buffers are the smallest, the control block is there */
+    size_t bufsz = hgshm_pipe_buf_size(pipes[0]);
+    int count = input ? 0 : (((uint64_t)gb * GB) / bufsz / nservers) *
+        nservers;
+    void *buf = malloc(bufsz);
+    bzero(buf, bufsz);
+    gettimeofday(&start, NULL);
+    if (input)
+        ingest_input(pipes, nservers);
+    for (j = 0; count--; j++) {
+        int b;
+        j = hgshm_ctl_credit_take_any(ctl, j, -1);
+        hgshm_pipe_acquire(pipes[j], &b, NULL, -1);
+        if (hgshm_pipe_copy(pool, pipes[j], b, buf, bufsz) < 0)
+            printf ("Could not queue copy for %d\n", j);
+    }
+    for (j = 0; j < nservers; j++)
+        hgshm_pipe_drain(pipes[j], -1);
+    printf("%d %ld\n", gb, elapsed_ms(&start));
+    hgshm_pipe_print_stats(pipes[nservers - 1], stdout);
+
+    if (input == NULL)
+        for (j = 0; j < nservers; j++)
+            hgshm_pipe_eof(pipes[j], -1);
+    pthread_join(tid0, NULL);
+    hgshm_pool_destroy(pool);
+    for (j = 0; j < nservers; j++)
+        hgshm_pipe_close(pipes[j]);
+    free(buf);
 }
 
-static void worker0(void *arg)
+/*
+ * Work stealing mode: CHUNK sized chunks in slice 0 after off0, queued
+ * round robin. A slow reducer loses its queue to the others instead of
+ * holding up the round.
+ */
+static void map_steal(int gb, int nservers, size_t off0)
 {
-//    printf("Worker %d INDEX: %d. Got new work\n", counter++, myindex);
-    int32_t *ptr = (int32_t *)shmptr[0];
-    ptr[(myindex * 2) + 1] = dowork(shmptr[0], shm_slice_sz);
-    ptr[(myindex * 2) + 0] = MAGIC;
-#ifndef POLLING
-    callback(arg);
-#endif
+    hgshm_sched_summary_t sum;
+    hgshm_sched_t *local;
+    struct timeval start;
+    pthread_t tid0;
+    size_t size;
+    int c;
+
+    /* Non-zero VMs map at most MAP_SLICE of slice 0 */
+    size = ((shm_slice_sz < MAP_SLICE) ? shm_slice_sz : MAP_SLICE) - off0;
+    sched = hgshm_sched_create(hgshm_default_ctx(), shmptr[0] + off0, size,
+        nservers, 0, CHUNK);
+    if (sched == NULL) {
+        printf("Could not create the scheduler\n");
+        exit(1);
+    }
+    local = hgshm_sched_attach(hgshm_default_ctx(), shmptr[0] + off0, 0);
+    if (thread_create(steal_reducer, local, 3, &tid0,
+        PTHREAD_CREATE_JOINABLE) != 0) {
+        printf ("Could not create thread\n");
+        exit(1);
+    }
+
+    hgshm_coll_barrier(coll, -1);
+
+    int count = ((uint64_t)gb * GB) / CHUNK;
+    void *buf = malloc(CHUNK);
+    bzero(buf, CHUNK);
+    gettimeofday(&start, NULL);
+    while (count--) {
+        void *data = hgshm_sched_get(sched, &c, -1);
+        hgshm_copy_to_slice(data, buf, CHUNK);
+        hgshm_sched_put(sched, c, CHUNK, -1);
+    }
+    hgshm_sched_wait(sched, &sum, -1);
+    printf("%d %ld\n", gb, elapsed_ms(&start));
+    printf("%lu chunks, %lu stolen\n", sum.chunks, sum.stolen);
+    hgshm_sched_print(sched, stdout);
+
+    hgshm_sched_eof(sched);
+    pthread_join(tid0, NULL);
+    hgshm_sched_close(local);
+    hgshm_sched_close(sched);
+    free(buf);
 }
 
-void print_usage(char *pgm, int ec)
+/*
+ * Stream mode: a ring of CHUNK segments per slice, fed round robin for
+ * gb GB or, with gb 0, until killed. A reducer that falls behind fills
+ * its ring and the mapper waits for it there.
+ */
+static void map_stream(int gb, int nservers, size_t off0)
 {
-    printf("Usage: %s <dev> <GB> [num reducers]\n", pgm);
-    if (ec)
-        exit(ec);
+    hgshm_stream_t *streams[nservers];
+    struct timeval start;
+    uint64_t seq, n = 0;
+    pthread_t tid0;
+    int j;
+
+    for (j = 0; j < nservers; j++) {
+        if (j == 0)
+            streams[j] = hgshm_stream_create(hgshm_default_ctx(),
+                shmptr[0] + off0, shm_slice_sz - off0, CHUNK, window,
+                policy);
+        else
+            streams[j] = hgshm_stream_create(hgshm_default_ctx(),
+                shmptr[0] + (shm_slice_sz * j), shm_slice_sz, CHUNK,
+                window, policy);
+        if (streams[j] == NULL) {
+            printf("Could not create stream %d\n", j);
+            exit(1);
+        }
+    }
+    if (thread_create(stream_reducer, hgshm_stream_attach(
+        hgshm_default_ctx(), shmptr[0] + off0, policy, 0), 3, &tid0,
+        PTHREAD_CREATE_JOINABLE) != 0) {
+        printf ("Could not create thread\n");
+        exit(1);
+    }
+
+    hgshm_coll_barrier(coll, -1);
+
+    uint64_t count = ((uint64_t)gb * GB) / CHUNK;
+    void *buf = malloc(CHUNK);
+    bzero(buf, CHUNK);
+    gettimeofday(&start, NULL);
+    while (gb == 0 || n < count) {
+        for (j = 0; j < nservers && (gb == 0 || n < count); j++, n++) {
+            void *data = hgshm_stream_reserve(streams[j], &seq, -1);
+            hgshm_copy_to_slice(data, buf, CHUNK);
+            hgshm_stream_commit(streams[j], seq, CHUNK);
+        }
+        /* Line rate every GB */
+        if (gb == 0 && n % (GB / CHUNK) < (uint64_t)nservers)
+            printf("%lu GB %lu MB/s\n", n / (GB / CHUNK),
+                n * (CHUNK >> 20) * 1000 / (elapsed_ms(&start) + 1));
+    }
+    for (j = 0; j < nservers; j++)
+        hgshm_stream_drain(streams[j], -1);
+    printf("%d %ld\n", gb, elapsed_ms(&start));
+    hgshm_stream_print_stats(streams[nservers - 1], stdout);
+
+    for (j = 0; j < nservers; j++)
+        hgshm_stream_eof(streams[j], -1);
+    pthread_join(tid0, NULL);
+    for (j = 0; j < nservers; j++)
+        hgshm_stream_close(streams[j]);
+    free(buf);
 }
 
-void doxfer (void *arg)
+/*
+ * Broadcast mode: every reducer gets all gb GB. The mapper writes each
+ * CHUNK once into an outbox in slice 0 after off0 and publishes it to
+ * all reducers, instead of copying it into every slice.
+ */
+static void map_bcast(int gb, int nservers, size_t off0)
 {
-    dtarg_t *dt = arg;
-    bcopy(dt->src, dt->dst, dt->size);
-    if (dt->dindex == 0) {
-        pthread_t tid;
-        if (thread_create_detached(worker0, dt->nservers, 3, &tid) != 0)
-            printf ("Could not create thread\n");
-    } else {
-#ifdef POLLING
-        int32_t *ptr = (int32_t *)shmptr[0];
-        ptr[8192 + (dt->dindex * 2)] = MAGIC;
-#else
-//        printf("NOTIFY %d\n", dt->dindex);
-        if (hgshm_notify(dt->dindex) < 0)
-            printf("Could not notify index %d\n", dt->dindex);
-#endif
+    uint64_t all = (nservers < 64) ? (1ULL << nservers) - 1 : ~0ULL;
+    size_t data, size;
+    struct timeval start;
+    hgshm_outbox_t *ob;
+    pthread_t tid0;
+    int b;
+
+    /* Buffers after the header, page aligned */
+    data = (off0 + hgshm_outbox_hdr_size(nservers) + 4095) & ~(size_t)4095;
+    size = ((shm_slice_sz < MAP_SLICE) ? shm_slice_sz : MAP_SLICE);
+    ob = (data < size) ? hgshm_outbox_create(hgshm_default_ctx(),
+        shmptr[0] + off0, shmptr[0] + data, size - data, CHUNK, nservers,
+        policy) : NULL;
+    if (ob == NULL) {
+        printf("Could not create the outbox\n");
+        exit(1);
+    }
+    if (thread_create(bcast_reducer, hgshm_outbox_attach(
+        hgshm_default_ctx(), shmptr[0] + off0, 0, policy, 0), 3, &tid0,
+        PTHREAD_CREATE_JOINABLE) != 0) {
+        printf ("Could not create thread\n");
+        exit(1);
     }
-    free(arg);
-    pthread_exit(0);
+
+    hgshm_coll_barrier(coll, -1);
+
+    int count = ((uint64_t)gb * GB) / CHUNK;
+    void *buf = malloc(CHUNK);
+    bzero(buf, CHUNK);
+    gettimeofday(&start, NULL);
+    while (count--) {
+        void *data = hgshm_outbox_get(ob, &b, -1);
+        hgshm_copy_to_slice(data, buf, CHUNK);
+        hgshm_outbox_publish(ob, b, CHUNK, all);
+    }
+    hgshm_outbox_drain(ob, -1);
+    printf("%d %ld\n", gb, elapsed_ms(&start));
+    hgshm_outbox_print_stats(ob, stdout);
+
+    hgshm_outbox_eof(ob, all);
+    pthread_join(tid0, NULL);
+    hgshm_outbox_close(ob);
+    free(buf);
 }
 
+void print_usage(char *pgm, int ec)
+{
+    printf("Usage: %s <dev|devnum> <GB> [num reducers]\n", pgm);
+    printf("HGSHM_SCHED=stream streams until killed with GB 0\n");
+    printf("HGSHM_SCHED=bcast sends all GB to every reducer\n");
+    if (ec)
+        exit(ec);
+}
 
 int main (int argc, char *argv[])
 {
@@ -201,18 +542,30 @@ int main (int argc, char *argv[])
 
 //    printf("Device: %s, GB: %d: NS: %d\n", dev, gb, nservers);
 
-    hgshm_init(dev, callback, &nservers);
+    policy = hgshm_wait_policy_env();
+    if (hgshm_init(dev, NULL, NULL) < 0) {
+        printf("Could not open %s\n", dev);
+        exit(1);
+    }
     myindex = hgshm_get_index();
 
     if (strcmp(argv[2], "-h") == 0) {
         printf("%d\n", myindex);
         exit(0);
     }
-#ifdef POLLING
-    printf("Polling mode\n");
-#else
-    printf("Interrupt mode\n");
-#endif
+    if (getenv("HGSHM_SCAN_THREADS"))
+        scan_threads = atoi(getenv("HGSHM_SCAN_THREADS"));
+    if (getenv("HGSHM_SCHED") && strcmp(getenv("HGSHM_SCHED"), "steal") == 0)
+        mode = MODE_STEAL;
+    if (getenv("HGSHM_SCHED") && strcmp(getenv("HGSHM_SCHED"), "stream") == 0)
+        mode = MODE_STREAM;
+    if (getenv("HGSHM_SCHED") && strcmp(getenv("HGSHM_SCHED"), "bcast") == 0)
+        mode = MODE_BCAST;
+    if (getenv("HGSHM_WINDOW"))
+        window = atoi(getenv("HGSHM_WINDOW"));
+    input = getenv("HGSHM_INPUT");
+    printf("Wait policy: %s, scan: %s x %d\n", hgshm_wait_policy_name(policy),
+        hgshm_scan_impl(), scan_threads);
     shmptr[0] = hgshm_getshm(0, &shm_sz);
     shmptr[1] = hgshm_getshm(1, &shm_slice_sz);
 
@@ -277,45 +630,83 @@ while (1) {
     }
 }
 #else
-#ifdef POLLING
-    pthread_t tid;
-    if (thread_create_detached(callback, &nservers, 3, &tid) != 0)
-        printf ("Could not create thread\n");
-#endif
     if (myindex == 0) {
-        int count = (((uint64_t)gb * GB) / shm_slice_sz) / nservers;
-        void *buf = malloc(shm_slice_sz);
-        bzero(buf, shm_slice_sz);
-        struct timeval start, end, elp;
-        gettimeofday(&start, NULL);
-        while (count--) {
-            int j;
-            alldone = 0;
-            for (j = 0; j < nservers; j++) {
-                pthread_t xfertid;
-                dtarg_t *dt = malloc(sizeof(dtarg_t)); /* Freed by thread */
-                dt->src = buf;
-                dt->dst = shmptr[0] + (shm_slice_sz * j);
-                dt->size = shm_slice_sz;
-                dt->dindex = j;
-                dt->nservers = &nservers;
-                if (thread_create_detached(doxfer, dt, 3, &xfertid) != 0)
-                    printf ("Could not create xfer thread\n");
-            }
-            while (! alldone);
+        size_t off0;
+        int j;
+
+        /*
+         * Control block and collectives at the start of slice 0, then
+         * the mode's buffers. Slice 0 is reduced by a thread of ours.
+         */
+        ctl = hgshm_ctl_create(hgshm_default_ctx(), shmptr[0],
+            shm_slice_sz, nservers, policy);
+        if (ctl)
+            coll = hgshm_coll_create(hgshm_default_ctx(),
+                hgshm_ctl_data(ctl), shm_slice_sz - hgshm_ctl_size(nservers),
+                nservers, COLL_SLOT, policy);
+        if (ctl == NULL || coll == NULL) {
+            printf("Could not create control block\n");
+            exit(1);
         }
-        gettimeofday(&end, NULL);
-        timediff(&start, &end, &elp);
-        uint64_t elapsed = (elp.tv_sec * 1000) + (elp.tv_usec / 1000);
-        printf("%d %ld\n", gb, elapsed);
-        free(buf);
-#ifdef POLLING
-        pthread_cancel(tid);
-        callbackrunning = 0;
-#endif
+        off0 = hgshm_ctl_size(nservers) + hgshm_coll_size(nservers, COLL_SLOT);
+        for (j = 1; j < nservers; j++)
+            hgshm_ctl_command(ctl, j, CMD_MODE, mode, off0);
+        if (mode == MODE_STEAL)
+            map_steal(gb, nservers, off0);
+        else if (mode == MODE_STREAM)
+            map_stream(gb, nservers, off0);
+        else if (mode == MODE_BCAST)
+            map_bcast(gb, nservers, off0);
+        else
+            map_pipes(gb, nservers, off0);
+        print_totals(nservers);
     } else {
-        while (1);
+        hgshm_ctl_rec_t cmd;
+        int64_t totals[2];
+        uint64_t seen = 0;
+
+        ctl = hgshm_ctl_attach(hgshm_default_ctx(), shmptr[1], policy, -1);
+        if (ctl)
+            coll = hgshm_coll_attach(hgshm_default_ctx(),
+                hgshm_ctl_data(ctl), policy, -1);
+        if (ctl == NULL || coll == NULL) {
+            printf("Could not attach control block\n");
+            exit(1);
+        }
+        do {
+            hgshm_ctl_wait_command(ctl, myindex, &seen, &cmd, -1);
+        } while (cmd.state != CMD_MODE);
+        if (cmd.value == MODE_STEAL) {
+            sched = hgshm_sched_attach(hgshm_default_ctx(),
+                shmptr[1] + cmd.arg, -1);
+            hgshm_coll_barrier(coll, -1);
+            steal_reducer(sched);
+            hgshm_sched_close(sched);
+        } else if (cmd.value == MODE_STREAM) {
+            hgshm_stream_t *s = hgshm_stream_attach(hgshm_default_ctx(),
+                shmptr[0], policy, -1);
+            hgshm_coll_barrier(coll, -1);
+            stream_reducer(s);
+            hgshm_stream_close(s);
+        } else if (cmd.value == MODE_BCAST) {
+            hgshm_outbox_t *ob = hgshm_outbox_attach(hgshm_default_ctx(),
+                shmptr[1] + cmd.arg, myindex, policy, -1);
+            if (ob == NULL)
+                exit(1);
+            hgshm_coll_barrier(coll, -1);
+            bcast_reducer(ob);
+            hgshm_outbox_close(ob);
+        } else {
+            hgshm_pipe_t *pipe = hgshm_pipe_attach(hgshm_default_ctx(),
+                shmptr[0], policy, -1);
+            hgshm_coll_barrier(coll, -1);
+            reducer(pipe);
+            hgshm_pipe_close(pipe);
+        }
+        reduce_totals(totals);
     }
+    hgshm_coll_close(coll);
+    hgshm_ctl_close(ctl);
 #endif
     usleep(1000);
 	hgshm_close();
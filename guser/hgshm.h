@@ -1,9 +1,89 @@
 #ifndef _HGSHM_H
 #define _HGSHM_H
-void * hgshm_init (char * dev, void (*cb)(void *), void *cb_arg);
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Context API. A context is one open hgshm device or emulated region.
+ * Any number of contexts can be open in a process and every call except
+ * hgshm_ctx_close() is safe to use from several threads at once.
+ *
+ * dev: device path, device number ("1" for /dev/hgshm1) or NULL, or
+ * "shm:<shmid>,index=<n>,..." for the host emulation backend.
+ *
+ * cb is called on a per context notifier thread whenever another VM
+ * notifies this one.
+ */
+typedef struct hgshm_ctx hgshm_ctx_t;
+
+hgshm_ctx_t * hgshm_ctx_open(const char *dev, void (*cb)(void *),
+    void *cb_arg);
+void hgshm_ctx_close(hgshm_ctx_t *ctx);
+int hgshm_ctx_notify(hgshm_ctx_t *ctx, int index);
+int hgshm_ctx_get_index(hgshm_ctx_t *ctx);
+/* index 0: BAR1 (whole region or own slice), 1: slice 0 (non-zero VMs) */
+void * hgshm_ctx_getshm(hgshm_ctx_t *ctx, int index, size_t *sz);
+size_t hgshm_ctx_get_shm_slice_sz(hgshm_ctx_t *ctx);
+/*
+ * Read-only view of every slice, so a buffer another VM built can be read
+ * where it is instead of being copied. Index 0 has it in BAR1, a non-zero
+ * VM with the device 'fullview' property ('fullview=1' for emulation).
+ * Without it this is slice 0 only. Writes go through hgshm_ctx_getshm().
+ */
+void * hgshm_ctx_view(hgshm_ctx_t *ctx, size_t *sz);
+/*
+ * Pointers differ between VMs, region offsets do not: an offset counts
+ * from the start of slice 0. region_off returns (uint64_t)-1 for a
+ * pointer outside the region, region_ptr NULL for a range that this VM
+ * cannot see. region_ptr prefers the writable mappings.
+ */
+uint64_t hgshm_ctx_region_off(hgshm_ctx_t *ctx, const void *ptr);
+void * hgshm_ctx_region_ptr(hgshm_ctx_t *ctx, uint64_t off, size_t len);
+/*
+ * Block until the context has seen an interrupt that the caller has not.
+ * *seen is the caller's cookie, start with 0 and pass back what is
+ * returned. timeout_ms < 0 waits forever. Returns -1 on timeout.
+ */
+int hgshm_ctx_wait(hgshm_ctx_t *ctx, uint64_t *seen, int timeout_ms);
+/*
+ * Current hgshm_ctx_wait() cookie: only interrupts after this call
+ * satisfy a wait that starts from it.
+ */
+uint64_t hgshm_ctx_events(hgshm_ctx_t *ctx);
+/*
+ * Non-zero index VMs can only ring index 0. Once every VM of a region
+ * has set the same 64 bit word in slice 0 as relay, hgshm_ctx_notify()
+ * from one non-zero VM to another sets the target's bit there and rings
+ * index 0, whose notifier thread rings the target. NULL turns it off.
+ */
+void hgshm_ctx_set_relay(hgshm_ctx_t *ctx, uint64_t *relay);
+
+/*
+ * Notification queues. A VM has 1 to 16 of them (the qemu device
+ * 'queues' property, 'queues=' for emulation), each with its own
+ * doorbell, interrupt vector and notifier thread, so threads that wait
+ * on different queues do not share a wakeup. Queue 0 is the context:
+ * hgshm_ctx_notify(), hgshm_ctx_wait() and the callback.
+ *
+ * Ringing a queue the target does not have is lost like a notify to a
+ * VM that is not there. The relay only carries queue 0, so a non-zero
+ * VM can ring queues of index 0 and of itself only.
+ */
+int hgshm_ctx_queues(hgshm_ctx_t *ctx);
+int hgshm_ctx_notify_queue(hgshm_ctx_t *ctx, int index, int queue);
+int hgshm_ctx_wait_queue(hgshm_ctx_t *ctx, int queue, uint64_t *seen,
+    int timeout_ms);
+uint64_t hgshm_ctx_queue_events(hgshm_ctx_t *ctx, int queue);
+
+/*
+ * Original single device API, kept for compatibility. It works on a
+ * default context opened by hgshm_init().
+ */
+int hgshm_init (char * dev, void (*cb)(void *), void *cb_arg);
 void hgshm_close();
 int hgshm_notify(int);
 int hgshm_get_index(void);
 void * hgshm_getshm(int index, size_t *sz);
 size_t hgshm_get_shm_slice_sz(void);
+hgshm_ctx_t * hgshm_default_ctx(void);
 #endif /* _HGSHM_H */
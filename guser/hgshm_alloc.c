@@ -0,0 +1,205 @@
+/*
+ * Shared memory arena allocator, see hgshm_alloc.h.
+ *
+ * Layout: header, then the bump region from 'start' to 'size'. Slabs and
+ * large objects are taken from the bump region in cache line multiples.
+ *
+ * A free list head is a 32 bit offset plus a 32 bit tag that changes on
+ * every update, so a CAS cannot succeed on a head that was popped and
+ * pushed back in between (ABA). A free object keeps the offset of the
+ * next one in its first 4 bytes.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "hgshm_int.h"
+#include "hgshm_alloc.h"
+
+#define HGSHM_ARENA_MAGIC   0x48474152  /* "HGAR" */
+#define ARENA_NCLASSES      9           /* 16 ... 4096 */
+#define ARENA_SLAB_SZ       (64 << 10)
+
+#define FL_OFF(h)           ((uint32_t)(h))
+#define FL_TAG(h)           ((uint32_t)((h) >> 32))
+#define FL_MAKE(tag, off)   (((uint64_t)(tag) << 32) | (off))
+
+struct hgshm_arena {
+    uint32_t    magic;
+    uint64_t    size;
+    uint64_t    start;
+    uint64_t    generation;
+    uint64_t    bump HGSHM_ALIGNED;
+    struct {
+        uint64_t    head HGSHM_ALIGNED;
+    } free[ARENA_NCLASSES];
+};
+
+static size_t arena_round(size_t sz)
+{
+    return (sz + HGSHM_CACHELINE - 1) & ~(size_t)(HGSHM_CACHELINE - 1);
+}
+
+static int arena_class(size_t size)
+{
+    if (size <= HGSHM_ARENA_MIN_CLASS)
+        return 0;
+    return (64 - __builtin_clzll(size - 1)) - 4;   /* log2(16) == 4 */
+}
+
+static size_t arena_class_size(int cls)
+{
+    return (size_t)HGSHM_ARENA_MIN_CLASS << cls;
+}
+
+static uint32_t *arena_next(hgshm_arena_t *a, uint32_t off)
+{
+    return (uint32_t *)((char *)a + off);
+}
+
+/* Take len bytes from the bump region, 0 if they are not there */
+static hgshm_off_t arena_bump(hgshm_arena_t *a, size_t len)
+{
+    uint64_t cur = __atomic_load_n(&a->bump, __ATOMIC_RELAXED);
+
+    do {
+        if (len > a->size - cur)
+            return HGSHM_OFF_NULL;
+    } while (!__atomic_compare_exchange_n(&a->bump, &cur, cur + len, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return cur;
+}
+
+static uint32_t arena_pop(hgshm_arena_t *a, int cls)
+{
+    uint64_t *head = &a->free[cls].head;
+    uint64_t old = hgshm_load_acquire(head);
+    uint32_t next;
+
+    do {
+        if (FL_OFF(old) == 0)
+            return 0;
+        next = __atomic_load_n(arena_next(a, FL_OFF(old)), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(head, &old,
+        FL_MAKE(FL_TAG(old) + 1, next), 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return FL_OFF(old);
+}
+
+/* Push the chain first ... last, already linked through their next fields */
+static void arena_push(hgshm_arena_t *a, int cls, uint32_t first, uint32_t last)
+{
+    uint64_t *head = &a->free[cls].head;
+    uint64_t old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(arena_next(a, last), FL_OFF(old), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(head, &old,
+        FL_MAKE(FL_TAG(old) + 1, first), 0,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Carve a slab for cls, keep the first object and free the rest. Falls
+ * back to a single cache line multiple when a whole slab does not fit.
+ */
+static hgshm_off_t arena_carve(hgshm_arena_t *a, int cls)
+{
+    size_t csz = arena_class_size(cls);
+    size_t len = (csz > ARENA_SLAB_SZ) ? csz : ARENA_SLAB_SZ;
+    hgshm_off_t slab;
+    uint32_t n, i;
+
+    if ((slab = arena_bump(a, len)) == HGSHM_OFF_NULL) {
+        len = arena_round(csz);
+        if ((slab = arena_bump(a, len)) == HGSHM_OFF_NULL)
+            return HGSHM_OFF_NULL;
+    }
+    n = len / csz;
+    if (n > 1) {
+        for (i = 1; i < n - 1; i++)
+            *arena_next(a, slab + i * csz) = slab + (i + 1) * csz;
+        arena_push(a, cls, slab + csz, slab + (n - 1) * csz);
+    }
+    return slab;
+}
+
+hgshm_arena_t *hgshm_arena_init(void *mem, size_t size)
+{
+    hgshm_arena_t *a = mem;
+
+    if (mem == NULL || ((uintptr_t)mem & (HGSHM_CACHELINE - 1)))
+        return NULL;
+    if (size > HGSHM_ARENA_MAX_SIZE)
+        size = HGSHM_ARENA_MAX_SIZE;
+    if (size < arena_round(sizeof(hgshm_arena_t)) + HGSHM_CACHELINE)
+        return NULL;
+
+    bzero(a, sizeof(hgshm_arena_t));
+    a->size = size & ~(uint64_t)(HGSHM_CACHELINE - 1);
+    a->start = arena_round(sizeof(hgshm_arena_t));
+    a->bump = a->start;
+    /* Magic last, hgshm_arena_attach must not see a half made arena */
+    hgshm_store_release(&a->magic, HGSHM_ARENA_MAGIC);
+    return a;
+}
+
+hgshm_arena_t *hgshm_arena_attach(void *mem)
+{
+    hgshm_arena_t *a = mem;
+
+    if (mem == NULL || hgshm_load_acquire(&a->magic) != HGSHM_ARENA_MAGIC)
+        return NULL;
+    return a;
+}
+
+hgshm_off_t hgshm_arena_alloc(hgshm_arena_t *a, size_t size)
+{
+    hgshm_off_t off;
+    int cls;
+
+    if (size == 0)
+        return HGSHM_OFF_NULL;
+    if (size > HGSHM_ARENA_MAX_CLASS)
+        return arena_bump(a, arena_round(size));
+
+    cls = arena_class(size);
+    if ((off = arena_pop(a, cls)) != 0)
+        return off;
+    return arena_carve(a, cls);
+}
+
+void hgshm_arena_free(hgshm_arena_t *a, hgshm_off_t off, size_t size)
+{
+    int cls;
+
+    /* Large objects go back with the next reset */
+    if (off == HGSHM_OFF_NULL || size == 0 || size > HGSHM_ARENA_MAX_CLASS)
+        return;
+    cls = arena_class(size);
+    arena_push(a, cls, off, off);
+}
+
+void hgshm_arena_reset(hgshm_arena_t *a)
+{
+    int i;
+
+    for (i = 0; i < ARENA_NCLASSES; i++)
+        __atomic_store_n(&a->free[i].head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->bump, a->start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&a->generation, 1, __ATOMIC_RELEASE);
+}
+
+size_t hgshm_arena_size(hgshm_arena_t *a)
+{
+    return a->size - a->start;
+}
+
+size_t hgshm_arena_used(hgshm_arena_t *a)
+{
+    return __atomic_load_n(&a->bump, __ATOMIC_RELAXED) - a->start;
+}
+
+uint64_t hgshm_arena_generation(hgshm_arena_t *a)
+{
+    return hgshm_load_acquire(&a->generation);
+}
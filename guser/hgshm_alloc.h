@@ -0,0 +1,60 @@
+#ifndef _HGSHM_ALLOC_H
+#define _HGSHM_ALLOC_H
+/*
+ * Arena allocator for a shared memory slice.
+ *
+ * Every VM maps the slice at its own address, so the allocator hands out
+ * offsets from the start of the arena (hgshm_off_t) instead of pointers.
+ * An offset stored in shared memory resolves in any VM with
+ * hgshm_arena_ptr(). Offset 0 is the arena header and doubles as NULL.
+ *
+ * Sizes up to HGSHM_ARENA_MAX_CLASS come from power of 2 size classes,
+ * carved out of the arena a slab at a time and recycled through lock
+ * free per class free lists. Larger sizes are bump allocated and only
+ * come back with hgshm_arena_reset(). Alloc and free can be called from
+ * any thread of any VM that maps the arena.
+ *
+ * hgshm_arena_reset() drops everything at once, typically at the end of
+ * a round. Nobody may be using the arena while it runs.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint64_t hgshm_off_t;
+#define HGSHM_OFF_NULL          0
+
+#define HGSHM_ARENA_MIN_CLASS   16
+#define HGSHM_ARENA_MAX_CLASS   4096
+/* Arenas are at most 4G, free lists keep 32 bit offsets */
+#define HGSHM_ARENA_MAX_SIZE    (1ULL << 32)
+
+typedef struct hgshm_arena hgshm_arena_t;
+
+/* Format mem (cache line aligned) as an arena of size bytes */
+hgshm_arena_t * hgshm_arena_init(void *mem, size_t size);
+/* Use an arena formatted by another VM, NULL if mem is not an arena */
+hgshm_arena_t * hgshm_arena_attach(void *mem);
+
+/* HGSHM_OFF_NULL when out of memory */
+hgshm_off_t hgshm_arena_alloc(hgshm_arena_t *a, size_t size);
+/* size must be the size passed to hgshm_arena_alloc */
+void hgshm_arena_free(hgshm_arena_t *a, hgshm_off_t off, size_t size);
+void hgshm_arena_reset(hgshm_arena_t *a);
+
+size_t hgshm_arena_size(hgshm_arena_t *a);
+/* Bytes taken from the bump region, including slabs */
+size_t hgshm_arena_used(hgshm_arena_t *a);
+/* Bumped by every reset, lets readers detect stale offsets */
+uint64_t hgshm_arena_generation(hgshm_arena_t *a);
+
+static inline void *hgshm_arena_ptr(hgshm_arena_t *a, hgshm_off_t off)
+{
+    return (off == HGSHM_OFF_NULL) ? NULL : (char *)a + off;
+}
+
+static inline hgshm_off_t hgshm_arena_off(hgshm_arena_t *a, const void *ptr)
+{
+    return (ptr == NULL) ? HGSHM_OFF_NULL :
+        (hgshm_off_t)((const char *)ptr - (const char *)a);
+}
+#endif /* _HGSHM_ALLOC_H */
@@ -0,0 +1,487 @@
+/*
+ * Columnar record batches, see hgshm_batch.h for the layout.
+ *
+ * The builder lays out the fixed width columns and offset arrays for
+ * max_rows first, in column order, then one data area per variable
+ * width column. Finish moves every buffer down to the end of the one
+ * before, in the same order, so a batch that is not full takes no more
+ * than its rows.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hgshm_int.h"
+#include "hgshm_batch.h"
+
+#define HGSHM_BATCH_MAGIC   0x42524748  /* "HGRB" */
+
+struct hgshm_batch {
+    uint32_t    magic;
+    uint16_t    major;
+    uint16_t    minor;
+    uint32_t    ncols;
+    uint32_t    col_size;
+    uint64_t    nrows;
+    uint64_t    size;
+    uint64_t    col_off;
+    uint8_t     pad[24];
+};
+
+typedef struct {
+    char        name[HGSHM_BATCH_NAME];
+    uint32_t    type;
+    uint32_t    width;
+    uint64_t    data_off;
+    uint64_t    data_len;
+    uint64_t    offsets_off;
+} batch_col_t;
+
+struct hgshm_batch_builder {
+    hgshm_batch_t *hdr;
+    batch_col_t *cols;
+    int         ncols;
+    int         nvar;
+    uint64_t    nrows;
+    uint64_t    max_rows;
+    uint64_t    *var_cap;           /* per column, 0 for fixed */
+};
+
+static const uint32_t batch_width[] = {
+    [HGSHM_BATCH_INT8] = 1,
+    [HGSHM_BATCH_INT16] = 2,
+    [HGSHM_BATCH_INT32] = 4,
+    [HGSHM_BATCH_INT64] = 8,
+    [HGSHM_BATCH_UINT8] = 1,
+    [HGSHM_BATCH_UINT16] = 2,
+    [HGSHM_BATCH_UINT32] = 4,
+    [HGSHM_BATCH_UINT64] = 8,
+    [HGSHM_BATCH_FLOAT] = 4,
+    [HGSHM_BATCH_DOUBLE] = 8,
+    [HGSHM_BATCH_BINARY] = 0,
+};
+
+static const char *batch_type_name[] = {
+    [HGSHM_BATCH_INT8] = "int8",
+    [HGSHM_BATCH_INT16] = "int16",
+    [HGSHM_BATCH_INT32] = "int32",
+    [HGSHM_BATCH_INT64] = "int64",
+    [HGSHM_BATCH_UINT8] = "uint8",
+    [HGSHM_BATCH_UINT16] = "uint16",
+    [HGSHM_BATCH_UINT32] = "uint32",
+    [HGSHM_BATCH_UINT64] = "uint64",
+    [HGSHM_BATCH_FLOAT] = "float",
+    [HGSHM_BATCH_DOUBLE] = "double",
+    [HGSHM_BATCH_BINARY] = "binary",
+};
+
+static uint64_t batch_align(uint64_t off)
+{
+    return (off + HGSHM_BATCH_ALIGN - 1) &
+        ~(uint64_t)(HGSHM_BATCH_ALIGN - 1);
+}
+
+static int batch_type_ok(int type)
+{
+    return type >= HGSHM_BATCH_INT8 && type <= HGSHM_BATCH_BINARY;
+}
+
+static const batch_col_t *batch_col(const hgshm_batch_t *t, int col)
+{
+    return (const batch_col_t *)((const char *)t + t->col_off +
+        (uint64_t)col * t->col_size);
+}
+
+/* Bytes of the header, descriptors, fixed columns and offsets */
+static uint64_t batch_fixed_size(const hgshm_batch_field_t *schema,
+    int ncols, uint64_t max_rows)
+{
+    uint64_t off = batch_align(sizeof(hgshm_batch_t) +
+        ncols * sizeof(batch_col_t));
+    int i;
+
+    for (i = 0; i < ncols; i++)
+        off = batch_align(off + ((schema[i].type == HGSHM_BATCH_BINARY) ?
+            (max_rows + 1) * sizeof(uint32_t) :
+            max_rows * batch_width[schema[i].type]));
+    return off;
+}
+
+size_t hgshm_batch_size(const hgshm_batch_field_t *schema, int ncols,
+    uint64_t max_rows, size_t var_bytes)
+{
+    int i, nvar = 0;
+
+    for (i = 0; i < ncols; i++)
+        nvar += (schema[i].type == HGSHM_BATCH_BINARY);
+    return batch_fixed_size(schema, ncols, max_rows) +
+        batch_align(var_bytes) + nvar * HGSHM_BATCH_ALIGN;
+}
+
+hgshm_batch_builder_t *hgshm_batch_builder(void *mem, size_t size,
+    const hgshm_batch_field_t *schema, int ncols, uint64_t max_rows)
+{
+    hgshm_batch_builder_t *b;
+    hgshm_batch_t *hdr = mem;
+    uint64_t off, area = 0;
+    batch_col_t *c;
+    int i;
+
+    if (mem == NULL || ((uintptr_t)mem & (HGSHM_BATCH_ALIGN - 1)) ||
+        ncols < 1 || max_rows == 0 || max_rows >= UINT32_MAX)
+        return NULL;
+    for (i = 0; i < ncols; i++) {
+        if (!batch_type_ok(schema[i].type) || schema[i].name == NULL ||
+            strlen(schema[i].name) >= HGSHM_BATCH_NAME) {
+            printf("hgshm: bad batch column %d\n", i);
+            return NULL;
+        }
+    }
+    off = batch_fixed_size(schema, ncols, max_rows);
+    if (off > size || (b = calloc(1, sizeof(*b))) == NULL)
+        return NULL;
+    if ((b->var_cap = calloc(ncols, sizeof(uint64_t))) == NULL) {
+        free(b);
+        return NULL;
+    }
+    b->hdr = hdr;
+    b->cols = (batch_col_t *)(hdr + 1);
+    b->ncols = ncols;
+    b->max_rows = max_rows;
+    for (i = 0; i < ncols; i++)
+        b->nvar += (schema[i].type == HGSHM_BATCH_BINARY);
+    if (b->nvar)
+        area = ((size - off) / b->nvar) & ~(uint64_t)(HGSHM_BATCH_ALIGN - 1);
+
+    memset(hdr, 0, sizeof(*hdr) + ncols * sizeof(batch_col_t));
+    hdr->major = HGSHM_BATCH_VERSION_MAJOR;
+    hdr->minor = HGSHM_BATCH_VERSION_MINOR;
+    hdr->ncols = ncols;
+    hdr->col_size = sizeof(batch_col_t);
+    hdr->col_off = sizeof(hgshm_batch_t);
+    off = batch_align(sizeof(hgshm_batch_t) + ncols * sizeof(batch_col_t));
+    for (i = 0; i < ncols; i++) {
+        c = &b->cols[i];
+        strcpy(c->name, schema[i].name);
+        c->type = schema[i].type;
+        c->width = batch_width[c->type];
+        if (c->width) {
+            c->data_off = off;
+            off = batch_align(off + max_rows * c->width);
+        } else {
+            c->offsets_off = off;
+            *(uint32_t *)((char *)hdr + off) = 0;
+            off = batch_align(off + (max_rows + 1) * sizeof(uint32_t));
+        }
+    }
+    for (i = 0; i < ncols; i++) {
+        c = &b->cols[i];
+        if (c->width == 0) {
+            c->data_off = off;
+            b->var_cap[i] = area;
+            off += area;
+        }
+    }
+    return b;
+}
+
+static void batch_put(batch_col_t *c, char *dst, const hgshm_batch_value_t *v)
+{
+    switch (c->type) {
+    case HGSHM_BATCH_INT8:
+        *(int8_t *)dst = v->i;
+        break;
+    case HGSHM_BATCH_INT16:
+        *(int16_t *)dst = v->i;
+        break;
+    case HGSHM_BATCH_INT32:
+        *(int32_t *)dst = v->i;
+        break;
+    case HGSHM_BATCH_INT64:
+        *(int64_t *)dst = v->i;
+        break;
+    case HGSHM_BATCH_UINT8:
+        *(uint8_t *)dst = v->u;
+        break;
+    case HGSHM_BATCH_UINT16:
+        *(uint16_t *)dst = v->u;
+        break;
+    case HGSHM_BATCH_UINT32:
+        *(uint32_t *)dst = v->u;
+        break;
+    case HGSHM_BATCH_UINT64:
+        *(uint64_t *)dst = v->u;
+        break;
+    case HGSHM_BATCH_FLOAT:
+        *(float *)dst = v->d;
+        break;
+    case HGSHM_BATCH_DOUBLE:
+        *(double *)dst = v->d;
+        break;
+    }
+}
+
+int hgshm_batch_append(hgshm_batch_builder_t *b,
+    const hgshm_batch_value_t *row)
+{
+    char *base = (char *)b->hdr;
+    uint32_t *offs;
+    batch_col_t *c;
+    int i;
+
+    if (b->nrows == b->max_rows)
+        return -1;
+    /* Check all variable width values fit before writing any */
+    for (i = 0; i < b->ncols; i++) {
+        c = &b->cols[i];
+        if (c->width == 0 &&
+            c->data_len + row[i].bin.len > b->var_cap[i])
+            return -1;
+    }
+    for (i = 0; i < b->ncols; i++) {
+        c = &b->cols[i];
+        if (c->width) {
+            batch_put(c, base + c->data_off + b->nrows * c->width, &row[i]);
+            continue;
+        }
+        memcpy(base + c->data_off + c->data_len, row[i].bin.ptr,
+            row[i].bin.len);
+        c->data_len += row[i].bin.len;
+        offs = (uint32_t *)(base + c->offsets_off);
+        offs[b->nrows + 1] = c->data_len;
+    }
+    b->nrows++;
+    return 0;
+}
+
+void *hgshm_batch_builder_column(hgshm_batch_builder_t *b, int col)
+{
+    if (col < 0 || col >= b->ncols || b->cols[col].width == 0)
+        return NULL;
+    return (char *)b->hdr + b->cols[col].data_off;
+}
+
+int hgshm_batch_builder_set_rows(hgshm_batch_builder_t *b, uint64_t nrows)
+{
+    if (b->nvar || nrows > b->max_rows)
+        return -1;
+    b->nrows = nrows;
+    return 0;
+}
+
+uint64_t hgshm_batch_builder_rows(hgshm_batch_builder_t *b)
+{
+    return b->nrows;
+}
+
+size_t hgshm_batch_finish(hgshm_batch_builder_t *b)
+{
+    char *base = (char *)b->hdr;
+    uint64_t off, len;
+    batch_col_t *c;
+    int i;
+
+    off = batch_align(sizeof(hgshm_batch_t) +
+        b->ncols * sizeof(batch_col_t));
+    for (i = 0; i < b->ncols; i++) {
+        c = &b->cols[i];
+        if (c->width) {
+            len = b->nrows * c->width;
+            memmove(base + off, base + c->data_off, len);
+            c->data_off = off;
+            c->data_len = len;
+        } else {
+            len = (b->nrows + 1) * sizeof(uint32_t);
+            memmove(base + off, base + c->offsets_off, len);
+            c->offsets_off = off;
+        }
+        off = batch_align(off + len);
+    }
+    for (i = 0; i < b->ncols; i++) {
+        c = &b->cols[i];
+        if (c->width == 0) {
+            memmove(base + off, base + c->data_off, c->data_len);
+            c->data_off = off;
+            off = batch_align(off + c->data_len);
+        }
+    }
+    b->hdr->nrows = b->nrows;
+    b->hdr->size = off;
+    hgshm_store_release(&b->hdr->magic, HGSHM_BATCH_MAGIC);
+    free(b->var_cap);
+    free(b);
+    return off;
+}
+
+const hgshm_batch_t *hgshm_batch_open(const void *mem, size_t len)
+{
+    const hgshm_batch_t *t = mem;
+    const batch_col_t *c;
+    const uint32_t *offs;
+    uint32_t i;
+
+    if (len < sizeof(*t) || hgshm_load_acquire(&t->magic) !=
+        HGSHM_BATCH_MAGIC)
+        return NULL;
+    if (t->major != HGSHM_BATCH_VERSION_MAJOR) {
+        printf("hgshm: batch version %u.%u, expected %d.x\n", t->major,
+            t->minor, HGSHM_BATCH_VERSION_MAJOR);
+        return NULL;
+    }
+    /* Every extent comes from shared memory, check it without overflow */
+    if (t->size > len || t->col_size < sizeof(batch_col_t) ||
+        t->col_off > t->size ||
+        (uint64_t)t->ncols * t->col_size > t->size - t->col_off)
+        return NULL;
+    for (i = 0; i < t->ncols; i++) {
+        c = batch_col(t, i);
+        if (!batch_type_ok(c->type) || c->width != batch_width[c->type] ||
+            c->data_off > t->size || c->data_len > t->size - c->data_off)
+            return NULL;
+        if (c->width && (c->data_len % c->width ||
+            c->data_len / c->width != t->nrows))
+            return NULL;
+        if (c->width == 0) {
+            if (c->offsets_off > t->size || t->nrows >=
+                (t->size - c->offsets_off) / sizeof(uint32_t))
+                return NULL;
+            offs = (const uint32_t *)((const char *)t + c->offsets_off);
+            if (offs[0] != 0 || offs[t->nrows] > c->data_len)
+                return NULL;
+        }
+    }
+    return t;
+}
+
+uint64_t hgshm_batch_rows(const hgshm_batch_t *t)
+{
+    return t->nrows;
+}
+
+int hgshm_batch_ncols(const hgshm_batch_t *t)
+{
+    return t->ncols;
+}
+
+int hgshm_batch_find(const hgshm_batch_t *t, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < t->ncols; i++)
+        if (strncmp(batch_col(t, i)->name, name, HGSHM_BATCH_NAME) == 0)
+            return i;
+    return -1;
+}
+
+const char *hgshm_batch_col_name(const hgshm_batch_t *t, int col)
+{
+    return batch_col(t, col)->name;
+}
+
+int hgshm_batch_col_type(const hgshm_batch_t *t, int col)
+{
+    return batch_col(t, col)->type;
+}
+
+const void *hgshm_batch_values(const hgshm_batch_t *t, int col)
+{
+    const batch_col_t *c = batch_col(t, col);
+
+    return c->width ? (const char *)t + c->data_off : NULL;
+}
+
+const uint32_t *hgshm_batch_offsets(const hgshm_batch_t *t, int col)
+{
+    const batch_col_t *c = batch_col(t, col);
+
+    return c->width ? NULL :
+        (const uint32_t *)((const char *)t + c->offsets_off);
+}
+
+const void *hgshm_batch_data(const hgshm_batch_t *t, int col)
+{
+    const batch_col_t *c = batch_col(t, col);
+
+    return c->width ? NULL : (const char *)t + c->data_off;
+}
+
+const void *hgshm_batch_get_bin(const hgshm_batch_t *t, int col,
+    uint64_t row, uint32_t *len)
+{
+    const batch_col_t *c = batch_col(t, col);
+    const uint32_t *offs;
+
+    if (c->width || row >= t->nrows)
+        return NULL;
+    offs = (const uint32_t *)((const char *)t + c->offsets_off);
+    if (offs[row] > offs[row + 1] || offs[row + 1] > c->data_len)
+        return NULL;
+    *len = offs[row + 1] - offs[row];
+    return (const char *)t + c->data_off + offs[row];
+}
+
+static void batch_print_value(const hgshm_batch_t *t, int col,
+    uint64_t row, FILE *fp)
+{
+    const batch_col_t *c = batch_col(t, col);
+    const char *p = (const char *)t + c->data_off + row * c->width;
+    const void *bin;
+    uint32_t len;
+
+    switch (c->type) {
+    case HGSHM_BATCH_INT8:
+        fprintf(fp, "%d", *(const int8_t *)p);
+        break;
+    case HGSHM_BATCH_INT16:
+        fprintf(fp, "%d", *(const int16_t *)p);
+        break;
+    case HGSHM_BATCH_INT32:
+        fprintf(fp, "%d", *(const int32_t *)p);
+        break;
+    case HGSHM_BATCH_INT64:
+        fprintf(fp, "%ld", *(const int64_t *)p);
+        break;
+    case HGSHM_BATCH_UINT8:
+        fprintf(fp, "%u", *(const uint8_t *)p);
+        break;
+    case HGSHM_BATCH_UINT16:
+        fprintf(fp, "%u", *(const uint16_t *)p);
+        break;
+    case HGSHM_BATCH_UINT32:
+        fprintf(fp, "%u", *(const uint32_t *)p);
+        break;
+    case HGSHM_BATCH_UINT64:
+        fprintf(fp, "%lu", *(const uint64_t *)p);
+        break;
+    case HGSHM_BATCH_FLOAT:
+        fprintf(fp, "%g", *(const float *)p);
+        break;
+    case HGSHM_BATCH_DOUBLE:
+        fprintf(fp, "%g", *(const double *)p);
+        break;
+    case HGSHM_BATCH_BINARY:
+        if ((bin = hgshm_batch_get_bin(t, col, row, &len)) != NULL)
+            fprintf(fp, "%.*s", (int)len, (const char *)bin);
+        break;
+    }
+}
+
+void hgshm_batch_print(const hgshm_batch_t *t, FILE *fp, uint64_t max_rows)
+{
+    uint64_t row;
+    uint32_t i;
+
+    fprintf(fp, "batch v%u.%u: %lu rows, %lu bytes\n", t->major, t->minor,
+        t->nrows, t->size);
+    for (i = 0; i < t->ncols; i++)
+        fprintf(fp, "%s%s %s", i ? ", " : "  ", batch_col(t, i)->name,
+            batch_type_name[batch_col(t, i)->type]);
+    fprintf(fp, "\n");
+    for (row = 0; row < t->nrows && row < max_rows; row++) {
+        for (i = 0; i < t->ncols; i++) {
+            fprintf(fp, i ? " | " : "  ");
+            batch_print_value(t, i, row, fp);
+        }
+        fprintf(fp, "\n");
+    }
+}
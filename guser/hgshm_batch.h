@@ -0,0 +1,122 @@
+#ifndef _HGSHM_BATCH_H
+#define _HGSHM_BATCH_H
+/*
+ * Columnar record batches.
+ *
+ * A batch is a self describing block of rows stored column by column, so
+ * a reducer can run a vector kernel straight over a column in the slice
+ * instead of parsing records. The layout is the contract between
+ * producers and consumers, whatever language they are written in:
+ *
+ *	header, 64 bytes
+ *	    uint32 magic "HGRB" (0x42524748), uint16 major, uint16 minor,
+ *	    uint32 ncols, uint32 col_size (bytes per column descriptor),
+ *	    uint64 nrows, uint64 size (bytes of the whole batch),
+ *	    uint64 col_off (first column descriptor), zero padding
+ *	column descriptor, col_size (64) bytes each
+ *	    char name[32] (NUL padded), uint32 type, uint32 width (bytes per
+ *	    value, 0 for variable width), uint64 data_off, uint64 data_len,
+ *	    uint64 offsets_off (variable width only, else 0)
+ *	buffers, each at a 64 byte aligned offset
+ *
+ * All integers are little endian and all offsets are from the start of
+ * the batch, so it can be read wherever it is mapped. A fixed width
+ * column is nrows values. A variable width column has nrows + 1 uint32
+ * offsets into its data buffer, value i is [offsets[i], offsets[i + 1]).
+ * There are no nulls. Readers refuse another major version; minor
+ * versions only add fields at the end of the header or a descriptor.
+ *
+ *	mapper                                  reducer
+ *	b = hgshm_batch_builder(buf, len, ..)   t = hgshm_batch_open(data, len)
+ *	hgshm_batch_append(b, row) ...          x = hgshm_batch_values(t, col)
+ *	len = hgshm_batch_finish(b)             for (i = 0; i < rows; i++) x[i]
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HGSHM_BATCH_VERSION_MAJOR   1
+#define HGSHM_BATCH_VERSION_MINOR   0
+#define HGSHM_BATCH_ALIGN           64
+#define HGSHM_BATCH_NAME            32
+
+/* Column types */
+#define HGSHM_BATCH_INT8            1
+#define HGSHM_BATCH_INT16           2
+#define HGSHM_BATCH_INT32           3
+#define HGSHM_BATCH_INT64           4
+#define HGSHM_BATCH_UINT8           5
+#define HGSHM_BATCH_UINT16          6
+#define HGSHM_BATCH_UINT32          7
+#define HGSHM_BATCH_UINT64          8
+#define HGSHM_BATCH_FLOAT           9
+#define HGSHM_BATCH_DOUBLE          10
+#define HGSHM_BATCH_BINARY          11  /* variable width bytes */
+
+typedef struct {
+    const char  *name;
+    int         type;
+} hgshm_batch_field_t;
+
+/* One column of a row for hgshm_batch_append(), by column type */
+typedef union {
+    int64_t     i;              /* signed integers */
+    uint64_t    u;              /* unsigned integers */
+    double      d;              /* float and double */
+    struct {
+        const void *ptr;
+        uint32_t    len;
+    } bin;                      /* binary */
+} hgshm_batch_value_t;
+
+/* The batch in memory, for readers */
+typedef struct hgshm_batch hgshm_batch_t;
+typedef struct hgshm_batch_builder hgshm_batch_builder_t;
+
+/* Bytes a batch of max_rows takes with var_bytes of variable width data */
+size_t hgshm_batch_size(const hgshm_batch_field_t *schema, int ncols,
+    uint64_t max_rows, size_t var_bytes);
+
+/*
+ * Start a batch of up to max_rows rows in mem (64 byte aligned, size
+ * bytes). Whatever the fixed width columns and offsets leave is shared
+ * evenly by the variable width columns. NULL if it does not fit.
+ */
+hgshm_batch_builder_t * hgshm_batch_builder(void *mem, size_t size,
+    const hgshm_batch_field_t *schema, int ncols, uint64_t max_rows);
+/* Add a row, one value per column. -1 when the batch is full */
+int hgshm_batch_append(hgshm_batch_builder_t *b,
+    const hgshm_batch_value_t *row);
+/*
+ * Fill fixed width columns in place instead: write up to max_rows values
+ * to the columns, then set the row count. Only for batches without
+ * variable width columns.
+ */
+void * hgshm_batch_builder_column(hgshm_batch_builder_t *b, int col);
+int hgshm_batch_builder_set_rows(hgshm_batch_builder_t *b, uint64_t nrows);
+uint64_t hgshm_batch_builder_rows(hgshm_batch_builder_t *b);
+/*
+ * Pack the buffers together, seal the batch and free the builder.
+ * Returns the bytes of the batch, what to publish.
+ */
+size_t hgshm_batch_finish(hgshm_batch_builder_t *b);
+
+/* Check a batch of len bytes and return it, NULL if it is not valid */
+const hgshm_batch_t * hgshm_batch_open(const void *mem, size_t len);
+uint64_t hgshm_batch_rows(const hgshm_batch_t *t);
+int hgshm_batch_ncols(const hgshm_batch_t *t);
+/* Column by name, -1 if there is none */
+int hgshm_batch_find(const hgshm_batch_t *t, const char *name);
+const char * hgshm_batch_col_name(const hgshm_batch_t *t, int col);
+int hgshm_batch_col_type(const hgshm_batch_t *t, int col);
+/* Fixed width column values, NULL for a variable width column */
+const void * hgshm_batch_values(const hgshm_batch_t *t, int col);
+/* Variable width column offsets (nrows + 1) and data, NULL otherwise */
+const uint32_t * hgshm_batch_offsets(const hgshm_batch_t *t, int col);
+const void * hgshm_batch_data(const hgshm_batch_t *t, int col);
+/* Value of a variable width column, NULL if row is out of range */
+const void * hgshm_batch_get_bin(const hgshm_batch_t *t, int col,
+    uint64_t row, uint32_t *len);
+/* Schema and the first max_rows rows */
+void hgshm_batch_print(const hgshm_batch_t *t, FILE *fp, uint64_t max_rows);
+#endif /* _HGSHM_BATCH_H */
@@ -0,0 +1,320 @@
+/*
+ * Tree collectives, see hgshm_coll.h.
+ *
+ * Client i has parent (i - 1) / R and children R * i + 1 .. R * i + R.
+ * Its line holds the epoch it and its subtree arrived at. Index 0 writes
+ * the released epoch in the header once the whole tree has arrived.
+ * Epochs are counted by every handle in step, so waiting for equality
+ * is enough and they may wrap.
+ *
+ * Operation e uses slot bank e & 1. Bank b is written again by operation
+ * e + 2, which cannot start anywhere before everybody has arrived at
+ * e + 1, i.e. finished reading the results of e.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_ctl.h"
+#include "hgshm_coll.h"
+
+#define HGSHM_COLL_MAGIC    0x4847434f  /* "HGCO" */
+#define HGSHM_COLL_VERSION  2
+
+typedef struct {
+    uint32_t    arrive;
+    uint32_t    sleepers;           /* threads of this VM blocked */
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) coll_line_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    nclients;
+    uint32_t    radix;
+    uint64_t    slot_size;
+    uint64_t    line_off;           /* from the header */
+    uint64_t    slot_off;
+    uint64_t    size;
+    /* Written by index 0 only, read by everybody */
+    uint32_t    release __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    /* Written by every non-zero VM */
+    uint64_t    relay __attribute__((aligned(HGSHM_CTL_ALIGN)));
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) coll_hdr_t;
+
+struct hgshm_coll {
+    coll_hdr_t  *hdr;
+    coll_line_t *line;
+    hgshm_ctx_t *ctx;
+    hgshm_chan_t chan;
+    int         index;
+    uint32_t    epoch;
+};
+
+typedef struct {
+    int         type;
+    int         op;
+    size_t      count;
+} coll_reduce_t;
+
+static const size_t coll_type_size[] = {
+    [HGSHM_COLL_INT32] = sizeof(int32_t),
+    [HGSHM_COLL_INT64] = sizeof(int64_t),
+    [HGSHM_COLL_UINT64] = sizeof(uint64_t),
+    [HGSHM_COLL_FLOAT] = sizeof(float),
+    [HGSHM_COLL_DOUBLE] = sizeof(double),
+};
+
+static char *coll_slot(hgshm_coll_t *c, uint32_t epoch, int client)
+{
+    return (char *)c->hdr + c->hdr->slot_off + ((epoch & 1) *
+        c->hdr->nclients + client) * c->hdr->slot_size;
+}
+
+static void coll_notify(hgshm_coll_t *c, int index)
+{
+    if (hgshm_chan_notify(c->ctx, &c->line[index].sleepers, index) < 0)
+        printf("hgshm: could not notify index %d\n", index);
+}
+
+#define COLL_REDUCE(T) do {                                     \
+    T *d = (T *)dst;                                            \
+    const T *s = (const T *)src;                                \
+    size_t i;                                                   \
+    switch (r->op) {                                            \
+    case HGSHM_COLL_SUM:                                        \
+        for (i = 0; i < r->count; i++)                          \
+            d[i] += s[i];                                       \
+        break;                                                  \
+    case HGSHM_COLL_MIN:                                        \
+        for (i = 0; i < r->count; i++)                          \
+            d[i] = (s[i] < d[i]) ? s[i] : d[i];                 \
+        break;                                                  \
+    case HGSHM_COLL_MAX:                                        \
+        for (i = 0; i < r->count; i++)                          \
+            d[i] = (s[i] > d[i]) ? s[i] : d[i];                 \
+        break;                                                  \
+    }                                                           \
+} while (0)
+
+static void coll_combine(const coll_reduce_t *r, void *dst, const void *src)
+{
+    switch (r->type) {
+    case HGSHM_COLL_INT32:
+        COLL_REDUCE(int32_t);
+        break;
+    case HGSHM_COLL_INT64:
+        COLL_REDUCE(int64_t);
+        break;
+    case HGSHM_COLL_UINT64:
+        COLL_REDUCE(uint64_t);
+        break;
+    case HGSHM_COLL_FLOAT:
+        COLL_REDUCE(float);
+        break;
+    case HGSHM_COLL_DOUBLE:
+        COLL_REDUCE(double);
+        break;
+    }
+}
+
+/*
+ * Arrive and wait for the release of operation epoch. With r, children
+ * slots are combined into ours on the way up.
+ */
+static int coll_sync(hgshm_coll_t *c, uint32_t epoch,
+    const coll_reduce_t *r, int timeout_ms)
+{
+    int n = c->hdr->nclients, me = c->index;
+    int first = me * HGSHM_COLL_RADIX + 1, i;
+
+    for (i = first; i < first + HGSHM_COLL_RADIX && i < n; i++) {
+        if (hgshm_chan_wait_word(&c->chan, &c->line[i].arrive, epoch,
+            timeout_ms) < 0)
+            return -1;
+        if (r)
+            coll_combine(r, coll_slot(c, epoch, me),
+                coll_slot(c, epoch, i));
+    }
+    if (me != 0) {
+        hgshm_store_release(&c->line[me].arrive, epoch);
+        coll_notify(c, (me - 1) / HGSHM_COLL_RADIX);
+        return hgshm_chan_wait_word(&c->chan, &c->hdr->release, epoch,
+            timeout_ms);
+    }
+    hgshm_store_release(&c->hdr->release, epoch);
+    for (i = 1; i < n; i++)
+        coll_notify(c, i);
+    return 0;
+}
+
+static hgshm_coll_t *coll_handle(hgshm_ctx_t *ctx, coll_hdr_t *hdr,
+    int policy)
+{
+    hgshm_coll_t *c = calloc(1, sizeof(hgshm_coll_t));
+
+    if (c == NULL)
+        return NULL;
+    c->hdr = hdr;
+    c->line = (coll_line_t *)((char *)hdr + hdr->line_off);
+    c->ctx = ctx;
+    c->index = hgshm_ctx_get_index(ctx);
+    c->epoch = c->line[c->index].arrive;
+    hgshm_chan_init(&c->chan, ctx, policy, 0);
+    hgshm_chan_set_sleepers(&c->chan, &c->line[c->index].sleepers);
+    hgshm_ctx_set_relay(ctx, &hdr->relay);
+    return c;
+}
+
+size_t hgshm_coll_size(int nclients, size_t slot_size)
+{
+    size_t size;
+
+    slot_size = (slot_size + HGSHM_CACHELINE - 1) &
+        ~(size_t)(HGSHM_CACHELINE - 1);
+    size = sizeof(coll_hdr_t) + nclients * sizeof(coll_line_t) +
+        2 * nclients * slot_size;
+    return (size + HGSHM_PAGE_SIZE - 1) & ~(size_t)(HGSHM_PAGE_SIZE - 1);
+}
+
+hgshm_coll_t *hgshm_coll_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, size_t slot_size, int policy)
+{
+    coll_hdr_t *hdr = mem;
+
+    if (mem == NULL || nclients < 1 || nclients > HGSHM_MAX_CLIENTS ||
+        hgshm_ctx_get_index(ctx) != 0 || slot_size == 0 ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)) ||
+        size < hgshm_coll_size(nclients, slot_size))
+        return NULL;
+
+    hdr->magic = 0;
+    __sync_synchronize();
+    hdr->version = HGSHM_COLL_VERSION;
+    hdr->nclients = nclients;
+    hdr->radix = HGSHM_COLL_RADIX;
+    hdr->slot_size = (slot_size + HGSHM_CACHELINE - 1) &
+        ~(size_t)(HGSHM_CACHELINE - 1);
+    hdr->line_off = sizeof(coll_hdr_t);
+    hdr->slot_off = hdr->line_off + nclients * sizeof(coll_line_t);
+    hdr->size = hgshm_coll_size(nclients, slot_size);
+    hdr->release = 0;
+    hdr->relay = 0;
+    memset((char *)hdr + hdr->line_off, 0,
+        nclients * sizeof(coll_line_t));
+    hgshm_store_release(&hdr->magic, HGSHM_COLL_MAGIC);
+    return coll_handle(ctx, hdr, policy);
+}
+
+hgshm_coll_t *hgshm_coll_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms)
+{
+    coll_hdr_t *hdr = mem;
+
+    while (hgshm_load_acquire(&hdr->magic) != HGSHM_COLL_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    if (hdr->version != HGSHM_COLL_VERSION ||
+        hdr->radix != HGSHM_COLL_RADIX) {
+        printf("hgshm: collectives version %u radix %u, expected %d %d\n",
+            hdr->version, hdr->radix, HGSHM_COLL_VERSION, HGSHM_COLL_RADIX);
+        return NULL;
+    }
+    if (hgshm_ctx_get_index(ctx) >= (int)hdr->nclients) {
+        printf("hgshm: index %d is not in a group of %u\n",
+            hgshm_ctx_get_index(ctx), hdr->nclients);
+        return NULL;
+    }
+    return coll_handle(ctx, hdr, policy);
+}
+
+void hgshm_coll_close(hgshm_coll_t *c)
+{
+    hgshm_ctx_set_relay(c->ctx, NULL);
+    free(c);
+}
+
+size_t hgshm_coll_slot_size(hgshm_coll_t *c)
+{
+    return c->hdr->slot_size;
+}
+
+int hgshm_coll_nclients(hgshm_coll_t *c)
+{
+    return c->hdr->nclients;
+}
+
+int hgshm_coll_barrier(hgshm_coll_t *c, int timeout_ms)
+{
+    return coll_sync(c, ++c->epoch, NULL, timeout_ms);
+}
+
+int hgshm_coll_bcast(hgshm_coll_t *c, int root, void *buf, size_t len,
+    int timeout_ms)
+{
+    uint32_t epoch;
+
+    /* Check before taking an epoch, the peers would not take it */
+    if (len > c->hdr->slot_size || root < 0 ||
+        root >= (int)c->hdr->nclients)
+        return -1;
+    epoch = ++c->epoch;
+    if (c->index == root)
+        memcpy(coll_slot(c, epoch, root), buf, len);
+    if (coll_sync(c, epoch, NULL, timeout_ms) < 0)
+        return -1;
+    if (c->index != root)
+        memcpy(buf, coll_slot(c, epoch, root), len);
+    return 0;
+}
+
+int hgshm_coll_gather(hgshm_coll_t *c, int root, const void *in,
+    size_t len, void *out, int timeout_ms)
+{
+    uint32_t epoch;
+    int i;
+
+    if (len > c->hdr->slot_size || root < 0 ||
+        root >= (int)c->hdr->nclients)
+        return -1;
+    epoch = ++c->epoch;
+    memcpy(coll_slot(c, epoch, c->index), in, len);
+    if (coll_sync(c, epoch, NULL, timeout_ms) < 0)
+        return -1;
+    if (c->index == root)
+        for (i = 0; i < (int)c->hdr->nclients; i++)
+            memcpy((char *)out + i * len, coll_slot(c, epoch, i), len);
+    return 0;
+}
+
+int hgshm_coll_allreduce(hgshm_coll_t *c, const void *in, void *out,
+    size_t count, int type, int op, int timeout_ms)
+{
+    coll_reduce_t r = { type, op, count };
+    uint32_t epoch;
+    size_t len;
+
+    if (type < HGSHM_COLL_INT32 || type > HGSHM_COLL_DOUBLE ||
+        op < HGSHM_COLL_SUM || op > HGSHM_COLL_MAX)
+        return -1;
+    len = count * coll_type_size[type];
+    if (len > c->hdr->slot_size)
+        return -1;
+    epoch = ++c->epoch;
+    memcpy(coll_slot(c, epoch, c->index), in, len);
+    if (coll_sync(c, epoch, &r, timeout_ms) < 0)
+        return -1;
+    memcpy(out, coll_slot(c, epoch, 0), len);
+    return 0;
+}
+
+void hgshm_coll_print_stats(hgshm_coll_t *c, FILE *fp)
+{
+    hgshm_chan_print_stats(&c->chan, fp);
+}
@@ -0,0 +1,86 @@
+#ifndef _HGSHM_COLL_H
+#define _HGSHM_COLL_H
+/*
+ * Collective operations between the VMs of a region.
+ *
+ * Every client (VM index 0 .. nclients - 1) calls the same collectives in
+ * the same order. Arrival runs up a radix HGSHM_COLL_RADIX tree rooted
+ * at index 0: a client waits for its children to arrive, combines their
+ * data, then arrives at its parent and rings its doorbell if a thread
+ * of the parent is blocked, as counted in the parent's line. Each client
+ * only writes its own line, so combining is spread over the tree and the
+ * critical path is log_R(N) arrivals instead of index 0 scanning every
+ * client.
+ *
+ * The block lives in slice 0, the only memory all VMs share. Doorbells
+ * between two non-zero VMs go through the relay word of the block (see
+ * hgshm_ctx_set_relay()) and index 0's notifier thread forwards them.
+ * Since index 0 rings every forwarded doorbell anyway, release is flat:
+ * index 0 writes one release word and rings every client itself, which
+ * saves the relay hops and never leaves a release waiting on a relay
+ * after index 0 is gone.
+ *
+ * Data travels through per client slots of slot_size bytes. Slots are
+ * double banked by operation, so a fast client starting the next
+ * collective never overwrites data a slow one is still reading.
+ *
+ * A collective that times out leaves the group out of step; close and
+ * create it again.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_COLL_RADIX        4
+
+/* hgshm_coll_allreduce() element types */
+#define HGSHM_COLL_INT32        0
+#define HGSHM_COLL_INT64        1
+#define HGSHM_COLL_UINT64       2
+#define HGSHM_COLL_FLOAT        3
+#define HGSHM_COLL_DOUBLE       4
+
+/* hgshm_coll_allreduce() operations */
+#define HGSHM_COLL_SUM          0
+#define HGSHM_COLL_MIN          1
+#define HGSHM_COLL_MAX          2
+
+typedef struct hgshm_coll hgshm_coll_t;
+
+/* Bytes taken by a block for nclients, a multiple of a page */
+size_t hgshm_coll_size(int nclients, size_t slot_size);
+/*
+ * Index 0: format mem (in slice 0, cache line aligned, size bytes) and
+ * return a handle. NULL if it does not fit.
+ */
+hgshm_coll_t * hgshm_coll_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, size_t slot_size, int policy);
+/* Other clients: wait up to timeout_ms for index 0 to format mem */
+hgshm_coll_t * hgshm_coll_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms);
+/* Frees the handle and turns the relay off, not the shared state */
+void hgshm_coll_close(hgshm_coll_t *c);
+
+size_t hgshm_coll_slot_size(hgshm_coll_t *c);
+int hgshm_coll_nclients(hgshm_coll_t *c);
+
+/*
+ * All return 0, or -1 on timeout or if len does not fit a slot.
+ * timeout_ms < 0 waits forever.
+ */
+int hgshm_coll_barrier(hgshm_coll_t *c, int timeout_ms);
+/* len bytes of buf at root end up in buf everywhere */
+int hgshm_coll_bcast(hgshm_coll_t *c, int root, void *buf, size_t len,
+    int timeout_ms);
+/* root gets len bytes from every client in out, nclients * len bytes */
+int hgshm_coll_gather(hgshm_coll_t *c, int root, const void *in,
+    size_t len, void *out, int timeout_ms);
+/* Element wise op over count elements of type, result everywhere */
+int hgshm_coll_allreduce(hgshm_coll_t *c, const void *in, void *out,
+    size_t count, int type, int op, int timeout_ms);
+
+/* Wait statistics of this handle, see hgshm_chan_print_stats() */
+void hgshm_coll_print_stats(hgshm_coll_t *c, FILE *fp);
+#endif /* _HGSHM_COLL_H */
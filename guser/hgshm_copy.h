@@ -0,0 +1,40 @@
+#ifndef _HGSHM_COPY_H
+#define _HGSHM_COPY_H
+/*
+ * Bulk copies into and out of slices.
+ *
+ * Copies of at least the non-temporal threshold use streaming stores
+ * (SSE2, AVX2 or AVX-512, picked by CPUID) with software prefetch of
+ * the source, so filling a slice does not evict the mapper's working
+ * set for data only the reducer reads. Smaller copies go to memcpy(),
+ * which wins while the destination still fits in cache. The threshold
+ * defaults to HGSHM_COPY_NT_DEFAULT and can be changed with
+ * hgshm_copy_set_nt_threshold() or $HGSHM_NT_THRESHOLD (bytes, k/m
+ * suffixes).
+ */
+#include <stddef.h>
+
+/* Warm destination crossover, see README */
+#define HGSHM_COPY_NT_DEFAULT   (1 << 20)
+#define HGSHM_COPY_NT_ENV       "HGSHM_NT_THRESHOLD"
+
+void hgshm_copy_to_slice(void *dst, const void *src, size_t len);
+/* Streaming stores regardless of size */
+void hgshm_copy_nt(void *dst, const void *src, size_t len);
+/*
+ * Copy out of a slice. Prefetches the source, the destination is
+ * private memory the caller is about to use, so it is cached.
+ */
+void hgshm_copy_from_slice(void *dst, const void *src, size_t len);
+/*
+ * hgshm_copy_to_slice() split across nthreads threads, 0 for one per
+ * online CPU.
+ */
+void hgshm_copy_to_slice_mt(void *dst, const void *src, size_t len,
+    int nthreads);
+
+size_t hgshm_copy_nt_threshold(void);
+void hgshm_copy_set_nt_threshold(size_t bytes);
+/* "avx512", "avx2" or "sse2" */
+const char * hgshm_copy_impl(void);
+#endif /* _HGSHM_COPY_H */
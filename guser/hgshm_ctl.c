@@ -0,0 +1,428 @@
+/*
+ * Slice 0 control block, see hgshm_ctl.h.
+ *
+ * Writer of a line:                  Reader:
+ *	seq = odd (relaxed)                s1 = seq (acquire), retry if odd
+ *	release fence                      read the fields
+ *	write the fields                   acquire fence
+ *	seq = even (release)               retry if seq != s1
+ *
+ * Each line has one writer, so the writer never needs an atomic read
+ * modify write. state is the first word of the line so waiters can spin
+ * on it with hgshm_chan_wait_word().
+ *
+ * Credits are two more lines per client: index 0 writes limit and spent,
+ * the client writes returned, and what index 0 may still send is
+ * limit - (spent - returned). Index 0 sets the bits of the clients it is
+ * waiting for in credit_wait before its last look at returned; a client
+ * that returns credits clears its bit and rings index 0 only if it was
+ * set, so returning credits costs no doorbell while index 0 is busy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_ctl.h"
+
+#define HGSHM_CTL_MAGIC     0x4847434c  /* "HGCL" */
+
+typedef struct {
+    uint32_t    state;
+    uint32_t    pad;
+    uint64_t    seq;
+    int64_t     value;
+    uint64_t    arg;
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) ctl_line_t;
+
+typedef struct {
+    uint64_t    limit;
+    uint64_t    spent;
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) ctl_credit_t;
+
+typedef struct {
+    ctl_line_t  status;             /* written by the client */
+    ctl_line_t  command;            /* written by index 0 */
+    /* 1.1 */
+    ctl_credit_t credit;            /* written by index 0 */
+    uint64_t    returned __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    /* 2.0, threads of the client blocked on the block */
+    uint32_t    sleepers __attribute__((aligned(HGSHM_CTL_ALIGN)));
+} ctl_rec_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    major;
+    uint16_t    minor;
+    uint32_t    nclients;
+    uint32_t    rec_size;           /* stride of the records */
+    uint64_t    rec_off;            /* record 0, from the header */
+    uint64_t    size;               /* whole block, page aligned */
+    uint64_t    generation;
+    /* 1.1, clients index 0 waits for credits from */
+    uint64_t    credit_wait __attribute__((aligned(HGSHM_CTL_ALIGN)));
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) ctl_hdr_t;
+
+struct hgshm_ctl {
+    ctl_hdr_t   *hdr;
+    hgshm_ctx_t *ctx;
+    hgshm_chan_t chan;
+};
+
+typedef struct {
+    ctl_line_t  *line;
+    uint64_t    seen;
+} ctl_wait_t;
+
+typedef struct {
+    hgshm_ctl_t *c;
+    int         client;             /* -1 for any */
+    int         first;
+} ctl_credit_wait_t;
+
+static ctl_rec_t *ctl_rec(hgshm_ctl_t *c, int client)
+{
+    if (client < 0 || client >= (int)c->hdr->nclients)
+        return NULL;
+    return (ctl_rec_t *)((char *)c->hdr + c->hdr->rec_off +
+        (size_t)client * c->hdr->rec_size);
+}
+
+static hgshm_ctl_t *ctl_handle(hgshm_ctx_t *ctx, ctl_hdr_t *hdr, int policy)
+{
+    hgshm_ctl_t *c = calloc(1, sizeof(hgshm_ctl_t));
+    ctl_rec_t *r;
+
+    if (c == NULL)
+        return NULL;
+    c->hdr = hdr;
+    c->ctx = ctx;
+    hgshm_chan_init(&c->chan, ctx, policy, 0);
+    if ((r = ctl_rec(c, hgshm_ctx_get_index(ctx))) != NULL)
+        hgshm_chan_set_sleepers(&c->chan, &r->sleepers);
+    return c;
+}
+
+static void ctl_notify(hgshm_ctl_t *c, int index)
+{
+    ctl_rec_t *r = ctl_rec(c, index);
+
+    if (r != NULL && hgshm_chan_notify(c->ctx, &r->sleepers, index) < 0)
+        printf("hgshm: could not notify index %d\n", index);
+}
+
+static uint64_t line_put(ctl_line_t *l, uint32_t state, int64_t value,
+    uint64_t arg)
+{
+    uint64_t seq = l->seq;
+
+    __atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&l->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->state, state, __ATOMIC_RELAXED);
+    hgshm_store_release(&l->seq, seq + 2);
+    return seq + 2;
+}
+
+static void line_get(ctl_line_t *l, hgshm_ctl_rec_t *rec)
+{
+    uint64_t seq;
+
+    for (;;) {
+        seq = hgshm_load_acquire(&l->seq);
+        if (seq & 1) {
+            hgshm_cpu_relax();
+            continue;
+        }
+        rec->state = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+        rec->value = __atomic_load_n(&l->value, __ATOMIC_RELAXED);
+        rec->arg = __atomic_load_n(&l->arg, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&l->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    rec->seq = seq;
+}
+
+static int line_changed(void *arg)
+{
+    ctl_wait_t *w = arg;
+    uint64_t seq = hgshm_load_acquire(&w->line->seq);
+
+    return seq != w->seen && !(seq & 1);
+}
+
+size_t hgshm_ctl_size(int nclients)
+{
+    size_t size = sizeof(ctl_hdr_t) + (size_t)nclients * sizeof(ctl_rec_t);
+
+    return (size + HGSHM_PAGE_SIZE - 1) & ~(size_t)(HGSHM_PAGE_SIZE - 1);
+}
+
+hgshm_ctl_t *hgshm_ctl_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, int policy)
+{
+    ctl_hdr_t *hdr = mem;
+    uint64_t generation = 0;
+
+    if (mem == NULL || nclients < 1 || nclients > HGSHM_MAX_CLIENTS ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)) ||
+        size < hgshm_ctl_size(nclients))
+        return NULL;
+
+    if (hdr->magic == HGSHM_CTL_MAGIC)
+        generation = hdr->generation;
+    hdr->magic = 0;
+    __sync_synchronize();
+    hdr->major = HGSHM_CTL_VERSION_MAJOR;
+    hdr->minor = HGSHM_CTL_VERSION_MINOR;
+    hdr->nclients = nclients;
+    hdr->rec_size = sizeof(ctl_rec_t);
+    hdr->rec_off = sizeof(ctl_hdr_t);
+    hdr->size = hgshm_ctl_size(nclients);
+    hdr->generation = generation + 1;
+    hdr->credit_wait = 0;
+    memset((char *)hdr + hdr->rec_off, 0, nclients * sizeof(ctl_rec_t));
+    hgshm_store_release(&hdr->magic, HGSHM_CTL_MAGIC);
+    return ctl_handle(ctx, hdr, policy);
+}
+
+hgshm_ctl_t *hgshm_ctl_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms)
+{
+    ctl_hdr_t *hdr = mem;
+
+    while (hgshm_load_acquire(&hdr->magic) != HGSHM_CTL_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    if (hdr->major != HGSHM_CTL_VERSION_MAJOR ||
+        hdr->rec_size < sizeof(ctl_rec_t)) {
+        printf("hgshm: control block version %d.%d, expected %d.x\n",
+            hdr->major, hdr->minor, HGSHM_CTL_VERSION_MAJOR);
+        return NULL;
+    }
+    return ctl_handle(ctx, hdr, policy);
+}
+
+void hgshm_ctl_close(hgshm_ctl_t *c)
+{
+    free(c);
+}
+
+int hgshm_ctl_nclients(hgshm_ctl_t *c)
+{
+    return c->hdr->nclients;
+}
+
+uint64_t hgshm_ctl_generation(hgshm_ctl_t *c)
+{
+    return c->hdr->generation;
+}
+
+void *hgshm_ctl_data(hgshm_ctl_t *c)
+{
+    return (char *)c->hdr + c->hdr->size;
+}
+
+uint64_t hgshm_ctl_post(hgshm_ctl_t *c, int client, uint32_t state,
+    int64_t value, uint64_t arg)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+    uint64_t seq;
+
+    if (r == NULL)
+        return 0;
+    seq = line_put(&r->status, state, value, arg);
+    ctl_notify(c, 0);
+    return seq;
+}
+
+uint64_t hgshm_ctl_command(hgshm_ctl_t *c, int client, uint32_t state,
+    int64_t value, uint64_t arg)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+    uint64_t seq;
+
+    if (r == NULL)
+        return 0;
+    seq = line_put(&r->command, state, value, arg);
+    ctl_notify(c, client);
+    return seq;
+}
+
+int hgshm_ctl_status(hgshm_ctl_t *c, int client, hgshm_ctl_rec_t *rec)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+
+    if (r == NULL)
+        return -1;
+    line_get(&r->status, rec);
+    return 0;
+}
+
+int hgshm_ctl_read_command(hgshm_ctl_t *c, int client, hgshm_ctl_rec_t *rec)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+
+    if (r == NULL)
+        return -1;
+    line_get(&r->command, rec);
+    return 0;
+}
+
+int hgshm_ctl_wait_state(hgshm_ctl_t *c, int client, uint32_t state,
+    int timeout_ms)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+
+    if (r == NULL)
+        return -1;
+    return hgshm_chan_wait_word(&c->chan, &r->status.state, state,
+        timeout_ms);
+}
+
+int hgshm_ctl_wait_command(hgshm_ctl_t *c, int client, uint64_t *seen,
+    hgshm_ctl_rec_t *rec, int timeout_ms)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+    ctl_wait_t w;
+
+    if (r == NULL)
+        return -1;
+    w.line = &r->command;
+    w.seen = *seen;
+    if (hgshm_chan_wait(&c->chan, line_changed, &w, timeout_ms) < 0)
+        return -1;
+    line_get(&r->command, rec);
+    *seen = rec->seq;
+    return 0;
+}
+
+void hgshm_ctl_credit_init(hgshm_ctl_t *c, int client, uint32_t limit)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+
+    if (r == NULL)
+        return;
+    r->credit.spent = __atomic_load_n(&r->returned, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&r->credit.limit, limit, __ATOMIC_RELEASE);
+}
+
+int64_t hgshm_ctl_credits(hgshm_ctl_t *c, int client)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+
+    if (r == NULL)
+        return 0;
+    return r->credit.limit - (r->credit.spent -
+        __atomic_load_n(&r->returned, __ATOMIC_SEQ_CST));
+}
+
+/* First client from w->first on with a credit, -1 if none has one */
+static int credit_find(ctl_credit_wait_t *w)
+{
+    int n = w->c->hdr->nclients, i, j;
+
+    if (w->client >= 0)
+        return (hgshm_ctl_credits(w->c, w->client) > 0) ? w->client : -1;
+    for (i = 0; i < n; i++) {
+        j = (w->first + i) % n;
+        if (hgshm_ctl_credits(w->c, j) > 0)
+            return j;
+    }
+    return -1;
+}
+
+static int credit_ready(void *arg)
+{
+    ctl_credit_wait_t *w = arg;
+    uint64_t mask;
+
+    if (credit_find(w) >= 0)
+        return 1;
+    if (w->client >= 0)
+        mask = 1ULL << w->client;
+    else if (w->c->hdr->nclients == 64)
+        mask = ~0ULL;
+    else
+        mask = (1ULL << w->c->hdr->nclients) - 1;
+    /* Spinning waiters only write the line once */
+    if (__atomic_load_n(&w->c->hdr->credit_wait, __ATOMIC_RELAXED) != mask)
+        __atomic_store_n(&w->c->hdr->credit_wait, mask, __ATOMIC_SEQ_CST);
+    else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return credit_find(w) >= 0;
+}
+
+static int credit_take(hgshm_ctl_t *c, int client, int first,
+    int timeout_ms)
+{
+    ctl_credit_wait_t w;
+    int rc, j;
+
+    w.c = c;
+    w.client = client;
+    w.first = (first < 0) ? 0 : first % (int)c->hdr->nclients;
+    rc = hgshm_chan_wait(&c->chan, credit_ready, &w, timeout_ms);
+    if (c->hdr->credit_wait)
+        __atomic_store_n(&c->hdr->credit_wait, 0, __ATOMIC_RELAXED);
+    if (rc < 0 || (j = credit_find(&w)) < 0)
+        return -1;
+    __atomic_store_n(&ctl_rec(c, j)->credit.spent,
+        ctl_rec(c, j)->credit.spent + 1, __ATOMIC_RELEASE);
+    return j;
+}
+
+int hgshm_ctl_credit_take(hgshm_ctl_t *c, int client, int timeout_ms)
+{
+    if (ctl_rec(c, client) == NULL)
+        return -1;
+    return (credit_take(c, client, 0, timeout_ms) < 0) ? -1 : 0;
+}
+
+int hgshm_ctl_credit_take_any(hgshm_ctl_t *c, int first, int timeout_ms)
+{
+    return credit_take(c, -1, first, timeout_ms);
+}
+
+void hgshm_ctl_credit_return(hgshm_ctl_t *c, int client, uint32_t n)
+{
+    ctl_rec_t *r = ctl_rec(c, client);
+    uint64_t bit = 1ULL << client;
+
+    if (r == NULL)
+        return;
+    __atomic_store_n(&r->returned, r->returned + n, __ATOMIC_SEQ_CST);
+    if ((__atomic_load_n(&c->hdr->credit_wait, __ATOMIC_SEQ_CST) & bit) &&
+        (__atomic_fetch_and(&c->hdr->credit_wait, ~bit, __ATOMIC_SEQ_CST) &
+        bit))
+        ctl_notify(c, 0);
+}
+
+void hgshm_ctl_print(hgshm_ctl_t *c, FILE *fp)
+{
+    hgshm_ctl_rec_t rec;
+    int i;
+
+    fprintf(fp, "control block v%d.%d generation %lu, %d clients\n",
+        c->hdr->major, c->hdr->minor, c->hdr->generation,
+        c->hdr->nclients);
+    for (i = 0; i < (int)c->hdr->nclients; i++) {
+        hgshm_ctl_status(c, i, &rec);
+        fprintf(fp, "%d: state %u value %ld arg %lu seq %lu credits %ld\n",
+            i, rec.state, rec.value, rec.arg, rec.seq,
+            hgshm_ctl_credits(c, i));
+    }
+}
+
+void hgshm_ctl_print_stats(hgshm_ctl_t *c, FILE *fp)
+{
+    hgshm_chan_print_stats(&c->chan, fp);
+}
@@ -0,0 +1,137 @@
+#ifndef _HGSHM_CTL_H
+#define _HGSHM_CTL_H
+/*
+ * Per job control block at the start of slice 0.
+ *
+ * Every client (VM index) has a record of two lines: a status line only
+ * the client writes and a command line only index 0 writes. Each line
+ * is HGSHM_CTL_ALIGN bytes, so no two writers share a cache line (nor
+ * the adjacent line the spatial prefetcher pulls in with it) and a
+ * mapper polling the status of one reducer does not steal the line
+ * another reducer is updating.
+ *
+ * A line is a small seqlock: the writer makes seq odd, updates the
+ * fields and makes seq even again with release ordering. Readers get a
+ * consistent snapshot and can wait for seq or state to change. Posting
+ * rings the reader's doorbell only if a thread of the reader is blocked
+ * on the block, as counted in its record.
+ *
+ * The header carries a major/minor version and the record size. Attach
+ * refuses another major version; minor versions only append fields, so
+ * older readers step over them.
+ *
+ * A handle is used by one waiting thread at a time. Posting does not
+ * touch the wait channel, so other threads may post through it.
+ *
+ *	index 0                              index i
+ *	c = hgshm_ctl_create(ctx, slice0..)  c = hgshm_ctl_attach(ctx, slice0..)
+ *	hgshm_ctl_wait_state(c, i, READY..)  hgshm_ctl_post(c, i, READY, 0, 0)
+ *	...                                  ...
+ *	hgshm_ctl_status(c, i, &rec)         hgshm_ctl_post(c, i, DONE, total, n)
+ *
+ * Credit flow control: index 0 gives each client a limit of work items
+ * (buffers, segments) it may have outstanding there, takes a credit
+ * before sending one and the client returns it when it is done with the
+ * item. Index 0 never overwrites data a client is still working on, and
+ * hgshm_ctl_credit_take_any() sends to whichever client has room instead
+ * of waiting for the slowest one:
+ *
+ *	hgshm_ctl_credit_init(c, i, nbufs)
+ *	i = hgshm_ctl_credit_take_any(c, ..)  work on the item
+ *	send an item to i                     hgshm_ctl_credit_return(c, i, 1)
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_CTL_VERSION_MAJOR 2
+#define HGSHM_CTL_VERSION_MINOR 0
+/* Two cache lines, see above */
+#define HGSHM_CTL_ALIGN         128
+
+/* Status states, applications may use their own from HGSHM_CTL_USER */
+#define HGSHM_CTL_IDLE          0
+#define HGSHM_CTL_READY         1
+#define HGSHM_CTL_RUNNING       2
+#define HGSHM_CTL_DONE          3
+#define HGSHM_CTL_FAILED        4
+#define HGSHM_CTL_USER          16
+
+typedef struct hgshm_ctl hgshm_ctl_t;
+
+/* Snapshot of a status or command line */
+typedef struct {
+    uint64_t    seq;            /* even, bumped by 2 per post */
+    uint32_t    state;
+    int64_t     value;
+    uint64_t    arg;
+} hgshm_ctl_rec_t;
+
+/* Bytes taken by a control block for nclients, a multiple of a page */
+size_t hgshm_ctl_size(int nclients);
+/*
+ * Index 0: format mem (cache line aligned, size bytes) for nclients and
+ * return a handle. The rest of the slice starts hgshm_ctl_size() bytes
+ * in. NULL if it does not fit.
+ */
+hgshm_ctl_t * hgshm_ctl_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, int policy);
+/*
+ * Other clients: wait up to timeout_ms for index 0 to format mem. NULL
+ * on timeout or if the version does not match.
+ */
+hgshm_ctl_t * hgshm_ctl_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms);
+/* Frees the handle, not the shared state */
+void hgshm_ctl_close(hgshm_ctl_t *c);
+
+int hgshm_ctl_nclients(hgshm_ctl_t *c);
+/* Bumped every time index 0 formats the block */
+uint64_t hgshm_ctl_generation(hgshm_ctl_t *c);
+/* First byte after the control block */
+void * hgshm_ctl_data(hgshm_ctl_t *c);
+
+/* Client: publish its status line, notifies index 0. Returns the seq */
+uint64_t hgshm_ctl_post(hgshm_ctl_t *c, int client, uint32_t state,
+    int64_t value, uint64_t arg);
+/* Index 0: publish a command line for client, notifies it */
+uint64_t hgshm_ctl_command(hgshm_ctl_t *c, int client, uint32_t state,
+    int64_t value, uint64_t arg);
+/* Consistent snapshot of a status or command line, -1 if no such client */
+int hgshm_ctl_status(hgshm_ctl_t *c, int client, hgshm_ctl_rec_t *rec);
+int hgshm_ctl_read_command(hgshm_ctl_t *c, int client, hgshm_ctl_rec_t *rec);
+
+/*
+ * Wait until the status of client has state. timeout_ms < 0 waits
+ * forever. Returns 0, or -1 on timeout.
+ */
+int hgshm_ctl_wait_state(hgshm_ctl_t *c, int client, uint32_t state,
+    int timeout_ms);
+/*
+ * Wait until the command line of client changes from seq *seen, then
+ * snapshot it into rec and update *seen.
+ */
+int hgshm_ctl_wait_command(hgshm_ctl_t *c, int client, uint64_t *seen,
+    hgshm_ctl_rec_t *rec, int timeout_ms);
+
+/* Index 0: allow limit outstanding items at client, none are now */
+void hgshm_ctl_credit_init(hgshm_ctl_t *c, int client, uint32_t limit);
+/* Index 0: credits client has left, returned ones included */
+int64_t hgshm_ctl_credits(hgshm_ctl_t *c, int client);
+/* Index 0: wait for a credit of client and take it. -1 on timeout */
+int hgshm_ctl_credit_take(hgshm_ctl_t *c, int client, int timeout_ms);
+/*
+ * Index 0: take a credit of the first client from first on (round robin)
+ * that has one, waiting if none has. Returns the client, -1 on timeout.
+ */
+int hgshm_ctl_credit_take_any(hgshm_ctl_t *c, int first, int timeout_ms);
+/* Client: give n credits back, rings index 0 only if it waits for them */
+void hgshm_ctl_credit_return(hgshm_ctl_t *c, int client, uint32_t n);
+
+/* One line per client status, for debugging */
+void hgshm_ctl_print(hgshm_ctl_t *c, FILE *fp);
+/* Wait statistics of this handle, see hgshm_chan_print_stats() */
+void hgshm_ctl_print_stats(hgshm_ctl_t *c, FILE *fp);
+#endif /* _HGSHM_CTL_H */
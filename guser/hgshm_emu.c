@@ -0,0 +1,593 @@
+/*
+ * Host emulation backend of libhgshm.
+ *
+ * Runs mappers and reducers as plain Linux processes, without qemu. The
+ * shared region is the POSIX shm object <shmid>, laid out exactly as the
+ * hgshm device lays it out, and notifications are event fds.
+ *
+ * Event fds are exchanged over a unix socket with the same messages that
+ * the qemu device sends over its chardev (ivm_pdu_t), so an emulated
+ * process can join a VM based mapper and VMs can join an emulated
+ * mapper, as long as both sides use the same shmid and socket.
+ *
+ * Device spec, following the qemu device options:
+ *	shm:<shmid>,index=<n>[,size=<sz>][,clients=<n>][,sock=<path>]
+ *	    [,unlink=1][,wait=<n>][,queues=<n>][,fullview=1]
+ * queues is this process' number of notification queues, 1 by default,
+ * one event fd each; the exchange sends one message per queue.
+ * fullview is the device property of the same name, for non-zero index.
+ * size, clients, unlink and wait are only used by index 0. wait makes
+ * hgshm_init() return only once n clients have attached, notifying a
+ * client that has not attached yet fails like notifying a VM that has
+ * not booted.
+ *
+ * Index 0 maps the whole region in shmptr[0]. Index n maps slice n in
+ * shmptr[0] and slice 0 in shmptr[1], and with fullview the whole region
+ * read-only in view.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "hgshm.h"
+#include "hgshm_int.h"
+
+#define EMU_DEFAULT_SOCK        "/tmp/hgshmsock"
+#define EMU_DEFAULT_SIZE        (512 << 20)
+#define EMU_DEFAULT_CLIENTS     8
+#define EMU_SPEC_LEN            256
+
+/* Efd type, as in qemu */
+#define EFD_RD_HANDLER          0
+#define EFD_MEM_IO              1
+
+/* Must match ivm_pdu_t in qemu-2.3.0-rc3/hw/hgshm/hgshm.h */
+typedef struct {
+    int index;
+    int efd_type;
+    int needefd;
+    size_t  shmsize;
+    int     clients;
+    int     queue;
+    int     queues;
+} hgshm_pdu_t;
+
+typedef struct {
+    char    *shmid;
+    char    *sock;
+    size_t  size;
+    int     clients;
+    int     unlink;
+    int     wait;                       /* clients to wait for */
+    int     fullview;
+    int     attached;
+    uint64_t attached_mask;             /* indexes counted in attached */
+    pthread_cond_t attach_cond;
+    int     queues;
+    int     irqfds[HGSHM_MAX_QUEUES];   /* notify us */
+    int     efds[HGSHM_MAX_CLIENTS][HGSHM_MAX_QUEUES]; /* notify others */
+    int     listenfd;
+    int     shmfd;
+    pthread_t accept_tid;
+    int     accept_running;
+    int     accept_sock;                /* client being served, or -1 */
+    int     stopping;                   /* set by emu_close, under lock */
+    pthread_mutex_t lock;
+} emu_t;
+
+static size_t parse_size(const char *str)
+{
+    char *end;
+    size_t val = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'k': case 'K': return val << 10;
+    case 'm': case 'M': return val << 20;
+    case 'g': case 'G': return val << 30;
+    }
+    return val;
+}
+
+static int parse_spec(hgshm_ctx_t *ctx, emu_t *emu, const char *spec)
+{
+    char buf[EMU_SPEC_LEN];
+    char *tok, *save = NULL;
+
+    if (strlen(spec) >= sizeof(buf))
+        return -1;
+    strcpy(buf, spec);
+
+    ctx->index = -1;
+    emu->queues = 1;
+    emu->size = EMU_DEFAULT_SIZE;
+    emu->clients = EMU_DEFAULT_CLIENTS;
+
+    for (tok = strtok_r(buf, ",", &save); tok;
+        tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (val == NULL) {
+            free(emu->shmid);
+            emu->shmid = strdup(tok);
+            continue;
+        }
+        *val++ = 0;
+        if (strcmp(tok, "index") == 0) {
+            ctx->index = atoi(val);
+        } else if (strcmp(tok, "size") == 0) {
+            emu->size = parse_size(val);
+        } else if (strcmp(tok, "clients") == 0) {
+            emu->clients = atoi(val);
+        } else if (strcmp(tok, "sock") == 0) {
+            free(emu->sock);
+            emu->sock = strdup(val);
+        } else if (strcmp(tok, "unlink") == 0) {
+            emu->unlink = atoi(val);
+        } else if (strcmp(tok, "wait") == 0) {
+            emu->wait = atoi(val);
+        } else if (strcmp(tok, "queues") == 0) {
+            emu->queues = atoi(val);
+        } else if (strcmp(tok, "fullview") == 0) {
+            emu->fullview = atoi(val);
+        } else {
+            fprintf(stderr, "hgshm: unknown option '%s'\n", tok);
+            return -1;
+        }
+    }
+
+    if (emu->shmid == NULL || ctx->index < 0 ||
+        ctx->index >= HGSHM_MAX_CLIENTS) {
+        fprintf(stderr, "hgshm: shmid and index are required\n");
+        return -1;
+    }
+    if (emu->queues < 1 || emu->queues > HGSHM_MAX_QUEUES) {
+        fprintf(stderr, "hgshm: queues should be 1 to %d\n",
+            HGSHM_MAX_QUEUES);
+        return -1;
+    }
+    if (emu->sock == NULL)
+        emu->sock = strdup(EMU_DEFAULT_SOCK);
+    if (ctx->index == 0 && (emu->clients <= 0 ||
+        emu->clients > HGSHM_MAX_CLIENTS ||
+        (emu->clients & (emu->clients - 1)))) {
+        fprintf(stderr, "hgshm: clients should be a power of 2 <= %d\n",
+            HGSHM_MAX_CLIENTS);
+        return -1;
+    }
+    return 0;
+}
+
+static int send_pdu(int sock, hgshm_pdu_t *pdu, int fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = pdu;
+    iov.iov_len = sizeof(*pdu);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return (sendmsg(sock, &msg, 0) == sizeof(*pdu)) ? 0 : -1;
+}
+
+static int recv_pdu(int sock, hgshm_pdu_t *pdu, int *fd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+
+    *fd = -1;
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = pdu;
+    iov.iov_len = sizeof(*pdu);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(*pdu))
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return (*fd < 0) ? -1 : 0;
+}
+
+/* One message per queue, only the one for queue 0 asks for efds back */
+static int send_efds(hgshm_ctx_t *ctx, emu_t *emu, int sock)
+{
+    hgshm_pdu_t pdu;
+    int q;
+
+    for (q = 0; q < emu->queues; q++) {
+        bzero(&pdu, sizeof(pdu));
+        pdu.index = ctx->index;
+        pdu.efd_type = EFD_MEM_IO;
+        pdu.queue = q;
+        pdu.queues = emu->queues;
+        if (ctx->index == 0) {
+            pdu.shmsize = emu->size;
+            pdu.clients = emu->clients;
+        } else if (q == 0) {
+            pdu.needefd = 1;
+        }
+        if (send_pdu(sock, &pdu, emu->irqfds[q]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Keep the efd of queue pdu->queue of pdu->index. Returns 1 for the last
+ * queue, a peer counts as attached from then on. Queue 0 comes first, a
+ * peer that sends it again is attaching again and only stops counting if
+ * its earlier attach had completed.
+ */
+static int emu_add_efd(emu_t *emu, hgshm_pdu_t *pdu, int efd)
+{
+    int *efds = emu->efds[pdu->index];
+    int q, last = (pdu->queue >= pdu->queues - 1);
+
+    if (pdu->queue < 0 || pdu->queue >= HGSHM_MAX_QUEUES) {
+        close(efd);
+        return -1;
+    }
+    pthread_mutex_lock(&emu->lock);
+    if (pdu->queue == 0 && efds[0] >= 0) {
+        for (q = 0; q < HGSHM_MAX_QUEUES; q++) {
+            if (efds[q] >= 0)
+                close(efds[q]);
+            efds[q] = -1;
+        }
+        if (emu->attached_mask & (1ULL << pdu->index)) {
+            emu->attached_mask &= ~(1ULL << pdu->index);
+            emu->attached--;
+        }
+    }
+    if (efds[pdu->queue] >= 0)
+        close(efds[pdu->queue]);
+    efds[pdu->queue] = efd;
+    if (last && !(emu->attached_mask & (1ULL << pdu->index))) {
+        emu->attached_mask |= 1ULL << pdu->index;
+        emu->attached++;
+        pthread_cond_broadcast(&emu->attach_cond);
+    }
+    pthread_mutex_unlock(&emu->lock);
+    return last;
+}
+
+/*
+ * Index 0: every client sends its event fds and gets ours back, together
+ * with the region size and number of clients.
+ */
+static void *emu_accept(void *arg)
+{
+    hgshm_ctx_t *ctx = arg;
+    emu_t *emu = ctx->priv;
+    hgshm_pdu_t pdu;
+    int sock, efd, rc;
+
+    while ((sock = accept(emu->listenfd, NULL, NULL)) >= 0) {
+        pthread_mutex_lock(&emu->lock);
+        if (emu->stopping) {
+            pthread_mutex_unlock(&emu->lock);
+            close(sock);
+            break;
+        }
+        emu->accept_sock = sock;
+        pthread_mutex_unlock(&emu->lock);
+        do {
+            if (recv_pdu(sock, &pdu, &efd) < 0 || pdu.index <= 0 ||
+                pdu.index >= emu->clients || pdu.efd_type != EFD_MEM_IO) {
+                if (!__atomic_load_n(&emu->stopping, __ATOMIC_SEQ_CST))
+                    fprintf(stderr, "hgshm: bad request from client\n");
+                if (efd >= 0)
+                    close(efd);
+                break;
+            }
+            rc = emu_add_efd(emu, &pdu, efd);
+            if (pdu.needefd && send_efds(ctx, emu, sock) < 0)
+                fprintf(stderr, "hgshm: sending efd failed\n");
+        } while (rc == 0);
+        pthread_mutex_lock(&emu->lock);
+        emu->accept_sock = -1;
+        pthread_mutex_unlock(&emu->lock);
+        close(sock);
+    }
+    return NULL;
+}
+
+static int emu_listen(hgshm_ctx_t *ctx, emu_t *emu)
+{
+    struct sockaddr_un addr;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, emu->sock, sizeof(addr.sun_path) - 1);
+    unlink(emu->sock);
+
+    if ((emu->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(emu->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(emu->listenfd, HGSHM_MAX_CLIENTS) < 0) {
+        perror("hgshm: listen");
+        return -1;
+    }
+    if (pthread_create(&emu->accept_tid, NULL, emu_accept, ctx) != 0)
+        return -1;
+    emu->accept_running = 1;
+
+    pthread_mutex_lock(&emu->lock);
+    while (emu->attached < emu->wait)
+        pthread_cond_wait(&emu->attach_cond, &emu->lock);
+    pthread_mutex_unlock(&emu->lock);
+    return 0;
+}
+
+/* Non-zero index: same exchange as a qemu client VM */
+static int emu_connect(hgshm_ctx_t *ctx, emu_t *emu)
+{
+    struct sockaddr_un addr;
+    hgshm_pdu_t pdu;
+    int sock, efd, rc;
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, emu->sock, sizeof(addr.sun_path) - 1);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("hgshm: connect");
+        close(sock);
+        return -1;
+    }
+
+    if (send_efds(ctx, emu, sock) < 0)
+        goto error;
+    do {
+        if (recv_pdu(sock, &pdu, &efd) < 0)
+            goto error;
+        if (pdu.index != 0) {
+            close(efd);
+            goto error;
+        }
+        if (pdu.queue == 0) {
+            emu->size = pdu.shmsize;
+            emu->clients = pdu.clients;
+        }
+    } while ((rc = emu_add_efd(emu, &pdu, efd)) == 0);
+    close(sock);
+    if (rc < 0)
+        return -1;
+
+    if (ctx->index >= emu->clients) {
+        fprintf(stderr, "hgshm: index greater than number of clients\n");
+        return -1;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "hgshm: efd exchange failed\n");
+    close(sock);
+    return -1;
+}
+
+static void *emu_mmap(emu_t *emu, size_t sz, off_t off, int prot)
+{
+    void *ptr = mmap(0, sz, prot, MAP_SHARED, emu->shmfd, off);
+    if (ptr == MAP_FAILED) {
+        perror("hgshm: mmap");
+        return NULL;
+    }
+    return ptr;
+}
+
+/* Same sizes and offsets as the device's BAR1 and BAR3 */
+static int emu_map(hgshm_ctx_t *ctx, emu_t *emu)
+{
+    size_t slice = hgshm_slice_size(emu->size, emu->clients);
+    int flags = O_RDWR;
+
+    if (ctx->index == 0) {
+        if (emu->unlink)
+            shm_unlink(emu->shmid);
+        flags |= O_CREAT;
+    }
+    if ((emu->shmfd = shm_open(emu->shmid, flags, 0777)) < 0) {
+        perror("hgshm: shm_open");
+        return -1;
+    }
+    if (ctx->index == 0 && ftruncate(emu->shmfd, emu->size) < 0) {
+        perror("hgshm: ftruncate");
+        return -1;
+    }
+
+    if (ctx->index == 0) {
+        ctx->shm_sz = emu->size;
+        ctx->shm_slice_sz = slice;
+        ctx->shmptr[0] = emu_mmap(emu, ctx->shm_sz, 0,
+            PROT_READ|PROT_WRITE);
+        return ctx->shmptr[0] ? 0 : -1;
+    }
+
+    ctx->shm_sz = slice;
+    ctx->shm_slice_sz = (slice > HGSHM_MAX_MAP_SLICE_SZ) ?
+        HGSHM_MAX_MAP_SLICE_SZ : slice;
+    ctx->shmptr[0] = emu_mmap(emu, ctx->shm_sz, ctx->index * slice,
+        PROT_READ|PROT_WRITE);
+    ctx->shmptr[1] = emu_mmap(emu, ctx->shm_slice_sz, 0,
+        PROT_READ|PROT_WRITE);
+    /* Capped like the device's fullview BAR3 */
+    ctx->view_sz = (emu->size > HGSHM_MAX_MAP_SLICE_SZ) ?
+        HGSHM_MAX_MAP_SLICE_SZ : emu->size;
+    if (emu->fullview && ctx->view_sz > ctx->shm_slice_sz) {
+        if ((ctx->view = emu_mmap(emu, ctx->view_sz, 0, PROT_READ)) == NULL)
+            return -1;
+    }
+    return (ctx->shmptr[0] && ctx->shmptr[1]) ? 0 : -1;
+}
+
+static int emu_notify_queue(hgshm_ctx_t *ctx, int index, int queue)
+{
+    emu_t *emu = ctx->priv;
+    uint64_t val = 1;
+    int efd;
+
+    pthread_mutex_lock(&emu->lock);
+    efd = emu->efds[index][queue];
+    pthread_mutex_unlock(&emu->lock);
+    if (efd < 0)
+        return -1;
+    __sync_synchronize();
+    return (write(efd, &val, sizeof(val)) == sizeof(val)) ? 0 : -1;
+}
+
+static int emu_notify(hgshm_ctx_t *ctx, int index)
+{
+    return emu_notify_queue(ctx, index, 0);
+}
+
+static int emu_wait_queue_irq(hgshm_ctx_t *ctx, int queue)
+{
+    emu_t *emu = ctx->priv;
+    uint64_t val;
+
+    if (read(emu->irqfds[queue], &val, sizeof(val)) == sizeof(val))
+        return 1;
+    return (errno == EINTR) ? 0 : -1;
+}
+
+static int emu_wait_irq(hgshm_ctx_t *ctx)
+{
+    return emu_wait_queue_irq(ctx, 0);
+}
+
+/* The notifier sees closing once read() returns */
+static void emu_kick_queue(hgshm_ctx_t *ctx, int queue)
+{
+    emu_t *emu = ctx->priv;
+    uint64_t val = 1;
+
+    if (write(emu->irqfds[queue], &val, sizeof(val)) != sizeof(val))
+        perror("hgshm: kick");
+}
+
+static void emu_kick(hgshm_ctx_t *ctx)
+{
+    emu_kick_queue(ctx, 0);
+}
+
+static void emu_close(hgshm_ctx_t *ctx)
+{
+    emu_t *emu = ctx->priv;
+    int i, q;
+
+    if (emu == NULL)
+        return;
+    /*
+     * Not pthread_cancel: the thread may be in close() or sendmsg() with
+     * emu->lock held. Shutting the sockets down makes accept() and a
+     * pending recvmsg() return, and the thread sees stopping.
+     */
+    if (emu->accept_running) {
+        pthread_mutex_lock(&emu->lock);
+        emu->stopping = 1;
+        if (emu->accept_sock >= 0)
+            shutdown(emu->accept_sock, SHUT_RDWR);
+        pthread_mutex_unlock(&emu->lock);
+        shutdown(emu->listenfd, SHUT_RDWR);
+        pthread_join(emu->accept_tid, NULL);
+    }
+    if (emu->listenfd >= 0) {
+        close(emu->listenfd);
+        unlink(emu->sock);
+    }
+    if (ctx->shmptr[0])
+        munmap(ctx->shmptr[0], ctx->shm_sz);
+    if (ctx->shmptr[1])
+        munmap(ctx->shmptr[1], ctx->shm_slice_sz);
+    if (ctx->view)
+        munmap(ctx->view, ctx->view_sz);
+    for (i = 0; i < HGSHM_MAX_CLIENTS; i++)
+        for (q = 0; q < HGSHM_MAX_QUEUES; q++)
+            if (emu->efds[i][q] >= 0)
+                close(emu->efds[i][q]);
+    for (q = 0; q < HGSHM_MAX_QUEUES; q++)
+        if (emu->irqfds[q] >= 0)
+            close(emu->irqfds[q]);
+    if (emu->shmfd >= 0)
+        close(emu->shmfd);
+    pthread_mutex_destroy(&emu->lock);
+    pthread_cond_destroy(&emu->attach_cond);
+    free(emu->shmid);
+    free(emu->sock);
+    free(emu);
+    ctx->priv = NULL;
+    ctx->shmptr[0] = ctx->shmptr[1] = ctx->view = NULL;
+}
+
+static const hgshm_ops_t hgshm_emu_ops = {
+    .notify = emu_notify,
+    .wait_irq = emu_wait_irq,
+    .kick = emu_kick,
+    .close = emu_close,
+    .notify_queue = emu_notify_queue,
+    .wait_queue_irq = emu_wait_queue_irq,
+    .kick_queue = emu_kick_queue,
+};
+
+int hgshm_emu_init(hgshm_ctx_t *ctx, const char *spec)
+{
+    emu_t *emu = calloc(1, sizeof(emu_t));
+    int i, q;
+
+    if (emu == NULL)
+        return -1;
+    for (i = 0; i < HGSHM_MAX_CLIENTS; i++)
+        for (q = 0; q < HGSHM_MAX_QUEUES; q++)
+            emu->efds[i][q] = -1;
+    for (q = 0; q < HGSHM_MAX_QUEUES; q++)
+        emu->irqfds[q] = -1;
+    emu->listenfd = emu->shmfd = emu->accept_sock = -1;
+    pthread_mutex_init(&emu->lock, NULL);
+    pthread_cond_init(&emu->attach_cond, NULL);
+    ctx->priv = emu;
+    ctx->ops = &hgshm_emu_ops;
+    ctx->fd = -1;
+
+    if (parse_spec(ctx, emu, spec) < 0)
+        goto error;
+    for (q = 0; q < emu->queues; q++)
+        if ((emu->irqfds[q] = eventfd(0, 0)) < 0)
+            goto error;
+    ctx->queues = emu->queues;
+    if (ctx->index != 0 && emu_connect(ctx, emu) < 0)
+        goto error;
+    if (emu_map(ctx, emu) < 0)
+        goto error;
+    if (ctx->index == 0 && emu_listen(ctx, emu) < 0)
+        goto error;
+    return 0;
+
+error:
+    emu_close(ctx);
+    return -1;
+}
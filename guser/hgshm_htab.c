@@ -0,0 +1,430 @@
+/*
+ * Concurrent shared memory hash table, see hgshm_htab.h.
+ *
+ * Group: 16 tag bytes, then 16 slots of key and value, padded to a cache
+ * line. A tag is EMPTY, BUSY (claimed, key being written) or 0x80 | the
+ * top 7 bits of the hash. Slots are only ever claimed in probe order, so
+ * a key is either before the first empty slot of its probe sequence or
+ * not in the table; a lookup waits for BUSY slots before that point as
+ * one of them may be the key it wants.
+ *
+ * gate: generation << 32 | RESIZE | number of operations in progress.
+ * An operation enters by bumping the count while RESIZE is clear. A
+ * resize sets RESIZE, allocates the new groups and waits for the count
+ * to drain; the old groups are then handed out HTAB_CHUNK at a time
+ * from claim (generation << 32 | next group) to the resizer and to
+ * everybody who arrives meanwhile. Whoever moves the last chunk switches
+ * to the new groups and opens the gate with the next generation.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <emmintrin.h>
+
+#include "hgshm_int.h"
+#include "hgshm_alloc.h"
+#include "hgshm_htab.h"
+
+#define HGSHM_HTAB_MAGIC    0x48474854  /* "HGHT" */
+
+#define TAG_EMPTY           0
+#define TAG_BUSY            1
+
+#define GATE_ACTIVE         0x7fffffffULL
+#define GATE_RESIZE         0x80000000ULL
+#define GATE_GEN(g)         ((g) >> 32)
+
+/* Old groups per migration claim */
+#define HTAB_CHUNK          16
+/* Grow above 7/8 full */
+#define HTAB_LOAD(cap)      ((cap) - (cap) / 8)
+
+struct hgshm_htab {
+    uint32_t    magic;
+    uint32_t    key_size;
+    uint32_t    val_size;
+    uint32_t    slot_size;
+    uint64_t    group_size;
+    uint64_t    arena_off;
+    uint64_t    size;
+    uint64_t    gate HGSHM_ALIGNED;
+    /* Changed by resizes only, with the gate closed */
+    uint64_t    groups HGSHM_ALIGNED;   /* arena offset */
+    uint64_t    ngroups;
+    uint64_t    next;                   /* new groups during a resize */
+    uint64_t    next_ngroups;
+    uint64_t    old_ngroups;            /* of the resize in progress */
+    uint32_t    full;                   /* arena exhausted, stop growing */
+    uint32_t    resizes;
+    uint64_t    claim HGSHM_ALIGNED;
+    uint64_t    moved;
+    uint64_t    count HGSHM_ALIGNED;
+};
+
+static hgshm_arena_t *htab_arena(hgshm_htab_t *t)
+{
+    return (hgshm_arena_t *)((char *)t + t->arena_off);
+}
+
+static uint8_t *htab_group(hgshm_htab_t *t, uint64_t groups, uint64_t g)
+{
+    return (uint8_t *)hgshm_arena_ptr(htab_arena(t), groups) +
+        g * t->group_size;
+}
+
+static char *htab_key(hgshm_htab_t *t, uint8_t *group, int i)
+{
+    return (char *)group + HGSHM_HTAB_GROUP + i * t->slot_size;
+}
+
+static uint64_t htab_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t htab_hash(const void *key, size_t len)
+{
+    const uint8_t *p = key;
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        h = htab_mix(h ^ w);
+    }
+    if (len) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = htab_mix(h ^ w);
+    }
+    return htab_mix(h);
+}
+
+/* Another VM holds what we wait for and may not be running */
+static void htab_spin(unsigned *n)
+{
+    if ((++*n & 1023) == 0)
+        sched_yield();
+    else
+        hgshm_cpu_relax();
+}
+
+/*
+ * Find key in groups, or claim a slot for it when create is set. Returns
+ * the value, NULL if it is not there or there is no room.
+ */
+static char *htab_probe(hgshm_htab_t *t, uint64_t groups, uint64_t ngroups,
+    const void *key, uint64_t hash, int create, int *created)
+{
+    const __m128i tag = _mm_set1_epi8((char)(0x80 | (hash >> 57)));
+    const __m128i empty = _mm_set1_epi8(TAG_EMPTY);
+    const __m128i busy = _mm_set1_epi8(TAG_BUSY);
+    uint64_t g = hash & (ngroups - 1), n;
+    unsigned match, holes, wait, before, spins = 0;
+    uint8_t *grp, expected;
+    __m128i v;
+    int i;
+
+    for (n = 0; n < ngroups; n++, g = (g + 1) & (ngroups - 1)) {
+        grp = htab_group(t, groups, g);
+again:
+        v = _mm_load_si128((const __m128i *)grp);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        match = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tag));
+        holes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, empty));
+        wait = _mm_movemask_epi8(_mm_cmpeq_epi8(v, busy));
+        before = holes ? (1u << __builtin_ctz(holes)) - 1 : 0xffff;
+        for (match &= before; match; match &= match - 1) {
+            i = __builtin_ctz(match);
+            if (memcmp(htab_key(t, grp, i), key, t->key_size) == 0)
+                return htab_key(t, grp, i) + t->key_size;
+        }
+        if (wait & before) {
+            htab_spin(&spins);
+            goto again;
+        }
+        if (holes == 0)
+            continue;
+        if (!create)
+            return NULL;
+        i = __builtin_ctz(holes);
+        expected = TAG_EMPTY;
+        if (!__atomic_compare_exchange_n(&grp[i], &expected, TAG_BUSY, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto again;
+        memcpy(htab_key(t, grp, i), key, t->key_size);
+        memset(htab_key(t, grp, i) + t->key_size, 0, t->val_size);
+        hgshm_store_release(&grp[i], 0x80 | (hash >> 57));
+        *created = 1;
+        return htab_key(t, grp, i) + t->key_size;
+    }
+    return NULL;
+}
+
+/* Move the claimed old groups [first, last) to the new ones */
+static void htab_move(hgshm_htab_t *t, uint64_t first, uint64_t last)
+{
+    uint8_t *grp;
+    char *val;
+    uint64_t g;
+    int i, created;
+
+    for (g = first; g < last; g++) {
+        grp = htab_group(t, t->groups, g);
+        for (i = 0; i < HGSHM_HTAB_GROUP; i++) {
+            if (!(grp[i] & 0x80))
+                continue;
+            val = htab_probe(t, t->next, t->next_ngroups, htab_key(t, grp, i),
+                htab_hash(htab_key(t, grp, i), t->key_size), 1, &created);
+            memcpy(val, htab_key(t, grp, i) + t->key_size, t->val_size);
+        }
+    }
+}
+
+/* Help the resize of generation gen until it is over */
+static void htab_help(hgshm_htab_t *t, uint64_t gen)
+{
+    uint64_t c, first, last, old;
+    unsigned spins = 0;
+
+    /* Wait for the operations inside and for the new groups */
+    for (;;) {
+        c = __atomic_load_n(&t->gate, __ATOMIC_ACQUIRE);
+        if (GATE_GEN(c) != gen || !(c & GATE_RESIZE))
+            return;
+        if ((c & GATE_ACTIVE) == 0 && hgshm_load_acquire(&t->next))
+            break;
+        htab_spin(&spins);
+    }
+    /*
+     * A claim that succeeds was made before the resize could end, so
+     * old and the groups are still those of gen.
+     */
+    c = __atomic_load_n(&t->claim, __ATOMIC_ACQUIRE);
+    old = t->old_ngroups;
+    for (;;) {
+        if (GATE_GEN(c) != gen || (first = (uint32_t)c) >= old)
+            break;
+        last = (first + HTAB_CHUNK < old) ? first + HTAB_CHUNK : old;
+        if (!__atomic_compare_exchange_n(&t->claim, &c, c + (last - first),
+            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        htab_move(t, first, last);
+        if (__atomic_add_fetch(&t->moved, last - first, __ATOMIC_ACQ_REL) ==
+            old) {
+            t->groups = t->next;
+            t->ngroups = t->next_ngroups;
+            t->next = 0;
+            t->resizes++;
+            hgshm_store_release(&t->gate, (gen + 1) << 32);
+            return;
+        }
+        c = __atomic_load_n(&t->claim, __ATOMIC_ACQUIRE);
+        old = t->old_ngroups;
+    }
+    while (GATE_GEN(__atomic_load_n(&t->gate, __ATOMIC_ACQUIRE)) == gen)
+        htab_spin(&spins);
+}
+
+static void htab_enter(hgshm_htab_t *t)
+{
+    uint64_t g = __atomic_load_n(&t->gate, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        if (g & GATE_RESIZE) {
+            htab_help(t, GATE_GEN(g));
+            g = __atomic_load_n(&t->gate, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&t->gate, &g, g + 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return;
+    }
+}
+
+static void htab_exit(hgshm_htab_t *t)
+{
+    __atomic_fetch_sub(&t->gate, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Double the table unless somebody already did since we saw ngroups.
+ * The gate changes with every operation that enters or leaves, so the
+ * CAS is retried until it wins or a resize has started, which we help.
+ */
+static void htab_grow(hgshm_htab_t *t, uint64_t ngroups)
+{
+    uint64_t g = __atomic_load_n(&t->gate, __ATOMIC_ACQUIRE);
+    hgshm_off_t off;
+
+    for (;;) {
+        if (g & GATE_RESIZE) {
+            htab_help(t, GATE_GEN(g));
+            return;
+        }
+        /* A resize since g was read also changed its generation */
+        if (t->ngroups != ngroups || t->full)
+            return;
+        if (__atomic_compare_exchange_n(&t->gate, &g, g | GATE_RESIZE, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    off = hgshm_arena_alloc(htab_arena(t), 2 * ngroups * t->group_size);
+    if (off == HGSHM_OFF_NULL) {
+        t->full = 1;
+        __atomic_fetch_and(&t->gate, ~GATE_RESIZE, __ATOMIC_RELEASE);
+        return;
+    }
+    memset(hgshm_arena_ptr(htab_arena(t), off), 0,
+        2 * ngroups * t->group_size);
+    t->next_ngroups = 2 * ngroups;
+    t->old_ngroups = ngroups;
+    t->moved = 0;
+    __atomic_store_n(&t->claim, GATE_GEN(g) << 32, __ATOMIC_RELEASE);
+    hgshm_store_release(&t->next, off);
+    htab_help(t, GATE_GEN(g));
+}
+
+hgshm_htab_t *hgshm_htab_create(void *mem, size_t size, uint32_t key_size,
+    uint32_t val_size, size_t nkeys)
+{
+    hgshm_htab_t *t = mem;
+    hgshm_arena_t *a;
+    uint64_t ngroups = 1;
+
+    if (mem == NULL || ((uintptr_t)mem & (HGSHM_CACHELINE - 1)) ||
+        key_size == 0 || key_size > HGSHM_HTAB_MAX_KEY ||
+        size < 2 * sizeof(hgshm_htab_t))
+        return NULL;
+    while (HTAB_LOAD(ngroups * HGSHM_HTAB_GROUP) < nkeys)
+        ngroups *= 2;
+
+    t->magic = 0;
+    __sync_synchronize();
+    t->key_size = key_size;
+    t->val_size = val_size;
+    t->slot_size = (key_size + val_size + 7) & ~7;
+    t->group_size = (HGSHM_HTAB_GROUP + HGSHM_HTAB_GROUP * t->slot_size +
+        HGSHM_CACHELINE - 1) & ~(uint64_t)(HGSHM_CACHELINE - 1);
+    t->arena_off = sizeof(hgshm_htab_t);
+    t->size = size;
+    t->gate = 0;
+    t->next = 0;
+    t->full = 0;
+    t->resizes = 0;
+    t->claim = 0;
+    t->moved = 0;
+    t->count = 0;
+    if ((a = hgshm_arena_init((char *)t + t->arena_off,
+        size - t->arena_off)) == NULL ||
+        (t->groups = hgshm_arena_alloc(a, ngroups * t->group_size)) ==
+        HGSHM_OFF_NULL)
+        return NULL;
+    t->ngroups = ngroups;
+    memset(hgshm_arena_ptr(a, t->groups), 0, ngroups * t->group_size);
+    hgshm_store_release(&t->magic, HGSHM_HTAB_MAGIC);
+    return t;
+}
+
+hgshm_htab_t *hgshm_htab_attach(void *mem)
+{
+    hgshm_htab_t *t = mem;
+
+    if (hgshm_load_acquire(&t->magic) != HGSHM_HTAB_MAGIC)
+        return NULL;
+    return t;
+}
+
+int hgshm_htab_update(hgshm_htab_t *t, const void *key,
+    void (*fn)(void *val, void *arg), void *arg)
+{
+    uint64_t hash = htab_hash(key, t->key_size), ngroups, count;
+    int created = 0;
+    char *val;
+
+    for (;;) {
+        htab_enter(t);
+        ngroups = t->ngroups;
+        val = htab_probe(t, t->groups, ngroups, key, hash, 1, &created);
+        if (val)
+            fn(val, arg);
+        htab_exit(t);
+        if (val || t->full)
+            break;
+        /* No room left in the probe sequence: grow and try again */
+        htab_grow(t, ngroups);
+    }
+    if (val == NULL)
+        return -1;
+    if (created) {
+        count = __atomic_add_fetch(&t->count, 1, __ATOMIC_RELAXED);
+        if (count > HTAB_LOAD(ngroups * HGSHM_HTAB_GROUP))
+            htab_grow(t, ngroups);
+    }
+    return created;
+}
+
+static void htab_add_fn(void *val, void *arg)
+{
+    __atomic_fetch_add((int64_t *)val, *(int64_t *)arg, __ATOMIC_RELAXED);
+}
+
+int hgshm_htab_add(hgshm_htab_t *t, const void *key, int64_t delta)
+{
+    if (t->val_size < sizeof(int64_t))
+        return -1;
+    return (hgshm_htab_update(t, key, htab_add_fn, &delta) < 0) ? -1 : 0;
+}
+
+int hgshm_htab_get(hgshm_htab_t *t, const void *key, void *val)
+{
+    char *v;
+
+    htab_enter(t);
+    v = htab_probe(t, t->groups, t->ngroups, key,
+        htab_hash(key, t->key_size), 0, NULL);
+    if (v)
+        memcpy(val, v, t->val_size);
+    htab_exit(t);
+    return v ? 0 : -1;
+}
+
+void hgshm_htab_foreach(hgshm_htab_t *t, void (*fn)(const void *key,
+    void *val, void *arg), void *arg)
+{
+    uint8_t *grp;
+    uint64_t g;
+    int i;
+
+    htab_enter(t);
+    for (g = 0; g < t->ngroups; g++) {
+        grp = htab_group(t, t->groups, g);
+        for (i = 0; i < HGSHM_HTAB_GROUP; i++)
+            if (hgshm_load_acquire(&grp[i]) & 0x80)
+                fn(htab_key(t, grp, i), htab_key(t, grp, i) + t->key_size,
+                    arg);
+    }
+    htab_exit(t);
+}
+
+uint64_t hgshm_htab_count(hgshm_htab_t *t)
+{
+    return __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+}
+
+uint64_t hgshm_htab_capacity(hgshm_htab_t *t)
+{
+    return t->ngroups * HGSHM_HTAB_GROUP;
+}
+
+void hgshm_htab_print(hgshm_htab_t *t, FILE *fp)
+{
+    fprintf(fp, "htab: %lu keys in %lu slots, %u resizes%s, arena %zu/%zu\n",
+        hgshm_htab_count(t), hgshm_htab_capacity(t), t->resizes,
+        t->full ? " (full)" : "", hgshm_arena_used(htab_arena(t)),
+        hgshm_arena_size(htab_arena(t)));
+}
@@ -0,0 +1,72 @@
+#ifndef _HGSHM_HTAB_H
+#define _HGSHM_HTAB_H
+/*
+ * Concurrent hash table in shared memory.
+ *
+ * Fixed size keys and values, open addressing over groups of 16 slots.
+ * Each group starts with 16 tag bytes (7 bits of the hash, or empty, or
+ * being inserted) that a lookup compares all at once with SSE2, so a
+ * probe touches the keys of matching slots only. Like the arena and the
+ * rings everything inside is an offset: the table can be formatted in
+ * any memory every user maps (slice 0 for all VMs, the whole region for
+ * index 0 alone) and used from any thread of any VM.
+ *
+ * Inserts claim the first empty slot of the probe sequence with a CAS on
+ * its tag, so two VMs inserting the same key meet at the same slot and
+ * only one creates it. Values start zeroed and are updated in place by
+ * the caller with atomics, within hgshm_htab_update() or with
+ * hgshm_htab_add() for 64 bit counters. There is no delete.
+ *
+ * The groups come from an arena behind the header. When the table is
+ * 7/8 full it doubles: new operations stop at the door, and every thread
+ * that arrives helps copy a share of the old groups to the new ones
+ * before going on, so a resize is spread over whoever uses the table.
+ *
+ *	t = hgshm_htab_create(mem, size, sizeof(key), sizeof(int64_t), n)
+ *	t = hgshm_htab_attach(mem)                  (other VMs)
+ *	hgshm_htab_add(t, &key, 1)                  (anyone)
+ *	hgshm_htab_foreach(t, fn, arg)              (once everyone is done)
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slots per group, one SSE2 compare */
+#define HGSHM_HTAB_GROUP    16
+#define HGSHM_HTAB_MAX_KEY  256
+
+typedef struct hgshm_htab hgshm_htab_t;
+
+/*
+ * Format mem (cache line aligned, size bytes) for keys and values of the
+ * given sizes, with room for nkeys before the first resize. Whatever the
+ * initial groups leave of size is kept for resizing. NULL if the initial
+ * groups do not fit.
+ */
+hgshm_htab_t * hgshm_htab_create(void *mem, size_t size, uint32_t key_size,
+    uint32_t val_size, size_t nkeys);
+/* Use a table formatted by another VM, NULL if mem is not a table */
+hgshm_htab_t * hgshm_htab_attach(void *mem);
+
+/*
+ * Find or insert key and call fn on its value, in place. Others may be
+ * updating the same value: fn must use atomics. Returns 1 if the key was
+ * created, 0 if it was there, -1 if the table is full.
+ */
+int hgshm_htab_update(hgshm_htab_t *t, const void *key,
+    void (*fn)(void *val, void *arg), void *arg);
+/* Add delta to the 64 bit value at the start of key's value, -1 if full */
+int hgshm_htab_add(hgshm_htab_t *t, const void *key, int64_t delta);
+/* Copy key's value out, -1 if it is not there */
+int hgshm_htab_get(hgshm_htab_t *t, const void *key, void *val);
+/*
+ * Call fn for every key. It holds off resizes until it returns, so fn
+ * must not insert.
+ */
+void hgshm_htab_foreach(hgshm_htab_t *t, void (*fn)(const void *key,
+    void *val, void *arg), void *arg);
+
+uint64_t hgshm_htab_count(hgshm_htab_t *t);
+uint64_t hgshm_htab_capacity(hgshm_htab_t *t);
+void hgshm_htab_print(hgshm_htab_t *t, FILE *fp);
+#endif /* _HGSHM_HTAB_H */
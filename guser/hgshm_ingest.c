@@ -0,0 +1,274 @@
+/*
+ * Ingestion into pipe buffers, see hgshm_ingest.h.
+ *
+ * Regular files: up to depth reads are queued, each owning one acquired
+ * buffer. New reads are queued while there is input and the next pipe
+ * has a free buffer; otherwise we sleep in aio_suspend() until a read
+ * completes, publish its buffer and go on. Only when nothing is in
+ * flight do we block in hgshm_pipe_acquire(). Reads never start past
+ * the size the file had at open, so a read returning 0 means the file
+ * shrank; its buffer is published empty, which is that pipe's eof. Its
+ * consumer stops there and never frees a buffer again, so no read is
+ * queued past that offset or to an ended pipe.
+ *
+ * O_DIRECT reads are rounded up to HGSHM_PAGE_SIZE. Pipe buffers are
+ * page aligned and a page multiple, so they always hold the rounding.
+ * Direct I/O cannot target every mapping: in a guest the buffers are
+ * BAR pages mapped with remap_pfn_range() and the read fails with
+ * EFAULT. The first such read is redone through the buffered descriptor
+ * and every later one goes there too.
+ *
+ * A failed read ends its pipe like a short file would, but no read is
+ * queued after it and the run returns -1.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <aio.h>
+#include <sys/stat.h>
+
+#include "hgshm_int.h"
+#include "hgshm_ingest.h"
+
+typedef struct {
+    struct aiocb cb;
+    int         pipe;
+    int         buf;
+    size_t      want;               /* bytes of input, before rounding */
+    int         busy;
+} ingest_req_t;
+
+struct hgshm_ingest {
+    int         fd;
+    int         dfd;                /* O_DIRECT, -1 without */
+    int         regular;
+    int         direct;
+    int         failed;
+    int         depth;
+    uint64_t    size;               /* regular files, at open */
+    ingest_req_t *req;
+    /* Stats */
+    uint64_t    reads;
+    uint64_t    bytes;
+    uint64_t    stalls;             /* waits for a free buffer */
+    int         max_inflight;
+};
+
+hgshm_ingest_t *hgshm_ingest_open(const char *path, int flags, int depth)
+{
+    hgshm_ingest_t *in = calloc(1, sizeof(hgshm_ingest_t));
+    struct stat st;
+
+    if (in == NULL)
+        return NULL;
+    in->depth = depth ? depth : HGSHM_INGEST_DEPTH;
+    if (strcmp(path, "-") == 0) {
+        in->fd = dup(STDIN_FILENO);
+        in->dfd = -1;
+    } else {
+        in->fd = open(path, O_RDONLY);
+        in->dfd = -1;
+        if (in->fd >= 0 && (flags & HGSHM_INGEST_DIRECT)) {
+            in->dfd = open(path, O_RDONLY | O_DIRECT);
+            in->direct = (in->dfd >= 0);
+        }
+    }
+    if (in->fd < 0 || fstat(in->fd, &st) < 0) {
+        perror(path);
+        goto error;
+    }
+    in->regular = S_ISREG(st.st_mode);
+    in->size = st.st_size;
+    if (!in->regular && in->dfd >= 0) {
+        close(in->dfd);
+        in->dfd = -1;
+        in->direct = 0;
+    } else if (!in->direct) {
+        posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if ((in->req = calloc(in->depth, sizeof(ingest_req_t))) == NULL)
+        goto error;
+    return in;
+
+error:
+    if (in->fd >= 0)
+        close(in->fd);
+    if (in->dfd >= 0)
+        close(in->dfd);
+    free(in);
+    return NULL;
+}
+
+void hgshm_ingest_close(hgshm_ingest_t *in)
+{
+    close(in->fd);
+    if (in->dfd >= 0)
+        close(in->dfd);
+    free(in->req);
+    free(in);
+}
+
+/* Publish a read that returned n, -1 if it failed */
+static int ingest_complete(hgshm_ingest_t *in, ingest_req_t *r,
+    hgshm_pipe_t **pipes, int *ended, ssize_t n)
+{
+    size_t got;
+
+    r->busy = 0;
+    if (n < 0 && r->cb.aio_fildes == in->dfd &&
+        (errno == EFAULT || errno == EINVAL)) {
+        in->direct = 0;
+        n = pread(in->fd, (char *)r->cb.aio_buf, r->want, r->cb.aio_offset);
+    }
+    got = (n < 0) ? 0 : ((size_t)n > r->want) ? r->want : (size_t)n;
+    /* A short read before the end, finish it synchronously */
+    while (got < r->want && n > 0) {
+        n = pread(in->fd, (char *)r->cb.aio_buf + got, r->want - got,
+            r->cb.aio_offset + got);
+        if (n > 0)
+            got += n;
+    }
+    if (n < 0) {
+        perror("hgshm: ingest read");
+        in->failed = 1;
+    }
+    hgshm_pipe_publish(pipes[r->pipe], r->buf, got);
+    if (got == 0) {
+        ended[r->pipe] = 1;
+        if (in->size > (uint64_t)r->cb.aio_offset)
+            in->size = r->cb.aio_offset;
+    }
+    in->reads++;
+    in->bytes += got;
+    return (n < 0) ? -1 : 0;
+}
+
+static int64_t ingest_file(hgshm_ingest_t *in, hgshm_pipe_t **pipes,
+    int npipes, int *ended)
+{
+    const struct aiocb *list[in->depth];
+    int i, b, n, j = 0, inflight = 0, rc = 0;
+    uint64_t off = 0;
+    ingest_req_t *r;
+    size_t len;
+    void *data;
+
+    while ((off < in->size && !in->failed) || inflight) {
+        while (inflight < in->depth && off < in->size && !in->failed) {
+            for (i = 0; i < npipes && ended[j]; i++)
+                j = (j + 1) % npipes;
+            if (ended[j]) {
+                in->size = off;
+                break;
+            }
+            data = hgshm_pipe_acquire(pipes[j], &b, NULL, inflight ? 0 : -1);
+            if (data == NULL) {
+                in->stalls++;
+                break;
+            }
+            for (r = in->req; r->busy; r++)
+                ;
+            len = hgshm_pipe_buf_size(pipes[j]);
+            if (len > in->size - off)
+                len = in->size - off;
+            memset(&r->cb, 0, sizeof(r->cb));
+            r->cb.aio_fildes = in->direct ? in->dfd : in->fd;
+            r->cb.aio_buf = data;
+            r->cb.aio_offset = off;
+            r->cb.aio_nbytes = in->direct ? (len + HGSHM_PAGE_SIZE - 1) &
+                ~(size_t)(HGSHM_PAGE_SIZE - 1) : len;
+            r->pipe = j;
+            r->buf = b;
+            r->want = len;
+            r->busy = 1;
+            off += len;
+            j = (j + 1) % npipes;
+            /* Out of AIO resources, read this one ourselves */
+            if (aio_read(&r->cb) < 0) {
+                if (ingest_complete(in, r, pipes, ended, pread(
+                    r->cb.aio_fildes, data, r->cb.aio_nbytes,
+                    r->cb.aio_offset)) < 0)
+                    rc = -1;
+                continue;
+            }
+            if (++inflight > in->max_inflight)
+                in->max_inflight = inflight;
+        }
+        if (!in->direct && off < in->size)
+            readahead(in->fd, off, (size_t)in->depth *
+                hgshm_pipe_buf_size(pipes[j]));
+        if (inflight == 0)
+            continue;
+
+        for (i = n = 0; i < in->depth; i++)
+            if (in->req[i].busy)
+                list[n++] = &in->req[i].cb;
+        aio_suspend(list, n, NULL);
+        for (i = 0; i < in->depth; i++) {
+            r = &in->req[i];
+            if (!r->busy || aio_error(&r->cb) == EINPROGRESS)
+                continue;
+            errno = aio_error(&r->cb);
+            if (ingest_complete(in, r, pipes, ended, aio_return(&r->cb)) < 0)
+                rc = -1;
+            inflight--;
+        }
+    }
+    return (rc < 0) ? -1 : (int64_t)in->bytes;
+}
+
+static int64_t ingest_stream(hgshm_ingest_t *in, hgshm_pipe_t **pipes,
+    int npipes, int *ended)
+{
+    size_t len, got;
+    ssize_t n = 1;
+    int b, j = 0;
+    char *data;
+
+    while (n > 0) {
+        data = hgshm_pipe_acquire(pipes[j], &b, NULL, -1);
+        len = hgshm_pipe_buf_size(pipes[j]);
+        for (got = 0; got < len; got += n) {
+            n = read(in->fd, data + got, len - got);
+            if (n <= 0)
+                break;
+        }
+        if (n < 0)
+            perror("hgshm: ingest read");
+        hgshm_pipe_publish(pipes[j], b, got);
+        if (got == 0)
+            ended[j] = 1;
+        in->reads++;
+        in->bytes += got;
+        j = (j + 1) % npipes;
+    }
+    return (n < 0) ? -1 : (int64_t)in->bytes;
+}
+
+int64_t hgshm_ingest_run(hgshm_ingest_t *in, hgshm_pipe_t **pipes,
+    int npipes)
+{
+    int ended[npipes], j;
+    int64_t rc;
+
+    memset(ended, 0, sizeof(ended));
+    if (in->regular)
+        rc = ingest_file(in, pipes, npipes, ended);
+    else
+        rc = ingest_stream(in, pipes, npipes, ended);
+    for (j = 0; j < npipes; j++)
+        if (!ended[j])
+            hgshm_pipe_eof(pipes[j], -1);
+    return rc;
+}
+
+void hgshm_ingest_print_stats(hgshm_ingest_t *in, FILE *fp)
+{
+    fprintf(fp, "ingest: %s%s, %lu reads, %lu bytes, %d in flight, "
+        "%lu stalls\n", in->regular ? "file" : "stream",
+        in->direct ? " O_DIRECT" : "", in->reads, in->bytes,
+        in->max_inflight, in->stalls);
+}
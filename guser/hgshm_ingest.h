@@ -0,0 +1,47 @@
+#ifndef _HGSHM_INGEST_H
+#define _HGSHM_INGEST_H
+/*
+ * Ingestion: read a file or a stream straight into pipe buffers.
+ *
+ * The mapper no longer reads its input into private memory to copy it
+ * into a slice again. A regular file is read with a queue of POSIX AIO
+ * reads, each into a free buffer of the next pipe (round robin); a
+ * buffer is published to its reducer as soon as its read completes,
+ * while the other reads are still in flight. The file is opened with
+ * O_DIRECT when asked and the file system allows it, otherwise the
+ * kernel is told to read ahead of the queue. Buffers that cannot take
+ * direct I/O (BAR mappings in a guest) switch the run to buffered reads. Pipes, sockets and
+ * terminals are read in order with read(2), a buffer at a time.
+ *
+ * Buffers carry consecutive raw bytes of the input, cut at the buffer
+ * size; records that must not be split need a format that says so.
+ *
+ *	in = hgshm_ingest_open("video.raw", HGSHM_INGEST_DIRECT, 0)
+ *	hgshm_ingest_run(in, pipes, n)      pipes get the data, then eof
+ *	hgshm_ingest_close(in)
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hgshm_pipe.h"
+
+/* Try O_DIRECT for regular files */
+#define HGSHM_INGEST_DIRECT     0x1
+/* Reads in flight when hgshm_ingest_open() is given 0 */
+#define HGSHM_INGEST_DEPTH      8
+
+typedef struct hgshm_ingest hgshm_ingest_t;
+
+/* path "-" is standard input. depth 0 for HGSHM_INGEST_DEPTH */
+hgshm_ingest_t * hgshm_ingest_open(const char *path, int flags, int depth);
+/*
+ * Read the whole input into the pipes and send each of them eof. The
+ * caller is the producer of every pipe. Returns the bytes read, -1 on a
+ * read error (the pipes still get eof).
+ */
+int64_t hgshm_ingest_run(hgshm_ingest_t *in, hgshm_pipe_t **pipes,
+    int npipes);
+void hgshm_ingest_close(hgshm_ingest_t *in);
+/* Reads, bytes, whether O_DIRECT was used and how often buffers ran out */
+void hgshm_ingest_print_stats(hgshm_ingest_t *in, FILE *fp);
+#endif /* _HGSHM_INGEST_H */
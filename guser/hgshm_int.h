@@ -0,0 +1,100 @@
+#ifndef _HGSHM_INT_H
+#define _HGSHM_INT_H
+/*
+ * libhgshm internals shared by the backends. Not installed.
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "hgshm.h"
+
+#define HGSHM_MAX_CLIENTS       64
+#define HGSHM_MAX_QUEUES        16
+#define HGSHM_PAGE_SIZE         (4<<10)
+#define HGSHM_CACHELINE         64
+#define HGSHM_ALIGNED           __attribute__((aligned(HGSHM_CACHELINE)))
+
+#define hgshm_load_acquire(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define hgshm_store_release(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define hgshm_cpu_relax()           __builtin_ia32_pause()
+
+/* Same slice limits as the qemu device */
+#define HGSHM_MAX_SLICE_SZ      (256 << 20)
+#define HGSHM_MAX_MAP_SLICE_SZ  (128 << 20)
+
+typedef struct {
+    int     (*notify)(hgshm_ctx_t *ctx, int index);
+    /*
+     * Block for the next interrupt of this context. Returns 1 for an
+     * interrupt, 0 for nothing (timeout, signal) and -1 on error.
+     */
+    int     (*wait_irq)(hgshm_ctx_t *ctx);
+    /* Make a blocked wait_irq return, used by close */
+    void    (*kick)(hgshm_ctx_t *ctx);
+    void    (*close)(hgshm_ctx_t *ctx);
+    /* Same for queues past 0, NULL if the backend has only one queue */
+    int     (*notify_queue)(hgshm_ctx_t *ctx, int index, int queue);
+    int     (*wait_queue_irq)(hgshm_ctx_t *ctx, int queue);
+    void    (*kick_queue)(hgshm_ctx_t *ctx, int queue);
+} hgshm_ops_t;
+
+/*
+ * Queue 1 and up of a context, each with its own notifier thread and
+ * its own count, see hgshm_ctx_wait_queue(). Queue 0 is the context.
+ */
+typedef struct {
+    hgshm_ctx_t *ctx;
+    int         queue;
+    pthread_t   tid;
+    int         running;
+    uint64_t    irq_seen;       /* device backend HGSHM_QWAIT cookie */
+    uint64_t    events;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} hgshm_queue_t;
+
+struct hgshm_ctx {
+	int	fd;
+	size_t	shm_sz;
+	size_t	shm_slice_sz;
+	void	(*cb) (void *);
+	void	*cb_arg;
+    void    *shmptr[2];
+    void    *view;              /* read-only whole region, see hgshm_ctx_view */
+    size_t  view_sz;
+    volatile uint32_t *doorbell; /* NULL if device has no doorbell BAR */
+    size_t  doorbell_sz;        /* 2 pages with the queue doorbells */
+    int index;
+    const hgshm_ops_t *ops;
+    void    *priv;              /* backend private state */
+
+    /* Interrupts seen by the notifier thread, see hgshm_ctx_wait */
+    pthread_t   notifier_tid;
+    int         notifier_running;
+    volatile int closing;
+    uint64_t    irq_seen;       /* device backend HGSHM_WAIT cookie */
+    uint64_t    *relay;         /* see hgshm_ctx_set_relay() */
+    uint64_t    events;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int         queues;         /* set by the backend, at least 1 */
+    hgshm_queue_t q[HGSHM_MAX_QUEUES];
+};
+
+/* Host emulation backend, hgshm_emu.c */
+int hgshm_emu_init(hgshm_ctx_t *ctx, const char *spec);
+
+/* Timeouts, hgshm_sync.c: monotonic ms, and what is left of timeout_ms */
+uint64_t hgshm_now_ms(void);
+int hgshm_remain_ms(int timeout_ms, uint64_t start);
+
+static inline size_t hgshm_slice_size(size_t shmsize, int clients)
+{
+    int ffs = __builtin_ffs(clients); /* ffs = find first set */
+    if (ffs <= 0)
+        return shmsize;
+    shmsize >>= (ffs - 1);
+    return (shmsize > HGSHM_MAX_SLICE_SZ) ? HGSHM_MAX_SLICE_SZ : shmsize;
+}
+#endif /* _HGSHM_INT_H */
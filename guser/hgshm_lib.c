@@ -3,10 +3,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "hgshm.h"
+#include "hgshm_int.h"
 
 #define HGSHM_SET_SIGNAL	        _IOW('H', 1, set_sig_ioctl_t)
 #define HGSHM_POKE                  _IOW('H', 2, int)
@@ -16,138 +23,707 @@
 #define HGSHM_GET_IO_SIZE	        _IOR('H', 6, size_t)
 #define HGSHM_GET_SHM_SLICE_SIZE	_IOR('H', 7, size_t)
 
+/* mmap offsets are BAR numbers in pages */
+#define HGSHM_MEM_BAR           1
+#define HGSHM_SLICE_I_BAR       3
+#define HGSHM_DOORBELL_BAR      5
+#define HGSHM_DOORBELL_STRIDE   4
+/* Queue doorbells, after the doorbell page, see lnx_gkernel/hgshm.h */
+#define HGSHM_QDOORBELL_OFF     HGSHM_PAGE_SIZE
+#define HGSHM_DOORBELL_MAP_SIZE (2 * HGSHM_PAGE_SIZE)
+
+#define HGSHM_DEV_PREFIX        "/dev/hgshm"
+#define HGSHM_DEV_PATH_LEN      64
+
+/* Device spec prefix that selects the host emulation backend */
+#define HGSHM_EMU_PREFIX        "shm:"
+
 typedef struct {
 	int	signal;
 	pid_t	pid;
 } set_sig_ioctl_t;
 
+/* Must match hgshm_wait_t in lnx_gkernel/hgshm.h */
 typedef struct {
-	int	fd;
-	size_t	shm_sz;
-	size_t	shm_slice_sz;
-	void	(*cb) (void *);
-	void	*cb_arg;
-    void    *shmptr[2];
-    int index;
-} hgshm_t;
+	uint64_t	seen;
+	int		timeout_ms;
+} hgshm_wait_t;
 
-hgshm_t hgshm;
+/* Must match hgshm_qwait_t and hgshm_qpoke_t in lnx_gkernel/hgshm.h */
+typedef struct {
+	uint64_t	seen;
+	int		timeout_ms;
+	int		queue;
+} hgshm_qwait_t;
+
+typedef struct {
+	int		index;
+	int		queue;
+} hgshm_qpoke_t;
+
+#define HGSHM_WAIT                  _IOWR('H', 8, hgshm_wait_t)
+#define HGSHM_GET_QUEUES            _IOR('H', 9, int)
+#define HGSHM_QWAIT                 _IOWR('H', 10, hgshm_qwait_t)
+#define HGSHM_QPOKE                 _IOW('H', 11, hgshm_qpoke_t)
+#define HGSHM_GET_VIEW_SIZE         _IOR('H', 12, size_t)
+
+/*
+ * The notifier thread blocks in HGSHM_WAIT with this timeout so that
+ * hgshm_ctx_close() does not wait on a device that never interrupts.
+ */
+#define HGSHM_DEV_WAIT_MS       200
+
+/* Context behind the original global API */
+static hgshm_ctx_t *hgshm_ctx;
 
 static uint64_t virt_to_phys(void *vmem);
+static void hgshm_ctx_post(hgshm_ctx_t *ctx);
 
-static void sig_handler(int sig)
+static int hgshm_dev_notify(hgshm_ctx_t *ctx, int index)
 {
-	if(hgshm.cb)
-		hgshm.cb(hgshm.cb_arg);
+    if (ctx->doorbell) {
+        /* Data written so far must be visible before the peer wakes up */
+        __sync_synchronize();
+        ctx->doorbell[index * (HGSHM_DOORBELL_STRIDE / sizeof(uint32_t))] = 1;
+        return 0;
+    }
+	return ioctl(ctx->fd, HGSHM_POKE, &index);
 }
 
-int hgshm_notify(int index)
+static int hgshm_dev_wait_irq(hgshm_ctx_t *ctx)
 {
-	return ioctl(hgshm.fd, HGSHM_POKE, &index);
+    hgshm_wait_t wait;
+
+    wait.seen = ctx->irq_seen;
+    wait.timeout_ms = HGSHM_DEV_WAIT_MS;
+    if (ioctl(ctx->fd, HGSHM_WAIT, &wait) < 0)
+        return (errno == ETIMEDOUT || errno == EINTR) ? 0 : -1;
+    ctx->irq_seen = wait.seen;
+    return 1;
 }
 
-int hgshm_get_index(void)
+static void hgshm_dev_kick(hgshm_ctx_t *ctx)
 {
-    return hgshm.index;
+    /* Nothing to do, hgshm_dev_wait_irq times out on its own */
 }
 
-size_t hgshm_get_shm_slice_sz(void)
+static void hgshm_dev_kick_queue(hgshm_ctx_t *ctx, int queue)
 {
-    return hgshm.shm_slice_sz;
+    /* Same, HGSHM_QWAIT times out */
 }
 
-void hgshm_close(void)
+static int hgshm_dev_notify_queue(hgshm_ctx_t *ctx, int index, int queue)
 {
-	munmap(hgshm.shmptr[0], hgshm.shm_sz);
-    if (hgshm.index != 0)
-	    munmap(hgshm.shmptr[1], hgshm.shm_slice_sz);
-    close(hgshm.fd);
+    hgshm_qpoke_t poke;
+
+    if (ctx->doorbell_sz >= HGSHM_DOORBELL_MAP_SIZE) {
+        __sync_synchronize();
+        ctx->doorbell[(HGSHM_QDOORBELL_OFF + (index * HGSHM_MAX_QUEUES +
+            queue) * HGSHM_DOORBELL_STRIDE) / sizeof(uint32_t)] = 1;
+        return 0;
+    }
+    poke.index = index;
+    poke.queue = queue;
+    return ioctl(ctx->fd, HGSHM_QPOKE, &poke);
 }
 
-void * hgshm_getshm(int index, size_t *sz)
+static int hgshm_dev_wait_queue_irq(hgshm_ctx_t *ctx, int queue)
 {
-    if (index < 0 && index > 1)
-        return NULL;
-     switch (index) {
-     case 0: *sz = hgshm.shm_sz;
-        break;
-     case 1: *sz = hgshm.shm_slice_sz;
-        break;
-     }
-     return hgshm.shmptr[index];
+    hgshm_queue_t *q = &ctx->q[queue];
+    hgshm_qwait_t wait;
+
+    wait.seen = q->irq_seen;
+    wait.timeout_ms = HGSHM_DEV_WAIT_MS;
+    wait.queue = queue;
+    if (ioctl(ctx->fd, HGSHM_QWAIT, &wait) < 0)
+        return (errno == ETIMEDOUT || errno == EINTR) ? 0 : -1;
+    q->irq_seen = wait.seen;
+    return 1;
 }
 
-static int hgshm_map(void)
+static void hgshm_dev_close(hgshm_ctx_t *ctx)
 {
-    hgshm.shmptr[0] = mmap(0, hgshm.shm_sz, PROT_READ|PROT_WRITE,
-        MAP_SHARED|MAP_LOCKED, hgshm.fd, ((4<<10) * 1));
+	munmap(ctx->shmptr[0], ctx->shm_sz);
+    if (ctx->index != 0)
+	    munmap(ctx->shmptr[1], ctx->shm_slice_sz);
+    if (ctx->view)
+        munmap(ctx->view, ctx->view_sz);
+    if (ctx->doorbell)
+        munmap((void *)ctx->doorbell, ctx->doorbell_sz);
+    close(ctx->fd);
+}
+
+/*
+ * Doorbell page is optional. Without it hgshm_notify falls back to the
+ * HGSHM_POKE ioctl. Devices with queues have a second page with the
+ * queue doorbells, without it queues are rung with HGSHM_QPOKE.
+ */
+static void hgshm_map_doorbell(hgshm_ctx_t *ctx)
+{
+    void *ptr = mmap(0, HGSHM_DOORBELL_MAP_SIZE, PROT_WRITE, MAP_SHARED,
+        ctx->fd, HGSHM_PAGE_SIZE * HGSHM_DOORBELL_BAR);
 
-	if (hgshm.shmptr[0] == MAP_FAILED) {
+    ctx->doorbell_sz = HGSHM_DOORBELL_MAP_SIZE;
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(0, HGSHM_PAGE_SIZE, PROT_WRITE, MAP_SHARED, ctx->fd,
+            HGSHM_PAGE_SIZE * HGSHM_DOORBELL_BAR);
+        ctx->doorbell_sz = HGSHM_PAGE_SIZE;
+    }
+    ctx->doorbell = (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+static int hgshm_map(hgshm_ctx_t *ctx)
+{
+    ctx->shmptr[0] = mmap(0, ctx->shm_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_LOCKED, ctx->fd, HGSHM_PAGE_SIZE * HGSHM_MEM_BAR);
+
+	if (ctx->shmptr[0] == MAP_FAILED) {
 		perror ("");
         printf("MAP_FAILED for shmptr[0]\n");
-		close(hgshm.fd);
 		return -1;
 	}
 
-    if (hgshm.index == 0)
+    hgshm_map_doorbell(ctx);
+
+    if (ctx->index == 0)
         return 0; /* No BAR3 for zero index */
 
-    hgshm.shmptr[1] = mmap(0, hgshm.shm_slice_sz, PROT_READ|PROT_WRITE,
-        MAP_SHARED|MAP_LOCKED, hgshm.fd, ((4<<10) * 3));
+    ctx->shmptr[1] = mmap(0, ctx->shm_slice_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_LOCKED, ctx->fd, HGSHM_PAGE_SIZE * HGSHM_SLICE_I_BAR);
 
-	if (hgshm.shmptr[1] == MAP_FAILED) {
+	if (ctx->shmptr[1] == MAP_FAILED) {
 		perror ("");
         printf("MAP_FAILED for shmptr[1]\n");
-	    munmap(hgshm.shmptr[0], hgshm.shm_sz);
-		close(hgshm.fd);
+	    munmap(ctx->shmptr[0], ctx->shm_sz);
+        if (ctx->doorbell)
+            munmap((void *)ctx->doorbell, ctx->doorbell_sz);
 		return -1;
 	}
+
+    /*
+     * With the full view BAR3 is the whole region, past slice 0 it is
+     * read-only. Map all of it read-only once more, so a stray write
+     * faults here instead of being dropped by the device.
+     */
+	if (ioctl(ctx->fd, HGSHM_GET_VIEW_SIZE, &ctx->view_sz) < 0 ||
+        ctx->view_sz <= ctx->shm_slice_sz)
+        return 0;
+    ctx->view = mmap(0, ctx->view_sz, PROT_READ, MAP_SHARED, ctx->fd,
+        HGSHM_PAGE_SIZE * HGSHM_SLICE_I_BAR);
+    if (ctx->view == MAP_FAILED) {
+        perror ("");
+        printf("MAP_FAILED for view, slice 0 only\n");
+        ctx->view = NULL;
+    }
     return 0;
 }
 
-int hgshm_init(char *dev, void (*cb)(void *), void *cb_arg)
+/*
+ * A guest can have several hgshm devices, /dev/hgshm0 ... /dev/hgshmN.
+ * dev may be a path, a bare device number ("1" is /dev/hgshm1) or NULL
+ * for /dev/hgshm0.
+ */
+static const char *hgshm_devpath(const char *dev, char *buf, size_t len)
 {
-	set_sig_ioctl_t iodata;
+    const char *p;
 
-	hgshm.fd = open (dev, O_RDWR, 0666);
-	if (hgshm.fd <= 0) {
+    if (dev == NULL || *dev == 0)
+        dev = "0";
+    for (p = dev; *p && isdigit(*p); p++);
+    if (*p)
+        return dev;
+    snprintf(buf, len, "%s%s", HGSHM_DEV_PREFIX, dev);
+    return buf;
+}
+
+static const hgshm_ops_t hgshm_dev_ops = {
+    .notify = hgshm_dev_notify,
+    .wait_irq = hgshm_dev_wait_irq,
+    .kick = hgshm_dev_kick,
+    .close = hgshm_dev_close,
+    .notify_queue = hgshm_dev_notify_queue,
+    .wait_queue_irq = hgshm_dev_wait_queue_irq,
+    .kick_queue = hgshm_dev_kick_queue,
+};
+
+static int hgshm_dev_init(hgshm_ctx_t *ctx, const char *dev)
+{
+    char path[HGSHM_DEV_PATH_LEN];
+
+    ctx->ops = &hgshm_dev_ops;
+	ctx->fd = open (hgshm_devpath(dev, path, sizeof(path)), O_RDWR, 0666);
+	if (ctx->fd < 0) {
         return -1;
     }
 
-	iodata.pid = getpid();
-	iodata.signal = SIGUSR1;
-
-	signal(iodata.signal, sig_handler);
-	if (ioctl(hgshm.fd, HGSHM_SET_SIGNAL, &iodata) < 0) {
+	if (ioctl(ctx->fd, HGSHM_GET_INDEX, &ctx->index) < 0) {
 		perror ("");
-		close(hgshm.fd);
+		close(ctx->fd);
         return -1;
 	}
+    //printf("IDX: %d\n", (int)ctx->index);
 
-	if (ioctl(hgshm.fd, HGSHM_GET_INDEX, &hgshm.index) < 0) {
+	if (ioctl(ctx->fd, HGSHM_GET_SHM_SIZE, &ctx->shm_sz) < 0) {
 		perror ("");
-		close(hgshm.fd);
+		close(ctx->fd);
         return -1;
 	}
-    //printf("IDX: %d\n", (int)hgshm.index);
+    //printf("SZ: %d\n", (int)ctx->shm_sz);
 
-	if (ioctl(hgshm.fd, HGSHM_GET_SHM_SIZE, &hgshm.shm_sz) < 0) {
+	if (ioctl(ctx->fd, HGSHM_GET_SHM_SLICE_SIZE, &ctx->shm_slice_sz) < 0) {
 		perror ("");
-		close(hgshm.fd);
+		close(ctx->fd);
         return -1;
 	}
-    //printf("SZ: %d\n", (int)hgshm.shm_sz);
+    //printf("SLICE_SZ: %d\n", (int)ctx->shm_slice_sz);
 
-	if (ioctl(hgshm.fd, HGSHM_GET_SHM_SLICE_SIZE, &hgshm.shm_slice_sz) < 0) {
-		perror ("");
-		close(hgshm.fd);
+    /* Older drivers have one queue */
+	if (ioctl(ctx->fd, HGSHM_GET_QUEUES, &ctx->queues) < 0 ||
+        ctx->queues < 1 || ctx->queues > HGSHM_MAX_QUEUES)
+        ctx->queues = 1;
+    if (hgshm_map(ctx) < 0) {
+        close(ctx->fd);
         return -1;
-	}
-    //printf("SLICE_SZ: %d\n", (int)hgshm.shm_slice_sz);
-	hgshm.cb = cb;
-	hgshm.cb_arg = cb_arg;
-    hgshm_map();
-	return 0;
+    }
+    return 0;
+}
+
+/* Index 0: ring the VMs other VMs asked us to, see hgshm_ctx_set_relay() */
+static void hgshm_ctx_forward(hgshm_ctx_t *ctx)
+{
+    uint64_t *relay = __atomic_load_n(&ctx->relay, __ATOMIC_ACQUIRE);
+    uint64_t mask;
+    int i;
+
+    if (relay == NULL || (mask = __atomic_exchange_n(relay, 0,
+        __ATOMIC_ACQ_REL)) == 0)
+        return;
+    while (mask) {
+        i = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if (i != 0 && ctx->ops->notify(ctx, i) < 0)
+            printf("hgshm: could not forward to index %d\n", i);
+    }
+}
+
+/*
+ * One notifier thread per context. It counts interrupts for
+ * hgshm_ctx_wait() and runs the callback, so contexts never share
+ * process wide state such as a signal handler.
+ */
+static void *hgshm_notifier(void *arg)
+{
+    hgshm_ctx_t *ctx = arg;
+    int rc;
+
+    while (!ctx->closing) {
+        rc = ctx->ops->wait_irq(ctx);
+        if (rc < 0)
+            break;
+        if (rc == 0 || ctx->closing)
+            continue;
+        hgshm_ctx_post(ctx);
+        if (ctx->index == 0)
+            hgshm_ctx_forward(ctx);
+        if (ctx->cb)
+            ctx->cb(ctx->cb_arg);
+    }
+    return NULL;
+}
+
+static void hgshm_queue_post(hgshm_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->events++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Notifier thread of a queue past 0. It runs on its own CPU, queue q on
+ * online CPU q modulo their number, like the guest driver spreads the
+ * MSI-X vectors, so queue wakeups do not pile up on one CPU.
+ */
+static void *hgshm_queue_notifier(void *arg)
+{
+    hgshm_queue_t *q = arg;
+    hgshm_ctx_t *ctx = q->ctx;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int rc;
+
+    if (ncpus > 1) {
+        CPU_ZERO(&set);
+        CPU_SET(q->queue % ncpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    while (!ctx->closing) {
+        rc = ctx->ops->wait_queue_irq(ctx, q->queue);
+        if (rc < 0)
+            break;
+        if (rc == 0 || ctx->closing)
+            continue;
+        hgshm_queue_post(q);
+    }
+    return NULL;
+}
+
+static void hgshm_ctx_stop_queues(hgshm_ctx_t *ctx)
+{
+    int i;
+
+    for (i = 1; i < HGSHM_MAX_QUEUES; i++) {
+        if (ctx->q[i].running) {
+            ctx->ops->kick_queue(ctx, i);
+            pthread_join(ctx->q[i].tid, NULL);
+            ctx->q[i].running = 0;
+        }
+        pthread_mutex_destroy(&ctx->q[i].lock);
+        pthread_cond_destroy(&ctx->q[i].cond);
+    }
+}
+
+static int hgshm_ctx_start_queues(hgshm_ctx_t *ctx)
+{
+    int i;
+
+    if (ctx->ops->wait_queue_irq == NULL)
+        ctx->queues = 1;
+    for (i = 1; i < ctx->queues; i++) {
+        if (pthread_create(&ctx->q[i].tid, NULL, hgshm_queue_notifier,
+            &ctx->q[i]) != 0)
+            return -1;
+        ctx->q[i].running = 1;
+    }
+    return 0;
+}
+
+/*
+ * dev selects the backend:
+ *  - /dev/hgshmN, N or NULL: the guest driver, inside a VM
+ *  - shm:<shmid>,index=<n>[,...]: host emulation, see hgshm_emu.c
+ * Both present the same slice layout and hgshm_notify() semantics.
+ */
+hgshm_ctx_t *hgshm_ctx_open(const char *dev, void (*cb)(void *), void *cb_arg)
+{
+    hgshm_ctx_t *ctx = calloc(1, sizeof(hgshm_ctx_t));
+    int rc, i;
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->cb = cb;
+    ctx->cb_arg = cb_arg;
+    ctx->fd = -1;
+    ctx->queues = 1;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    for (i = 1; i < HGSHM_MAX_QUEUES; i++) {
+        ctx->q[i].ctx = ctx;
+        ctx->q[i].queue = i;
+        pthread_mutex_init(&ctx->q[i].lock, NULL);
+        pthread_cond_init(&ctx->q[i].cond, NULL);
+    }
+
+    if (dev && strncmp(dev, HGSHM_EMU_PREFIX, strlen(HGSHM_EMU_PREFIX)) == 0)
+        rc = hgshm_emu_init(ctx, dev + strlen(HGSHM_EMU_PREFIX));
+    else
+        rc = hgshm_dev_init(ctx, dev);
+    if (rc < 0)
+        goto error;
+
+    if (pthread_create(&ctx->notifier_tid, NULL, hgshm_notifier, ctx) != 0) {
+        ctx->ops->close(ctx);
+        goto error;
+    }
+    ctx->notifier_running = 1;
+    if (hgshm_ctx_start_queues(ctx) < 0) {
+        hgshm_ctx_close(ctx);
+        return NULL;
+    }
+    return ctx;
+
+error:
+    hgshm_ctx_stop_queues(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx);
+    return NULL;
+}
+
+void hgshm_ctx_close(hgshm_ctx_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+    ctx->closing = 1;
+    if (ctx->notifier_running) {
+        ctx->ops->kick(ctx);
+        pthread_join(ctx->notifier_tid, NULL);
+    }
+    hgshm_ctx_stop_queues(ctx);
+    ctx->ops->close(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx);
+}
+
+/* An event raised locally, as if the device had interrupted */
+static void hgshm_ctx_post(hgshm_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->events++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Notifying our own index wakes hgshm_ctx_wait() callers of this context
+ * without going through the device, so threads of one VM can use the
+ * same wait code as remote VMs. The callback is not run.
+ */
+int hgshm_ctx_notify(hgshm_ctx_t *ctx, int index)
+{
+    uint64_t *relay;
+
+    if (index < 0 || index >= HGSHM_MAX_CLIENTS)
+        return -1;
+    if (index == ctx->index) {
+        hgshm_ctx_post(ctx);
+        return 0;
+    }
+    relay = __atomic_load_n(&ctx->relay, __ATOMIC_ACQUIRE);
+    if (relay && ctx->index != 0 && index != 0) {
+        __atomic_fetch_or(relay, 1ULL << index, __ATOMIC_SEQ_CST);
+        index = 0;
+    }
+    return ctx->ops->notify(ctx, index);
+}
+
+void hgshm_ctx_set_relay(hgshm_ctx_t *ctx, uint64_t *relay)
+{
+    __atomic_store_n(&ctx->relay, relay, __ATOMIC_RELEASE);
+}
+
+int hgshm_ctx_get_index(hgshm_ctx_t *ctx)
+{
+    return ctx->index;
+}
+
+size_t hgshm_ctx_get_shm_slice_sz(hgshm_ctx_t *ctx)
+{
+    return ctx->shm_slice_sz;
+}
+
+void * hgshm_ctx_getshm(hgshm_ctx_t *ctx, int index, size_t *sz)
+{
+    if (index < 0 || index > 1)
+        return NULL;
+     switch (index) {
+     case 0: *sz = ctx->shm_sz;
+        break;
+     case 1: *sz = ctx->shm_slice_sz;
+        break;
+     }
+     return ctx->shmptr[index];
+}
+
+void * hgshm_ctx_view(hgshm_ctx_t *ctx, size_t *sz)
+{
+    if (ctx->index == 0) {
+        *sz = ctx->shm_sz;
+        return ctx->shmptr[0];
+    }
+    if (ctx->view) {
+        *sz = ctx->view_sz;
+        return ctx->view;
+    }
+    *sz = ctx->shm_slice_sz;
+    return ctx->shmptr[1];
+}
+
+/* Distance between slices, own BAR1 is slice 'index' */
+static size_t hgshm_stride(hgshm_ctx_t *ctx)
+{
+    return (ctx->index == 0) ? ctx->shm_slice_sz : ctx->shm_sz;
+}
+
+uint64_t hgshm_ctx_region_off(hgshm_ctx_t *ctx, const void *ptr)
+{
+    const char *p = ptr;
+    const char *base;
+    size_t sz;
+
+    base = ctx->shmptr[0];
+    if (p >= base && p < base + ctx->shm_sz)
+        return (uint64_t)ctx->index * hgshm_stride(ctx) + (p - base);
+    if (ctx->index == 0)
+        return (uint64_t)-1;
+    base = hgshm_ctx_view(ctx, &sz);
+    if (p >= base && p < base + sz)
+        return p - base;
+    return (uint64_t)-1;
+}
+
+void * hgshm_ctx_region_ptr(hgshm_ctx_t *ctx, uint64_t off, size_t len)
+{
+    uint64_t own = (uint64_t)ctx->index * hgshm_stride(ctx);
+    size_t sz;
+    char *base;
+
+    if (off >= own && off - own <= ctx->shm_sz &&
+        len <= ctx->shm_sz - (off - own))
+        return (char *)ctx->shmptr[0] + (off - own);
+    if (ctx->index == 0)
+        return NULL;
+    if (off <= ctx->shm_slice_sz && len <= ctx->shm_slice_sz - off)
+        return (char *)ctx->shmptr[1] + off;
+    base = hgshm_ctx_view(ctx, &sz);
+    if (off <= sz && len <= sz - off)
+        return base + off;
+    return NULL;
+}
+
+/* Wait on one event count, the context's or a queue's */
+static int hgshm_wait_events(pthread_mutex_t *lock, pthread_cond_t *cond,
+    uint64_t *events, uint64_t *seen, int timeout_ms)
+{
+    struct timespec ts;
+    int rc = 0;
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(lock);
+    while (*events == *seen && rc == 0) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(cond, lock);
+        else
+            rc = pthread_cond_timedwait(cond, lock, &ts);
+    }
+    if (*events == *seen) {
+        pthread_mutex_unlock(lock);
+        return -1;
+    }
+    *seen = *events;
+    pthread_mutex_unlock(lock);
+    return 0;
+}
+
+int hgshm_ctx_wait(hgshm_ctx_t *ctx, uint64_t *seen, int timeout_ms)
+{
+    return hgshm_wait_events(&ctx->lock, &ctx->cond, &ctx->events, seen,
+        timeout_ms);
+}
+
+uint64_t hgshm_ctx_events(hgshm_ctx_t *ctx)
+{
+    uint64_t events;
+
+    pthread_mutex_lock(&ctx->lock);
+    events = ctx->events;
+    pthread_mutex_unlock(&ctx->lock);
+    return events;
+}
+
+int hgshm_ctx_queues(hgshm_ctx_t *ctx)
+{
+    return ctx->queues;
+}
+
+/* Like hgshm_ctx_notify(), our own queues are posted without the device */
+int hgshm_ctx_notify_queue(hgshm_ctx_t *ctx, int index, int queue)
+{
+    if (queue == 0)
+        return hgshm_ctx_notify(ctx, index);
+    if (index < 0 || index >= HGSHM_MAX_CLIENTS ||
+        queue < 0 || queue >= HGSHM_MAX_QUEUES)
+        return -1;
+    if (index == ctx->index) {
+        if (queue >= ctx->queues)
+            return -1;
+        hgshm_queue_post(&ctx->q[queue]);
+        return 0;
+    }
+    if ((ctx->index != 0 && index != 0) || ctx->ops->notify_queue == NULL)
+        return -1;
+    return ctx->ops->notify_queue(ctx, index, queue);
+}
+
+int hgshm_ctx_wait_queue(hgshm_ctx_t *ctx, int queue, uint64_t *seen,
+    int timeout_ms)
+{
+    hgshm_queue_t *q;
+
+    if (queue == 0)
+        return hgshm_ctx_wait(ctx, seen, timeout_ms);
+    if (queue < 0 || queue >= ctx->queues)
+        return -1;
+    q = &ctx->q[queue];
+    return hgshm_wait_events(&q->lock, &q->cond, &q->events, seen,
+        timeout_ms);
+}
+
+uint64_t hgshm_ctx_queue_events(hgshm_ctx_t *ctx, int queue)
+{
+    hgshm_queue_t *q;
+    uint64_t events;
+
+    if (queue <= 0 || queue >= ctx->queues)
+        return hgshm_ctx_events(ctx);
+    q = &ctx->q[queue];
+    pthread_mutex_lock(&q->lock);
+    events = q->events;
+    pthread_mutex_unlock(&q->lock);
+    return events;
+}
+
+/*
+ * Original API. The callback used to run in a SIGUSR1 handler, it now
+ * runs on the default context's notifier thread.
+ */
+int hgshm_init(char *dev, void (*cb)(void *), void *cb_arg)
+{
+    if (hgshm_ctx)
+        return -1;
+    hgshm_ctx = hgshm_ctx_open(dev, cb, cb_arg);
+    return hgshm_ctx ? 0 : -1;
+}
+
+void hgshm_close(void)
+{
+    hgshm_ctx_close(hgshm_ctx);
+    hgshm_ctx = NULL;
+}
+
+hgshm_ctx_t *hgshm_default_ctx(void)
+{
+    return hgshm_ctx;
+}
+
+int hgshm_notify(int index)
+{
+    return hgshm_ctx_notify(hgshm_ctx, index);
+}
+
+int hgshm_get_index(void)
+{
+    return hgshm_ctx_get_index(hgshm_ctx);
+}
+
+size_t hgshm_get_shm_slice_sz(void)
+{
+    return hgshm_ctx_get_shm_slice_sz(hgshm_ctx);
+}
+
+void * hgshm_getshm(int index, size_t *sz)
+{
+    return hgshm_ctx_getshm(hgshm_ctx, index, sz);
 }
 
 static uint64_t virt_to_phys(void *vmem)
@@ -0,0 +1,607 @@
+/*
+ * MapReduce runtime, see hgshm_mr.h.
+ *
+ * Shuffle records are packed back to back in pipe buffers:
+ *	uint32_t klen, key, value (vsize bytes)
+ * Result records are 8 byte aligned in the reducer's result area:
+ *	uint32_t klen, uint32_t vlen, key, value
+ * A reducer posts DONE (FAILED if it had to drop results) with the bytes
+ * and records of its area in its control block status, then joins a
+ * barrier. Index 0 reads the areas once the barrier completes.
+ *
+ * Index 0 sends every other VM a START command through the control
+ * block with the offset and size of the result areas.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_pipe.h"
+#include "hgshm_ctl.h"
+#include "hgshm_coll.h"
+#include "hgshm_mr.h"
+
+#define MR_CMD_START        HGSHM_CTL_USER
+#define MR_COLL_SLOT        64
+#define MR_TABLE_MIN        1024
+#define MR_NBUFS            2
+
+typedef struct mr_entry {
+    struct mr_entry *next;
+    uint64_t    hash;
+    uint32_t    klen;
+    uint32_t    nvals;
+    uint32_t    cap;
+    char        *vals;
+    char        key[];
+} mr_entry_t;
+
+typedef struct {
+    mr_entry_t  **buckets;
+    size_t      nbuckets;           /* power of 2 */
+    size_t      count;
+    size_t      bytes;              /* shuffle size of the contents */
+} mr_table_t;
+
+/* Map side state of a partition */
+typedef struct {
+    hgshm_pipe_t *pipe;
+    mr_table_t  table;
+    char        *buf;               /* acquired buffer, NULL if none */
+    int         bufno;
+    size_t      used;
+} mr_part_t;
+
+struct hgshm_mr {
+    hgshm_mr_job_t job;
+    hgshm_ctx_t *ctx;
+    hgshm_ctl_t *ctl;
+    hgshm_coll_t *coll;
+    int         index;              /* partition we map or reduce for */
+    int         nclients;
+    char        *slice0;
+    size_t      res_off;            /* result area 0, from slice 0 */
+    size_t      res_size;
+
+    /* Map side, index 0 */
+    mr_part_t   *parts;
+    hgshm_mr_t  *local;             /* reducer of partition 0 */
+    pthread_t   local_tid;
+    int         local_running;
+
+    /* Reduce side */
+    hgshm_pipe_t *pipe;
+    mr_table_t  table;
+    char        *out;
+    size_t      out_used;
+
+    hgshm_mr_stats_t stats;
+};
+
+/* FNV-1a */
+static uint64_t mr_hash(const void *key, size_t klen)
+{
+    const uint8_t *p = key;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < klen; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static size_t mr_rec_size(hgshm_mr_t *mr, size_t klen)
+{
+    return sizeof(uint32_t) + klen + mr->job.vsize;
+}
+
+static int table_init(mr_table_t *t)
+{
+    t->buckets = calloc(MR_TABLE_MIN, sizeof(mr_entry_t *));
+    t->nbuckets = MR_TABLE_MIN;
+    t->count = 0;
+    t->bytes = 0;
+    return (t->buckets == NULL) ? -1 : 0;
+}
+
+static void table_clear(mr_table_t *t)
+{
+    mr_entry_t *e, *next;
+    size_t i;
+
+    for (i = 0; i < t->nbuckets; i++) {
+        for (e = t->buckets[i]; e; e = next) {
+            next = e->next;
+            free(e->vals);
+            free(e);
+        }
+        t->buckets[i] = NULL;
+    }
+    t->count = 0;
+    t->bytes = 0;
+}
+
+static void table_free(mr_table_t *t)
+{
+    if (t->buckets == NULL)
+        return;
+    table_clear(t);
+    free(t->buckets);
+    t->buckets = NULL;
+}
+
+static void table_grow(mr_table_t *t)
+{
+    size_t n = t->nbuckets * 2, i;
+    mr_entry_t **b = calloc(n, sizeof(mr_entry_t *));
+    mr_entry_t *e, *next;
+
+    if (b == NULL)
+        return;
+    for (i = 0; i < t->nbuckets; i++) {
+        for (e = t->buckets[i]; e; e = next) {
+            next = e->next;
+            e->next = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+        }
+    }
+    free(t->buckets);
+    t->buckets = b;
+    t->nbuckets = n;
+}
+
+static mr_entry_t *table_find(mr_table_t *t, uint64_t hash, const void *key,
+    size_t klen)
+{
+    mr_entry_t *e;
+
+    for (e = t->buckets[hash & (t->nbuckets - 1)]; e; e = e->next)
+        if (e->hash == hash && e->klen == klen &&
+            memcmp(e->key, key, klen) == 0)
+            return e;
+    return NULL;
+}
+
+static mr_entry_t *table_add(mr_table_t *t, uint64_t hash, const void *key,
+    size_t klen, const void *val, size_t vsize)
+{
+    mr_entry_t *e = malloc(sizeof(mr_entry_t) + klen);
+
+    if (e == NULL || (e->vals = malloc(vsize)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->hash = hash;
+    e->klen = klen;
+    e->nvals = 1;
+    e->cap = 1;
+    memcpy(e->key, key, klen);
+    memcpy(e->vals, val, vsize);
+    if (t->count >= t->nbuckets)
+        table_grow(t);
+    e->next = t->buckets[hash & (t->nbuckets - 1)];
+    t->buckets[hash & (t->nbuckets - 1)] = e;
+    t->count++;
+    return e;
+}
+
+/* Fold val into e, or append it when the job has no combine */
+static int entry_add(hgshm_mr_t *mr, mr_entry_t *e, const void *val)
+{
+    size_t vsize = mr->job.vsize;
+    char *vals;
+
+    if (mr->job.combine) {
+        mr->stats.combined++;
+        mr->job.combine(e->vals, val, mr->job.arg);
+        return 0;
+    }
+    if (e->nvals == e->cap) {
+        if ((vals = realloc(e->vals, 2 * e->cap * vsize)) == NULL)
+            return -1;
+        e->vals = vals;
+        e->cap *= 2;
+    }
+    memcpy(e->vals + e->nvals * vsize, val, vsize);
+    e->nvals++;
+    return 0;
+}
+
+static int table_put(hgshm_mr_t *mr, mr_table_t *t, uint64_t hash,
+    const void *key, size_t klen, const void *val)
+{
+    mr_entry_t *e = table_find(t, hash, key, klen);
+
+    if (e)
+        return entry_add(mr, e, val);
+    if (table_add(t, hash, key, klen, val, mr->job.vsize) == NULL)
+        return -1;
+    t->bytes += mr_rec_size(mr, klen);
+    return 0;
+}
+
+/* Ship the partition's current buffer to its reducer */
+static void part_flush(hgshm_mr_t *mr, mr_part_t *part)
+{
+    if (part->buf == NULL)
+        return;
+    hgshm_pipe_publish(part->pipe, part->bufno, part->used);
+    mr->stats.spills++;
+    mr->stats.shuffle_bytes += part->used;
+    part->buf = NULL;
+}
+
+static void part_put(hgshm_mr_t *mr, mr_part_t *part, const void *key,
+    size_t klen, const void *val)
+{
+    size_t rec = mr_rec_size(mr, klen);
+    uint32_t k = klen;
+
+    if (part->buf && part->used + rec > hgshm_pipe_buf_size(part->pipe))
+        part_flush(mr, part);
+    if (part->buf == NULL) {
+        part->buf = hgshm_pipe_acquire(part->pipe, &part->bufno, NULL, -1);
+        part->used = 0;
+    }
+    memcpy(part->buf + part->used, &k, sizeof(k));
+    memcpy(part->buf + part->used + sizeof(k), key, klen);
+    memcpy(part->buf + part->used + sizeof(k) + klen, val, mr->job.vsize);
+    part->used += rec;
+}
+
+/* Combined partition: write the table out as one buffer */
+static void part_spill(hgshm_mr_t *mr, mr_part_t *part)
+{
+    mr_entry_t *e;
+    size_t i;
+
+    for (i = 0; i < part->table.nbuckets; i++)
+        for (e = part->table.buckets[i]; e; e = e->next)
+            part_put(mr, part, e->key, e->klen, e->vals);
+    table_clear(&part->table);
+    part_flush(mr, part);
+}
+
+static hgshm_mr_t *mr_alloc(hgshm_ctx_t *ctx, const hgshm_mr_job_t *job)
+{
+    hgshm_mr_t *mr;
+
+    if (job->vsize == 0 || job->reduce == NULL ||
+        (mr = calloc(1, sizeof(hgshm_mr_t))) == NULL)
+        return NULL;
+    mr->job = *job;
+    if (mr->job.nbufs == 0)
+        mr->job.nbufs = MR_NBUFS;
+    mr->ctx = ctx;
+    mr->index = hgshm_ctx_get_index(ctx);
+    return mr;
+}
+
+/* Reduce until the empty buffer, then run reduce and report */
+static int mr_reduce_part(hgshm_mr_t *mr)
+{
+    size_t len, off, klen, vsize = mr->job.vsize;
+    mr_entry_t *e;
+    uint32_t k;
+    char *data;
+    size_t i;
+    int buf;
+
+    if (table_init(&mr->table) < 0)
+        return -1;
+    while ((data = hgshm_pipe_next(mr->pipe, &len, &buf, -1)) != NULL) {
+        if (len == 0) {
+            hgshm_pipe_release(mr->pipe, buf, 0);
+            break;
+        }
+        for (off = 0; off + sizeof(k) <= len; off += sizeof(k) + klen + vsize) {
+            memcpy(&k, data + off, sizeof(k));
+            klen = k;
+            table_put(mr, &mr->table, mr_hash(data + off + sizeof(k), klen),
+                data + off + sizeof(k), klen, data + off + sizeof(k) + klen);
+            mr->stats.emitted++;
+        }
+        mr->stats.spills++;
+        mr->stats.shuffle_bytes += len;
+        hgshm_pipe_release(mr->pipe, buf, 0);
+    }
+
+    for (i = 0; i < mr->table.nbuckets; i++) {
+        for (e = mr->table.buckets[i]; e; e = e->next) {
+            mr->job.reduce(mr, e->key, e->klen, e->vals, e->nvals,
+                mr->job.arg);
+            mr->stats.keys++;
+        }
+    }
+    table_free(&mr->table);
+    hgshm_ctl_post(mr->ctl, mr->index, mr->stats.truncated ?
+        HGSHM_CTL_FAILED : HGSHM_CTL_DONE, mr->out_used, mr->stats.outputs);
+    return mr->stats.truncated ? -1 : 0;
+}
+
+static void *mr_local_reducer(void *arg)
+{
+    mr_reduce_part(arg);
+    return NULL;
+}
+
+hgshm_mr_t *hgshm_mr_create(hgshm_ctx_t *ctx, const hgshm_mr_job_t *job,
+    int nclients)
+{
+    hgshm_mr_t *mr, *local;
+    size_t shm_sz, slice_sz, limit, pipe0;
+    int j, policy = job->policy;
+
+    if (hgshm_ctx_get_index(ctx) != 0 || nclients < 1 ||
+        (mr = mr_alloc(ctx, job)) == NULL)
+        return NULL;
+    mr->nclients = nclients;
+    mr->slice0 = hgshm_ctx_getshm(ctx, 0, &shm_sz);
+    slice_sz = hgshm_ctx_get_shm_slice_sz(ctx);
+    limit = (slice_sz > HGSHM_MAX_MAP_SLICE_SZ) ?
+        HGSHM_MAX_MAP_SLICE_SZ : slice_sz;
+    if (mr->slice0 == NULL || shm_sz < nclients * slice_sz)
+        goto error;
+
+    mr->ctl = hgshm_ctl_create(ctx, mr->slice0, slice_sz, nclients, policy);
+    if (mr->ctl == NULL)
+        goto error;
+    mr->coll = hgshm_coll_create(ctx, hgshm_ctl_data(mr->ctl),
+        slice_sz - hgshm_ctl_size(nclients), nclients, MR_COLL_SLOT, policy);
+    if (mr->coll == NULL)
+        goto error;
+    mr->res_off = hgshm_ctl_size(nclients) +
+        hgshm_coll_size(nclients, MR_COLL_SLOT);
+    mr->res_size = job->result_size ? job->result_size :
+        (limit - mr->res_off) / 4 / nclients;
+    mr->res_size = (mr->res_size + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    pipe0 = mr->res_off + nclients * mr->res_size;
+    if (pipe0 >= limit) {
+        printf("hgshm: %zu byte result areas do not fit slice 0\n",
+            mr->res_size);
+        goto error;
+    }
+
+    if ((mr->parts = calloc(nclients, sizeof(mr_part_t))) == NULL)
+        goto error;
+    for (j = 0; j < nclients; j++) {
+        mr->parts[j].pipe = (j == 0) ?
+            hgshm_pipe_create(ctx, mr->slice0 + pipe0, slice_sz - pipe0,
+                mr->job.nbufs, 0, 0, policy) :
+            hgshm_pipe_create(ctx, mr->slice0 + j * slice_sz, slice_sz,
+                mr->job.nbufs, 0, j, policy);
+        if (mr->parts[j].pipe == NULL || (job->combine &&
+            table_init(&mr->parts[j].table) < 0))
+            goto error;
+    }
+
+    /* Partition 0 is ours, reduced by a thread */
+    if ((local = mr->local = mr_alloc(ctx, job)) == NULL)
+        goto error;
+    local->ctl = mr->ctl;
+    local->nclients = nclients;
+    local->slice0 = mr->slice0;
+    local->res_off = mr->res_off;
+    local->res_size = mr->res_size;
+    local->out = mr->slice0 + mr->res_off;
+    local->pipe = hgshm_pipe_attach(ctx, mr->slice0 + pipe0, policy, 0);
+    if (local->pipe == NULL ||
+        pthread_create(&mr->local_tid, NULL, mr_local_reducer, local) != 0)
+        goto error;
+    mr->local_running = 1;
+
+    for (j = 1; j < nclients; j++)
+        hgshm_ctl_command(mr->ctl, j, MR_CMD_START, mr->res_off,
+            mr->res_size);
+    return mr;
+
+error:
+    hgshm_mr_close(mr);
+    return NULL;
+}
+
+hgshm_mr_t *hgshm_mr_attach(hgshm_ctx_t *ctx, const hgshm_mr_job_t *job)
+{
+    hgshm_ctl_rec_t rec;
+    uint64_t seen = 0;
+    size_t sz0, sz;
+    hgshm_mr_t *mr;
+
+    if (hgshm_ctx_get_index(ctx) == 0 || (mr = mr_alloc(ctx, job)) == NULL)
+        return NULL;
+    mr->slice0 = hgshm_ctx_getshm(ctx, 1, &sz0);
+    if (mr->slice0 == NULL)
+        goto error;
+    mr->ctl = hgshm_ctl_attach(ctx, mr->slice0, job->policy, -1);
+    if (mr->ctl == NULL)
+        goto error;
+    mr->nclients = hgshm_ctl_nclients(mr->ctl);
+    mr->coll = hgshm_coll_attach(ctx, hgshm_ctl_data(mr->ctl), job->policy,
+        -1);
+    if (mr->coll == NULL)
+        goto error;
+    do {
+        if (hgshm_ctl_wait_command(mr->ctl, mr->index, &seen, &rec, -1) < 0)
+            goto error;
+    } while (rec.state != MR_CMD_START);
+    mr->res_off = rec.value;
+    mr->res_size = rec.arg;
+    if (mr->res_off + mr->nclients * mr->res_size > sz0) {
+        printf("hgshm: result areas beyond the mapped slice 0\n");
+        goto error;
+    }
+    mr->out = mr->slice0 + mr->res_off + mr->index * mr->res_size;
+    mr->pipe = hgshm_pipe_attach(ctx, hgshm_ctx_getshm(ctx, 0, &sz),
+        job->policy, -1);
+    if (mr->pipe == NULL)
+        goto error;
+    return mr;
+
+error:
+    hgshm_mr_close(mr);
+    return NULL;
+}
+
+void hgshm_mr_close(hgshm_mr_t *mr)
+{
+    int j;
+
+    if (mr == NULL)
+        return;
+    if (mr->local) {
+        if (mr->local_running)
+            pthread_join(mr->local_tid, NULL);
+        if (mr->local->pipe)
+            hgshm_pipe_close(mr->local->pipe);
+        free(mr->local);
+    }
+    if (mr->parts) {
+        for (j = 0; j < mr->nclients; j++) {
+            if (mr->parts[j].pipe)
+                hgshm_pipe_close(mr->parts[j].pipe);
+            table_free(&mr->parts[j].table);
+        }
+        free(mr->parts);
+    }
+    if (mr->pipe)
+        hgshm_pipe_close(mr->pipe);
+    if (mr->coll)
+        hgshm_coll_close(mr->coll);
+    if (mr->ctl)
+        hgshm_ctl_close(mr->ctl);
+    free(mr);
+}
+
+void hgshm_mr_map(hgshm_mr_t *mr, const void *data, size_t len)
+{
+    mr->job.map(mr, data, len, mr->job.arg);
+}
+
+int hgshm_mr_emit(hgshm_mr_t *mr, const void *key, size_t klen,
+    const void *val)
+{
+    uint64_t hash = mr_hash(key, klen);
+    mr_part_t *part = &mr->parts[hash % mr->nclients];
+    mr_entry_t *e;
+
+    if (klen > HGSHM_MR_MAX_KEY ||
+        mr_rec_size(mr, klen) > hgshm_pipe_buf_size(part->pipe))
+        return -1;
+    mr->stats.emitted++;
+    if (mr->job.combine == NULL) {
+        part_put(mr, part, key, klen, val);
+        return 0;
+    }
+    if ((e = table_find(&part->table, hash, key, klen)) != NULL)
+        return entry_add(mr, e, val);
+    if (part->table.bytes + mr_rec_size(mr, klen) >
+        hgshm_pipe_buf_size(part->pipe))
+        part_spill(mr, part);
+    if (table_add(&part->table, hash, key, klen, val, mr->job.vsize) == NULL)
+        return -1;
+    part->table.bytes += mr_rec_size(mr, klen);
+    return 0;
+}
+
+int hgshm_mr_finish(hgshm_mr_t *mr)
+{
+    hgshm_ctl_rec_t rec;
+    int j, failed = 0;
+
+    for (j = 0; j < mr->nclients; j++) {
+        if (mr->job.combine)
+            part_spill(mr, &mr->parts[j]);
+        else
+            part_flush(mr, &mr->parts[j]);
+        hgshm_pipe_eof(mr->parts[j].pipe, -1);
+    }
+    pthread_join(mr->local_tid, NULL);
+    mr->local_running = 0;
+    hgshm_coll_barrier(mr->coll, -1);
+    for (j = 0; j < mr->nclients; j++) {
+        hgshm_ctl_status(mr->ctl, j, &rec);
+        if (rec.state != HGSHM_CTL_DONE)
+            failed++;
+    }
+    return failed;
+}
+
+void hgshm_mr_foreach(hgshm_mr_t *mr, void (*fn)(const void *key,
+    size_t klen, const void *val, size_t vlen, void *arg), void *arg)
+{
+    hgshm_ctl_rec_t rec;
+    uint32_t hdr[2];
+    size_t off;
+    char *area;
+    int j;
+
+    for (j = 0; j < mr->nclients; j++) {
+        hgshm_ctl_status(mr->ctl, j, &rec);
+        area = mr->slice0 + mr->res_off + j * mr->res_size;
+        for (off = 0; off + sizeof(hdr) <= (size_t)rec.value;
+            off += (sizeof(hdr) + hdr[0] + hdr[1] + 7) & ~(size_t)7) {
+            memcpy(hdr, area + off, sizeof(hdr));
+            fn(area + off + sizeof(hdr), hdr[0],
+                area + off + sizeof(hdr) + hdr[0], hdr[1], arg);
+        }
+    }
+}
+
+int hgshm_mr_reduce(hgshm_mr_t *mr)
+{
+    int rc = mr_reduce_part(mr);
+
+    hgshm_coll_barrier(mr->coll, -1);
+    return rc;
+}
+
+int hgshm_mr_output(hgshm_mr_t *mr, const void *key, size_t klen,
+    const void *val, size_t vlen)
+{
+    size_t rec = (2 * sizeof(uint32_t) + klen + vlen + 7) & ~(size_t)7;
+    uint32_t hdr[2] = { klen, vlen };
+
+    if (mr->out_used + rec > mr->res_size) {
+        mr->stats.truncated++;
+        return -1;
+    }
+    memcpy(mr->out + mr->out_used, hdr, sizeof(hdr));
+    memcpy(mr->out + mr->out_used + sizeof(hdr), key, klen);
+    memcpy(mr->out + mr->out_used + sizeof(hdr) + klen, val, vlen);
+    mr->out_used += rec;
+    mr->stats.outputs++;
+    mr->stats.output_bytes += rec;
+    return 0;
+}
+
+int hgshm_mr_client(hgshm_mr_t *mr)
+{
+    return mr->index;
+}
+
+int hgshm_mr_nclients(hgshm_mr_t *mr)
+{
+    return mr->nclients;
+}
+
+void hgshm_mr_get_stats(hgshm_mr_t *mr, hgshm_mr_stats_t *st)
+{
+    *st = mr->stats;
+}
+
+void hgshm_mr_print_stats(hgshm_mr_t *mr, FILE *fp)
+{
+    hgshm_mr_stats_t *st = &mr->stats;
+
+    fprintf(fp, "mr %d: emitted %lu combined %lu spills %lu shuffle %lu "
+        "keys %lu outputs %lu (%lu bytes, %lu dropped)\n", mr->index,
+        st->emitted, st->combined, st->spills, st->shuffle_bytes,
+        st->keys, st->outputs, st->output_bytes, st->truncated);
+}
@@ -0,0 +1,107 @@
+#ifndef _HGSHM_MR_H
+#define _HGSHM_MR_H
+/*
+ * MapReduce runtime.
+ *
+ * A job is a map, an optional combine and a reduce function over keys
+ * (byte strings) and fixed size values. Index 0 maps; every VM of the
+ * region, index 0 included, reduces one partition. A key goes to
+ * partition hash(key) % nclients.
+ *
+ *  - Map side: emitted pairs are combined per partition in a private
+ *    table when the job has a combine function, or appended directly to
+ *    the partition's current pipe buffer in the reducer's slice. When the
+ *    table or buffer is full it is spilled (the buffer is published to
+ *    the reducer) and mapping continues in the next buffer.
+ *  - Reduce side: records are combined into a private table, or their
+ *    values collected per key. After the last buffer reduce runs once
+ *    per key and its hgshm_mr_output() records go to this reducer's
+ *    result area in slice 0.
+ *  - Index 0 collects the result areas with hgshm_mr_foreach().
+ *
+ * Slice 0 holds the control block, the collectives block, the result
+ * areas and partition 0's pipe; partition i > 0 pipes in slice i.
+ *
+ *	index 0                             index i
+ *	mr = hgshm_mr_create(ctx, &job, n)  mr = hgshm_mr_attach(ctx, &job)
+ *	hgshm_mr_map(mr, split, len) ...    hgshm_mr_reduce(mr)
+ *	hgshm_mr_finish(mr)                 hgshm_mr_close(mr)
+ *	hgshm_mr_foreach(mr, fn, arg)
+ *	hgshm_mr_close(mr)
+ *
+ * Every VM must be given the same job. Mapping is single threaded: call
+ * hgshm_mr_map() and hgshm_mr_emit() from one thread.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+/* Longest key hgshm_mr_emit() takes */
+#define HGSHM_MR_MAX_KEY    1024
+
+typedef struct hgshm_mr hgshm_mr_t;
+
+typedef struct {
+    size_t      vsize;          /* bytes per value */
+    /* Index 0: split some input into pairs with hgshm_mr_emit() */
+    void        (*map)(hgshm_mr_t *mr, const void *data, size_t len,
+                    void *arg);
+    /* Fold value src into dst, NULL to hand every value to reduce */
+    void        (*combine)(void *dst, const void *src, void *arg);
+    /* Once per key with nvals values (1 with combine) of vsize bytes */
+    void        (*reduce)(hgshm_mr_t *mr, const void *key, size_t klen,
+                    const void *vals, size_t nvals, void *arg);
+    void        *arg;
+    size_t      result_size;    /* result area per reducer, 0 for default */
+    int         nbufs;          /* pipe buffers per partition, 0 for 2 */
+    int         policy;         /* hgshm_wait.h policy */
+} hgshm_mr_job_t;
+
+typedef struct {
+    uint64_t    emitted;        /* pairs from map */
+    uint64_t    combined;       /* pairs folded into an existing key */
+    uint64_t    spills;         /* buffers shipped to reducers */
+    uint64_t    shuffle_bytes;
+    uint64_t    keys;           /* reduce calls */
+    uint64_t    outputs;        /* result records */
+    uint64_t    output_bytes;
+    uint64_t    truncated;      /* result records that did not fit */
+} hgshm_mr_stats_t;
+
+/* Index 0: lay the job out over nclients VMs and start the local reducer */
+hgshm_mr_t * hgshm_mr_create(hgshm_ctx_t *ctx, const hgshm_mr_job_t *job,
+    int nclients);
+/* Other VMs: wait for index 0 to start the job */
+hgshm_mr_t * hgshm_mr_attach(hgshm_ctx_t *ctx, const hgshm_mr_job_t *job);
+void hgshm_mr_close(hgshm_mr_t *mr);
+
+/* Index 0: run map over one split of the input */
+void hgshm_mr_map(hgshm_mr_t *mr, const void *data, size_t len);
+/* From map: emit a pair, val is vsize bytes. -1 if the key is too long */
+int hgshm_mr_emit(hgshm_mr_t *mr, const void *key, size_t klen,
+    const void *val);
+/*
+ * Index 0: flush the partitions, tell the reducers the input is done and
+ * wait until every result area is complete. Returns the number of
+ * reducers whose results were truncated.
+ */
+int hgshm_mr_finish(hgshm_mr_t *mr);
+/* Index 0, after finish: call fn for every result record */
+void hgshm_mr_foreach(hgshm_mr_t *mr, void (*fn)(const void *key,
+    size_t klen, const void *val, size_t vlen, void *arg), void *arg);
+
+/* Other VMs: reduce our partition until index 0 finishes */
+int hgshm_mr_reduce(hgshm_mr_t *mr);
+/* From reduce: append a result record to this reducer's area */
+int hgshm_mr_output(hgshm_mr_t *mr, const void *key, size_t klen,
+    const void *val, size_t vlen);
+
+/* Partition (VM index) this handle maps or reduces for */
+int hgshm_mr_client(hgshm_mr_t *mr);
+int hgshm_mr_nclients(hgshm_mr_t *mr);
+/* Map side totals, or this reducer's */
+void hgshm_mr_get_stats(hgshm_mr_t *mr, hgshm_mr_stats_t *st);
+void hgshm_mr_print_stats(hgshm_mr_t *mr, FILE *fp);
+#endif /* _HGSHM_MR_H */
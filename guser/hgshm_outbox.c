@@ -0,0 +1,354 @@
+/*
+ * Zero-copy outboxes, see hgshm_outbox.h.
+ *
+ * Every buffer has a count of the readers that still hold it. The
+ * mapper sets it to the number of readers it publishes to before the
+ * descriptors go out, each release takes one off and the release that
+ * takes the last one bumps the freed futex, the only one the mapper
+ * sleeps on for buffers. A buffer is free when its count is 0 and the
+ * mapper has not got it.
+ *
+ * Each reader has a queue of descriptors with two counters like a
+ * stream's: posted by the mapper, taken by the reader, the low 32 bits
+ * of the 64 bit counts the two handles keep. A reader never holds more
+ * than every buffer plus the end, so the queue is twice the buffers and
+ * the mapper waits for room only when a reader is far behind.
+ *
+ * The mapper writes the buffer, the descriptor, then posted with
+ * sequentially consistent ordering; the reader reads posted before the
+ * descriptor and the data, and releases after it is done with the data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_sync.h"
+#include "hgshm_outbox.h"
+
+#define HGSHM_OUTBOX_MAGIC  0x48474f42  /* "HGOB" */
+#define OUTBOX_QLEN         (2 * HGSHM_OUTBOX_MAX_BUFS)
+
+typedef struct {
+    uint32_t    n;                  /* readers holding the buffer */
+} __attribute__((aligned(64))) outbox_ref_t;
+
+typedef struct {
+    hgshm_futex_t posted;           /* mapper */
+    hgshm_futex_t taken;            /* reader */
+    hgshm_desc_t desc[OUTBOX_QLEN];
+} outbox_queue_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    nbufs;
+    uint32_t    nreaders;
+    uint32_t    pad;
+    uint64_t    buf_size;
+    uint64_t    data_off;           /* region offset of buffer 0 */
+    hgshm_futex_t freed;            /* bumped by the last release */
+    outbox_ref_t refs[HGSHM_OUTBOX_MAX_BUFS];
+    outbox_queue_t q[];             /* one per reader */
+} outbox_hdr_t;
+
+struct hgshm_outbox {
+    outbox_hdr_t *hdr;
+    hgshm_ctx_t *ctx;
+    int         policy;
+    int         reader;             /* -1 for the mapper */
+    char        *data;              /* buffer 0 in this VM */
+    /* Mapper */
+    uint64_t    held;               /* got and not published yet */
+    int         next;               /* where hgshm_outbox_get() looks */
+    int         found;
+    int         room_for;           /* reader outbox_has_room() checks */
+    uint64_t    posted[HGSHM_OUTBOX_MAX_READERS];
+    /* Reader */
+    uint64_t    seq;                /* next descriptor to take */
+    /* Stats */
+    uint64_t    bufs;
+    uint64_t    bytes;
+    uint64_t    descs;
+    hgshm_futex_stats_t stats;
+};
+
+static hgshm_outbox_t *outbox_handle(hgshm_ctx_t *ctx, outbox_hdr_t *hdr,
+    int reader, int policy)
+{
+    hgshm_outbox_t *ob = calloc(1, sizeof(hgshm_outbox_t));
+
+    if (ob == NULL)
+        return NULL;
+    ob->hdr = hdr;
+    ob->ctx = ctx;
+    ob->reader = reader;
+    ob->policy = policy;
+    return ob;
+}
+
+size_t hgshm_outbox_hdr_size(int nreaders)
+{
+    return sizeof(outbox_hdr_t) + (size_t)nreaders * sizeof(outbox_queue_t);
+}
+
+hgshm_outbox_t *hgshm_outbox_create(hgshm_ctx_t *ctx, void *hdr,
+    void *data, size_t size, size_t buf_size, int nreaders, int policy)
+{
+    outbox_hdr_t *h = hdr;
+    hgshm_outbox_t *ob;
+    uint64_t data_off;
+    size_t nbufs;
+
+    buf_size = (buf_size + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    if (hdr == NULL || data == NULL || buf_size == 0 || nreaders < 1 ||
+        nreaders > HGSHM_OUTBOX_MAX_READERS ||
+        ((uintptr_t)hdr & (HGSHM_CACHELINE - 1)))
+        return NULL;
+    if ((data_off = hgshm_ctx_region_off(ctx, data)) == (uint64_t)-1) {
+        printf("outbox: buffers are not in the shared region\n");
+        return NULL;
+    }
+    nbufs = size / buf_size;
+    if (nbufs > HGSHM_OUTBOX_MAX_BUFS)
+        nbufs = HGSHM_OUTBOX_MAX_BUFS;
+    if (nbufs == 0)
+        return NULL;
+
+    h->magic = 0;
+    __sync_synchronize();
+    memset((char *)h + sizeof(uint32_t), 0,
+        hgshm_outbox_hdr_size(nreaders) - sizeof(uint32_t));
+    h->nbufs = nbufs;
+    h->nreaders = nreaders;
+    h->buf_size = buf_size;
+    h->data_off = data_off;
+    hgshm_store_release(&h->magic, HGSHM_OUTBOX_MAGIC);
+
+    if ((ob = outbox_handle(ctx, h, -1, policy)) != NULL)
+        ob->data = data;
+    return ob;
+}
+
+hgshm_outbox_t *hgshm_outbox_attach(hgshm_ctx_t *ctx, void *hdr,
+    int reader, int policy, int timeout_ms)
+{
+    outbox_hdr_t *h = hdr;
+    hgshm_outbox_t *ob;
+    char *data;
+
+    while (hgshm_load_acquire(&h->magic) != HGSHM_OUTBOX_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    if (reader < 0 || reader >= (int)h->nreaders)
+        return NULL;
+    data = hgshm_ctx_region_ptr(ctx, h->data_off, h->nbufs * h->buf_size);
+    if (data == NULL) {
+        printf("outbox: buffers are not visible from VM %d, "
+            "needs fullview\n", hgshm_ctx_get_index(ctx));
+        return NULL;
+    }
+    if ((ob = outbox_handle(ctx, h, reader, policy)) != NULL)
+        ob->data = data;
+    return ob;
+}
+
+void hgshm_outbox_close(hgshm_outbox_t *ob)
+{
+    free(ob);
+}
+
+int hgshm_outbox_nbufs(hgshm_outbox_t *ob)
+{
+    return ob->hdr->nbufs;
+}
+
+size_t hgshm_outbox_buf_size(hgshm_outbox_t *ob)
+{
+    return ob->hdr->buf_size;
+}
+
+static int outbox_has_free(void *arg)
+{
+    hgshm_outbox_t *ob = arg;
+    uint32_t i, b;
+
+    for (i = 0; i < ob->hdr->nbufs; i++) {
+        b = (ob->next + i) % ob->hdr->nbufs;
+        if (!(ob->held & (1ULL << b)) &&
+            __atomic_load_n(&ob->hdr->refs[b].n, __ATOMIC_SEQ_CST) == 0) {
+            ob->found = b;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *hgshm_outbox_get(hgshm_outbox_t *ob, int *buf, int timeout_ms)
+{
+    if (ob->reader >= 0 ||
+        hgshm_futex_wait_until(ob->ctx, &ob->hdr->freed, outbox_has_free,
+        ob, ob->policy, timeout_ms, &ob->stats) < 0)
+        return NULL;
+    *buf = ob->found;
+    ob->held |= 1ULL << ob->found;
+    ob->next = (ob->found + 1) % ob->hdr->nbufs;
+    return ob->data + (size_t)ob->found * ob->hdr->buf_size;
+}
+
+static int outbox_has_room(void *arg)
+{
+    hgshm_outbox_t *ob = arg;
+    outbox_queue_t *q = &ob->hdr->q[ob->room_for];
+    uint32_t taken = __atomic_load_n(&q->taken.word, __ATOMIC_SEQ_CST);
+
+    return (uint32_t)((uint32_t)ob->posted[ob->room_for] - taken) <
+        OUTBOX_QLEN;
+}
+
+/* Queue desc to reader r, waiting for room if r is far behind */
+static void outbox_post(hgshm_outbox_t *ob, int r, const hgshm_desc_t *desc)
+{
+    outbox_queue_t *q = &ob->hdr->q[r];
+
+    ob->room_for = r;
+    hgshm_futex_wait_until(ob->ctx, &q->taken, outbox_has_room, ob,
+        ob->policy, -1, &ob->stats);
+    q->desc[ob->posted[r] % OUTBOX_QLEN] = *desc;
+    ob->posted[r]++;
+    __atomic_store_n(&q->posted.word, (uint32_t)ob->posted[r],
+        __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(ob->ctx, &q->posted);
+}
+
+/* Readers bits in the mask, -1 if a bit is past the last reader */
+static int outbox_count(hgshm_outbox_t *ob, uint64_t readers)
+{
+    if (ob->hdr->nreaders < 64 && (readers >> ob->hdr->nreaders))
+        return -1;
+    return __builtin_popcountll(readers);
+}
+
+int hgshm_outbox_publish(hgshm_outbox_t *ob, int buf, size_t len,
+    uint64_t readers)
+{
+    hgshm_desc_t desc;
+    int n, r;
+
+    if (ob->reader >= 0 || buf < 0 || buf >= (int)ob->hdr->nbufs ||
+        !(ob->held & (1ULL << buf)) || len == 0 ||
+        len > ob->hdr->buf_size || (n = outbox_count(ob, readers)) < 0)
+        return -1;
+    ob->held &= ~(1ULL << buf);
+    if (n == 0)
+        return 0;
+
+    desc.off = ob->hdr->data_off + (uint64_t)buf * ob->hdr->buf_size;
+    desc.len = len;
+    desc.buf = buf;
+    desc.pad = 0;
+    __atomic_store_n(&ob->hdr->refs[buf].n, n, __ATOMIC_SEQ_CST);
+    for (r = 0; r < (int)ob->hdr->nreaders; r++)
+        if (readers & (1ULL << r))
+            outbox_post(ob, r, &desc);
+    ob->bufs++;
+    ob->bytes += len;
+    ob->descs += n;
+    return 0;
+}
+
+int hgshm_outbox_eof(hgshm_outbox_t *ob, uint64_t readers)
+{
+    hgshm_desc_t desc = { 0 };
+    int r;
+
+    if (ob->reader >= 0 || outbox_count(ob, readers) < 0)
+        return -1;
+    for (r = 0; r < (int)ob->hdr->nreaders; r++)
+        if (readers & (1ULL << r))
+            outbox_post(ob, r, &desc);
+    return 0;
+}
+
+static int outbox_all_freed(void *arg)
+{
+    hgshm_outbox_t *ob = arg;
+    uint32_t b;
+
+    for (b = 0; b < ob->hdr->nbufs; b++)
+        if (__atomic_load_n(&ob->hdr->refs[b].n, __ATOMIC_SEQ_CST))
+            return 0;
+    return 1;
+}
+
+int hgshm_outbox_drain(hgshm_outbox_t *ob, int timeout_ms)
+{
+    return hgshm_futex_wait_until(ob->ctx, &ob->hdr->freed,
+        outbox_all_freed, ob, ob->policy, timeout_ms, &ob->stats);
+}
+
+static int outbox_has_next(void *arg)
+{
+    hgshm_outbox_t *ob = arg;
+    outbox_queue_t *q = &ob->hdr->q[ob->reader];
+
+    return __atomic_load_n(&q->posted.word, __ATOMIC_SEQ_CST) !=
+        (uint32_t)ob->seq;
+}
+
+int hgshm_outbox_next(hgshm_outbox_t *ob, hgshm_desc_t *desc,
+    const void **data, int timeout_ms)
+{
+    outbox_queue_t *q;
+
+    if (ob->reader < 0)
+        return -1;
+    q = &ob->hdr->q[ob->reader];
+    if (hgshm_futex_wait_until(ob->ctx, &q->posted, outbox_has_next, ob,
+        ob->policy, timeout_ms, &ob->stats) < 0)
+        return -1;
+    *desc = q->desc[ob->seq % OUTBOX_QLEN];
+    ob->seq++;
+    /* Wakes a mapper waiting for room */
+    __atomic_store_n(&q->taken.word, (uint32_t)ob->seq, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(ob->ctx, &q->taken);
+
+    *data = NULL;
+    if (desc->len) {
+        *data = ob->data + (desc->off - ob->hdr->data_off);
+        ob->bufs++;
+        ob->bytes += desc->len;
+    }
+    return 0;
+}
+
+void hgshm_outbox_release(hgshm_outbox_t *ob, const hgshm_desc_t *desc)
+{
+    outbox_hdr_t *h = ob->hdr;
+
+    if (desc->len == 0 || desc->buf >= h->nbufs)
+        return;
+    if (__atomic_sub_fetch(&h->refs[desc->buf].n, 1, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_add_fetch(&h->freed.word, 1, __ATOMIC_SEQ_CST);
+        hgshm_futex_wake(ob->ctx, &h->freed);
+    }
+}
+
+void hgshm_outbox_print_stats(hgshm_outbox_t *ob, FILE *fp)
+{
+    if (ob->reader < 0)
+        fprintf(fp, "outbox: %lu buffers, %lu bytes, %lu descriptors to "
+            "%u readers, %u x %lu, %lu waits, %lu sleeps\n", ob->bufs,
+            ob->bytes, ob->descs, ob->hdr->nreaders, ob->hdr->nbufs,
+            ob->hdr->buf_size, ob->stats.waits, ob->stats.sleeps);
+    else
+        fprintf(fp, "outbox reader %d: %lu buffers, %lu bytes, "
+            "%lu waits, %lu sleeps\n", ob->reader, ob->bufs, ob->bytes,
+            ob->stats.waits, ob->stats.sleeps);
+}
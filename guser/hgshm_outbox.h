@@ -0,0 +1,99 @@
+#ifndef _HGSHM_OUTBOX_H
+#define _HGSHM_OUTBOX_H
+/*
+ * Zero-copy handoff of buffers from one writer to many readers.
+ *
+ * Pipes, streams and the scheduler move data by copying it into the
+ * slice of the VM that reads it, so a buffer every reducer needs (a
+ * lookup table, a broadcast input) is copied once per reducer. An outbox
+ * is a set of buffers the writer (mapper) owns, in memory every reader
+ * can see: slice 0, or any slice for readers with the device 'fullview'
+ * property (see hgshm_ctx_view()). The mapper fills a buffer once and
+ * publishes a descriptor, a region offset and a length, to any set of
+ * readers; each reads the buffer in place and releases it. The buffer
+ * goes back to the mapper when the last of them has released it.
+ *
+ *	mapper                               reader r
+ *	ob = hgshm_outbox_create(ctx, ..)    ob = hgshm_outbox_attach(ctx,
+ *	for (;;) {                               hdr, r, ..)
+ *	    d = hgshm_outbox_get(ob, &b, -1) while (hgshm_outbox_next(ob,
+ *	    fill d                               &desc, &d, -1) == 0 &&
+ *	    hgshm_outbox_publish(ob, b,          desc.len) {
+ *	        len, readers)                    read d
+ *	}                                        hgshm_outbox_release(ob,
+ *	hgshm_outbox_eof(ob, readers)                &desc)
+ *	                                     }
+ *
+ * The header holds a reference count per buffer and a descriptor queue
+ * per reader, which readers write, so it must be in slice 0. Waits sleep
+ * in hgshm_sync.h futexes. There is one mapper and a handle is used by
+ * one thread.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_OUTBOX_MAX_BUFS       64
+#define HGSHM_OUTBOX_MAX_READERS    64
+
+/* Meaningful in any VM of the region, see hgshm_ctx_region_ptr() */
+typedef struct {
+    uint64_t    off;            /* region offset of the data */
+    uint64_t    len;            /* 0: the mapper is done */
+    uint32_t    buf;
+    uint32_t    pad;
+} hgshm_desc_t;
+
+typedef struct hgshm_outbox hgshm_outbox_t;
+
+/* Bytes of header for nreaders readers */
+size_t hgshm_outbox_hdr_size(int nreaders);
+/*
+ * Mapper side: format hdr (in slice 0, hgshm_outbox_hdr_size() bytes) for
+ * nreaders readers and split data (size bytes, writable here) into
+ * buf_size (rounded up to a page) buffers, at most HGSHM_OUTBOX_MAX_BUFS.
+ */
+hgshm_outbox_t * hgshm_outbox_create(hgshm_ctx_t *ctx, void *hdr,
+    void *data, size_t size, size_t buf_size, int nreaders, int policy);
+/*
+ * Reader side: wait up to timeout_ms for the mapper to format hdr. NULL
+ * as well if this VM cannot see the buffers.
+ */
+hgshm_outbox_t * hgshm_outbox_attach(hgshm_ctx_t *ctx, void *hdr,
+    int reader, int policy, int timeout_ms);
+/* Frees the handle, not the shared state */
+void hgshm_outbox_close(hgshm_outbox_t *ob);
+
+int hgshm_outbox_nbufs(hgshm_outbox_t *ob);
+size_t hgshm_outbox_buf_size(hgshm_outbox_t *ob);
+
+/*
+ * Mapper: wait for a buffer no reader holds. Returns it and its number
+ * in *buf, NULL on timeout.
+ */
+void * hgshm_outbox_get(hgshm_outbox_t *ob, int *buf, int timeout_ms);
+/*
+ * Mapper: hand the first len bytes of buf to every reader in the mask,
+ * bit r for reader r. An empty mask gives the buffer back.
+ */
+int hgshm_outbox_publish(hgshm_outbox_t *ob, int buf, size_t len,
+    uint64_t readers);
+/* Mapper: an empty descriptor to every reader in the mask, the end */
+int hgshm_outbox_eof(hgshm_outbox_t *ob, uint64_t readers);
+/* Mapper: wait until the readers have released every buffer */
+int hgshm_outbox_drain(hgshm_outbox_t *ob, int timeout_ms);
+
+/*
+ * Reader: wait for the next descriptor. *data is the buffer, read-only
+ * to readers. desc->len 0 is the end. -1 on timeout.
+ */
+int hgshm_outbox_next(hgshm_outbox_t *ob, hgshm_desc_t *desc,
+    const void **data, int timeout_ms);
+/* Reader: done with the buffer, the last release frees it */
+void hgshm_outbox_release(hgshm_outbox_t *ob, const hgshm_desc_t *desc);
+
+/* Buffers, bytes and how often this end had to wait */
+void hgshm_outbox_print_stats(hgshm_outbox_t *ob, FILE *fp);
+#endif /* _HGSHM_OUTBOX_H */
@@ -0,0 +1,386 @@
+/*
+ * Slice pipeline and copy thread pool, see hgshm_pipe.h.
+ *
+ * Buffer b carries sequence numbers b, b + nbufs, b + 2 * nbufs ... so
+ * both sides walk the buffers round robin and only the per buffer state
+ * word is shared:
+ *	PIPE_FREE: the producer may acquire it
+ *	PIPE_FILLING: acquired, the producer (or a copy thread) is filling it
+ *	PIPE_FULL: the consumer may read it
+ * The producer writes the data, then len, then the state with release
+ * ordering. The consumer writes result, then the state. Each side counts
+ * its blocked waiter in sleepers[], the other side rings it only then.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_pipe.h"
+#include "hgshm_copy.h"
+
+#define HGSHM_PIPE_MAGIC    0x48475049  /* "HGPI" */
+#define PIPE_FREE           0
+#define PIPE_FILLING        1
+#define PIPE_FULL           2
+
+#define PIPE_PRODUCER       0
+#define PIPE_CONSUMER       1
+
+#define HGSHM_POOL_QLEN     256
+
+typedef struct {
+    uint32_t    state;
+    uint64_t    len;
+    int64_t     result;
+} HGSHM_ALIGNED pipe_desc_t;
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    nbufs;
+    uint64_t    buf_size;
+    uint64_t    buf_off;            /* buffer 0, from the header */
+    int32_t     producer;
+    int32_t     consumer;
+    /* Blocked waiters, PIPE_PRODUCER and PIPE_CONSUMER */
+    uint32_t    sleepers[2] HGSHM_ALIGNED;
+    pipe_desc_t desc[HGSHM_PIPE_MAX_BUFS];
+} pipe_hdr_t;
+
+typedef struct {
+    hgshm_pipe_t *p;
+    int         buf;
+    const void  *src;
+    size_t      len;
+} pipe_copy_t;
+
+struct hgshm_pipe {
+    pipe_hdr_t  *hdr;
+    hgshm_ctx_t *ctx;
+    hgshm_chan_t chan;
+    uint64_t    seq;                /* next buffer to acquire or read */
+    pipe_copy_t copy[HGSHM_PIPE_MAX_BUFS];
+};
+
+typedef struct {
+    void        (*fn)(void *);
+    void        *arg;
+} pool_job_t;
+
+struct hgshm_pool {
+    pthread_t   *tids;
+    int         nthreads;
+    pool_job_t  jobs[HGSHM_POOL_QLEN];
+    int         head;
+    int         count;
+    int         pending;            /* queued or running */
+    int         stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;
+    pthread_cond_t  space_cond;
+    pthread_cond_t  idle_cond;
+};
+
+static char *pipe_buf(hgshm_pipe_t *p, int buf)
+{
+    return (char *)p->hdr + p->hdr->buf_off + buf * p->hdr->buf_size;
+}
+
+static hgshm_pipe_t *pipe_handle(hgshm_ctx_t *ctx, pipe_hdr_t *hdr,
+    int policy)
+{
+    hgshm_pipe_t *p = calloc(1, sizeof(hgshm_pipe_t));
+
+    if (p == NULL)
+        return NULL;
+    p->hdr = hdr;
+    p->ctx = ctx;
+    hgshm_chan_init(&p->chan, ctx, policy, 0);
+    return p;
+}
+
+static void pipe_notify(hgshm_pipe_t *p, int side)
+{
+    int index = (side == PIPE_PRODUCER) ? p->hdr->producer :
+        p->hdr->consumer;
+
+    if (hgshm_chan_notify(p->ctx, &p->hdr->sleepers[side], index) < 0)
+        printf("hgshm: could not notify index %d\n", index);
+}
+
+/* Producers wait for PIPE_FREE, consumers for PIPE_FULL */
+static int pipe_wait(hgshm_pipe_t *p, int b, uint32_t state, int timeout_ms)
+{
+    hgshm_chan_set_sleepers(&p->chan, &p->hdr->sleepers[(state ==
+        PIPE_FULL) ? PIPE_CONSUMER : PIPE_PRODUCER]);
+    return hgshm_chan_wait_word(&p->chan, &p->hdr->desc[b].state, state,
+        timeout_ms);
+}
+
+hgshm_pipe_t *hgshm_pipe_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nbufs, int producer, int consumer, int policy)
+{
+    pipe_hdr_t *hdr = mem;
+    size_t off = (sizeof(pipe_hdr_t) + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    int i;
+
+    if (mem == NULL || nbufs < 2 || nbufs > HGSHM_PIPE_MAX_BUFS ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)) ||
+        size < off + nbufs * HGSHM_PAGE_SIZE)
+        return NULL;
+
+    hdr->magic = 0;
+    __sync_synchronize();
+    hdr->nbufs = nbufs;
+    hdr->buf_off = off;
+    hdr->buf_size = ((size - off) / nbufs) & ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    hdr->producer = producer;
+    hdr->consumer = consumer;
+    hdr->sleepers[PIPE_PRODUCER] = hdr->sleepers[PIPE_CONSUMER] = 0;
+    for (i = 0; i < nbufs; i++) {
+        hdr->desc[i].state = PIPE_FREE;
+        hdr->desc[i].len = 0;
+        hdr->desc[i].result = 0;
+    }
+    hgshm_store_release(&hdr->magic, HGSHM_PIPE_MAGIC);
+    return pipe_handle(ctx, hdr, policy);
+}
+
+hgshm_pipe_t *hgshm_pipe_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms)
+{
+    pipe_hdr_t *hdr = mem;
+
+    while (hgshm_load_acquire(&hdr->magic) != HGSHM_PIPE_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    return pipe_handle(ctx, hdr, policy);
+}
+
+void hgshm_pipe_close(hgshm_pipe_t *p)
+{
+    free(p);
+}
+
+size_t hgshm_pipe_buf_size(hgshm_pipe_t *p)
+{
+    return p->hdr->buf_size;
+}
+
+int hgshm_pipe_nbufs(hgshm_pipe_t *p)
+{
+    return p->hdr->nbufs;
+}
+
+void hgshm_pipe_print_stats(hgshm_pipe_t *p, FILE *fp)
+{
+    hgshm_chan_print_stats(&p->chan, fp);
+}
+
+void *hgshm_pipe_acquire(hgshm_pipe_t *p, int *buf, int64_t *result,
+    int timeout_ms)
+{
+    int b = p->seq % p->hdr->nbufs;
+
+    if (pipe_wait(p, b, PIPE_FREE, timeout_ms) < 0)
+        return NULL;
+    if (result)
+        *result = p->hdr->desc[b].result;
+    p->hdr->desc[b].state = PIPE_FILLING;
+    p->seq++;
+    *buf = b;
+    return pipe_buf(p, b);
+}
+
+void hgshm_pipe_publish(hgshm_pipe_t *p, int buf, size_t len)
+{
+    pipe_desc_t *d = &p->hdr->desc[buf];
+
+    d->len = len;
+    hgshm_store_release(&d->state, PIPE_FULL);
+    pipe_notify(p, PIPE_CONSUMER);
+}
+
+int hgshm_pipe_eof(hgshm_pipe_t *p, int timeout_ms)
+{
+    int buf;
+
+    if (hgshm_pipe_acquire(p, &buf, NULL, timeout_ms) == NULL)
+        return -1;
+    hgshm_pipe_publish(p, buf, 0);
+    return 0;
+}
+
+int hgshm_pipe_drain(hgshm_pipe_t *p, int timeout_ms)
+{
+    int i;
+
+    for (i = 0; i < p->hdr->nbufs; i++)
+        if (pipe_wait(p, i, PIPE_FREE, timeout_ms) < 0)
+            return -1;
+    return 0;
+}
+
+void *hgshm_pipe_next(hgshm_pipe_t *p, size_t *len, int *buf,
+    int timeout_ms)
+{
+    int b = p->seq % p->hdr->nbufs;
+
+    if (pipe_wait(p, b, PIPE_FULL, timeout_ms) < 0)
+        return NULL;
+    p->seq++;
+    *len = p->hdr->desc[b].len;
+    *buf = b;
+    return pipe_buf(p, b);
+}
+
+void hgshm_pipe_release(hgshm_pipe_t *p, int buf, int64_t result)
+{
+    pipe_desc_t *d = &p->hdr->desc[buf];
+
+    d->result = result;
+    hgshm_store_release(&d->state, PIPE_FREE);
+    pipe_notify(p, PIPE_PRODUCER);
+}
+
+static void pipe_copy_job(void *arg)
+{
+    pipe_copy_t *c = arg;
+
+    hgshm_copy_to_slice(pipe_buf(c->p, c->buf), c->src, c->len);
+    hgshm_pipe_publish(c->p, c->buf, c->len);
+}
+
+int hgshm_pipe_copy(hgshm_pool_t *pool, hgshm_pipe_t *p, int buf,
+    const void *src, size_t len)
+{
+    pipe_copy_t *c = &p->copy[buf];
+
+    if (len > p->hdr->buf_size)
+        return -1;
+    c->p = p;
+    c->buf = buf;
+    c->src = src;
+    c->len = len;
+    return hgshm_pool_submit(pool, pipe_copy_job, c);
+}
+
+static void *pool_worker(void *arg)
+{
+    hgshm_pool_t *pool = arg;
+    pool_job_t job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->count == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->count == 0)
+            break;
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % HGSHM_POOL_QLEN;
+        pool->count--;
+        pthread_cond_signal(&pool->space_cond);
+        pthread_mutex_unlock(&pool->lock);
+
+        job.fn(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+hgshm_pool_t *hgshm_pool_create(int nthreads, int pin)
+{
+    hgshm_pool_t *pool;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    int i;
+
+    if (nthreads <= 0 || (pool = calloc(1, sizeof(hgshm_pool_t))) == NULL)
+        return NULL;
+    if ((pool->tids = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->space_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->tids[i], NULL, pool_worker, pool) != 0)
+            break;
+        pool->nthreads++;
+        if (pin && ncpus > 0) {
+            CPU_ZERO(&set);
+            CPU_SET(i % ncpus, &set);
+            pthread_setaffinity_np(pool->tids[i], sizeof(set), &set);
+        }
+    }
+    if (pool->nthreads == 0) {
+        hgshm_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int hgshm_pool_submit(hgshm_pool_t *pool, void (*fn)(void *), void *arg)
+{
+    pool_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == HGSHM_POOL_QLEN && !pool->stop)
+        pthread_cond_wait(&pool->space_cond, &pool->lock);
+    if (pool->stop) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    job = &pool->jobs[(pool->head + pool->count) % HGSHM_POOL_QLEN];
+    job->fn = fn;
+    job->arg = arg;
+    pool->count++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void hgshm_pool_wait(hgshm_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs what is queued, then stops the threads */
+void hgshm_pool_destroy(hgshm_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_cond_broadcast(&pool->space_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->tids[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->space_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->tids);
+    free(pool);
+}
@@ -0,0 +1,87 @@
+#ifndef _HGSHM_PIPE_H
+#define _HGSHM_PIPE_H
+/*
+ * Multi-buffered slice pipeline and a pool of copy threads.
+ *
+ * A pipe splits a slice into nbufs (>= 2) page aligned sub-buffers that
+ * travel between one producer VM and one consumer VM in order. While the
+ * consumer works on buffer N the producer fills buffer N+1, so copying
+ * and reducing overlap instead of taking turns. The pipe header, with a
+ * cache line per buffer, is at the start of the slice; both sides only
+ * need the slice mapped.
+ *
+ * Producer:                          Consumer:
+ *   buf = hgshm_pipe_acquire(p, ..)    data = hgshm_pipe_next(p, &len, ..)
+ *   fill, or hgshm_pipe_copy()         work on data
+ *   hgshm_pipe_publish(p, buf, len)    hgshm_pipe_release(p, buf, result)
+ *   ...                                ... until len == 0
+ *   hgshm_pipe_eof(p)
+ *
+ * Waits use a hgshm_wait.h channel with the policy given at create or
+ * attach time. A handle is used by one thread at a time, apart from
+ * hgshm_pipe_publish() which copy threads may call for any buffer they
+ * were handed.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_PIPE_MAX_BUFS     8
+
+typedef struct hgshm_pipe hgshm_pipe_t;
+typedef struct hgshm_pool hgshm_pool_t;
+
+/*
+ * Producer side: format mem (page aligned, size bytes) and return a
+ * handle. producer and consumer are VM indexes, they get the doorbells.
+ */
+hgshm_pipe_t * hgshm_pipe_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nbufs, int producer, int consumer, int policy);
+/* Consumer side: wait up to timeout_ms for the producer to format mem */
+hgshm_pipe_t * hgshm_pipe_attach(hgshm_ctx_t *ctx, void *mem, int policy,
+    int timeout_ms);
+/* Frees the handle, not the shared state */
+void hgshm_pipe_close(hgshm_pipe_t *p);
+
+size_t hgshm_pipe_buf_size(hgshm_pipe_t *p);
+int hgshm_pipe_nbufs(hgshm_pipe_t *p);
+/* Wait statistics of this end, see hgshm_chan_print_stats() */
+void hgshm_pipe_print_stats(hgshm_pipe_t *p, FILE *fp);
+
+/*
+ * Producer: wait for the next buffer to be free. Returns its address and
+ * number in *buf, and what the consumer returned for its last use in
+ * *result (may be NULL). NULL on timeout.
+ */
+void * hgshm_pipe_acquire(hgshm_pipe_t *p, int *buf, int64_t *result,
+    int timeout_ms);
+void hgshm_pipe_publish(hgshm_pipe_t *p, int buf, size_t len);
+/* Producer: tell the consumer there is nothing more (len 0 buffer) */
+int hgshm_pipe_eof(hgshm_pipe_t *p, int timeout_ms);
+/* Producer: wait until the consumer has released every buffer */
+int hgshm_pipe_drain(hgshm_pipe_t *p, int timeout_ms);
+
+/* Consumer: wait for the next full buffer, NULL on timeout */
+void * hgshm_pipe_next(hgshm_pipe_t *p, size_t *len, int *buf,
+    int timeout_ms);
+void hgshm_pipe_release(hgshm_pipe_t *p, int buf, int64_t result);
+
+/*
+ * Copy thread pool. Threads are pinned round robin to the online CPUs
+ * when pin is set.
+ */
+hgshm_pool_t * hgshm_pool_create(int nthreads, int pin);
+int hgshm_pool_submit(hgshm_pool_t *pool, void (*fn)(void *), void *arg);
+/* Wait until every submitted job has run */
+void hgshm_pool_wait(hgshm_pool_t *pool);
+void hgshm_pool_destroy(hgshm_pool_t *pool);
+
+/*
+ * Producer: copy len bytes from src into acquired buffer buf on a pool
+ * thread with hgshm_copy_to_slice(), then publish it.
+ */
+int hgshm_pipe_copy(hgshm_pool_t *pool, hgshm_pipe_t *p, int buf,
+    const void *src, size_t len);
+#endif /* _HGSHM_PIPE_H */
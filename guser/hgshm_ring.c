@@ -0,0 +1,181 @@
+/*
+ * SPSC/MPSC ring queues in shared memory, see hgshm_ring.h.
+ *
+ * Counters are free running 64 bit slot numbers, the slot of counter c is
+ * c & (nslots - 1). prod_head is the next slot to reserve, prod_tail the
+ * first slot not yet published and cons_head the next slot to consume.
+ * Only one of them is written by each side, which keeps the producer and
+ * the consumer from bouncing each other's cache line.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "hgshm.h"
+#include "hgshm_int.h"
+#include "hgshm_ring.h"
+
+#define HGSHM_RING_MAGIC    0x48475247  /* "HGRG" */
+
+struct hgshm_ring {
+    uint32_t    magic;
+    uint32_t    flags;
+    uint32_t    slot_size;
+    uint32_t    nslots;
+    int32_t     consumer;
+    uint64_t    prod_head HGSHM_ALIGNED;
+    uint64_t    prod_tail HGSHM_ALIGNED;
+    uint64_t    cons_head HGSHM_ALIGNED;
+    char        slots[] HGSHM_ALIGNED;
+};
+
+size_t hgshm_ring_memsize(uint32_t slot_size, uint32_t nslots)
+{
+    return sizeof(hgshm_ring_t) + (size_t)slot_size * nslots;
+}
+
+hgshm_ring_t *hgshm_ring_init(void *mem, size_t size, uint32_t slot_size,
+    int flags, int consumer)
+{
+    hgshm_ring_t *r = mem;
+    uint32_t nslots;
+
+    if (mem == NULL || slot_size == 0 || size < sizeof(hgshm_ring_t) ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)))
+        return NULL;
+    if ((size - sizeof(hgshm_ring_t)) / slot_size < 2)
+        return NULL;
+    for (nslots = 2; (size_t)nslots * 2 * slot_size <=
+        size - sizeof(hgshm_ring_t) && nslots < (1U << 31); nslots <<= 1);
+
+    bzero(r, sizeof(hgshm_ring_t));
+    r->flags = flags;
+    r->slot_size = slot_size;
+    r->nslots = nslots;
+    r->consumer = consumer;
+    /* Magic last, hgshm_ring_attach must not see a half made ring */
+    hgshm_store_release(&r->magic, HGSHM_RING_MAGIC);
+    return r;
+}
+
+hgshm_ring_t *hgshm_ring_attach(void *mem)
+{
+    hgshm_ring_t *r = mem;
+
+    if (mem == NULL || hgshm_load_acquire(&r->magic) != HGSHM_RING_MAGIC)
+        return NULL;
+    return r;
+}
+
+static void ring_copy_in(hgshm_ring_t *r, uint64_t pos, const void *items,
+    unsigned n)
+{
+    uint32_t idx = pos & (r->nslots - 1);
+    unsigned first = (n < r->nslots - idx) ? n : r->nslots - idx;
+
+    memcpy(r->slots + (size_t)idx * r->slot_size, items,
+        (size_t)first * r->slot_size);
+    if (first < n)
+        memcpy(r->slots, (const char *)items + (size_t)first * r->slot_size,
+            (size_t)(n - first) * r->slot_size);
+}
+
+static void ring_copy_out(hgshm_ring_t *r, uint64_t pos, void *items,
+    unsigned n)
+{
+    uint32_t idx = pos & (r->nslots - 1);
+    unsigned first = (n < r->nslots - idx) ? n : r->nslots - idx;
+
+    memcpy(items, r->slots + (size_t)idx * r->slot_size,
+        (size_t)first * r->slot_size);
+    if (first < n)
+        memcpy((char *)items + (size_t)first * r->slot_size, r->slots,
+            (size_t)(n - first) * r->slot_size);
+}
+
+/* Reserve up to n slots, returns how many and the first one in *head */
+static unsigned ring_reserve(hgshm_ring_t *r, unsigned n, uint64_t *head)
+{
+    uint64_t h, cons, avail;
+
+    h = __atomic_load_n(&r->prod_head, __ATOMIC_RELAXED);
+    do {
+        cons = hgshm_load_acquire(&r->cons_head);
+        avail = r->nslots - (h - cons);
+        if (avail == 0)
+            return 0;
+        if (n > avail)
+            n = avail;
+        if (r->flags != HGSHM_RING_MPSC) {
+            __atomic_store_n(&r->prod_head, h + n, __ATOMIC_RELAXED);
+            break;
+        }
+    } while (!__atomic_compare_exchange_n(&r->prod_head, &h, h + n, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *head = h;
+    return n;
+}
+
+unsigned hgshm_ring_enqueue(hgshm_ctx_t *ctx, hgshm_ring_t *r,
+    const void *items, unsigned n)
+{
+    uint64_t head;
+
+    if (n == 0 || (n = ring_reserve(r, n, &head)) == 0)
+        return 0;
+    ring_copy_in(r, head, items, n);
+
+    /* MPSC: producers that reserved earlier publish first */
+    if (r->flags == HGSHM_RING_MPSC)
+        while (hgshm_load_acquire(&r->prod_tail) != head)
+            hgshm_cpu_relax();
+    hgshm_store_release(&r->prod_tail, head + n);
+
+    /*
+     * Ring the doorbell only if the consumer had drained everything before
+     * these slots. Pairs with the fence in hgshm_ring_empty(): either the
+     * consumer sees the new tail or we see its cons_head and notify.
+     */
+    if (ctx) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->cons_head, __ATOMIC_RELAXED) == head)
+            hgshm_ctx_notify(ctx, r->consumer);
+    }
+    return n;
+}
+
+unsigned hgshm_ring_dequeue(hgshm_ring_t *r, void *items, unsigned n)
+{
+    uint64_t cons = __atomic_load_n(&r->cons_head, __ATOMIC_RELAXED);
+    uint64_t avail = hgshm_load_acquire(&r->prod_tail) - cons;
+
+    if (n > avail)
+        n = avail;
+    if (n == 0)
+        return 0;
+    ring_copy_out(r, cons, items, n);
+    hgshm_store_release(&r->cons_head, cons + n);
+    return n;
+}
+
+int hgshm_ring_empty(hgshm_ring_t *r)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return hgshm_load_acquire(&r->prod_tail) ==
+        __atomic_load_n(&r->cons_head, __ATOMIC_RELAXED);
+}
+
+unsigned hgshm_ring_count(hgshm_ring_t *r)
+{
+    return hgshm_load_acquire(&r->prod_tail) -
+        hgshm_load_acquire(&r->cons_head);
+}
+
+unsigned hgshm_ring_capacity(hgshm_ring_t *r)
+{
+    return r->nslots;
+}
+
+uint32_t hgshm_ring_slot_size(hgshm_ring_t *r)
+{
+    return r->slot_size;
+}
@@ -0,0 +1,65 @@
+#ifndef _HGSHM_RING_H
+#define _HGSHM_RING_H
+/*
+ * Ring queues of fixed size slots that live in shared memory.
+ *
+ * The ring is position independent, everything in it is an index or an
+ * offset, so the producer and the consumer may map it at different
+ * addresses (mapper BAR1, reducer BAR3 ...). Producer and consumer
+ * counters are on their own cache lines.
+ *
+ * HGSHM_RING_SPSC: one producer, one consumer.
+ * HGSHM_RING_MPSC: any number of producers, one consumer. Producers
+ * reserve slots with a CAS and publish in reservation order.
+ *
+ * Enqueue notifies the consumer VM only when the ring goes from empty to
+ * non empty, so a busy consumer is not interrupted for every batch.
+ * A consumer that wants to sleep does:
+ *
+ *	for (;;) {
+ *	    while ((n = hgshm_ring_dequeue(r, items, max)) > 0)
+ *	        process(items, n);
+ *	    if (hgshm_ring_empty(r))
+ *	        hgshm_ctx_wait(ctx, &seen, -1);
+ *	}
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_RING_SPSC     0
+#define HGSHM_RING_MPSC     1
+
+typedef struct hgshm_ring hgshm_ring_t;
+
+/* Bytes needed for a ring of nslots (power of 2) slots of slot_size */
+size_t hgshm_ring_memsize(uint32_t slot_size, uint32_t nslots);
+/*
+ * Format mem as a ring, with as many slots as fit in size. consumer is
+ * the index of the VM that dequeues, it gets the doorbell.
+ * Returns NULL if not even two slots fit.
+ */
+hgshm_ring_t * hgshm_ring_init(void *mem, size_t size, uint32_t slot_size,
+    int flags, int consumer);
+/* Use a ring formatted by another VM, NULL if mem is not a ring */
+hgshm_ring_t * hgshm_ring_attach(void *mem);
+
+/*
+ * Copy up to n items in, returns the number enqueued (0 if full).
+ * ctx may be NULL for a polling consumer, no doorbell is rung then.
+ */
+unsigned hgshm_ring_enqueue(hgshm_ctx_t *ctx, hgshm_ring_t *r,
+    const void *items, unsigned n);
+/* Copy up to n items out, returns the number dequeued */
+unsigned hgshm_ring_dequeue(hgshm_ring_t *r, void *items, unsigned n);
+
+unsigned hgshm_ring_count(hgshm_ring_t *r);
+unsigned hgshm_ring_capacity(hgshm_ring_t *r);
+uint32_t hgshm_ring_slot_size(hgshm_ring_t *r);
+/*
+ * Consumer side emptiness check, with the barrier that pairs with the
+ * producer's doorbell decision. Call it right before going to sleep.
+ */
+int hgshm_ring_empty(hgshm_ring_t *r);
+#endif /* _HGSHM_RING_H */
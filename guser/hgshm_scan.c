@@ -0,0 +1,265 @@
+/*
+ * Byte scan kernels, see hgshm_scan.h.
+ *
+ * Counting compares a vector against the byte and subtracts the result
+ * (0 or -1 per byte) from a byte accumulator. The accumulator is folded
+ * into a 64 bit total with psadbw before a lane can overflow, so the
+ * inner loop has no horizontal operations. AVX-512BW compares into a
+ * mask register and counts its bits instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "hgshm_scan.h"
+
+/* Below this per thread share, threads cost more than they save */
+#define HGSHM_SCAN_MT_MIN   (4 << 20)
+#define HGSHM_SCAN_MAX_THR  64
+
+/* Unrolled iterations between accumulator folds, each adds up to 4 */
+#define FOLD_ITERS          63
+
+typedef struct {
+    const char  *name;
+    size_t      (*count)(const uint8_t *, size_t, uint8_t);
+    const void *(*find)(const uint8_t *, size_t, uint8_t);
+} scan_impl_t;
+
+static size_t count_scalar(const uint8_t *p, size_t len, uint8_t c)
+{
+    size_t i, x = 0;
+
+    for (i = 0; i < len; i++)
+        x += (p[i] == c);
+    return x;
+}
+
+static const void *find_scalar(const uint8_t *p, size_t len, uint8_t c)
+{
+    return memchr(p, c, len);
+}
+
+__attribute__((target("sse2")))
+static size_t count_sse2(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc, sum = zero;
+    size_t i = 0;
+    int n;
+
+    while (len - i >= 64) {
+        acc = zero;
+        for (n = 0; n < FOLD_ITERS && len - i >= 64; n++, i += 64) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(needle,
+                _mm_loadu_si128((const __m128i *)(p + i))));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(needle,
+                _mm_loadu_si128((const __m128i *)(p + i + 16))));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(needle,
+                _mm_loadu_si128((const __m128i *)(p + i + 32))));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(needle,
+                _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        }
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+    }
+    return (size_t)_mm_cvtsi128_si64(sum) +
+        (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)) +
+        count_scalar(p + i, len - i, c);
+}
+
+__attribute__((target("sse2")))
+static const void *find_sse2(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i;
+    int m;
+
+    for (i = 0; len - i >= 16; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(needle,
+            _mm_loadu_si128((const __m128i *)(p + i))));
+        if (m)
+            return p + i + __builtin_ctz(m);
+    }
+    return memchr(p + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc, sum = zero;
+    size_t i = 0;
+    int n;
+
+    while (len - i >= 128) {
+        acc = zero;
+        for (n = 0; n < FOLD_ITERS && len - i >= 128; n++, i += 128) {
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(needle,
+                _mm256_loadu_si256((const __m256i *)(p + i))));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(needle,
+                _mm256_loadu_si256((const __m256i *)(p + i + 32))));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(needle,
+                _mm256_loadu_si256((const __m256i *)(p + i + 64))));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(needle,
+                _mm256_loadu_si256((const __m256i *)(p + i + 96))));
+        }
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));
+    }
+    return (size_t)_mm256_extract_epi64(sum, 0) +
+        (size_t)_mm256_extract_epi64(sum, 1) +
+        (size_t)_mm256_extract_epi64(sum, 2) +
+        (size_t)_mm256_extract_epi64(sum, 3) +
+        count_sse2(p + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const void *find_avx2(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i;
+    unsigned int m;
+
+    for (i = 0; len - i >= 32; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle,
+            _mm256_loadu_si256((const __m256i *)(p + i))));
+        if (m)
+            return p + i + __builtin_ctz(m);
+    }
+    return find_sse2(p + i, len - i, c);
+}
+
+__attribute__((target("avx512bw,popcnt")))
+static size_t count_avx512(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m512i needle = _mm512_set1_epi8(c);
+    size_t i, x = 0;
+
+    for (i = 0; len - i >= 256; i += 256) {
+        x += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(needle,
+            _mm512_loadu_si512(p + i)));
+        x += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(needle,
+            _mm512_loadu_si512(p + i + 64)));
+        x += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(needle,
+            _mm512_loadu_si512(p + i + 128)));
+        x += _mm_popcnt_u64(_mm512_cmpeq_epi8_mask(needle,
+            _mm512_loadu_si512(p + i + 192)));
+    }
+    return x + count_avx2(p + i, len - i, c);
+}
+
+__attribute__((target("avx512bw")))
+static const void *find_avx512(const uint8_t *p, size_t len, uint8_t c)
+{
+    const __m512i needle = _mm512_set1_epi8(c);
+    size_t i;
+    uint64_t m;
+
+    for (i = 0; len - i >= 64; i += 64) {
+        m = _mm512_cmpeq_epi8_mask(needle, _mm512_loadu_si512(p + i));
+        if (m)
+            return p + i + __builtin_ctzll(m);
+    }
+    return find_avx2(p + i, len - i, c);
+}
+
+static const scan_impl_t scan_impls[] = {
+    { "avx512bw", count_avx512, find_avx512 },
+    { "avx2", count_avx2, find_avx2 },
+    { "sse2", count_sse2, find_sse2 },
+    { "scalar", count_scalar, find_scalar },
+};
+
+static const scan_impl_t *scan;
+
+static const scan_impl_t *scan_select(void)
+{
+    const scan_impl_t *impl;
+
+    if ((impl = __atomic_load_n(&scan, __ATOMIC_ACQUIRE)) != NULL)
+        return impl;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt"))
+        impl = &scan_impls[0];
+    else if (__builtin_cpu_supports("avx2"))
+        impl = &scan_impls[1];
+    else if (__builtin_cpu_supports("sse2"))
+        impl = &scan_impls[2];
+    else
+        impl = &scan_impls[3];
+    __atomic_store_n(&scan, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+size_t hgshm_count_byte(const void *buf, size_t len, uint8_t c)
+{
+    return scan_select()->count(buf, len, c);
+}
+
+const void *hgshm_find_byte(const void *buf, size_t len, uint8_t c)
+{
+    return scan_select()->find(buf, len, c);
+}
+
+const char *hgshm_scan_impl(void)
+{
+    return scan_select()->name;
+}
+
+typedef struct {
+    const uint8_t   *p;
+    size_t          len;
+    uint8_t         c;
+    int             threaded;
+    size_t          count;
+} scan_part_t;
+
+static void *count_part(void *arg)
+{
+    scan_part_t *part = arg;
+
+    part->count = hgshm_count_byte(part->p, part->len, part->c);
+    return NULL;
+}
+
+size_t hgshm_count_byte_mt(const void *buf, size_t len, uint8_t c,
+    int nthreads)
+{
+    scan_part_t part[HGSHM_SCAN_MAX_THR];
+    pthread_t tid[HGSHM_SCAN_MAX_THR];
+    size_t chunk, off, x = 0;
+    int i, n;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > HGSHM_SCAN_MAX_THR)
+        nthreads = HGSHM_SCAN_MAX_THR;
+    if (nthreads > len / HGSHM_SCAN_MT_MIN)
+        nthreads = len / HGSHM_SCAN_MT_MIN;
+    if (nthreads <= 1)
+        return hgshm_count_byte(buf, len, c);
+
+    /* Page sized chunks, part 0 runs on the caller */
+    chunk = ((len / nthreads) + 4095) & ~(size_t)4095;
+    for (n = 0, off = 0; n < nthreads && off < len; n++, off += chunk) {
+        part[n].p = (const uint8_t *)buf + off;
+        part[n].len = (len - off < chunk) ? len - off : chunk;
+        part[n].c = c;
+        part[n].count = 0;
+        part[n].threaded = (n > 0 &&
+            pthread_create(&tid[n], NULL, count_part, &part[n]) == 0);
+        if (n > 0 && !part[n].threaded)
+            count_part(&part[n]);
+    }
+    count_part(&part[0]);
+    for (i = 1; i < n; i++) {
+        if (part[i].threaded)
+            pthread_join(tid[i], NULL);
+        x += part[i].count;
+    }
+    return x + part[0].count;
+}
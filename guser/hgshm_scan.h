@@ -0,0 +1,26 @@
+#ifndef _HGSHM_SCAN_H
+#define _HGSHM_SCAN_H
+/*
+ * Byte scan kernels used by the reducers.
+ *
+ * SSE2, AVX2 and AVX-512BW versions are built in and the best one the
+ * CPU supports is picked at the first call. The file has no other
+ * dependency on libhgshm so the VIRTIO client/server programs compile
+ * it directly.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of bytes equal to c */
+size_t hgshm_count_byte(const void *buf, size_t len, uint8_t c);
+/* Like memchr(), NULL if c is not in buf */
+const void * hgshm_find_byte(const void *buf, size_t len, uint8_t c);
+/*
+ * hgshm_count_byte() split across nthreads threads, 0 for one per
+ * online CPU. Small buffers are counted on the calling thread.
+ */
+size_t hgshm_count_byte_mt(const void *buf, size_t len, uint8_t c,
+    int nthreads);
+/* "avx512bw", "avx2", "sse2" or "scalar" */
+const char * hgshm_scan_impl(void);
+#endif /* _HGSHM_SCAN_H */
@@ -0,0 +1,369 @@
+/*
+ * Work stealing chunk scheduler, see hgshm_sched.h.
+ *
+ * Layout: header, a queue record per client, a descriptor per chunk, a
+ * ring of chunk numbers per client, then the page aligned chunks.
+ *
+ * A queue is a ring with a head and a tail counter. Index 0 writes the
+ * ring entry and then the tail; a reducer reads head, tail and the entry
+ * and claims it by moving head with a compare and swap, so the owner
+ * and thieves race on the same end and exactly one of them wins. A ring
+ * holds at most nchunks entries, which is every chunk there is.
+ *
+ * Chunk states: FREE (index 0 may get it), BUSY (got by index 0, queued
+ * or being worked on). Only index 0 moves FREE to BUSY and only the
+ * reducer that finishes a chunk moves it back.
+ *
+ * hdr->work counts queued chunks plus eof, reducers sleep on it when no
+ * queue has anything. hdr->done counts finished chunks, index 0 sleeps
+ * on it for a free chunk or for the end of a round.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hgshm_int.h"
+#include "hgshm_ctl.h"
+#include "hgshm_wait.h"
+#include "hgshm_sync.h"
+#include "hgshm_sched.h"
+
+#define HGSHM_SCHED_MAGIC   0x48475343  /* "HGSC" */
+#define HGSHM_SCHED_VERSION 1
+
+#define SCHED_FREE          0
+#define SCHED_BUSY          1
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    nclients;
+    uint32_t    nchunks;
+    uint64_t    chunk_size;
+    uint64_t    queue_off;          /* from the header */
+    uint64_t    desc_off;
+    uint64_t    ring_off;
+    uint64_t    data_off;
+    uint64_t    size;
+    /* Written by index 0 */
+    uint32_t    eof __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    hgshm_futex_t work __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    hgshm_futex_t done __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    /* Added to by every reducer */
+    int64_t     result __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    uint64_t    stolen;
+} __attribute__((aligned(HGSHM_CTL_ALIGN))) sched_hdr_t;
+
+typedef struct {
+    uint32_t    head __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    uint32_t    tail __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    /* Written by the client */
+    uint64_t    chunks __attribute__((aligned(HGSHM_CTL_ALIGN)));
+    uint64_t    stolen;
+} sched_queue_t;
+
+typedef struct {
+    uint32_t    state;
+    uint32_t    owner;              /* queue it was put on */
+    uint64_t    len;
+} __attribute__((aligned(HGSHM_CACHELINE))) sched_desc_t;
+
+struct hgshm_sched {
+    sched_hdr_t *hdr;
+    sched_queue_t *queue;
+    sched_desc_t *desc;
+    uint32_t    *ring;
+    char        *data;
+    hgshm_ctx_t *ctx;
+    int         index;
+    int         nclients;
+    int         nchunks;
+    int         found;              /* chunk ready() got, -1 for eof */
+    /* Index 0 */
+    uint32_t    queued;
+    int         cursor;             /* next chunk to look at in get */
+    int         next_owner;
+    uint32_t    last_done;          /* at the previous wait */
+    int64_t     last_result;
+    uint64_t    last_stolen;
+};
+
+static size_t sched_meta(int nclients, int nchunks)
+{
+    size_t size = sizeof(sched_hdr_t) + nclients * sizeof(sched_queue_t) +
+        nchunks * sizeof(sched_desc_t) +
+        (size_t)nclients * nchunks * sizeof(uint32_t);
+
+    return (size + HGSHM_PAGE_SIZE - 1) & ~(size_t)(HGSHM_PAGE_SIZE - 1);
+}
+
+size_t hgshm_sched_size(int nclients, int nchunks, size_t chunk_size)
+{
+    chunk_size = (chunk_size + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    return sched_meta(nclients, nchunks) + nchunks * chunk_size;
+}
+
+static hgshm_sched_t *sched_handle(hgshm_ctx_t *ctx, sched_hdr_t *hdr)
+{
+    hgshm_sched_t *s = calloc(1, sizeof(hgshm_sched_t));
+
+    if (s == NULL)
+        return NULL;
+    s->hdr = hdr;
+    s->queue = (sched_queue_t *)((char *)hdr + hdr->queue_off);
+    s->desc = (sched_desc_t *)((char *)hdr + hdr->desc_off);
+    s->ring = (uint32_t *)((char *)hdr + hdr->ring_off);
+    s->data = (char *)hdr + hdr->data_off;
+    s->ctx = ctx;
+    s->index = hgshm_ctx_get_index(ctx);
+    s->nclients = hdr->nclients;
+    s->nchunks = hdr->nchunks;
+    return s;
+}
+
+hgshm_sched_t *hgshm_sched_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, int nchunks, size_t chunk_size)
+{
+    sched_hdr_t *hdr = mem;
+
+    if (mem == NULL || nclients < 1 || nclients > HGSHM_MAX_CLIENTS ||
+        hgshm_ctx_get_index(ctx) != 0 || chunk_size == 0 ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)))
+        return NULL;
+    chunk_size = (chunk_size + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    if (nchunks == 0)
+        for (nchunks = size / chunk_size; nchunks > 0 &&
+            hgshm_sched_size(nclients, nchunks, chunk_size) > size; )
+            nchunks--;
+    if (nchunks < 1 || hgshm_sched_size(nclients, nchunks, chunk_size) > size)
+        return NULL;
+
+    hdr->magic = 0;
+    __sync_synchronize();
+    hdr->version = HGSHM_SCHED_VERSION;
+    hdr->nclients = nclients;
+    hdr->nchunks = nchunks;
+    hdr->chunk_size = chunk_size;
+    hdr->queue_off = sizeof(sched_hdr_t);
+    hdr->desc_off = hdr->queue_off + nclients * sizeof(sched_queue_t);
+    hdr->ring_off = hdr->desc_off + nchunks * sizeof(sched_desc_t);
+    hdr->data_off = sched_meta(nclients, nchunks);
+    hdr->size = hgshm_sched_size(nclients, nchunks, chunk_size);
+    hdr->eof = 0;
+    memset(&hdr->work, 0, sizeof(hdr->work));
+    memset(&hdr->done, 0, sizeof(hdr->done));
+    hdr->result = 0;
+    hdr->stolen = 0;
+    memset((char *)hdr + hdr->queue_off, 0, hdr->data_off - hdr->queue_off);
+    hgshm_store_release(&hdr->magic, HGSHM_SCHED_MAGIC);
+    return sched_handle(ctx, hdr);
+}
+
+hgshm_sched_t *hgshm_sched_attach(hgshm_ctx_t *ctx, void *mem,
+    int timeout_ms)
+{
+    sched_hdr_t *hdr = mem;
+
+    while (hgshm_load_acquire(&hdr->magic) != HGSHM_SCHED_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    if (hdr->version != HGSHM_SCHED_VERSION) {
+        printf("hgshm: scheduler version %u, expected %d\n", hdr->version,
+            HGSHM_SCHED_VERSION);
+        return NULL;
+    }
+    if (hgshm_ctx_get_index(ctx) >= (int)hdr->nclients) {
+        printf("hgshm: index %d is not in a group of %u\n",
+            hgshm_ctx_get_index(ctx), hdr->nclients);
+        return NULL;
+    }
+    return sched_handle(ctx, hdr);
+}
+
+void hgshm_sched_close(hgshm_sched_t *s)
+{
+    free(s);
+}
+
+size_t hgshm_sched_chunk_size(hgshm_sched_t *s)
+{
+    return s->hdr->chunk_size;
+}
+
+int hgshm_sched_nchunks(hgshm_sched_t *s)
+{
+    return s->nchunks;
+}
+
+static void *sched_chunk(hgshm_sched_t *s, int chunk)
+{
+    return s->data + chunk * s->hdr->chunk_size;
+}
+
+static int sched_has_free(void *arg)
+{
+    hgshm_sched_t *s = arg;
+    int i, c;
+
+    for (i = 0; i < s->nchunks; i++) {
+        c = (s->cursor + i) % s->nchunks;
+        if (hgshm_load_acquire(&s->desc[c].state) == SCHED_FREE) {
+            s->found = c;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *hgshm_sched_get(hgshm_sched_t *s, int *chunk, int timeout_ms)
+{
+    if (hgshm_futex_wait_until(s->ctx, &s->hdr->done, sched_has_free, s,
+        HGSHM_WAIT_BLOCK, timeout_ms, NULL) < 0)
+        return NULL;
+    s->desc[s->found].state = SCHED_BUSY;
+    s->cursor = s->found + 1;
+    *chunk = s->found;
+    return sched_chunk(s, s->found);
+}
+
+void hgshm_sched_put(hgshm_sched_t *s, int chunk, size_t len, int owner)
+{
+    sched_queue_t *q;
+    uint32_t t;
+
+    if (owner < 0) {
+        owner = s->next_owner;
+        s->next_owner = (owner + 1) % s->nclients;
+    }
+    q = &s->queue[owner];
+    s->desc[chunk].owner = owner;
+    s->desc[chunk].len = len;
+    t = q->tail;
+    s->ring[owner * s->nchunks + t % s->nchunks] = chunk;
+    hgshm_store_release(&q->tail, t + 1);
+    s->queued++;
+    __atomic_fetch_add(&s->hdr->work.word, 1, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(s->ctx, &s->hdr->work);
+}
+
+static int sched_all_done(void *arg)
+{
+    hgshm_sched_t *s = arg;
+
+    return __atomic_load_n(&s->hdr->done.word, __ATOMIC_SEQ_CST) ==
+        s->queued;
+}
+
+int hgshm_sched_wait(hgshm_sched_t *s, hgshm_sched_summary_t *sum,
+    int timeout_ms)
+{
+    uint32_t done = s->queued;
+    int64_t result;
+    uint64_t stolen;
+
+    if (hgshm_futex_wait_until(s->ctx, &s->hdr->done, sched_all_done, s,
+        HGSHM_WAIT_BLOCK, timeout_ms, NULL) < 0)
+        return -1;
+    result = __atomic_load_n(&s->hdr->result, __ATOMIC_ACQUIRE);
+    stolen = __atomic_load_n(&s->hdr->stolen, __ATOMIC_ACQUIRE);
+    if (sum) {
+        sum->chunks = done - s->last_done;
+        sum->stolen = stolen - s->last_stolen;
+        sum->result = result - s->last_result;
+    }
+    s->last_done = done;
+    s->last_result = result;
+    s->last_stolen = stolen;
+    return 0;
+}
+
+void hgshm_sched_eof(hgshm_sched_t *s)
+{
+    hgshm_store_release(&s->hdr->eof, 1);
+    __atomic_fetch_add(&s->hdr->work.word, 1, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(s->ctx, &s->hdr->work);
+}
+
+/* Claim the oldest chunk of queue q, -1 if it is empty */
+static int sched_claim(hgshm_sched_t *s, int q)
+{
+    sched_queue_t *qu = &s->queue[q];
+    uint32_t h = __atomic_load_n(&qu->head, __ATOMIC_ACQUIRE), t, c;
+
+    for (;;) {
+        t = hgshm_load_acquire(&qu->tail);
+        if ((int32_t)(t - h) <= 0)
+            return -1;
+        c = s->ring[q * s->nchunks + h % s->nchunks];
+        if (__atomic_compare_exchange_n(&qu->head, &h, h + 1, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return c;
+    }
+}
+
+/* Claims a chunk from any queue, own first; eof only once all are empty */
+static int sched_has_work(void *arg)
+{
+    hgshm_sched_t *s = arg;
+    int i, eof = hgshm_load_acquire(&s->hdr->eof);
+
+    for (i = 0; i < s->nclients; i++) {
+        s->found = sched_claim(s, (s->index + i) % s->nclients);
+        if (s->found >= 0)
+            return 1;
+    }
+    return eof;
+}
+
+void *hgshm_sched_next(hgshm_sched_t *s, int *chunk, size_t *len,
+    int timeout_ms)
+{
+    if (hgshm_futex_wait_until(s->ctx, &s->hdr->work, sched_has_work, s,
+        HGSHM_WAIT_ADAPTIVE, timeout_ms, NULL) < 0 || s->found < 0)
+        return NULL;
+    *chunk = s->found;
+    *len = s->desc[s->found].len;
+    return sched_chunk(s, s->found);
+}
+
+void hgshm_sched_done(hgshm_sched_t *s, int chunk, int64_t result)
+{
+    sched_queue_t *me = &s->queue[s->index];
+
+    me->chunks++;
+    __atomic_fetch_add(&s->hdr->result, result, __ATOMIC_RELAXED);
+    if (s->desc[chunk].owner != (uint32_t)s->index) {
+        me->stolen++;
+        __atomic_fetch_add(&s->hdr->stolen, 1, __ATOMIC_RELAXED);
+    }
+    hgshm_store_release(&s->desc[chunk].state, SCHED_FREE);
+    __atomic_fetch_add(&s->hdr->done.word, 1, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(s->ctx, &s->hdr->done);
+}
+
+void hgshm_sched_client_stats(hgshm_sched_t *s, int client,
+    uint64_t *chunks, uint64_t *stolen)
+{
+    *chunks = hgshm_load_acquire(&s->queue[client].chunks);
+    *stolen = hgshm_load_acquire(&s->queue[client].stolen);
+}
+
+void hgshm_sched_print(hgshm_sched_t *s, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "sched: %d chunks of %lu, %u queued, %u done\n",
+        s->nchunks, s->hdr->chunk_size, s->hdr->work.word - s->hdr->eof,
+        s->hdr->done.word);
+    for (i = 0; i < s->nclients; i++)
+        fprintf(fp, "  %d: %lu chunks, %lu stolen, queue %u\n", i,
+            s->queue[i].chunks, s->queue[i].stolen,
+            s->queue[i].tail - s->queue[i].head);
+}
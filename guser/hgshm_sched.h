@@ -0,0 +1,80 @@
+#ifndef _HGSHM_SCHED_H
+#define _HGSHM_SCHED_H
+/*
+ * Work stealing chunk scheduler.
+ *
+ * Instead of reducer i owning slice i, index 0 cuts the work into chunks
+ * in a pool in slice 0, which every VM maps, and queues each chunk on one
+ * reducer's queue. A reducer takes from its own queue and, when that is
+ * empty, steals from the others, so a slow VM only holds up the chunks
+ * it has actually taken. All claims are a compare and swap on the head
+ * of a queue; index 0 is the only producer.
+ *
+ *	index 0                              index i
+ *	s = hgshm_sched_create(ctx, mem..)   s = hgshm_sched_attach(ctx, mem..)
+ *	buf = hgshm_sched_get(s, &c, -1)     while ((d = hgshm_sched_next(s,
+ *	fill buf                                 &c, &len, -1)) != NULL) {
+ *	hgshm_sched_put(s, c, len, -1)           work on d
+ *	...                                      hgshm_sched_done(s, c, res)
+ *	hgshm_sched_wait(s, &summary, -1)    }
+ *	hgshm_sched_eof(s)
+ *
+ * Reducers and index 0 sleep in hgshm_sync.h futexes when there is
+ * nothing to take or no free chunk, so an idle pool costs no doorbells.
+ * Index 0 may reduce too, through a second handle in another thread.
+ * A handle is used by one thread.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+/* Summary of the chunks completed since the previous hgshm_sched_wait() */
+typedef struct {
+    uint64_t    chunks;
+    uint64_t    stolen;         /* taken from another reducer's queue */
+    int64_t     result;         /* sum of hgshm_sched_done() results */
+} hgshm_sched_summary_t;
+
+typedef struct hgshm_sched hgshm_sched_t;
+
+/* Bytes taken for nchunks chunks of chunk_size, a multiple of a page */
+size_t hgshm_sched_size(int nclients, int nchunks, size_t chunk_size);
+/*
+ * Index 0: format mem (cache line aligned, size bytes). nchunks is the
+ * largest that fits when 0. chunk_size is rounded up to a page.
+ */
+hgshm_sched_t * hgshm_sched_create(hgshm_ctx_t *ctx, void *mem, size_t size,
+    int nclients, int nchunks, size_t chunk_size);
+/* Wait up to timeout_ms for index 0 to format mem */
+hgshm_sched_t * hgshm_sched_attach(hgshm_ctx_t *ctx, void *mem,
+    int timeout_ms);
+void hgshm_sched_close(hgshm_sched_t *s);
+
+size_t hgshm_sched_chunk_size(hgshm_sched_t *s);
+int hgshm_sched_nchunks(hgshm_sched_t *s);
+
+/* Index 0: wait for a free chunk, NULL on timeout */
+void * hgshm_sched_get(hgshm_sched_t *s, int *chunk, int timeout_ms);
+/* Index 0: queue chunk on owner's queue, owner < 0 for round robin */
+void hgshm_sched_put(hgshm_sched_t *s, int chunk, size_t len, int owner);
+/* Index 0: wait until every queued chunk is done, -1 on timeout */
+int hgshm_sched_wait(hgshm_sched_t *s, hgshm_sched_summary_t *sum,
+    int timeout_ms);
+/* Index 0: no more chunks, hgshm_sched_next() returns NULL once drained */
+void hgshm_sched_eof(hgshm_sched_t *s);
+
+/*
+ * Reducers: take a chunk, our own queue first. NULL after eof or on
+ * timeout.
+ */
+void * hgshm_sched_next(hgshm_sched_t *s, int *chunk, size_t *len,
+    int timeout_ms);
+void hgshm_sched_done(hgshm_sched_t *s, int chunk, int64_t result);
+
+/* Chunks a client has completed and how many of them it stole */
+void hgshm_sched_client_stats(hgshm_sched_t *s, int client,
+    uint64_t *chunks, uint64_t *stolen);
+void hgshm_sched_print(hgshm_sched_t *s, FILE *fp);
+#endif /* _HGSHM_SCHED_H */
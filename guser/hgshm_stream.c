@@ -0,0 +1,288 @@
+/*
+ * Segment streams, see hgshm_stream.h.
+ *
+ * The shared state is two counters, each a futex word written by one
+ * side: committed by the producer, taken by the consumer. Both are the
+ * low 32 bits of the side's 64 bit segment count; each handle keeps its
+ * own 64 bit count and the other side is never more than the ring away,
+ * so the difference of the low bits is the real distance. Segment n is
+ * slot n % nsegs. The consumer holds the last window segments it took,
+ * so the producer may reuse slots up to taken - window + nsegs.
+ *
+ * The producer writes the data and len[slot], then committed with
+ * release ordering; the consumer reads committed with acquire ordering
+ * before the data. A side that has to wait spins a little, unless the
+ * policy is HGSHM_WAIT_BLOCK, then sleeps on the other side's futex.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_sync.h"
+#include "hgshm_stream.h"
+
+#define HGSHM_STREAM_MAGIC  0x48475354  /* "HGST" */
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    nsegs;
+    uint32_t    window;
+    uint32_t    pad;
+    uint64_t    seg_size;
+    uint64_t    seg_off;            /* segment 0, from the header */
+    hgshm_futex_t committed;        /* producer */
+    hgshm_futex_t taken;            /* consumer */
+    uint64_t    len[HGSHM_STREAM_MAX_SEGS] __attribute__((aligned(64)));
+} stream_hdr_t;
+
+struct hgshm_stream {
+    stream_hdr_t *hdr;
+    hgshm_ctx_t *ctx;
+    int         policy;
+    uint64_t    seq;                /* next segment to reserve or take */
+    int         eof;                /* consumer took the empty segment */
+    /* Stats */
+    uint64_t    segs;
+    uint64_t    bytes;
+    hgshm_futex_stats_t stats;
+};
+
+static char *stream_seg(hgshm_stream_t *s, uint64_t seq)
+{
+    return (char *)s->hdr + s->hdr->seg_off +
+        (seq % s->hdr->nsegs) * s->hdr->seg_size;
+}
+
+/* The other side's count, as a 64 bit number near ours */
+static uint64_t stream_count(hgshm_stream_t *s, hgshm_futex_t *f)
+{
+    uint32_t word = __atomic_load_n(&f->word, __ATOMIC_SEQ_CST);
+
+    if (f == &s->hdr->taken)
+        return s->seq - (uint32_t)((uint32_t)s->seq - word);
+    return s->seq + (uint32_t)(word - (uint32_t)s->seq);
+}
+
+/* Slots free for the producer, from the consumer's taken count */
+static uint64_t stream_room(hgshm_stream_t *s)
+{
+    uint64_t taken = stream_count(s, &s->hdr->taken);
+    uint64_t freed = (taken > s->hdr->window) ? taken - s->hdr->window : 0;
+
+    return s->hdr->nsegs - (s->seq - freed);
+}
+
+static hgshm_stream_t *stream_handle(hgshm_ctx_t *ctx, stream_hdr_t *hdr,
+    int policy)
+{
+    hgshm_stream_t *s = calloc(1, sizeof(hgshm_stream_t));
+
+    if (s == NULL)
+        return NULL;
+    s->hdr = hdr;
+    s->ctx = ctx;
+    s->policy = policy;
+    return s;
+}
+
+hgshm_stream_t *hgshm_stream_create(hgshm_ctx_t *ctx, void *mem,
+    size_t size, size_t seg_size, int window, int policy)
+{
+    stream_hdr_t *hdr = mem;
+    size_t off = (sizeof(stream_hdr_t) + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    size_t nsegs;
+
+    seg_size = (seg_size + HGSHM_PAGE_SIZE - 1) &
+        ~(size_t)(HGSHM_PAGE_SIZE - 1);
+    if (mem == NULL || seg_size == 0 || window < 1 || size < off ||
+        ((uintptr_t)mem & (HGSHM_CACHELINE - 1)))
+        return NULL;
+    nsegs = (size - off) / seg_size;
+    if (nsegs > HGSHM_STREAM_MAX_SEGS)
+        nsegs = HGSHM_STREAM_MAX_SEGS;
+    if (nsegs <= (size_t)window)
+        return NULL;
+
+    hdr->magic = 0;
+    __sync_synchronize();
+    hdr->nsegs = nsegs;
+    hdr->window = window;
+    hdr->seg_size = seg_size;
+    hdr->seg_off = off;
+    hdr->committed.word = 0;
+    hdr->committed.waiters = 0;
+    hdr->taken.word = 0;
+    hdr->taken.waiters = 0;
+    hgshm_store_release(&hdr->magic, HGSHM_STREAM_MAGIC);
+    return stream_handle(ctx, hdr, policy);
+}
+
+hgshm_stream_t *hgshm_stream_attach(hgshm_ctx_t *ctx, void *mem,
+    int policy, int timeout_ms)
+{
+    stream_hdr_t *hdr = mem;
+
+    while (hgshm_load_acquire(&hdr->magic) != HGSHM_STREAM_MAGIC) {
+        if (timeout_ms == 0)
+            return NULL;
+        usleep(1000);
+        if (timeout_ms > 0)
+            timeout_ms--;
+    }
+    return stream_handle(ctx, hdr, policy);
+}
+
+void hgshm_stream_close(hgshm_stream_t *s)
+{
+    free(s);
+}
+
+size_t hgshm_stream_seg_size(hgshm_stream_t *s)
+{
+    return s->hdr->seg_size;
+}
+
+int hgshm_stream_nsegs(hgshm_stream_t *s)
+{
+    return s->hdr->nsegs;
+}
+
+int hgshm_stream_window_size(hgshm_stream_t *s)
+{
+    return s->hdr->window;
+}
+
+static int stream_has_room(void *arg)
+{
+    hgshm_stream_t *s = arg;
+
+    return stream_room(s) > 0;
+}
+
+void *hgshm_stream_reserve(hgshm_stream_t *s, uint64_t *seq,
+    int timeout_ms)
+{
+    if (hgshm_futex_wait_until(s->ctx, &s->hdr->taken, stream_has_room, s,
+        s->policy, timeout_ms, &s->stats) < 0)
+        return NULL;
+    *seq = s->seq++;
+    return stream_seg(s, *seq);
+}
+
+void hgshm_stream_commit(hgshm_stream_t *s, uint64_t seq, size_t len)
+{
+    s->hdr->len[seq % s->hdr->nsegs] = len;
+    __atomic_store_n(&s->hdr->committed.word, (uint32_t)(seq + 1),
+        __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(s->ctx, &s->hdr->committed);
+    s->segs++;
+    s->bytes += len;
+}
+
+int hgshm_stream_free(hgshm_stream_t *s)
+{
+    return stream_room(s);
+}
+
+int hgshm_stream_eof(hgshm_stream_t *s, int timeout_ms)
+{
+    uint64_t seq;
+
+    if (hgshm_stream_reserve(s, &seq, timeout_ms) == NULL)
+        return -1;
+    hgshm_stream_commit(s, seq, 0);
+    s->segs--;
+    return 0;
+}
+
+static int stream_all_taken(void *arg)
+{
+    hgshm_stream_t *s = arg;
+
+    return stream_count(s, &s->hdr->taken) == s->seq;
+}
+
+int hgshm_stream_drain(hgshm_stream_t *s, int timeout_ms)
+{
+    return hgshm_futex_wait_until(s->ctx, &s->hdr->taken,
+        stream_all_taken, s, s->policy, timeout_ms, &s->stats);
+}
+
+static int stream_has_next(void *arg)
+{
+    hgshm_stream_t *s = arg;
+
+    return stream_count(s, &s->hdr->committed) > s->seq;
+}
+
+void *hgshm_stream_next(hgshm_stream_t *s, uint64_t *seq, size_t *len,
+    int timeout_ms)
+{
+    uint64_t n = s->seq;
+
+    if (s->eof) {
+        *seq = n - 1;
+        *len = 0;
+        return stream_seg(s, n - 1);
+    }
+    if (hgshm_futex_wait_until(s->ctx, &s->hdr->committed,
+        stream_has_next, s, s->policy, timeout_ms, &s->stats) < 0)
+        return NULL;
+    *seq = n;
+    *len = s->hdr->len[n % s->hdr->nsegs];
+    s->seq++;
+    if (*len == 0)
+        s->eof = 1;
+    s->segs += !s->eof;
+    s->bytes += *len;
+    /* Frees n - window, wakes a producer waiting for room or a drain */
+    __atomic_store_n(&s->hdr->taken.word, (uint32_t)s->seq,
+        __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(s->ctx, &s->hdr->taken);
+    return stream_seg(s, n);
+}
+
+/* Segments the consumer holds, the empty one at the end is not data */
+static uint64_t stream_held(hgshm_stream_t *s)
+{
+    uint64_t taken = s->seq - s->eof;
+
+    return (taken < s->hdr->window) ? taken : s->hdr->window;
+}
+
+void *hgshm_stream_get(hgshm_stream_t *s, uint64_t seq, size_t *len)
+{
+    uint64_t last = s->seq - s->eof;
+
+    if (seq >= last || last - seq > stream_held(s))
+        return NULL;
+    *len = s->hdr->len[seq % s->hdr->nsegs];
+    return stream_seg(s, seq);
+}
+
+int hgshm_stream_window(hgshm_stream_t *s, void **data, size_t *len,
+    int max, uint64_t *last)
+{
+    uint64_t held = stream_held(s), end = s->seq - s->eof, seq;
+    int i = 0;
+
+    if (held > (uint64_t)max)
+        held = max;
+    for (seq = end - held; seq < end; seq++, i++) {
+        data[i] = stream_seg(s, seq);
+        len[i] = s->hdr->len[seq % s->hdr->nsegs];
+    }
+    if (last)
+        *last = end - 1;
+    return i;
+}
+
+void hgshm_stream_print_stats(hgshm_stream_t *s, FILE *fp)
+{
+    fprintf(fp, "stream: %lu segments, %lu bytes, %d x %lu, window %u, "
+        "%lu waits, %lu sleeps\n", s->segs, s->bytes, s->hdr->nsegs,
+        s->hdr->seg_size, s->hdr->window, s->stats.waits, s->stats.sleeps);
+}
@@ -0,0 +1,90 @@
+#ifndef _HGSHM_STREAM_H
+#define _HGSHM_STREAM_H
+/*
+ * Unbounded streams of segments through a slice.
+ *
+ * A stream splits a slice into a ring of fixed size segments that one
+ * producer fills and one consumer reads, forever: both sides keep 64 bit
+ * segment numbers and the ring is set up once, so there is no per round
+ * setup and no round at all. Unlike a pipe, the consumer keeps the last
+ * window segments it took instead of giving each one back when it is
+ * done: taking segment N frees segment N - window, so the consumer can
+ * look at the last window segments at any time (moving averages, frame
+ * differences, reassembling records cut at a segment boundary).
+ *
+ * When the consumer falls behind the ring fills up and the producer
+ * blocks in hgshm_stream_reserve(), or gets NULL with a timeout of 0 and
+ * may drop or send the data elsewhere. Both sides sleep in hgshm_sync.h
+ * futexes, so a busy stream rings no doorbells.
+ *
+ *	producer                             consumer
+ *	s = hgshm_stream_create(ctx, mem..)  s = hgshm_stream_attach(ctx, mem..)
+ *	for (;;) {                           while ((d = hgshm_stream_next(s,
+ *	    d = hgshm_stream_reserve(s,          &seq, &len, -1)) && len) {
+ *	        &seq, -1)                        work on d, and on
+ *	    fill d                               hgshm_stream_window(s, ..)
+ *	    hgshm_stream_commit(s, seq, len) }
+ *	}
+ *
+ * Segments are committed in the order they were reserved. A handle is
+ * used by one thread.
+ */
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_STREAM_MAX_SEGS   256
+
+typedef struct hgshm_stream hgshm_stream_t;
+
+/*
+ * Producer side: format mem (page aligned, size bytes) as a ring of
+ * seg_size (rounded up to a page) segments, as many as fit, of which the
+ * consumer keeps window. NULL unless at least window + 1 fit.
+ */
+hgshm_stream_t * hgshm_stream_create(hgshm_ctx_t *ctx, void *mem,
+    size_t size, size_t seg_size, int window, int policy);
+/* Consumer side: wait up to timeout_ms for the producer to format mem */
+hgshm_stream_t * hgshm_stream_attach(hgshm_ctx_t *ctx, void *mem,
+    int policy, int timeout_ms);
+/* Frees the handle, not the shared state */
+void hgshm_stream_close(hgshm_stream_t *s);
+
+size_t hgshm_stream_seg_size(hgshm_stream_t *s);
+int hgshm_stream_nsegs(hgshm_stream_t *s);
+int hgshm_stream_window_size(hgshm_stream_t *s);
+
+/*
+ * Producer: wait for a free segment. Returns its address and number in
+ * *seq, NULL on timeout (the ring is full, the consumer is behind).
+ */
+void * hgshm_stream_reserve(hgshm_stream_t *s, uint64_t *seq,
+    int timeout_ms);
+void hgshm_stream_commit(hgshm_stream_t *s, uint64_t seq, size_t len);
+/* Segments hgshm_stream_reserve() could hand out without waiting */
+int hgshm_stream_free(hgshm_stream_t *s);
+/* Producer: an empty segment, the end of the stream */
+int hgshm_stream_eof(hgshm_stream_t *s, int timeout_ms);
+/* Producer: wait until the consumer has taken every committed segment */
+int hgshm_stream_drain(hgshm_stream_t *s, int timeout_ms);
+
+/*
+ * Consumer: wait for the next segment and take it. The segment that
+ * falls out of the window goes back to the producer. len 0 is the end.
+ */
+void * hgshm_stream_next(hgshm_stream_t *s, uint64_t *seq, size_t *len,
+    int timeout_ms);
+/* Consumer: a segment in the window, NULL if it is not there any more */
+void * hgshm_stream_get(hgshm_stream_t *s, uint64_t seq, size_t *len);
+/*
+ * Consumer: the segments in the window, oldest first, at most max of
+ * them. Returns how many, the number of the last one is in *last.
+ */
+int hgshm_stream_window(hgshm_stream_t *s, void **data, size_t *len,
+    int max, uint64_t *last);
+
+/* Segments, bytes and how often this end had to wait */
+void hgshm_stream_print_stats(hgshm_stream_t *s, FILE *fp);
+#endif /* _HGSHM_STREAM_H */
@@ -0,0 +1,235 @@
+/*
+ * Futex like word, mutex, condition variable and semaphore, see
+ * hgshm_sync.h.
+ *
+ * Waiter:                        Waker:
+ *	waiters |= bit (seq_cst)        change word (seq_cst)
+ *	if word != val: return          mask = waiters (seq_cst), 0: return
+ *	sleep                           mask = xchg(waiters, 0), ring mask
+ *
+ * Either the waiter sees the new word or the waker sees its bit. The
+ * waiter takes its hgshm_ctx_wait() cookie before setting the bit, so a
+ * doorbell that arrives before it sleeps still wakes it. A bit left
+ * behind by a waiter that timed out costs one spurious doorbell.
+ *
+ * hgshm_futex_wait_until() reads f->word before the condition, so a
+ * change in between makes the sleep return at once.
+ *
+ * The mutex is the three state futex mutex: unlock only wakes when the
+ * word was 2, and a thread that slept takes the lock with 2 so the next
+ * unlock wakes whoever else may be waiting.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+#include "hgshm_sync.h"
+
+uint64_t hgshm_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Time left of a timeout started at start, -1 for forever */
+int hgshm_remain_ms(int timeout_ms, uint64_t start)
+{
+    uint64_t t;
+
+    if (timeout_ms < 0)
+        return -1;
+    t = hgshm_now_ms() - start;
+    return (t >= (uint64_t)timeout_ms) ? 0 : timeout_ms - (int)t;
+}
+
+int hgshm_futex_wait(hgshm_ctx_t *ctx, hgshm_futex_t *f, uint32_t val,
+    int timeout_ms)
+{
+    uint64_t seen = hgshm_ctx_events(ctx);
+    uint64_t bit = 1ULL << hgshm_ctx_get_index(ctx);
+
+    if (hgshm_load_acquire(&f->word) != val)
+        return 0;
+    __atomic_fetch_or(&f->waiters, bit, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&f->word, __ATOMIC_SEQ_CST) != val)
+        return 0;
+    if (timeout_ms == 0)
+        return -1;
+    return hgshm_ctx_wait(ctx, &seen, timeout_ms);
+}
+
+int hgshm_futex_wake(hgshm_ctx_t *ctx, hgshm_futex_t *f)
+{
+    uint64_t mask;
+    int i, n = 0;
+
+    if (__atomic_load_n(&f->waiters, __ATOMIC_SEQ_CST) == 0)
+        return 0;
+    mask = __atomic_exchange_n(&f->waiters, 0, __ATOMIC_SEQ_CST);
+    while (mask) {
+        i = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if (hgshm_ctx_notify(ctx, i) < 0)
+            printf("hgshm: could not wake index %d\n", i);
+        else
+            n++;
+    }
+    return n;
+}
+
+int hgshm_futex_wait_until(hgshm_ctx_t *ctx, hgshm_futex_t *f,
+    int (*ready)(void *), void *arg, int policy, int timeout_ms,
+    hgshm_futex_stats_t *stats)
+{
+    uint64_t start = (timeout_ms > 0) ? hgshm_now_ms() : 0;
+    int spin = (policy == HGSHM_WAIT_BLOCK) ? 0 : HGSHM_SYNC_SPIN;
+    uint32_t seen, i = 0;
+    int remain;
+
+    if (ready(arg))
+        return 0;
+    if (stats)
+        stats->waits++;
+    if (timeout_ms == 0)
+        return -1;
+    for (;;) {
+        seen = __atomic_load_n(&f->word, __ATOMIC_SEQ_CST);
+        if (ready(arg))
+            return 0;
+        if (i < (uint32_t)spin || policy == HGSHM_WAIT_POLL) {
+            hgshm_cpu_relax();
+            if ((++i & 1023) == 0 && timeout_ms >= 0 &&
+                hgshm_remain_ms(timeout_ms, start) == 0)
+                return -1;
+            continue;
+        }
+        remain = hgshm_remain_ms(timeout_ms, start);
+        if (remain == 0)
+            return -1;
+        if (stats)
+            stats->sleeps++;
+        if (hgshm_futex_wait(ctx, f, seen, remain) < 0)
+            return -1;
+    }
+}
+
+void hgshm_mutex_init(hgshm_mutex_t *m)
+{
+    m->f.word = 0;
+    m->f.waiters = 0;
+}
+
+void hgshm_mutex_lock(hgshm_ctx_t *ctx, hgshm_mutex_t *m)
+{
+    uint32_t c;
+    int i;
+
+    for (i = 0; i < HGSHM_SYNC_SPIN; i++) {
+        c = 0;
+        if (__atomic_compare_exchange_n(&m->f.word, &c, 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        if (c == 2)
+            break;
+        hgshm_cpu_relax();
+    }
+    while (__atomic_exchange_n(&m->f.word, 2, __ATOMIC_ACQUIRE) != 0)
+        hgshm_futex_wait(ctx, &m->f, 2, -1);
+}
+
+int hgshm_mutex_trylock(hgshm_mutex_t *m)
+{
+    uint32_t c = 0;
+
+    return __atomic_compare_exchange_n(&m->f.word, &c, 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+void hgshm_mutex_unlock(hgshm_ctx_t *ctx, hgshm_mutex_t *m)
+{
+    if (__atomic_exchange_n(&m->f.word, 0, __ATOMIC_SEQ_CST) == 2)
+        hgshm_futex_wake(ctx, &m->f);
+}
+
+void hgshm_cond_init(hgshm_cond_t *c)
+{
+    c->f.word = 0;
+    c->f.waiters = 0;
+}
+
+int hgshm_cond_wait(hgshm_ctx_t *ctx, hgshm_cond_t *c, hgshm_mutex_t *m,
+    int timeout_ms)
+{
+    uint32_t seq = hgshm_load_acquire(&c->f.word);
+    int rc;
+
+    hgshm_mutex_unlock(ctx, m);
+    rc = hgshm_futex_wait(ctx, &c->f, seq, timeout_ms);
+    /* Others may be queued behind us, take it contended */
+    while (__atomic_exchange_n(&m->f.word, 2, __ATOMIC_ACQUIRE) != 0)
+        hgshm_futex_wait(ctx, &m->f, 2, -1);
+    return rc;
+}
+
+void hgshm_cond_signal(hgshm_ctx_t *ctx, hgshm_cond_t *c)
+{
+    __atomic_fetch_add(&c->f.word, 1, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(ctx, &c->f);
+}
+
+void hgshm_cond_broadcast(hgshm_ctx_t *ctx, hgshm_cond_t *c)
+{
+    hgshm_cond_signal(ctx, c);
+}
+
+void hgshm_sem_init(hgshm_sem_t *s, uint32_t value)
+{
+    s->f.word = value;
+    s->f.waiters = 0;
+}
+
+int hgshm_sem_trywait(hgshm_sem_t *s)
+{
+    uint32_t v = __atomic_load_n(&s->f.word, __ATOMIC_RELAXED);
+
+    while (v > 0)
+        if (__atomic_compare_exchange_n(&s->f.word, &v, v - 1, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 0;
+    return -1;
+}
+
+int hgshm_sem_wait(hgshm_ctx_t *ctx, hgshm_sem_t *s, int timeout_ms)
+{
+    uint64_t start = 0;
+    int i, remain;
+
+    for (i = 0; i < HGSHM_SYNC_SPIN; i++) {
+        if (hgshm_sem_trywait(s) == 0)
+            return 0;
+        hgshm_cpu_relax();
+    }
+    if (timeout_ms > 0)
+        start = hgshm_now_ms();
+    for (;;) {
+        if (hgshm_sem_trywait(s) == 0)
+            return 0;
+        remain = hgshm_remain_ms(timeout_ms, start);
+        if (remain == 0 || hgshm_futex_wait(ctx, &s->f, 0, remain) < 0)
+            return (hgshm_sem_trywait(s) == 0) ? 0 : -1;
+    }
+}
+
+void hgshm_sem_post(hgshm_ctx_t *ctx, hgshm_sem_t *s)
+{
+    __atomic_fetch_add(&s->f.word, 1, __ATOMIC_SEQ_CST);
+    hgshm_futex_wake(ctx, &s->f);
+}
+
+uint32_t hgshm_sem_value(hgshm_sem_t *s)
+{
+    return hgshm_load_acquire(&s->f.word);
+}
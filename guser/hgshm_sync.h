@@ -0,0 +1,101 @@
+#ifndef _HGSHM_SYNC_H
+#define _HGSHM_SYNC_H
+/*
+ * Blocking synchronization between VMs.
+ *
+ * hgshm_futex_t is a 32 bit word in shared memory plus a mask of the VMs
+ * that have a thread asleep on it. A waiter sets its VM's bit, checks
+ * the word once more and sleeps in hgshm_ctx_wait() until a doorbell.
+ * A waker changes the word, takes the mask and rings only those VMs;
+ * an uncontended wake is one load. Wakeups are per VM, so every thread
+ * of a woken VM rechecks its word, and all of them may return early:
+ * callers loop like they would on futex(2).
+ *
+ * Mutex, condition variable and counting semaphore are built on it. All
+ * of them may live anywhere in memory every user maps (slice 0 for all
+ * VMs) and are zero when free/empty, so a formatted slice needs no init
+ * beyond memset. Every call takes the caller's context, used for its
+ * VM index, the doorbells and the sleep. A non-zero VM can only wake
+ * another non-zero VM through the relay, see hgshm_ctx_set_relay().
+ */
+#include <stdint.h>
+
+#include "hgshm.h"
+
+/* Pause loops a lock or semaphore spins before it sleeps */
+#define HGSHM_SYNC_SPIN     1000
+
+typedef struct {
+    uint32_t    word;
+    uint32_t    pad;
+    uint64_t    waiters;        /* bit per VM index */
+} __attribute__((aligned(64))) hgshm_futex_t;
+
+/*
+ * Sleep while f->word == val, at most timeout_ms (< 0 forever). Returns
+ * 0 when woken, the word changed or on a spurious wakeup, -1 on timeout.
+ */
+int hgshm_futex_wait(hgshm_ctx_t *ctx, hgshm_futex_t *f, uint32_t val,
+    int timeout_ms);
+/*
+ * Call after changing f->word with a sequentially consistent atomic.
+ * Returns the number of VMs rung.
+ */
+int hgshm_futex_wake(hgshm_ctx_t *ctx, hgshm_futex_t *f);
+
+typedef struct {
+    uint64_t    waits;          /* ready() was false on entry */
+    uint64_t    sleeps;         /* hgshm_futex_wait() calls */
+} hgshm_futex_stats_t;
+
+/*
+ * Wait until ready(arg), sleeping on f, whose word the other side bumps
+ * (then hgshm_futex_wake) whenever ready() may have become true. policy
+ * is an HGSHM_WAIT_* of hgshm_wait.h: POLL never sleeps, ADAPTIVE
+ * spins HGSHM_SYNC_SPIN pauses first, BLOCK sleeps right away. stats
+ * may be NULL. Returns 0, -1 on timeout.
+ */
+int hgshm_futex_wait_until(hgshm_ctx_t *ctx, hgshm_futex_t *f,
+    int (*ready)(void *), void *arg, int policy, int timeout_ms,
+    hgshm_futex_stats_t *stats);
+
+/* word: 0 unlocked, 1 locked, 2 locked and maybe contended */
+typedef struct {
+    hgshm_futex_t f;
+} hgshm_mutex_t;
+
+void hgshm_mutex_init(hgshm_mutex_t *m);
+void hgshm_mutex_lock(hgshm_ctx_t *ctx, hgshm_mutex_t *m);
+/* 0 if taken, -1 if held */
+int hgshm_mutex_trylock(hgshm_mutex_t *m);
+void hgshm_mutex_unlock(hgshm_ctx_t *ctx, hgshm_mutex_t *m);
+
+/*
+ * word: sequence bumped by signal and broadcast. Signal wakes the VMs
+ * with waiters like broadcast does, which condition variable users have
+ * to cope with anyway (spurious wakeups).
+ */
+typedef struct {
+    hgshm_futex_t f;
+} hgshm_cond_t;
+
+void hgshm_cond_init(hgshm_cond_t *c);
+/* Returns with m held again, -1 on timeout */
+int hgshm_cond_wait(hgshm_ctx_t *ctx, hgshm_cond_t *c, hgshm_mutex_t *m,
+    int timeout_ms);
+void hgshm_cond_signal(hgshm_ctx_t *ctx, hgshm_cond_t *c);
+void hgshm_cond_broadcast(hgshm_ctx_t *ctx, hgshm_cond_t *c);
+
+/* word: count */
+typedef struct {
+    hgshm_futex_t f;
+} hgshm_sem_t;
+
+void hgshm_sem_init(hgshm_sem_t *s, uint32_t value);
+/* Take one, waiting up to timeout_ms. -1 on timeout */
+int hgshm_sem_wait(hgshm_ctx_t *ctx, hgshm_sem_t *s, int timeout_ms);
+/* 0 if taken, -1 if the count is 0 */
+int hgshm_sem_trywait(hgshm_sem_t *s);
+void hgshm_sem_post(hgshm_ctx_t *ctx, hgshm_sem_t *s);
+uint32_t hgshm_sem_value(hgshm_sem_t *s);
+#endif /* _HGSHM_SYNC_H */
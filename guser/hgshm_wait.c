@@ -0,0 +1,296 @@
+/*
+ * Spin then block waiting, see hgshm_wait.h.
+ *
+ * The spin phase checks the clock every few iterations only. When
+ * waiting on a word and the CPU has WAITPKG, umonitor/umwait parks the
+ * core in a light sleep state until the line is written instead of
+ * spinning on pause.
+ *
+ * Self tuning: every completed wait reports how long it took. A wait that
+ * would have fitted in HGSHM_SPIN_MAX_NS pulls the window towards twice
+ * its duration, a longer one pulls it towards HGSHM_SPIN_MIN_NS, so the
+ * window grows while events come back to back and collapses when the
+ * channel goes idle.
+ *
+ * Sleepers: the waiter increments the shared count, then reads the
+ * condition; the notifier writes the condition, then reads the count,
+ * each with a full barrier in between. One of them sees the other, so
+ * either the waiter does not sleep or the notifier rings.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#include "hgshm_int.h"
+#include "hgshm_wait.h"
+
+#define HGSHM_SPIN_MIN_NS       1000
+#define HGSHM_SPIN_MAX_NS       200000
+#define HGSHM_SPIN_DEFAULT_NS   20000
+#define HGSHM_SPIN_CHECK        16          /* iterations per clock read */
+#define HGSHM_UMWAIT_CYCLES     10000       /* umwait deadline per round */
+
+typedef struct {
+    volatile uint32_t *word;
+    uint32_t    val;
+} word_arg_t;
+
+static int have_waitpkg = -1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cpu_has_waitpkg(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (have_waitpkg < 0)
+        have_waitpkg = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+            (ecx & (1 << 5));
+    return have_waitpkg;
+}
+
+__attribute__((target("waitpkg")))
+static void umwait_word(volatile uint32_t *word, uint32_t val)
+{
+    _umonitor((void *)word);
+    if (*word != val)
+        _umwait(0, __rdtsc() + HGSHM_UMWAIT_CYCLES);
+}
+
+void hgshm_chan_init(hgshm_chan_t *ch, hgshm_ctx_t *ctx, int policy,
+    uint32_t spin_us)
+{
+    bzero(ch, sizeof(*ch));
+    ch->ctx = ctx;
+    ch->policy = (ctx == NULL) ? HGSHM_WAIT_POLL : policy;
+    ch->min_ns = HGSHM_SPIN_MIN_NS;
+    ch->max_ns = HGSHM_SPIN_MAX_NS;
+    ch->tune = (spin_us == 0);
+    ch->window_ns = ch->tune ? HGSHM_SPIN_DEFAULT_NS : spin_us * 1000;
+}
+
+void hgshm_chan_set_sleepers(hgshm_chan_t *ch, volatile uint32_t *sleepers)
+{
+    ch->sleepers = sleepers;
+}
+
+int hgshm_chan_notify(hgshm_ctx_t *ctx, volatile uint32_t *sleepers,
+    int index)
+{
+    if (sleepers) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(sleepers, __ATOMIC_RELAXED) == 0)
+            return 0;
+    }
+    return hgshm_ctx_notify(ctx, index);
+}
+
+static void chan_sleep(hgshm_chan_t *ch)
+{
+    if (ch->sleepers)
+        __atomic_add_fetch(ch->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void chan_wake(hgshm_chan_t *ch)
+{
+    if (ch->sleepers)
+        __atomic_sub_fetch(ch->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void chan_tune(hgshm_chan_t *ch, uint64_t waited)
+{
+    uint64_t target;
+
+    if (!ch->tune)
+        return;
+    if (waited <= ch->max_ns)
+        target = (2 * waited > ch->max_ns) ? ch->max_ns : 2 * waited;
+    else
+        target = ch->min_ns;
+    if (target < ch->min_ns)
+        target = ch->min_ns;
+    ch->window_ns = (3 * (uint64_t)ch->window_ns + target) / 4;
+}
+
+/* Returns 1 if the condition came true in the window */
+static int chan_spin(int (*ready)(void *), void *arg, word_arg_t *w,
+    uint64_t start, uint64_t window)
+{
+    int umwait = (w != NULL) && cpu_has_waitpkg();
+    uint64_t t;
+    int i;
+
+    for (;;) {
+        for (i = 0; i < HGSHM_SPIN_CHECK; i++) {
+            if (ready(arg))
+                return 1;
+            if (umwait)
+                umwait_word(w->word, w->val);
+            else
+                hgshm_cpu_relax();
+        }
+        t = now_ns();
+        if (t - start >= window)
+            return ready(arg);
+    }
+}
+
+static int chan_wait(hgshm_chan_t *ch, int (*ready)(void *), void *arg,
+    word_arg_t *w, int timeout_ms)
+{
+    uint64_t start, spun, window, limit, t;
+    int remain, woke;
+
+    if (ready(arg)) {
+        ch->stats.immediate++;
+        return 0;
+    }
+    start = now_ns();
+    limit = (timeout_ms < 0) ? UINT64_MAX : (uint64_t)timeout_ms * 1000000;
+
+    switch (ch->policy) {
+    case HGSHM_WAIT_POLL:
+        window = limit;
+        break;
+    case HGSHM_WAIT_BLOCK:
+        window = 0;
+        break;
+    default:
+        window = (ch->window_ns < limit) ? ch->window_ns : limit;
+        break;
+    }
+
+    if (window && chan_spin(ready, arg, w, start, window)) {
+        spun = now_ns() - start;
+        ch->stats.spin_wakeups++;
+        ch->stats.spin_ns += spun;
+        chan_tune(ch, spun);
+        return 0;
+    }
+    spun = now_ns() - start;
+    ch->stats.spin_ns += spun;
+    if (ch->policy == HGSHM_WAIT_POLL || spun >= limit) {
+        ch->stats.timeouts++;
+        return -1;
+    }
+
+    /*
+     * Block. Count ourselves in and look once more, a notifier that came
+     * before may have skipped the doorbell. ch->seen is carried over from
+     * the previous wait, so a notify that came after the condition was
+     * last checked wakes us right away.
+     */
+    chan_sleep(ch);
+    for (woke = ready(arg); !woke; ) {
+        t = now_ns() - start;
+        if (timeout_ms < 0)
+            remain = -1;
+        else if (t >= limit)
+            remain = 0;
+        else
+            remain = (limit - t + 999999) / 1000000;
+        if (remain == 0 || hgshm_ctx_wait(ch->ctx, &ch->seen, remain) < 0) {
+            if (ready(arg))
+                break;
+            chan_wake(ch);
+            ch->stats.block_ns += now_ns() - start - spun;
+            ch->stats.timeouts++;
+            return -1;
+        }
+        if (!(woke = ready(arg)))
+            ch->stats.spurious++;
+    }
+    chan_wake(ch);
+    t = now_ns() - start;
+    ch->stats.block_wakeups++;
+    ch->stats.block_ns += t - spun;
+    chan_tune(ch, t);
+    return 0;
+}
+
+int hgshm_chan_wait(hgshm_chan_t *ch, int (*ready)(void *), void *arg,
+    int timeout_ms)
+{
+    return chan_wait(ch, ready, arg, NULL, timeout_ms);
+}
+
+static int word_ready(void *arg)
+{
+    word_arg_t *w = arg;
+
+    return hgshm_load_acquire(w->word) == w->val;
+}
+
+int hgshm_chan_wait_word(hgshm_chan_t *ch, volatile uint32_t *word,
+    uint32_t val, int timeout_ms)
+{
+    word_arg_t w;
+
+    w.word = word;
+    w.val = val;
+    return chan_wait(ch, word_ready, &w, &w, timeout_ms);
+}
+
+void hgshm_chan_print_stats(hgshm_chan_t *ch, FILE *fp)
+{
+    hgshm_wait_stats_t *s = &ch->stats;
+
+    fprintf(fp, "wait %s: immediate %llu spin %llu block %llu spurious %llu "
+        "timeouts %llu spin_ms %llu block_ms %llu window_us %u\n",
+        hgshm_wait_policy_name(ch->policy),
+        (unsigned long long)s->immediate,
+        (unsigned long long)s->spin_wakeups,
+        (unsigned long long)s->block_wakeups,
+        (unsigned long long)s->spurious,
+        (unsigned long long)s->timeouts,
+        (unsigned long long)s->spin_ns / 1000000,
+        (unsigned long long)s->block_ns / 1000000,
+        ch->window_ns / 1000);
+}
+
+static const char *policy_names[] = {
+    [HGSHM_WAIT_ADAPTIVE] = "adaptive",
+    [HGSHM_WAIT_POLL] = "poll",
+    [HGSHM_WAIT_BLOCK] = "block",
+};
+
+int hgshm_wait_policy(const char *name)
+{
+    int i;
+
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+        if (strcmp(name, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+int hgshm_wait_policy_env(void)
+{
+    const char *env = getenv(HGSHM_WAIT_ENV);
+    int policy;
+
+    if (env == NULL)
+        return HGSHM_WAIT_ADAPTIVE;
+    if ((policy = hgshm_wait_policy(env)) < 0) {
+        fprintf(stderr, "hgshm: unknown %s '%s', using adaptive\n",
+            HGSHM_WAIT_ENV, env);
+        return HGSHM_WAIT_ADAPTIVE;
+    }
+    return policy;
+}
+
+const char *hgshm_wait_policy_name(int policy)
+{
+    if (policy < 0 || policy > HGSHM_WAIT_BLOCK)
+        return "unknown";
+    return policy_names[policy];
+}
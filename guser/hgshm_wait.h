@@ -0,0 +1,93 @@
+#ifndef _HGSHM_WAIT_H
+#define _HGSHM_WAIT_H
+/*
+ * Waiting for a condition in shared memory.
+ *
+ * A channel is one waiter's view of a context. hgshm_chan_wait() spins
+ * on the condition for a while, with pause or umwait, then blocks in
+ * hgshm_ctx_wait() until the other side notifies. The policy is chosen
+ * at run time:
+ *
+ *	HGSHM_WAIT_POLL      spin until the condition holds, no interrupts
+ *	HGSHM_WAIT_BLOCK     block right away
+ *	HGSHM_WAIT_ADAPTIVE  spin for a window, then block. With spin_us 0
+ *	                     the window follows how long waits really take
+ *
+ * The side that makes the condition true must call hgshm_ctx_notify()
+ * after doing so unless everybody polls. A channel belongs to one
+ * waiting thread.
+ *
+ * A channel can count the threads blocked on it in a shared word: the
+ * waiter bumps it before its last look at the condition and going to
+ * sleep, and hgshm_chan_notify() rings the doorbell only when it is not
+ * 0, so a waiter that is still spinning costs its notifier nothing.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#include "hgshm.h"
+
+#define HGSHM_WAIT_ADAPTIVE     0
+#define HGSHM_WAIT_POLL         1
+#define HGSHM_WAIT_BLOCK        2
+
+/* Environment variable read by hgshm_wait_policy_env() */
+#define HGSHM_WAIT_ENV          "HGSHM_WAIT"
+
+typedef struct {
+    uint64_t    immediate;      /* condition held on entry */
+    uint64_t    spin_wakeups;   /* condition met while spinning */
+    uint64_t    block_wakeups;  /* condition met after blocking */
+    uint64_t    spurious;       /* woke up, condition not met */
+    uint64_t    timeouts;
+    uint64_t    spin_ns;        /* time spent spinning */
+    uint64_t    block_ns;       /* time spent blocked */
+} hgshm_wait_stats_t;
+
+typedef struct {
+    hgshm_ctx_t *ctx;
+    int         policy;
+    int         tune;           /* window follows observed waits */
+    uint64_t    seen;           /* hgshm_ctx_wait() cookie */
+    uint32_t    window_ns;
+    uint32_t    min_ns;
+    uint32_t    max_ns;
+    volatile uint32_t *sleepers;   /* shared, NULL if not counted */
+    hgshm_wait_stats_t stats;
+} hgshm_chan_t;
+
+/*
+ * spin_us is the spin window of HGSHM_WAIT_ADAPTIVE, 0 to self tune.
+ * A NULL ctx can only poll.
+ */
+void hgshm_chan_init(hgshm_chan_t *ch, hgshm_ctx_t *ctx, int policy,
+    uint32_t spin_us);
+/*
+ * Wait until ready(arg) returns non zero. timeout_ms < 0 waits forever.
+ * Returns 0, or -1 on timeout.
+ */
+int hgshm_chan_wait(hgshm_chan_t *ch, int (*ready)(void *), void *arg,
+    int timeout_ms);
+/* Wait until *word == val. Spins with umwait on CPUs that have it */
+int hgshm_chan_wait_word(hgshm_chan_t *ch, volatile uint32_t *word,
+    uint32_t val, int timeout_ms);
+/*
+ * Count the threads blocked on ch in *sleepers, zero when nobody waits,
+ * in memory the notifiers map.
+ */
+void hgshm_chan_set_sleepers(hgshm_chan_t *ch, volatile uint32_t *sleepers);
+/*
+ * After making the condition true: hgshm_ctx_notify(ctx, index) if a
+ * thread is blocked on *sleepers, always with NULL. Returns 0 if there
+ * was nobody to ring.
+ */
+int hgshm_chan_notify(hgshm_ctx_t *ctx, volatile uint32_t *sleepers,
+    int index);
+void hgshm_chan_print_stats(hgshm_chan_t *ch, FILE *fp);
+
+/* "poll", "block" or "adaptive", -1 if unknown */
+int hgshm_wait_policy(const char *name);
+/* Policy from $HGSHM_WAIT, HGSHM_WAIT_ADAPTIVE if not set */
+int hgshm_wait_policy_env(void);
+const char * hgshm_wait_policy_name(int policy);
+#endif /* _HGSHM_WAIT_H */
@@ -0,0 +1,63 @@
+/*
+ * Checks that the full view is read-only past slice 0: a child writes
+ * into slice 1 through hgshm_ctx_view() and must die of SIGSEGV, and the
+ * byte must be unchanged afterwards.
+ *
+ *	viewtest <dev>      (non-zero index with fullview)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "hgshm.h"
+
+int main(int argc, char *argv[])
+{
+    volatile unsigned char *view;
+    unsigned char old;
+    hgshm_ctx_t *ctx;
+    size_t sz, slice;
+    pid_t pid;
+    int status, rc = 1;
+
+    if (argc < 2) {
+        printf("usage: %s <dev>\n", argv[0]);
+        return 1;
+    }
+    if ((ctx = hgshm_ctx_open(argv[1], NULL, NULL)) == NULL)
+        return 1;
+    view = hgshm_ctx_view(ctx, &sz);
+    slice = hgshm_ctx_get_shm_slice_sz(ctx);
+    printf("view %zu bytes, slice %zu bytes\n", sz, slice);
+    if (hgshm_ctx_get_index(ctx) == 0 || sz <= slice) {
+        printf("No read-only full view on this device\n");
+        goto out;
+    }
+
+    old = view[slice];
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        goto out;
+    }
+    if (pid == 0) {
+        view[slice] = ~old;
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        goto out;
+    }
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV)
+        printf("FAIL: write to the view did not fault\n");
+    else if (view[slice] != old)
+        printf("FAIL: write to the view changed the region\n");
+    else {
+        printf("PASS: write to the view faulted\n");
+        rc = 0;
+    }
+out:
+    hgshm_ctx_close(ctx);
+    return rc;
+}
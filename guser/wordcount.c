@@ -0,0 +1,241 @@
+/*
+ * Word count on the MapReduce runtime.
+ *
+ * Index 0 maps a file, or <MB> megabytes of generated text, and prints the
+ * most frequent words; every VM reduces one partition.
+ *
+ *	index 0: wordcount <dev> <file|MB> [num reducers]
+ *	others:  wordcount <dev>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "hgshm.h"
+#include "hgshm_wait.h"
+#include "hgshm_mr.h"
+
+/* Input is handed to map in splits of about this size */
+#define SPLIT       (1 << 20)
+#define TOP         10
+#define VOCABULARY  50000
+
+typedef struct {
+    char        *word;
+    int64_t     count;
+} result_t;
+
+typedef struct {
+    result_t    *res;
+    size_t      nres;
+    size_t      cap;
+    int64_t     total;
+} results_t;
+
+static void wc_map(hgshm_mr_t *mr, const void *data, size_t len, void *arg)
+{
+    const unsigned char *p = data, *end = p + len;
+    char word[HGSHM_MR_MAX_KEY];
+    const int64_t one = 1;
+    size_t n;
+
+    while (p < end) {
+        while (p < end && !isalnum(*p))
+            p++;
+        for (n = 0; p < end && isalnum(*p); p++)
+            if (n < sizeof(word))
+                word[n++] = tolower(*p);
+        if (n)
+            hgshm_mr_emit(mr, word, n, &one);
+    }
+}
+
+static void wc_combine(void *dst, const void *src, void *arg)
+{
+    *(int64_t *)dst += *(const int64_t *)src;
+}
+
+static void wc_reduce(hgshm_mr_t *mr, const void *key, size_t klen,
+    const void *vals, size_t nvals, void *arg)
+{
+    const int64_t *v = vals;
+    int64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < nvals; i++)
+        sum += v[i];
+    hgshm_mr_output(mr, key, klen, &sum, sizeof(sum));
+}
+
+static void collect(const void *key, size_t klen, const void *val,
+    size_t vlen, void *arg)
+{
+    results_t *r = arg;
+    result_t *res;
+
+    if (r->nres == r->cap) {
+        r->cap = r->cap ? 2 * r->cap : 1024;
+        if ((res = realloc(r->res, r->cap * sizeof(result_t))) == NULL)
+            return;
+        r->res = res;
+    }
+    res = &r->res[r->nres++];
+    res->word = strndup(key, klen);
+    memcpy(&res->count, val, sizeof(res->count));
+    r->total += res->count;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const result_t *x = a, *y = b;
+
+    if (x->count != y->count)
+        return (x->count < y->count) ? 1 : -1;
+    return strcmp(x->word, y->word);
+}
+
+/* Skewed text from a fixed seed, so every run counts the same words */
+static char *generate(size_t size)
+{
+    char *text = malloc(size + 1);
+    uint64_t x = 88172645463325252ULL;
+    size_t off = 0;
+
+    if (text == NULL)
+        return NULL;
+    while (off + 16 < size) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        off += sprintf(text + off, "w%lu ",
+            (x >> 32) % (1 + (x & 0xffffffff) % VOCABULARY));
+    }
+    memset(text + off, ' ', size - off);
+    text[size] = 0;
+    return text;
+}
+
+static char *load(const char *name, size_t *size)
+{
+    FILE *fp = fopen(name, "r");
+    char *text;
+    long len;
+
+    if (fp == NULL) {
+        perror(name);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    if ((text = malloc(len + 1)) != NULL &&
+        fread(text, 1, len, fp) != (size_t)len) {
+        perror(name);
+        free(text);
+        text = NULL;
+    }
+    fclose(fp);
+    *size = len;
+    return text;
+}
+
+static void print_usage(char *pgm, int ec)
+{
+    printf("Usage: %s <dev|devnum> <file|MB> [num reducers] (index 0)\n"
+        "       %s <dev|devnum> (reducers)\n", pgm, pgm);
+    if (ec)
+        exit(ec);
+}
+
+int main(int argc, char *argv[])
+{
+    hgshm_mr_job_t job = {
+        .vsize = sizeof(int64_t),
+        .map = wc_map,
+        .combine = wc_combine,
+        .reduce = wc_reduce,
+    };
+    hgshm_mr_t *mr;
+    int myindex;
+
+    if (argc < 2)
+        print_usage(argv[0], 1);
+    job.policy = hgshm_wait_policy_env();
+    if (getenv("WORDCOUNT_NO_COMBINE"))
+        job.combine = NULL;
+    if (hgshm_init(argv[1], NULL, NULL) < 0) {
+        printf("Could not open %s\n", argv[1]);
+        exit(1);
+    }
+    myindex = hgshm_get_index();
+
+    if (myindex == 0) {
+        struct timeval start, end;
+        results_t r = { NULL, 0, 0, 0 };
+        size_t size, off, len;
+        int nreducers = 1, failed;
+        char *text;
+
+        if (argc < 3)
+            print_usage(argv[0], 1);
+        if (argc > 3)
+            nreducers = atoi(argv[3]);
+        if (isdigit((unsigned char)argv[2][0]) && access(argv[2], R_OK) < 0) {
+            size = (size_t)atoi(argv[2]) << 20;
+            text = generate(size);
+        } else {
+            text = load(argv[2], &size);
+        }
+        if (text == NULL) {
+            printf("No input\n");
+            exit(1);
+        }
+        if ((mr = hgshm_mr_create(hgshm_default_ctx(), &job,
+            nreducers)) == NULL) {
+            printf("Could not start the job\n");
+            exit(1);
+        }
+
+        gettimeofday(&start, NULL);
+        for (off = 0; off < size; off += len) {
+            len = (size - off > SPLIT) ? SPLIT : size - off;
+            while (off + len < size && !isspace((unsigned char)text[off + len]))
+                len++;
+            hgshm_mr_map(mr, text + off, len);
+        }
+        failed = hgshm_mr_finish(mr);
+        gettimeofday(&end, NULL);
+        if (failed)
+            printf("%d reducers ran out of result space\n", failed);
+
+        hgshm_mr_foreach(mr, collect, &r);
+        qsort(r.res, r.nres, sizeof(result_t), by_count);
+        for (off = 0; off < r.nres && off < TOP; off++)
+            printf("%10ld %s\n", r.res[off].count, r.res[off].word);
+        printf("%zu MB: %ld words, %zu distinct, %ld ms\n", size >> 20,
+            r.total, r.nres, (end.tv_sec - start.tv_sec) * 1000 +
+            (end.tv_usec - start.tv_usec) / 1000);
+        hgshm_mr_print_stats(mr, stdout);
+        hgshm_mr_close(mr);
+        for (off = 0; off < r.nres; off++)
+            free(r.res[off].word);
+        free(r.res);
+        free(text);
+    } else {
+        if ((mr = hgshm_mr_attach(hgshm_default_ctx(), &job)) == NULL) {
+            printf("Could not join the job\n");
+            exit(1);
+        }
+        if (hgshm_mr_reduce(mr) < 0)
+            printf("Results truncated\n");
+        hgshm_mr_print_stats(mr, stdout);
+        hgshm_mr_close(mr);
+    }
+    usleep(1000);
+    hgshm_close();
+    return 0;
+}
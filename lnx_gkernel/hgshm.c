@@ -6,6 +6,12 @@
 #include <asm/io.h>
 #include <linux/sched.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+#include <linux/cpumask.h>
+#include <linux/rcupdate.h>
 
 #include "hgshm.h"
 
@@ -17,6 +23,12 @@ static int devopen = 0;
 static struct class *hgshm_class;
 static unsigned int hgshm_major;
 
+/* Probed devices indexed by minor. /dev/hgshmN is hgshm_devs[N] */
+static hgshm_softc_t *hgshm_devs[HGSHM_MAX_DEVS];
+static DEFINE_MUTEX(hgshm_devs_lock);
+
+static struct dentry *hgshm_debugfs_root;
+
 static struct pci_device_id hgshm_id_table[] = {
 	{ PCI_DEVICE(HGSHM_VENDOR_ID, HGSHM_DEVICE_ID) },
 	{ 0 },
@@ -24,18 +36,25 @@ static struct pci_device_id hgshm_id_table[] = {
 
 MODULE_DEVICE_TABLE(pci, hgshm_id_table);
 
+static void hgshm_free(struct kref *kref);
+
+/* An open file holds a reference, the softc outlives hgshm_remove */
 static int hgshm_open(struct inode *inode, struct file *file)
 {
     hgshm_softc_t *hsc;
     devopen++;
     try_module_get(THIS_MODULE);
 	hsc = container_of(inode->i_cdev, hgshm_softc_t, cdev);
+    kref_get(&hsc->kref);
     file->private_data = hsc;
     return 0;
 }
 
 static int hgshm_release(struct inode *inode, struct file *file)
 {
+    hgshm_softc_t *hsc = (hgshm_softc_t *) file->private_data;
+
+    kref_put(&hsc->kref, hgshm_free);
     if (! devopen) {
         printk(KERN_ALERT "%s not open\n", HGSHM_NAME);
         return (-1);
@@ -49,14 +68,18 @@ static int
 hgshm_mmap (struct file * file, struct vm_area_struct * vma)
 {
     hgshm_softc_t *hsc = (hgshm_softc_t *) file->private_data;
-	uint32_t reg_features = HGSHM_READ4_REG(hsc, HGSHM_FEATURES_REG);
+	uint32_t reg_features;
     size_t  psize;
     size_t  vsize;
     phys_addr_t phys;
     int bar_num;
 
     printk(KERN_DEBUG "%s hgshm_mmap\n", HGSHM_NAME);
-	if (! reg_features & HGSHM_FEATURES_GUEST_MMAP) {
+    /* The BARs are gone once the device is removed */
+    if (ACCESS_ONCE(hsc->removed))
+        return -ENODEV;
+	reg_features = HGSHM_READ4_REG(hsc, HGSHM_FEATURES_REG);
+	if (! (reg_features & HGSHM_FEATURES_GUEST_MMAP)) {
 		/* If hardware does not support mmap-ing, return error */
 		printk(KERN_WARNING "HGSHM_FEATURES_GUEST_MMAP not enabled by hardware\n");
 		return -EPERM;
@@ -70,25 +93,173 @@ hgshm_mmap (struct file * file, struct vm_area_struct * vma)
     bar_num = vma->vm_pgoff;
     printk(KERN_DEBUG "BAR NUM: %X\n", (int)bar_num);
     if (bar_num != HGSHM_IO_BAR && bar_num != HGSHM_MEM_BAR &&
-        bar_num != HGSHM_SLICE_I_BAR)
+        bar_num != HGSHM_SLICE_I_BAR && bar_num != HGSHM_DOORBELL_BAR)
         return -EINVAL;
 
     psize = hsc->bars[bar_num].size;
     vsize = vma->vm_end - vma->vm_start;
 
+    /*
+     * The doorbell pages let user space notify other VMs with a plain
+     * store instead of HGSHM_POKE. They are device memory, map them
+     * uncached, and never the MSI-X table behind them.
+     */
+    if (bar_num == HGSHM_DOORBELL_BAR) {
+        if (! (reg_features & HGSHM_FEATURES_DOORBELL))
+            return -ENODEV;
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+        psize = min_t(size_t, psize, HGSHM_DOORBELL_MAP_SIZE);
+    }
+
     printk(KERN_DEBUG "PSIZE: %X, VSIZE: %X\n", (int)psize, (int)vsize);
     if (vsize > psize)
         return -EINVAL;
 
     phys =  (hsc->bars[bar_num].phys_bar_addr) >> PAGE_SHIFT;
     printk(KERN_DEBUG "Remapping PHYS: %llX\n", phys);
-    if (remap_pfn_range(vma, vma->vm_start, phys, psize,
+    if (remap_pfn_range(vma, vma->vm_start, phys, vsize,
         vma->vm_page_prot)) {
             return -EAGAIN;
     }
 	return 0;
 }
 
+/*
+ * Pokes come from ioctls and in-kernel consumers, which may outlive the
+ * PCI device. They touch the BARs inside an RCU read side section only
+ * while removed is clear; hgshm_remove sets it and waits for a grace
+ * period before unmapping.
+ */
+static int hgshm_poke(hgshm_softc_t *hsc, int index)
+{
+    int rc = -ENODEV;
+
+    if (index < 0 || index >= HGSHM_MAX_CLIENTS)
+        return -EINVAL;
+    rcu_read_lock();
+    if (!ACCESS_ONCE(hsc->removed)) {
+        HGSHM_WRITE1_REG(hsc, (HGSHM_USER_IO_NOTIFY_REG + index), 1);
+        atomic_long_inc(&hsc->stats.pokes[index]);
+        rc = 0;
+    }
+    rcu_read_unlock();
+    return rc;
+}
+
+/*
+ * Queues past 0 have no PIO register, they are rung through the queue
+ * doorbell page.
+ */
+static int hgshm_qpoke(hgshm_softc_t *hsc, int index, int queue)
+{
+    void __iomem *db = hsc->bars[HGSHM_DOORBELL_BAR].bar_addr;
+    int rc = -ENODEV;
+
+    if (queue == 0)
+        return hgshm_poke(hsc, index);
+    if (index < 0 || index >= HGSHM_MAX_CLIENTS ||
+        queue < 0 || queue >= HGSHM_MAX_QUEUES)
+        return -EINVAL;
+    if (db == NULL || hsc->bars[HGSHM_DOORBELL_BAR].size <
+        HGSHM_DOORBELL_MAP_SIZE)
+        return -ENODEV;
+    rcu_read_lock();
+    if (!ACCESS_ONCE(hsc->removed)) {
+        iowrite32(1, db + HGSHM_QDOORBELL_OFF +
+            (index * HGSHM_MAX_QUEUES + queue) * HGSHM_DOORBELL_STRIDE);
+        atomic_long_inc(&hsc->stats.pokes[index]);
+        rc = 0;
+    }
+    rcu_read_unlock();
+    return rc;
+}
+
+/* Wait until queue's interrupt count differs from *seen */
+static int hgshm_queue_wait(hgshm_softc_t *hsc, int queue, uint64_t *seen,
+    int timeout_ms)
+{
+    hgshm_queue_t *q;
+    s64 start, intr_ns;
+    int slept;
+    long rc;
+
+    if (queue < 0 || queue >= hsc->queues)
+        return -EINVAL;
+    q = &hsc->q[queue];
+    /*
+     * Latency is only meaningful for a wait that slept and was ended by
+     * an interrupt stamped after it started, not for an event that was
+     * already pending.
+     */
+    start = ktime_to_ns(ktime_get());
+    slept = (ACCESS_ONCE(q->events) == *seen);
+    if (timeout_ms < 0) {
+        rc = wait_event_interruptible(q->wq,
+            ACCESS_ONCE(q->events) != *seen);
+    } else {
+        rc = wait_event_interruptible_timeout(q->wq,
+            ACCESS_ONCE(q->events) != *seen,
+            msecs_to_jiffies(timeout_ms));
+        if (rc == 0)
+            rc = -ETIMEDOUT;
+    }
+    if (rc < 0)
+        return rc;
+
+    atomic_long_inc(&hsc->stats.wakeups);
+    atomic_long_inc(&q->wakeups);
+    smp_rmb(); /* count before timestamp, pairs with hgshm_deliver */
+    intr_ns = ACCESS_ONCE(q->intr_ns);
+    if (slept && intr_ns >= start) {
+        s64 lat = ktime_to_ns(ktime_get()) - intr_ns;
+        atomic_long_inc(&hsc->stats.lat_hist[
+            min(lat > 0 ? fls64(lat) : 0, HGSHM_LAT_BUCKETS - 1)]);
+    }
+
+    *seen = ACCESS_ONCE(q->events);
+    return 0;
+}
+
+static int hgshm_wait(hgshm_softc_t *hsc, hgshm_wait_t __user *uwait)
+{
+    hgshm_wait_t wait;
+    int rc;
+
+    if (copy_from_user(&wait, uwait, sizeof(wait)))
+        return -EFAULT;
+    if ((rc = hgshm_queue_wait(hsc, 0, &wait.seen, wait.timeout_ms)))
+        return rc;
+    if (copy_to_user(uwait, &wait, sizeof(wait)))
+        return -EFAULT;
+    return 0;
+}
+
+static int hgshm_qwait(hgshm_softc_t *hsc, hgshm_qwait_t __user *uwait)
+{
+    hgshm_qwait_t wait;
+    int rc;
+
+    if (copy_from_user(&wait, uwait, sizeof(wait)))
+        return -EFAULT;
+    if ((rc = hgshm_queue_wait(hsc, wait.queue, &wait.seen,
+        wait.timeout_ms)))
+        return rc;
+    if (copy_to_user(uwait, &wait, sizeof(wait)))
+        return -EFAULT;
+    return 0;
+}
+
+static int hgshm_qpoke_user(hgshm_softc_t *hsc, hgshm_qpoke_t __user *upoke)
+{
+    hgshm_qpoke_t poke;
+
+    if (copy_from_user(&poke, upoke, sizeof(poke)))
+        return -EFAULT;
+    if (poke.queue < 0 || poke.queue >= hsc->queues)
+        return -EINVAL;
+    return hgshm_qpoke(hsc, poke.index, poke.queue);
+}
+
 static long hgshm_ioctl(struct file *file, /* see include/linux/fs.h */
          unsigned int ioctl_num,    /* number and param for ioctl */
          unsigned long ioctl_param)
@@ -97,8 +268,11 @@ static long hgshm_ioctl(struct file *file, /* see include/linux/fs.h */
     hgshm_softc_t *hsc = (hgshm_softc_t *) file->private_data;
     user_data_t *userdata = &hsc->userdata;
 	set_sig_ioctl_t *iodata;
+	size_t	view_size;
 	int	*value;
 
+	if (ACCESS_ONCE(hsc->removed))
+		return -ENODEV;
 	switch(ioctl_num) {
 		case HGSHM_SET_SIGNAL:
 			iodata = (set_sig_ioctl_t *) ioctl_param;
@@ -114,7 +288,7 @@ static long hgshm_ioctl(struct file *file, /* see include/linux/fs.h */
 			break;
 		case HGSHM_POKE:
 			value = (int *) ioctl_param;
-			HGSHM_WRITE1_REG(hsc, (HGSHM_USER_IO_NOTIFY_REG + *value), 1);
+			rc = hgshm_poke(hsc, *value);
 			break;
 		case HGSHM_GET_SHM_SIZE:
 			*((size_t *)ioctl_param) = hsc->bars[HGSHM_MEM_BAR].size;
@@ -132,6 +306,24 @@ static long hgshm_ioctl(struct file *file, /* see include/linux/fs.h */
 		case HGSHM_GET_IO_SIZE:
 			*((size_t *)ioctl_param) = hsc->bars[HGSHM_IO_BAR].size;
 			break;
+		case HGSHM_WAIT:
+			rc = hgshm_wait(hsc, (hgshm_wait_t __user *)ioctl_param);
+			break;
+		case HGSHM_GET_QUEUES:
+			rc = put_user(hsc->queues, (int __user *)ioctl_param) ?
+			    -EFAULT : 0;
+			break;
+		case HGSHM_QWAIT:
+			rc = hgshm_qwait(hsc, (hgshm_qwait_t __user *)ioctl_param);
+			break;
+		case HGSHM_QPOKE:
+			rc = hgshm_qpoke_user(hsc, (hgshm_qpoke_t __user *)ioctl_param);
+			break;
+		case HGSHM_GET_VIEW_SIZE:
+			view_size = hgshm_dev_view_size(hsc);
+			rc = copy_to_user((void __user *)ioctl_param, &view_size,
+			    sizeof(view_size)) ? -EFAULT : 0;
+			break;
     }
     return rc;
 }
@@ -162,69 +354,374 @@ static struct file_operations hsc_fops = {
     .mmap = hgshm_mmap,
 };
 
+static int
+alloc_hgshm_minor(hgshm_softc_t *hsc)
+{
+    int minor;
+
+    mutex_lock(&hgshm_devs_lock);
+    for (minor = 0; minor < HGSHM_MAX_DEVS; minor++) {
+        if (hgshm_devs[minor] == NULL) {
+            hgshm_devs[minor] = hsc;
+            break;
+        }
+    }
+    mutex_unlock(&hgshm_devs_lock);
+    return (minor < HGSHM_MAX_DEVS) ? minor : -ENOSPC;
+}
+
 static void
-destroy_hgshm_dev(hgshm_softc_t *hsc)
+free_hgshm_minor(int minor)
+{
+    mutex_lock(&hgshm_devs_lock);
+    hgshm_devs[minor] = NULL;
+    mutex_unlock(&hgshm_devs_lock);
+}
+
+static int hgshm_stats_show(struct seq_file *m, void *v)
 {
+    hgshm_softc_t *hsc = m->private;
+    hgshm_stats_t *st = &hsc->stats;
+    long val;
     int i;
-    int minor = MINOR(hsc->cdev.dev);
+
+    seq_printf(m, "interrupts:     %ld\n", atomic_long_read(&st->intr));
+    seq_printf(m, "spurious:       %ld\n", atomic_long_read(&st->spurious));
+    seq_printf(m, "signals:        %ld\n", atomic_long_read(&st->signals));
+    seq_printf(m, "wakeups:        %ld\n", atomic_long_read(&st->wakeups));
+    seq_printf(m, "kernel_notify:  %ld\n",
+        atomic_long_read(&st->kernel_notify));
+    seq_printf(m, "pokes (ioctl and in-kernel, not doorbell page):\n");
+    for (i = 0; i < HGSHM_MAX_CLIENTS; i++)
+        if ((val = atomic_long_read(&st->pokes[i])))
+            seq_printf(m, "  %2d: %ld\n", i, val);
+    seq_printf(m, "interrupt to wakeup latency (ns):\n");
+    for (i = 0; i < HGSHM_LAT_BUCKETS; i++)
+        if ((val = atomic_long_read(&st->lat_hist[i])))
+            seq_printf(m, "  < %12llu: %ld\n", 1ULL << i, val);
+    seq_printf(m, "queues:         %d%s\n", hsc->queues,
+        (hsc->init_progress_flag & MSIX_ENABLED) ? " (MSI-X)" : "");
+    for (i = 0; i < hsc->queues && hsc->queues > 1; i++)
+        seq_printf(m, "  %2d: %ld interrupts, %ld wakeups\n", i,
+            atomic_long_read(&hsc->q[i].intr),
+            atomic_long_read(&hsc->q[i].wakeups));
+    return 0;
+}
+
+static int hgshm_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hgshm_stats_show, inode->i_private);
+}
+
+static const struct file_operations hgshm_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = hgshm_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void
+create_hgshm_debugfs(hgshm_softc_t *hsc)
+{
+    char name[16];
+
+    if (IS_ERR_OR_NULL(hgshm_debugfs_root))
+        return;
+    snprintf(name, sizeof(name), "hgshm%d", hsc->minor);
+    hsc->debugfs = debugfs_create_dir(name, hgshm_debugfs_root);
+    if (IS_ERR_OR_NULL(hsc->debugfs)) {
+        hsc->debugfs = NULL;
+        return;
+    }
+    debugfs_create_file("stats", 0444, hsc->debugfs, hsc, &hgshm_stats_fops);
+}
+
+static void
+destroy_hgshm_dev(hgshm_softc_t *hsc)
+{
     printk(KERN_DEBUG "%s hgshm_destroy_dev\n", HGSHM_NAME);
     if (! (hsc->init_progress_flag & CDEV_CREATED)) {
         printk(KERN_DEBUG "%s hgshm_destroy_dev: NOP\n", HGSHM_NAME);
         return;
     }
-    for (i = minor; i < minor + HGSHM_MAX_DEVS; i++) {
-        printk(KERN_DEBUG "%s hgshm_destroy_dev: hgshm%d\n", HGSHM_NAME, i);
-        device_destroy(hgshm_class, MKDEV(hgshm_major, i));
-    }
+    printk(KERN_DEBUG "%s hgshm_destroy_dev: hgshm%d\n", HGSHM_NAME,
+        hsc->minor);
+    debugfs_remove_recursive(hsc->debugfs);
+    hsc->debugfs = NULL;
+    device_destroy(hgshm_class, MKDEV(hgshm_major, hsc->minor));
     cdev_del(&hsc->cdev);
+    free_hgshm_minor(hsc->minor);
+    hsc->init_progress_flag &= ~CDEV_CREATED;
 }
 
+/*
+ * Every probed device gets the first free minor and its own
+ * /dev/hgshm<minor> node, so several shared regions can be attached
+ * to one guest.
+ */
 static int
 create_hgshm_dev(hgshm_softc_t *hsc)
 {
     int err = 0;
-	int minor;
+    struct device *dev;
+
+    if ((hsc->minor = alloc_hgshm_minor(hsc)) < 0) {
+        printk(KERN_ERR "%s: Too many devices (max %d)\n", HGSHM_NAME,
+            HGSHM_MAX_DEVS);
+        return hsc->minor;
+    }
 
 	cdev_init(&hsc->cdev, &hsc_fops);
     hsc->cdev.owner = THIS_MODULE;
-    if ((err = cdev_add(&hsc->cdev, MKDEV(hgshm_major, 0), HGSHM_COUNT))) {
+    if ((err = cdev_add(&hsc->cdev, MKDEV(hgshm_major, hsc->minor), 1))) {
         printk(KERN_ERR "%s: Could not add cdev\n", HGSHM_NAME);
+        free_hgshm_minor(hsc->minor);
         return err;
     }
 
-	for (minor = 0 ; minor < HGSHM_MAX_DEVS; minor++) {
-		struct device *dev;
-		dev = device_create(hgshm_class, &hsc->pci_dev->dev,
-		    MKDEV(hgshm_major, minor), NULL,
-		    "hgshm%d", minor);
-		if (IS_ERR(dev))
-            printk(KERN_ERR "%s: Could not create dev files\n", HGSHM_NAME);
-	}
+    dev = device_create(hgshm_class, &hsc->pci_dev->dev,
+        MKDEV(hgshm_major, hsc->minor), hsc, "hgshm%d", hsc->minor);
+    if (IS_ERR(dev)) {
+        printk(KERN_ERR "%s: Could not create dev files\n", HGSHM_NAME);
+        cdev_del(&hsc->cdev);
+        free_hgshm_minor(hsc->minor);
+        return PTR_ERR(dev);
+    }
+    printk(KERN_DEBUG "%s: created hgshm%d\n", HGSHM_NAME, hsc->minor);
+    create_hgshm_debugfs(hsc);
     hsc->init_progress_flag |= CDEV_CREATED;
     return 0;
 }
 
+/*
+ * Wake the waiters of queue q. Queue 0 also signals the user task and
+ * calls the in-kernel consumer.
+ */
+static void
+hgshm_deliver(hgshm_softc_t *hsc, hgshm_queue_t *q)
+{
+	user_data_t	*userdata = &hsc->userdata;
+
+    atomic_long_inc(&hsc->stats.intr);
+    atomic_long_inc(&q->intr);
+
+    q->intr_ns = ktime_to_ns(ktime_get());
+    smp_wmb(); /* timestamp before the count that HGSHM_WAIT checks */
+    q->events++;
+    wake_up_interruptible(&q->wq);
+
+    if (q->queue != 0)
+        return;
+
+	if (userdata->task) {
+        kill_pid(task_pid(userdata->task), userdata->iodata.signal, 1);
+        atomic_long_inc(&hsc->stats.signals);
+    }
+
+    spin_lock(&hsc->notify_lock);
+    if (hsc->notify_fn) {
+        hsc->notify_fn(hsc->notify_arg);
+        atomic_long_inc(&hsc->stats.kernel_notify);
+    }
+    spin_unlock(&hsc->notify_lock);
+}
+
+/* INTx, shared by all queues: HGSHM_QPENDING_REG says which fired */
 static irqreturn_t
 hgshm_intr(int irq, void *arg)
 {
 	hgshm_softc_t	*hsc = arg;
-	user_data_t	*userdata = &hsc->userdata;
     irqreturn_t ret = IRQ_NONE;
+    uint32_t pending = 1;
     uint8_t reg_isr;
+    int i;
 
 	reg_isr = HGSHM_READ1_REG(hsc, HGSHM_ISR_REG); /* Reading clears ISR */
 
-	if ((reg_isr == 0xFF) || (reg_isr == 0))
+    /* 0: another device on the shared line, 0xFF: device is gone */
+	if ((reg_isr == 0xFF) || (reg_isr == 0)) {
+        atomic_long_inc(&hsc->stats.spurious);
 		return ret;
+    }
+    /* Older devices have one queue and no QPENDING register */
+    if (hsc->queues > 1)
+        pending = HGSHM_READ4_REG(hsc, HGSHM_QPENDING_REG);
+    for (i = 0; i < hsc->queues; i++)
+        if (pending & (1U << i))
+            hgshm_deliver(hsc, &hsc->q[i]);
 
-	if (userdata->task)
-        kill_pid(task_pid(userdata->task), userdata->iodata.signal, 1);
-
-    printk(KERN_DEBUG "%s hgshm_intr. irq: %d\n", HGSHM_NAME, irq);
     ret = IRQ_HANDLED;
     return ret;
 }
 
+static irqreturn_t
+hgshm_msix_intr(int irq, void *arg)
+{
+    hgshm_queue_t *q = arg;
+
+    hgshm_deliver(q->hsc, q);
+    return IRQ_HANDLED;
+}
+
+/*
+ * In-kernel consumer API, see hgshm_api.h
+ */
+static void hgshm_free(struct kref *kref)
+{
+    hgshm_softc_t *hsc = container_of(kref, hgshm_softc_t, kref);
+    kfree(hsc);
+}
+
+hgshm_softc_t *hgshm_get_dev(int minor)
+{
+    hgshm_softc_t *hsc = NULL;
+
+    if (minor < 0 || minor >= HGSHM_MAX_DEVS)
+        return NULL;
+    mutex_lock(&hgshm_devs_lock);
+    if ((hsc = hgshm_devs[minor]))
+        kref_get(&hsc->kref);
+    mutex_unlock(&hgshm_devs_lock);
+    return hsc;
+}
+EXPORT_SYMBOL_GPL(hgshm_get_dev);
+
+void hgshm_put_dev(hgshm_softc_t *hsc)
+{
+    kref_put(&hsc->kref, hgshm_free);
+}
+EXPORT_SYMBOL_GPL(hgshm_put_dev);
+
+int hgshm_dev_index(hgshm_softc_t *hsc)
+{
+    return hsc->index;
+}
+EXPORT_SYMBOL_GPL(hgshm_dev_index);
+
+size_t hgshm_dev_slice_size(hgshm_softc_t *hsc)
+{
+    return hsc->slice_size;
+}
+EXPORT_SYMBOL_GPL(hgshm_dev_slice_size);
+
+size_t hgshm_dev_shm_size(hgshm_softc_t *hsc)
+{
+    return hsc->bars[HGSHM_MEM_BAR].size;
+}
+EXPORT_SYMBOL_GPL(hgshm_dev_shm_size);
+
+size_t hgshm_dev_view_size(hgshm_softc_t *hsc)
+{
+    if (hsc->index == 0)
+        return hsc->bars[HGSHM_MEM_BAR].size;
+    return hsc->bars[HGSHM_SLICE_I_BAR].size;
+}
+EXPORT_SYMBOL_GPL(hgshm_dev_view_size);
+
+int hgshm_get_slice(hgshm_softc_t *hsc, int slice, hgshm_region_t *rg)
+{
+    struct pci_bus_region region;
+    int bar_num;
+    size_t off = 0;
+    bar_t *bar;
+
+    if (hsc->removed)
+        return -ENODEV;
+
+    /*
+     * Zero-index VM has the whole region in BAR1. Others have their own
+     * slice in BAR1 and slice 0 (mapidx) in BAR3, or with the full view
+     * every slice in BAR3, read-only past slice 0.
+     */
+    if (hsc->index == 0) {
+        bar_num = HGSHM_MEM_BAR;
+        off = (size_t)slice * hsc->slice_size;
+        if (slice < 0 || off >= hsc->bars[bar_num].size)
+            return -ENOENT;
+    } else if (slice == hsc->index) {
+        bar_num = HGSHM_MEM_BAR;
+    } else {
+        bar_num = HGSHM_SLICE_I_BAR;
+        off = (size_t)slice * hsc->slice_size;
+        if (slice < 0 || off >= hsc->bars[bar_num].size)
+            return -ENOENT;
+    }
+
+    bar = &hsc->bars[bar_num];
+    rg->slice = slice;
+    rg->size = min(hsc->slice_size, bar->size - off);
+    rg->phys = bar->phys_bar_addr + off;
+    pcibios_resource_to_bus(hsc->pci_dev, &region,
+        &hsc->pci_dev->resource[bar_num]);
+    rg->dma_addr = region.start + off;
+
+    /* Backed by RAM on the host, so a cached mapping is safe */
+    if ((rg->vaddr = (void __force *)ioremap_cache(rg->phys, rg->size)) == NULL)
+        return -ENOMEM;
+    kref_get(&hsc->kref);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(hgshm_get_slice);
+
+void hgshm_put_slice(hgshm_softc_t *hsc, hgshm_region_t *rg)
+{
+    if (rg->vaddr)
+        iounmap((void __iomem __force *)rg->vaddr);
+    rg->vaddr = NULL;
+    kref_put(&hsc->kref, hgshm_free);
+}
+EXPORT_SYMBOL_GPL(hgshm_put_slice);
+
+int hgshm_kernel_notify(hgshm_softc_t *hsc, int index)
+{
+    return hgshm_poke(hsc, index);
+}
+EXPORT_SYMBOL_GPL(hgshm_kernel_notify);
+
+int hgshm_dev_queues(hgshm_softc_t *hsc)
+{
+    return hsc->queues;
+}
+EXPORT_SYMBOL_GPL(hgshm_dev_queues);
+
+int hgshm_kernel_notify_queue(hgshm_softc_t *hsc, int index, int queue)
+{
+    return hgshm_qpoke(hsc, index, queue);
+}
+EXPORT_SYMBOL_GPL(hgshm_kernel_notify_queue);
+
+int hgshm_register_notifier(hgshm_softc_t *hsc, hgshm_notify_fn_t fn,
+    void *arg)
+{
+    unsigned long flags;
+    int rc = 0;
+
+    if (hsc->removed)
+        return -ENODEV;
+    spin_lock_irqsave(&hsc->notify_lock, flags);
+    if (hsc->notify_fn) {
+        rc = -EBUSY;
+    } else {
+        hsc->notify_arg = arg;
+        hsc->notify_fn = fn;
+    }
+    spin_unlock_irqrestore(&hsc->notify_lock, flags);
+    return rc;
+}
+EXPORT_SYMBOL_GPL(hgshm_register_notifier);
+
+void hgshm_unregister_notifier(hgshm_softc_t *hsc)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&hsc->notify_lock, flags);
+    hsc->notify_fn = NULL;
+    hsc->notify_arg = NULL;
+    spin_unlock_irqrestore(&hsc->notify_lock, flags);
+}
+EXPORT_SYMBOL_GPL(hgshm_unregister_notifier);
+
 static void
 release_pci_resources(hgshm_softc_t *hsc)
 {
@@ -232,16 +729,33 @@ release_pci_resources(hgshm_softc_t *hsc)
     uint16_t    *init_progress_flag = &hsc->init_progress_flag;
 
 	pci_set_drvdata(pci_dev, NULL);
+    /* free_irq waits for running handlers, which read the IO BAR */
+    if (*init_progress_flag & MSIX_ENABLED) {
+        int i;
+        for (i = 0; i < hsc->queues; i++) {
+            irq_set_affinity_hint(hsc->msix[i].vector, NULL);
+            free_irq(hsc->msix[i].vector, &hsc->q[i]);
+        }
+        pci_disable_msix(pci_dev);
+    }
+    if (*init_progress_flag & IRQ_ENABLED)
+        free_irq(pci_dev->irq, hsc);
     if (*init_progress_flag & IO_REGION_MAPPED)
 	    pci_iounmap(pci_dev, hsc->bars[HGSHM_IO_BAR].bar_addr);
-    if (*init_progress_flag & MEM_REGION_MAPPED)
-	    pci_iounmap(pci_dev, hsc->bars[HGSHM_MEM_BAR].bar_addr);
+    if (*init_progress_flag & MEM_REGION_MAPPED) {
+        int i;
+        /* populate_bar_info maps every implemented memory BAR */
+        for (i = 0; i < 6; i++)
+            if (hsc->bars[i].type == PCI_BASE_ADDRESS_SPACE_MEMORY &&
+                hsc->bars[i].bar_addr)
+	            pci_iounmap(pci_dev, hsc->bars[i].bar_addr);
+    }
+    if (*init_progress_flag & DB_REGION_ALLOCATED)
+        pci_release_region(pci_dev, HGSHM_DOORBELL_BAR);
     if (*init_progress_flag & MEM_REGION_ALLOCATED)
         pci_release_region(pci_dev, HGSHM_MEM_BAR);
     if (*init_progress_flag & IO_REGION_ALLOCATED)
         pci_release_region(pci_dev, HGSHM_IO_BAR);
-    if (*init_progress_flag & IRQ_ENABLED)
-        free_irq(pci_dev->irq, hsc);
     if (*init_progress_flag & DEV_ENABLED)
 	    pci_disable_device(pci_dev);
 }
@@ -306,6 +820,57 @@ static int populate_bar_info(hgshm_softc_t *hsc)
     return 0;
 }
 
+/* The q-th online CPU, wrapping around */
+static int hgshm_queue_cpu(int q)
+{
+    int cpu = cpumask_first(cpu_online_mask);
+
+    q %= num_online_cpus();
+    while (q--)
+        cpu = cpumask_next(cpu, cpu_online_mask);
+    return cpu;
+}
+
+/*
+ * One MSI-X vector per queue, each on its own CPU. Returns non-zero if
+ * the device or the platform cannot do it, the queues then share INTx.
+ */
+static int
+setup_msix(hgshm_softc_t *hsc)
+{
+    struct pci_dev *pci_dev = hsc->pci_dev;
+    int i, err;
+
+    if (! pci_find_capability(pci_dev, PCI_CAP_ID_MSIX))
+        return -ENODEV;
+    for (i = 0; i < hsc->queues; i++)
+        hsc->msix[i].entry = i;
+    if ((err = pci_enable_msix(pci_dev, hsc->msix, hsc->queues)))
+        return err;
+
+    for (i = 0; i < hsc->queues; i++) {
+        hgshm_queue_t *q = &hsc->q[i];
+
+        snprintf(q->name, sizeof(q->name), "%s-q%d@%s", HGSHM_NAME, i,
+            pci_name(pci_dev));
+        if ((err = request_irq(hsc->msix[i].vector, hgshm_msix_intr, 0,
+            q->name, q)))
+            break;
+        irq_set_affinity_hint(hsc->msix[i].vector,
+            cpumask_of(hgshm_queue_cpu(i)));
+    }
+    if (err) {
+        while (i--) {
+            irq_set_affinity_hint(hsc->msix[i].vector, NULL);
+            free_irq(hsc->msix[i].vector, &hsc->q[i]);
+        }
+        pci_disable_msix(pci_dev);
+        return err;
+    }
+    hsc->init_progress_flag |= MSIX_ENABLED;
+    return 0;
+}
+
 static int
 alloc_pci_resources(hgshm_softc_t *hsc)
 {
@@ -335,6 +900,17 @@ alloc_pci_resources(hgshm_softc_t *hsc)
     }
     *init_progress_flag |= MEM_REGION_ALLOCATED;
 
+    /* Doorbell BAR is optional, older devices do not implement it */
+    if (pci_resource_len(pci_dev, HGSHM_DOORBELL_BAR)) {
+        if ((err = pci_request_region(pci_dev, HGSHM_DOORBELL_BAR,
+            "hgshm-doorbell"))) {
+            printk(KERN_DEBUG "%s Doorbell region request failed\n",
+                HGSHM_NAME);
+            return err;
+        }
+        *init_progress_flag |= DB_REGION_ALLOCATED;
+    }
+
     if ((err = populate_bar_info(hsc))) {
         printk(KERN_DEBUG "%s Populating bar info failed\n", HGSHM_NAME);
         return err;
@@ -350,12 +926,21 @@ alloc_pci_resources(hgshm_softc_t *hsc)
     }
 #endif
 
-	if ((err = request_irq(pci_dev->irq, hgshm_intr,
+    hsc->queues = 1;
+    if (HGSHM_READ4_REG(hsc, HGSHM_FEATURES_REG) & HGSHM_FEATURES_QUEUES)
+        hsc->queues = clamp_t(int, HGSHM_READ1_REG(hsc, HGSHM_QUEUES_REG),
+            1, HGSHM_MAX_QUEUES);
+
+    /* MSI-X lives in the doorbell BAR */
+    if ((*init_progress_flag & DB_REGION_ALLOCATED) && setup_msix(hsc) == 0) {
+        printk(KERN_DEBUG "%s %d queues on MSI-X\n", HGSHM_NAME, hsc->queues);
+    } else if ((err = request_irq(pci_dev->irq, hgshm_intr,
         IRQF_SHARED, HGSHM_NAME, hsc))) {
         printk(KERN_DEBUG "%s IRQ request failed\n", HGSHM_NAME);
         return err;
+    } else {
+        *init_progress_flag |= IRQ_ENABLED;
     }
-    *init_progress_flag |= IRQ_ENABLED;
 
     /* Remember the index */
     hsc->index = HGSHM_READ1_REG(hsc, HGSHM_IDX_REG);
@@ -363,6 +948,9 @@ alloc_pci_resources(hgshm_softc_t *hsc)
     hsc->slice_size = HGSHM_READ4_REG(hsc, HGSHM_SHM_SLICE_SIZE_REG);
     printk(KERN_DEBUG "IDX: %d, SLICE_SZ: %X\n",
         hsc->index, (int)hsc->slice_size);
+    if (HGSHM_READ4_REG(hsc, HGSHM_FEATURES_REG) & HGSHM_FEATURES_FULL_VIEW)
+        printk(KERN_DEBUG "%s full view of %lX bytes in BAR3\n", HGSHM_NAME,
+            (unsigned long)hsc->bars[HGSHM_SLICE_I_BAR].size);
 	return 0;
 }
 
@@ -371,7 +959,7 @@ static int __devinit hgshm_probe(struct pci_dev *pci_dev,
 				      const struct pci_device_id *id)
 {
 
-    int err;
+    int err, i;
     hgshm_softc_t   *hsc = NULL;
 
     printk(KERN_DEBUG "%s hgshm_probe\n", HGSHM_NAME);
@@ -392,14 +980,23 @@ static int __devinit hgshm_probe(struct pci_dev *pci_dev,
 
     hsc->pci_dev = pci_dev;
     hsc->pci_id = id;
+    kref_init(&hsc->kref);
+    spin_lock_init(&hsc->notify_lock);
+    for (i = 0; i < HGSHM_MAX_QUEUES; i++) {
+        hsc->q[i].hsc = hsc;
+        hsc->q[i].queue = i;
+        init_waitqueue_head(&hsc->q[i].wq);
+    }
 	pci_set_drvdata(pci_dev, hsc);
     if ((err = alloc_pci_resources(hsc)) != 0) {
         release_pci_resources(hsc);
+        kfree(hsc);
         return err;
     }
 
     if ((err = create_hgshm_dev(hsc)) != 0) {
         release_pci_resources(hsc);
+        kfree(hsc);
         return err;
     }
     printk(KERN_DEBUG "ACTION FLAG: %X\n", hsc->init_progress_flag);
@@ -411,8 +1008,15 @@ static void __devexit hgshm_remove(struct pci_dev *pci_dev)
 	hgshm_softc_t *hsc = pci_get_drvdata(pci_dev);
     printk(KERN_DEBUG "%s hgshm_remove\n", HGSHM_NAME);
     destroy_hgshm_dev(hsc);
+    /*
+     * In-kernel consumers and open files may still hold references.
+     * Turn them away and wait for pokes already past the check before
+     * the BARs go.
+     */
+    hsc->removed = 1;
+    synchronize_rcu();
     release_pci_resources(hsc);
-	kfree(hsc);
+    hgshm_put_dev(hsc);
 }
 
 #ifdef CONFIG_PM
@@ -444,7 +1048,7 @@ static int __init hgshm_init(void)
 	dev_t dev;
 
     printk(KERN_DEBUG "%s hgshm_init\n", HGSHM_NAME);
-	hgshm_class = class_create(THIS_MODULE, "pci");
+	hgshm_class = class_create(THIS_MODULE, HGSHM_NAME);
 	if (IS_ERR(hgshm_class)) {
 		err = PTR_ERR(hgshm_class);
 		return err;
@@ -456,12 +1060,16 @@ static int __init hgshm_init(void)
 
 	hgshm_major = MAJOR(dev);
 
+	/* Statistics are optional, carry on without debugfs */
+	hgshm_debugfs_root = debugfs_create_dir(HGSHM_NAME, NULL);
+
 	err =	pci_register_driver(&hgshm_driver);
 	if (err)
 		goto chr_remove;
 	return 0;
 
 chr_remove:
+	debugfs_remove_recursive(hgshm_debugfs_root);
 	unregister_chrdev_region(dev, HGSHM_MAX_DEVS);
 class_destroy:
 	class_destroy(hgshm_class);
@@ -474,6 +1082,7 @@ static void __exit hgshm_exit(void)
 {
     printk(KERN_DEBUG "%s hgshm_exit\n", HGSHM_NAME);
 	pci_unregister_driver(&hgshm_driver);
+	debugfs_remove_recursive(hgshm_debugfs_root);
 	unregister_chrdev_region(MKDEV(hgshm_major, 0), HGSHM_MAX_DEVS);
 	class_destroy(hgshm_class);
 }
@@ -5,6 +5,12 @@
 #include <linux/interrupt.h>
 #include <linux/cdev.h>
 #include <linux/dma-mapping.h>
+#include <linux/kref.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/debugfs.h>
+
+#include "hgshm_api.h"
 
 #define	HGSHM_VENDOR_ID	0xBABE
 #define	HGSHM_DEVICE_ID	0x07B9
@@ -17,16 +23,35 @@
 #define	HGSHM_ISR_REG			    0x50	/* size 1 */
 #define	HGSHM_IRQ_REG			    0x51	/* size 1 */
 #define	HGSHM_IDX_REG			    0x52	/* size 1 */
+#define	HGSHM_QUEUES_REG		    0x53	/* size 1 */
+#define	HGSHM_QPENDING_REG		    0x54	/* size 4, read clears */
 
 #define HGSHM_IO_BAR            0
 #define HGSHM_MEM_BAR           1
 #define HGSHM_SLICE_I_BAR       3
+#define HGSHM_DOORBELL_BAR      5
+
+/* One 32-bit doorbell register per client index in the doorbell BAR */
+#define HGSHM_DOORBELL_STRIDE   4
+
+/*
+ * Queue q of client index is rung at HGSHM_QDOORBELL_OFF + (index *
+ * HGSHM_MAX_QUEUES + q) * HGSHM_DOORBELL_STRIDE in the doorbell BAR.
+ * Queue 0 is the doorbell page. Only the two doorbell pages may be
+ * mapped, the MSI-X table follows them.
+ */
+#define HGSHM_MAX_QUEUES        16
+#define HGSHM_QDOORBELL_OFF     PAGE_SIZE
+#define HGSHM_DOORBELL_MAP_SIZE (2 * PAGE_SIZE)
 
 #define	HGSHM_NAME                  "hgshm"
 #define	HGSHM_FEATURES_GUEST_MMAP	0x1
+#define	HGSHM_FEATURES_DOORBELL		0x2
+#define	HGSHM_FEATURES_QUEUES		0x4
+#define	HGSHM_FEATURES_FULL_VIEW	0x8
 
-#define HGSHM_COUNT             3
-#define HGSHM_MAX_DEVS          1
+#define HGSHM_MAX_DEVS          16  /* hgshm devices per guest */
+#define HGSHM_MAX_CLIENTS       64  /* VMs sharing one region */
 
 #define HGSHM_SET_SIGNAL	        _IOW('H', 1, set_sig_ioctl_t)
 #define HGSHM_POKE                  _IOW('H', 2, int)
@@ -35,12 +60,39 @@
 #define HGSHM_GET_INDEX             _IOR('H', 5, int)
 #define HGSHM_GET_IO_SIZE	        _IOR('H', 6, size_t)
 #define HGSHM_GET_SHM_SLICE_SIZE	_IOR('H', 7, size_t)
+#define HGSHM_WAIT                  _IOWR('H', 8, hgshm_wait_t)
+#define HGSHM_GET_QUEUES            _IOR('H', 9, int)
+#define HGSHM_QWAIT                 _IOWR('H', 10, hgshm_qwait_t)
+#define HGSHM_QPOKE                 _IOW('H', 11, hgshm_qpoke_t)
+#define HGSHM_GET_VIEW_SIZE         _IOR('H', 12, size_t)
 
 typedef struct {
 	int	signal;
 	pid_t	pid;
 } set_sig_ioctl_t;
 
+/*
+ * HGSHM_WAIT: block until the interrupt count differs from 'seen' or
+ * 'timeout_ms' expires (< 0 waits forever). 'seen' returns the current
+ * count, so callers loop passing back what they got.
+ */
+typedef struct {
+	uint64_t	seen;
+	int		timeout_ms;
+} hgshm_wait_t;
+
+/* HGSHM_QWAIT: HGSHM_WAIT on one queue, HGSHM_QPOKE: ring one queue */
+typedef struct {
+	uint64_t	seen;
+	int		timeout_ms;
+	int		queue;
+} hgshm_qwait_t;
+
+typedef struct {
+	int		index;
+	int		queue;
+} hgshm_qpoke_t;
+
 typedef struct {
 	set_sig_ioctl_t iodata;
     struct task_struct *task;
@@ -54,15 +106,60 @@ typedef struct {
     phys_addr_t phys_bar_addr;
 } bar_t;
 
+#define HGSHM_LAT_BUCKETS       32  /* log2(ns) buckets */
+
+/*
+ * Per device statistics, shown in debugfs under hgshm/hgshm<minor>.
+ * Pokes through the user-space doorbell page never enter the kernel and
+ * are not counted.
+ */
+typedef struct {
+    atomic_long_t   intr;           /* interrupts for this device */
+    atomic_long_t   spurious;       /* ISR 0/0xFF, shared line or removed */
+    atomic_long_t   signals;        /* signals sent to the user task */
+    atomic_long_t   wakeups;        /* HGSHM_WAIT callers woken */
+    atomic_long_t   kernel_notify;  /* in-kernel consumer callbacks */
+    atomic_long_t   pokes[HGSHM_MAX_CLIENTS];
+    /* interrupt to HGSHM_WAIT return latency */
+    atomic_long_t   lat_hist[HGSHM_LAT_BUCKETS];
+} hgshm_stats_t;
+
+/*
+ * A notification queue. With MSI-X each has its own vector, pinned to
+ * its own CPU, so threads waiting on different queues never share an
+ * interrupt or a wait queue.
+ */
+typedef struct {
+    struct hgshm_softc *hsc;
+    int         queue;
+    wait_queue_head_t wq;       /* HGSHM_WAIT/HGSHM_QWAIT sleepers */
+    uint64_t    events;         /* interrupts delivered so far */
+    s64         intr_ns;        /* time of the last interrupt */
+    char        name[24];       /* for request_irq */
+    atomic_long_t intr;
+    atomic_long_t wakeups;
+} hgshm_queue_t;
+
 typedef struct hgshm_softc {
     struct pci_dev *pci_dev;
     const struct pci_device_id *pci_id;
     uint16_t init_progress_flag;
     struct cdev cdev;
+    int         minor;
     user_data_t userdata;
     bar_t       bars[6]; /* 6 pci bars */
     int         index;
     size_t      slice_size;
+    struct kref kref;       /* probe + open files + in-kernel consumers */
+    int         removed;
+    spinlock_t  notify_lock;
+    hgshm_notify_fn_t notify_fn;   /* in-kernel consumer callback */
+    void        *notify_arg;
+    int         queues;
+    struct msix_entry msix[HGSHM_MAX_QUEUES];
+    hgshm_queue_t q[HGSHM_MAX_QUEUES];  /* q[0] is HGSHM_WAIT */
+    hgshm_stats_t stats;
+    struct dentry *debugfs;
 } hgshm_softc_t;
 
 #define HGSHM_READ1_REG(sc, o)		ioread8((sc)->bars[HGSHM_IO_BAR].bar_addr + (o))
@@ -82,4 +179,6 @@ typedef struct hgshm_softc {
 #define MEM_REGION_MAPPED       (0x1 << 4)
 #define IRQ_ENABLED             (0x1 << 5)
 #define CDEV_CREATED            (0x1 << 6)
+#define DB_REGION_ALLOCATED     (0x1 << 7)
+#define MSIX_ENABLED            (0x1 << 8)
 #endif /* _HGSHM_H */
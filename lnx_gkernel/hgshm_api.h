@@ -0,0 +1,75 @@
+#ifndef _HGSHM_API_H
+#define	_HGSHM_API_H
+
+/*
+ * In-kernel consumer API of the hgshm guest driver.
+ *
+ * Other guest drivers can look up an hgshm device by minor (the N in
+ * /dev/hgshmN), get the slices of the shared region that this VM can
+ * see, notify other VMs and receive notifications.
+ *
+ * The shared memory is RAM backed by qemu and mapped through PCI BARs,
+ * so the bus address of a slice can be handed to any emulated device
+ * (virtio-blk, NVMe, ...) as a DMA target. BAR memory has no struct
+ * page, therefore slices cannot be put into a bio or scatterlist
+ * directly; consumers program DMA with hgshm_region.dma_addr.
+ */
+
+#include <linux/types.h>
+
+struct hgshm_softc;
+
+typedef struct hgshm_region {
+    void        *vaddr;     /* cached kernel mapping */
+    phys_addr_t phys;       /* guest physical address */
+    dma_addr_t  dma_addr;   /* bus address, for device DMA */
+    size_t      size;
+    int         slice;
+} hgshm_region_t;
+
+typedef void (*hgshm_notify_fn_t)(void *arg);
+
+/* Reference counted device lookup. Returns NULL if minor is not probed */
+struct hgshm_softc *hgshm_get_dev(int minor);
+void hgshm_put_dev(struct hgshm_softc *hsc);
+
+int hgshm_dev_index(struct hgshm_softc *hsc);
+size_t hgshm_dev_slice_size(struct hgshm_softc *hsc);
+/* Size of the memory BAR: whole region for index 0, own slice otherwise */
+size_t hgshm_dev_shm_size(struct hgshm_softc *hsc);
+/*
+ * Size of the view of other slices: whole region for index 0 and for
+ * devices with the fullview property, slice 0 otherwise
+ */
+size_t hgshm_dev_view_size(struct hgshm_softc *hsc);
+
+/*
+ * Map slice 'slice' into the kernel. Zero-index VM sees every slice,
+ * other VMs see their own slice and slice 0, or every slice with the
+ * fullview property, where slices other than 0 and their own are
+ * read-only. Returns -ENOENT for a slice that is not visible from this VM.
+ */
+int hgshm_get_slice(struct hgshm_softc *hsc, int slice, hgshm_region_t *rg);
+void hgshm_put_slice(struct hgshm_softc *hsc, hgshm_region_t *rg);
+
+/* Interrupt VM 'index' */
+int hgshm_kernel_notify(struct hgshm_softc *hsc, int index);
+
+/*
+ * Notification queues of this VM, at least 1. Queue 0 is the one above
+ * and the notifier below. Other queues are for user space threads
+ * (HGSHM_QWAIT); queues of another VM can be rung from here.
+ */
+int hgshm_dev_queues(struct hgshm_softc *hsc);
+int hgshm_kernel_notify_queue(struct hgshm_softc *hsc, int index, int queue);
+
+/*
+ * Called from the interrupt handler, in interrupt context, whenever
+ * another VM notifies this one. One consumer per device, -EBUSY if
+ * already taken.
+ */
+int hgshm_register_notifier(struct hgshm_softc *hsc, hgshm_notify_fn_t fn,
+    void *arg);
+void hgshm_unregister_notifier(struct hgshm_softc *hsc);
+
+#endif /* _HGSHM_API_H */
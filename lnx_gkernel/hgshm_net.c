@@ -0,0 +1,733 @@
+/*
+ * hgshm-net: virtual Ethernet interface over hgshm slices.
+ *
+ * Every non-zero index VM (peer) has a point-to-point link with the
+ * zero-index VM (hub) in its own slice: one ring from hub to peer and one
+ * from peer to hub. Peers can only interrupt the hub, so the hub forwards
+ * frames between peers, which makes the interface point-to-multipoint.
+ * MAC addresses are derived from the VM index, so the hub forwards by
+ * destination MAC without learning.
+ *
+ * Frames are copied into the rings whole, including TSO super-frames of
+ * up to 64K, together with their GSO and checksum metadata. A doorbell
+ * is rung only when the consumer has gone idle.
+ *
+ * Load hgshm first, then:
+ *	insmod hgshm_net.ko devnum=<minor of /dev/hgshmN to use>
+ * The hgshm device used for networking should not be used by
+ * applications at the same time.
+ */
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+
+#include "hgshm.h"
+
+MODULE_AUTHOR("Shesha Sreenivasamurthy <shesha@ucsc.edu>");
+MODULE_DESCRIPTION("hgshm-net");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("1");
+
+static int devnum = 0;
+module_param(devnum, int, 0444);
+MODULE_PARM_DESC(devnum, "hgshm device minor to bind to");
+
+#define HGNET_NAME          "hgnet%d"
+#define HGNET_LINK_MAGIC    0x48474e54  /* "HGNT" */
+#define HGNET_LINK_HDR_SIZE (4<<10)     /* link header page in each slice */
+#define HGNET_REC_ALIGN     64
+#define HGNET_REC_WRAP      0xFFFFFFFF  /* rest of the ring is padding */
+#define HGNET_NAPI_WEIGHT   64
+
+#define HGNET_MIN_MTU       68
+#define HGNET_MAX_MTU       65520
+#define HGNET_MAX_FRAME     (64 * 1024 + ETH_HLEN)
+
+/* Locally administered MAC: 02:48:47:<devnum>:00:<index> */
+#define HGNET_MAC0          0x02
+#define HGNET_MAC1          0x48
+#define HGNET_MAC2          0x47
+
+/* hgnet_rec_t flags */
+#define HGNET_F_NEEDS_CSUM  0x1
+#define HGNET_F_DATA_VALID  0x2
+
+/* hgnet_rec_t gso_type */
+#define HGNET_GSO_NONE      0
+#define HGNET_GSO_TCPV4     1
+#define HGNET_GSO_TCPV6     2
+#define HGNET_GSO_ECN       0x80
+
+/* Per frame header in the ring, followed by the frame */
+typedef struct {
+    uint32_t    len;
+    uint16_t    gso_size;
+    uint8_t     gso_type;
+    uint8_t     flags;
+    uint16_t    csum_start;
+    uint16_t    csum_offset;
+    uint32_t    pad;
+} hgnet_rec_t;
+
+/*
+ * Ring indices are free running byte counts. Producer and consumer
+ * words are on separate cache lines so the two VMs do not share a line
+ * in the common path.
+ */
+typedef struct {
+    uint64_t    prod __attribute__((aligned(64)));
+    uint32_t    prod_waiting;   /* producer is out of space */
+    uint64_t    cons __attribute__((aligned(64)));
+    uint32_t    need_kick;      /* consumer is idle, ring the doorbell */
+} hgnet_ring_ctl_t;
+
+/* At offset 0 of the slice of every peer */
+typedef struct {
+    uint32_t    hub_magic __attribute__((aligned(64)));
+    uint32_t    peer_magic __attribute__((aligned(64)));
+    hgnet_ring_ctl_t down;      /* hub to peer */
+    hgnet_ring_ctl_t up;        /* peer to hub */
+} hgnet_link_t;
+
+typedef struct {
+    hgnet_ring_ctl_t *ctl;
+    uint8_t     *data;
+    size_t      size;
+    uint64_t    pos;            /* local copy of our own index */
+} hgnet_ring_t;
+
+typedef struct {
+    int         index;          /* VM at the other end */
+    int         mapped;
+    hgshm_region_t rg;
+    hgnet_link_t *link;
+    hgnet_ring_t tx;
+    hgnet_ring_t rx;
+    spinlock_t  tx_lock;        /* xmit and hub forwarding */
+} hgnet_port_t;
+
+typedef struct {
+    struct net_device   *dev;
+    struct hgshm_softc  *hsc;
+    struct napi_struct  napi;
+    int                 index;
+    int                 hub;
+    int                 nports;
+    hgnet_port_t        ports[HGSHM_MAX_CLIENTS];
+} hgnet_priv_t;
+
+static struct net_device *hgnet_dev;
+
+static inline size_t hgnet_rec_size(size_t len)
+{
+    return ALIGN(sizeof(hgnet_rec_t) + len, HGNET_REC_ALIGN);
+}
+
+static inline int hgnet_mac_index(const uint8_t *mac)
+{
+    if (mac[0] != HGNET_MAC0 || mac[1] != HGNET_MAC1 ||
+        mac[2] != HGNET_MAC2 || mac[3] != devnum)
+        return -1;
+    return mac[5];
+}
+
+static inline int hgnet_port_up(hgnet_port_t *port)
+{
+    return port->mapped && ACCESS_ONCE(port->link->hub_magic) ==
+        HGNET_LINK_MAGIC && ACCESS_ONCE(port->link->peer_magic) ==
+        HGNET_LINK_MAGIC;
+}
+
+static void hgnet_kick(hgnet_priv_t *priv, hgnet_port_t *port)
+{
+    hgshm_kernel_notify(priv->hsc, priv->hub ? port->index : 0);
+}
+
+/*
+ * Producer side
+ */
+static void *hgnet_ring_reserve(hgnet_ring_t *r, size_t recsz)
+{
+    uint64_t cons = ACCESS_ONCE(r->ctl->cons);
+    size_t off = r->pos % r->size;
+    size_t pad = 0;
+    hgnet_rec_t *rec;
+
+    if (off + recsz > r->size)
+        pad = r->size - off;
+    if (r->size - (r->pos - cons) < pad + recsz)
+        return NULL;
+    if (pad) {
+        rec = (hgnet_rec_t *)(r->data + off);
+        rec->len = HGNET_REC_WRAP;
+        r->pos += pad;
+        off = 0;
+    }
+    return r->data + off;
+}
+
+static void hgnet_ring_commit(hgnet_priv_t *priv, hgnet_port_t *port,
+    size_t recsz)
+{
+    hgnet_ring_t *r = &port->tx;
+
+    r->pos += recsz;
+    smp_wmb(); /* frame before index */
+    r->ctl->prod = r->pos;
+    smp_mb();  /* index before need_kick, pairs with hgnet_poll */
+    if (ACCESS_ONCE(r->ctl->need_kick)) {
+        r->ctl->need_kick = 0;
+        hgnet_kick(priv, port);
+    }
+}
+
+static void hgnet_fill_rec(hgnet_rec_t *rec, struct sk_buff *skb)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->len = skb->len;
+    if (skb_is_gso(skb)) {
+        struct skb_shared_info *sinfo = skb_shinfo(skb);
+        rec->gso_size = sinfo->gso_size;
+        if (sinfo->gso_type & SKB_GSO_TCPV4)
+            rec->gso_type = HGNET_GSO_TCPV4;
+        else if (sinfo->gso_type & SKB_GSO_TCPV6)
+            rec->gso_type = HGNET_GSO_TCPV6;
+        if (sinfo->gso_type & SKB_GSO_TCP_ECN)
+            rec->gso_type |= HGNET_GSO_ECN;
+    }
+    if (skb->ip_summed == CHECKSUM_PARTIAL) {
+        rec->flags = HGNET_F_NEEDS_CSUM;
+        rec->csum_start = skb_checksum_start_offset(skb);
+        rec->csum_offset = skb->csum_offset;
+    } else {
+        /* Shared memory does not corrupt frames */
+        rec->flags = HGNET_F_DATA_VALID;
+    }
+}
+
+static int hgnet_tx_skb(hgnet_priv_t *priv, hgnet_port_t *port,
+    struct sk_buff *skb)
+{
+    size_t recsz = hgnet_rec_size(skb->len);
+    hgnet_rec_t *rec;
+
+    spin_lock(&port->tx_lock);
+    if ((rec = hgnet_ring_reserve(&port->tx, recsz)) == NULL) {
+        spin_unlock(&port->tx_lock);
+        return -ENOSPC;
+    }
+    hgnet_fill_rec(rec, skb);
+    skb_copy_bits(skb, 0, rec + 1, skb->len);
+    hgnet_ring_commit(priv, port, recsz);
+    spin_unlock(&port->tx_lock);
+    return 0;
+}
+
+/* Hub only: copy a record from one peer's ring to another's */
+static void hgnet_forward(hgnet_priv_t *priv, hgnet_port_t *port,
+    hgnet_rec_t *src)
+{
+    size_t recsz = hgnet_rec_size(src->len);
+    void *dst;
+
+    spin_lock(&port->tx_lock);
+    if ((dst = hgnet_ring_reserve(&port->tx, recsz)) == NULL) {
+        spin_unlock(&port->tx_lock);
+        priv->dev->stats.tx_dropped++;
+        return;
+    }
+    memcpy(dst, src, sizeof(hgnet_rec_t) + src->len);
+    hgnet_ring_commit(priv, port, recsz);
+    spin_unlock(&port->tx_lock);
+    priv->dev->stats.tx_packets++;
+    priv->dev->stats.tx_bytes += src->len;
+}
+
+/* Room for a maximum sized frame, incl. the padding of a wrap */
+static int hgnet_port_room(hgnet_port_t *port)
+{
+    size_t need = hgnet_rec_size(HGNET_MAX_FRAME) * 2;
+
+    return port->tx.size - (port->tx.pos - ACCESS_ONCE(port->tx.ctl->cons))
+        >= need;
+}
+
+/*
+ * The device has no qdisc (tx_queue_len 0), so hgnet_xmit cannot give a
+ * frame back with NETDEV_TX_BUSY. Stop the queue while there is still
+ * room for one more maximum sized frame instead; hgnet_poll wakes it
+ * when the consumer has made room.
+ */
+static void hgnet_tx_maybe_stop(hgnet_priv_t *priv, hgnet_port_t *port)
+{
+    if (hgnet_port_room(port))
+        return;
+    netif_stop_queue(priv->dev);
+    /* Ask the consumer to kick us when it frees space, then recheck */
+    port->tx.ctl->prod_waiting = 1;
+    smp_mb();
+    if (hgnet_port_room(port))
+        netif_wake_queue(priv->dev);
+}
+
+static netdev_tx_t hgnet_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+    hgnet_priv_t *priv = netdev_priv(dev);
+    struct ethhdr *eth = (struct ethhdr *)skb->data;
+    hgnet_port_t *port = NULL;
+    int i;
+
+    if (priv->hub && is_multicast_ether_addr(eth->h_dest)) {
+        for (i = 1; i < priv->nports; i++) {
+            if (! hgnet_port_up(&priv->ports[i]))
+                continue;
+            if (hgnet_tx_skb(priv, &priv->ports[i], skb))
+                dev->stats.tx_dropped++;
+            hgnet_tx_maybe_stop(priv, &priv->ports[i]);
+        }
+        goto done;
+    }
+
+    if (priv->hub) {
+        i = hgnet_mac_index(eth->h_dest);
+        if (i > 0 && i < priv->nports)
+            port = &priv->ports[i];
+    } else {
+        port = &priv->ports[priv->index];
+    }
+    if (port == NULL || ! hgnet_port_up(port)) {
+        dev->stats.tx_dropped++;
+        goto drop;
+    }
+
+    if (hgnet_tx_skb(priv, port, skb)) {
+        /* Forwarded frames took the room we kept, nowhere to queue it */
+        dev->stats.tx_dropped++;
+        hgnet_tx_maybe_stop(priv, port);
+        goto drop;
+    }
+    hgnet_tx_maybe_stop(priv, port);
+done:
+    dev->stats.tx_packets++;
+    dev->stats.tx_bytes += skb->len;
+drop:
+    dev_kfree_skb(skb);
+    return NETDEV_TX_OK;
+}
+
+/*
+ * Consumer side
+ */
+static void hgnet_rx_deliver(hgnet_priv_t *priv, hgnet_rec_t *rec)
+{
+    struct net_device *dev = priv->dev;
+    struct sk_buff *skb;
+
+    if ((skb = netdev_alloc_skb_ip_align(dev, rec->len)) == NULL) {
+        dev->stats.rx_dropped++;
+        return;
+    }
+    memcpy(skb_put(skb, rec->len), rec + 1, rec->len);
+
+    if (rec->flags & HGNET_F_NEEDS_CSUM) {
+        if (! skb_partial_csum_set(skb, rec->csum_start, rec->csum_offset)) {
+            dev->stats.rx_frame_errors++;
+            dev_kfree_skb(skb);
+            return;
+        }
+    } else if (rec->flags & HGNET_F_DATA_VALID) {
+        skb->ip_summed = CHECKSUM_UNNECESSARY;
+    }
+
+    if (rec->gso_size) {
+        struct skb_shared_info *sinfo = skb_shinfo(skb);
+        switch (rec->gso_type & ~HGNET_GSO_ECN) {
+        case HGNET_GSO_TCPV4:
+            sinfo->gso_type = SKB_GSO_TCPV4;
+            break;
+        case HGNET_GSO_TCPV6:
+            sinfo->gso_type = SKB_GSO_TCPV6;
+            break;
+        default:
+            dev->stats.rx_frame_errors++;
+            dev_kfree_skb(skb);
+            return;
+        }
+        if (rec->gso_type & HGNET_GSO_ECN)
+            sinfo->gso_type |= SKB_GSO_TCP_ECN;
+        /* Header is from another VM, let the stack validate it */
+        sinfo->gso_type |= SKB_GSO_DODGY;
+        sinfo->gso_size = rec->gso_size;
+        sinfo->gso_segs = 0;
+    }
+
+    skb->protocol = eth_type_trans(skb, dev);
+    dev->stats.rx_packets++;
+    dev->stats.rx_bytes += rec->len;
+    netif_receive_skb(skb);
+}
+
+/* Hub only: decide between local delivery and forwarding */
+static void hgnet_rx_route(hgnet_priv_t *priv, hgnet_port_t *from,
+    hgnet_rec_t *rec)
+{
+    struct ethhdr *eth = (struct ethhdr *)(rec + 1);
+    int i;
+
+    if (is_multicast_ether_addr(eth->h_dest)) {
+        for (i = 1; i < priv->nports; i++)
+            if (&priv->ports[i] != from && hgnet_port_up(&priv->ports[i]))
+                hgnet_forward(priv, &priv->ports[i], rec);
+        hgnet_rx_deliver(priv, rec);
+        return;
+    }
+    i = hgnet_mac_index(eth->h_dest);
+    if (i > 0 && i < priv->nports && &priv->ports[i] != from) {
+        if (hgnet_port_up(&priv->ports[i]))
+            hgnet_forward(priv, &priv->ports[i], rec);
+        else
+            priv->dev->stats.tx_dropped++;
+        return;
+    }
+    hgnet_rx_deliver(priv, rec);
+}
+
+static int hgnet_rx_port(hgnet_priv_t *priv, hgnet_port_t *port, int budget)
+{
+    hgnet_ring_t *r = &port->rx;
+    uint64_t prod = ACCESS_ONCE(r->ctl->prod);
+    int work = 0;
+
+    smp_rmb(); /* index before frames */
+    while (r->pos != prod && work < budget) {
+        size_t off = r->pos % r->size;
+        hgnet_rec_t *rec = (hgnet_rec_t *)(r->data + off);
+
+        if (rec->len == HGNET_REC_WRAP) {
+            r->pos += r->size - off;
+            continue;
+        }
+        if (rec->len > HGNET_MAX_FRAME ||
+            off + hgnet_rec_size(rec->len) > r->size) {
+            /* Corrupt ring, drop everything that is queued */
+            priv->dev->stats.rx_frame_errors++;
+            r->pos = prod;
+            break;
+        }
+        if (priv->hub)
+            hgnet_rx_route(priv, port, rec);
+        else
+            hgnet_rx_deliver(priv, rec);
+        r->pos += hgnet_rec_size(rec->len);
+        work++;
+    }
+
+    if (work || r->pos == prod) {
+        smp_mb(); /* done with the frames before handing back space */
+        r->ctl->cons = r->pos;
+        smp_mb();
+        if (ACCESS_ONCE(r->ctl->prod_waiting)) {
+            r->ctl->prod_waiting = 0;
+            hgnet_kick(priv, port);
+        }
+    }
+    return work;
+}
+
+static int hgnet_rx_pending(hgnet_priv_t *priv)
+{
+    int i;
+
+    for (i = 0; i < priv->nports; i++) {
+        hgnet_port_t *port = &priv->ports[i];
+        if (port->mapped && ACCESS_ONCE(port->rx.ctl->prod) != port->rx.pos)
+            return 1;
+    }
+    return 0;
+}
+
+static void hgnet_set_need_kick(hgnet_priv_t *priv, uint32_t val)
+{
+    int i;
+
+    for (i = 0; i < priv->nports; i++)
+        if (priv->ports[i].mapped)
+            priv->ports[i].rx.ctl->need_kick = val;
+}
+
+/* Room for a maximum sized frame on every port that is up */
+static int hgnet_tx_room(hgnet_priv_t *priv)
+{
+    int i;
+
+    for (i = 0; i < priv->nports; i++) {
+        hgnet_port_t *port = &priv->ports[i];
+        if (hgnet_port_up(port) && ! hgnet_port_room(port))
+            return 0;
+    }
+    return 1;
+}
+
+static int hgnet_poll(struct napi_struct *napi, int budget)
+{
+    hgnet_priv_t *priv = container_of(napi, hgnet_priv_t, napi);
+    int work = 0;
+    int i;
+
+    for (i = 0; i < priv->nports && work < budget; i++)
+        if (priv->ports[i].mapped)
+            work += hgnet_rx_port(priv, &priv->ports[i], budget - work);
+
+    /* A doorbell may also mean that a peer consumed from our tx ring */
+    if (netif_queue_stopped(priv->dev) && hgnet_tx_room(priv))
+        netif_wake_queue(priv->dev);
+
+    if (work < budget) {
+        napi_complete(napi);
+        /* Go idle, then recheck so we do not miss a producer */
+        hgnet_set_need_kick(priv, 1);
+        smp_mb();
+        if (hgnet_rx_pending(priv) && napi_reschedule(napi))
+            hgnet_set_need_kick(priv, 0);
+    }
+    return work;
+}
+
+static void hgnet_notify(void *arg)
+{
+    hgnet_priv_t *priv = arg;
+
+    if (napi_schedule_prep(&priv->napi)) {
+        hgnet_set_need_kick(priv, 0);
+        __napi_schedule(&priv->napi);
+    }
+}
+
+/*
+ * Link setup. A side that comes up while the other side is down resets
+ * both rings. Otherwise it keeps the ring it produces into and drops
+ * whatever was queued for it.
+ */
+static void hgnet_port_init(hgnet_priv_t *priv, hgnet_port_t *port)
+{
+    hgnet_link_t *link = port->link;
+    size_t rsize = ((port->rg.size - HGNET_LINK_HDR_SIZE) / 2) &
+        ~(HGNET_REC_ALIGN - 1);
+    uint8_t *base = (uint8_t *)port->rg.vaddr + HGNET_LINK_HDR_SIZE;
+    uint32_t other = priv->hub ? link->peer_magic : link->hub_magic;
+
+    port->tx.ctl = priv->hub ? &link->down : &link->up;
+    port->rx.ctl = priv->hub ? &link->up : &link->down;
+    port->tx.data = priv->hub ? base : base + rsize;
+    port->rx.data = priv->hub ? base + rsize : base;
+    port->tx.size = port->rx.size = rsize;
+
+    if (other != HGNET_LINK_MAGIC) {
+        memset(link, 0, sizeof(*link));
+    }
+    port->tx.pos = port->tx.ctl->prod;
+    port->rx.pos = port->rx.ctl->prod;
+    port->rx.ctl->cons = port->rx.pos;
+    port->tx.ctl->prod_waiting = 0;
+    port->rx.ctl->need_kick = 0;
+    smp_wmb();
+    if (priv->hub)
+        link->hub_magic = HGNET_LINK_MAGIC;
+    else
+        link->peer_magic = HGNET_LINK_MAGIC;
+}
+
+static int hgnet_open(struct net_device *dev)
+{
+    hgnet_priv_t *priv = netdev_priv(dev);
+    int i, err;
+
+    for (i = 0; i < priv->nports; i++)
+        if (priv->ports[i].mapped)
+            hgnet_port_init(priv, &priv->ports[i]);
+
+    napi_enable(&priv->napi);
+    if ((err = hgshm_register_notifier(priv->hsc, hgnet_notify, priv))) {
+        printk(KERN_ERR "%s: hgshm%d is in use\n", dev->name, devnum);
+        napi_disable(&priv->napi);
+        return err;
+    }
+    netif_start_queue(dev);
+    /* Pick up anything queued while we were down and tell the peers */
+    napi_schedule(&priv->napi);
+    for (i = 0; i < priv->nports; i++)
+        if (hgnet_port_up(&priv->ports[i]))
+            hgnet_kick(priv, &priv->ports[i]);
+    return 0;
+}
+
+static int hgnet_stop(struct net_device *dev)
+{
+    hgnet_priv_t *priv = netdev_priv(dev);
+    int i;
+
+    netif_stop_queue(dev);
+    hgshm_unregister_notifier(priv->hsc);
+    napi_disable(&priv->napi);
+    for (i = 0; i < priv->nports; i++) {
+        hgnet_port_t *port = &priv->ports[i];
+        if (! port->mapped)
+            continue;
+        if (priv->hub)
+            port->link->hub_magic = 0;
+        else
+            port->link->peer_magic = 0;
+    }
+    return 0;
+}
+
+static int hgnet_change_mtu(struct net_device *dev, int new_mtu)
+{
+    if (new_mtu < HGNET_MIN_MTU || new_mtu > HGNET_MAX_MTU)
+        return -EINVAL;
+    dev->mtu = new_mtu;
+    return 0;
+}
+
+static const struct net_device_ops hgnet_netdev_ops = {
+    .ndo_open       = hgnet_open,
+    .ndo_stop       = hgnet_stop,
+    .ndo_start_xmit = hgnet_xmit,
+    .ndo_change_mtu = hgnet_change_mtu,
+    .ndo_set_mac_address = eth_mac_addr,
+    .ndo_validate_addr = eth_validate_addr,
+};
+
+static void hgnet_setup(struct net_device *dev)
+{
+    ether_setup(dev);
+    dev->netdev_ops = &hgnet_netdev_ops;
+    dev->mtu = HGNET_MAX_MTU;
+    dev->tx_queue_len = 0;
+    /* Frames are copied by the CPU, GSO and checksums travel as metadata */
+    dev->hw_features = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA |
+        NETIF_F_TSO | NETIF_F_TSO6 | NETIF_F_TSO_ECN;
+    dev->features = dev->hw_features;
+}
+
+static void hgnet_unmap_ports(hgnet_priv_t *priv)
+{
+    int i;
+
+    for (i = 0; i < priv->nports; i++) {
+        if (priv->ports[i].mapped)
+            hgshm_put_slice(priv->hsc, &priv->ports[i].rg);
+        priv->ports[i].mapped = 0;
+    }
+}
+
+static int hgnet_map_port(hgnet_priv_t *priv, int slice)
+{
+    hgnet_port_t *port = &priv->ports[slice];
+    int err;
+
+    if ((err = hgshm_get_slice(priv->hsc, slice, &port->rg)))
+        return err;
+    if (port->rg.size < HGNET_LINK_HDR_SIZE + 4 * HGNET_MAX_FRAME) {
+        printk(KERN_ERR "hgnet: slice %d too small\n", slice);
+        hgshm_put_slice(priv->hsc, &port->rg);
+        return -ENOSPC;
+    }
+    port->index = slice;
+    port->link = port->rg.vaddr;
+    spin_lock_init(&port->tx_lock);
+    port->mapped = 1;
+    return 0;
+}
+
+/*
+ * Hub has a port for each peer slice, a peer has a single port: its
+ * own slice, shared with the hub.
+ */
+static int hgnet_map_ports(hgnet_priv_t *priv)
+{
+    int i, err;
+
+    if (! priv->hub) {
+        priv->nports = priv->index + 1;
+        return hgnet_map_port(priv, priv->index);
+    }
+
+    priv->nports = hgshm_dev_shm_size(priv->hsc) /
+        hgshm_dev_slice_size(priv->hsc);
+    if (priv->nports > HGSHM_MAX_CLIENTS)
+        priv->nports = HGSHM_MAX_CLIENTS;
+    for (i = 1; i < priv->nports; i++) {
+        if ((err = hgnet_map_port(priv, i))) {
+            hgnet_unmap_ports(priv);
+            return err;
+        }
+    }
+    return 0;
+}
+
+static int __init hgnet_init(void)
+{
+    struct net_device *dev;
+    hgnet_priv_t *priv;
+    int err;
+
+    dev = alloc_netdev(sizeof(hgnet_priv_t), HGNET_NAME, hgnet_setup);
+    if (dev == NULL)
+        return -ENOMEM;
+
+    priv = netdev_priv(dev);
+    priv->dev = dev;
+    if ((priv->hsc = hgshm_get_dev(devnum)) == NULL) {
+        printk(KERN_ERR "hgnet: no hgshm%d\n", devnum);
+        free_netdev(dev);
+        return -ENODEV;
+    }
+    priv->index = hgshm_dev_index(priv->hsc);
+    priv->hub = (priv->index == 0);
+
+    if ((err = hgnet_map_ports(priv)))
+        goto put_dev;
+
+    dev->dev_addr[0] = HGNET_MAC0;
+    dev->dev_addr[1] = HGNET_MAC1;
+    dev->dev_addr[2] = HGNET_MAC2;
+    dev->dev_addr[3] = devnum;
+    dev->dev_addr[4] = 0;
+    dev->dev_addr[5] = priv->index;
+
+    netif_napi_add(dev, &priv->napi, hgnet_poll, HGNET_NAPI_WEIGHT);
+    if ((err = register_netdev(dev)))
+        goto unmap;
+
+    printk(KERN_INFO "%s: hgshm%d index %d, %d ports\n", dev->name, devnum,
+        priv->index, priv->hub ? priv->nports - 1 : 1);
+    hgnet_dev = dev;
+    return 0;
+
+unmap:
+    netif_napi_del(&priv->napi);
+    hgnet_unmap_ports(priv);
+put_dev:
+    hgshm_put_dev(priv->hsc);
+    free_netdev(dev);
+    return err;
+}
+
+module_init(hgnet_init);
+
+static void __exit hgnet_exit(void)
+{
+    hgnet_priv_t *priv = netdev_priv(hgnet_dev);
+
+    unregister_netdev(hgnet_dev);
+    netif_napi_del(&priv->napi);
+    hgnet_unmap_ports(priv);
+    hgshm_put_dev(priv->hsc);
+    free_netdev(hgnet_dev);
+}
+
+module_exit(hgnet_exit);
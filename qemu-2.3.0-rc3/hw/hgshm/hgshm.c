@@ -14,15 +14,17 @@
 
 #include "hw/sysbus.h"
 
-static void set_rd_handler(HGShm *hgshm, int efd, int index);
-static int register_fd_notifier(HGShm *hgshm, int efd, int index);
-static void unregister_fd_notifier(HGShm *hgshm, int index);
+static void set_rd_handler(HGShm *hgshm, int efd, int index, int queue);
+static int register_fd_notifier(HGShm *hgshm, int efd, int index,
+    int queue);
+static void unregister_fd_notifier(HGShm *hgshm, int index, int queue);
 static void hgshm_notifier_read(void *opaque);
 static int hgshm_init_pci_bh(HGShm *hgshm);
 
 typedef struct {
     HGShm   *hgshm;
     int     notifier_index;
+    int     queue;
 } handler_arg_t;
 
 /*
@@ -46,6 +48,19 @@ typedef struct {
               to determine shared memory is allowed or not
  * mapidx   : Valid for non-zero index VM, ignored for zero-index.
               Index of the VM whose memory you want to map into bar2
+ * doorbell : Expose the MMIO doorbell page in bar5 (default 1) so that
+              the guest can notify other VMs with a single store
+ * queues   : Notification queues of this VM (default 1, at most
+              HGSHM_MAX_QUEUES), each with its own doorbell and MSI-X
+              vector. More than one needs the doorbell
+ * fullview : Valid for non-zero index VM with guestmmap, ignored for
+              zero-index. bar3 maps the whole region instead of slice
+              mapidx: slice 0 read-write as before, every other slice
+              read-only, so buffers the mapper built anywhere can be
+              read in place instead of being copied into each slice.
+              bar3 is capped at MAXSLICESZ like the slice, so only
+              the start of the region is seen; if slice 0 alone
+              reaches the cap bar3 stays slice mapidx
  */
 static Property hgshm_properties[] = {
 	DEFINE_PROP_STRING("size", HGShm, sizestr),
@@ -56,6 +71,9 @@ static Property hgshm_properties[] = {
 	DEFINE_PROP_CHR("chardev", HGShm, chardev),
 	DEFINE_PROP_INT32("mapidx", HGShm, mapidx, -1),
 	DEFINE_PROP_UINT8("clients", HGShm, clients, NUM_CLIENTS),
+	DEFINE_PROP_UINT8("doorbell", HGShm, doorbell, 1),
+	DEFINE_PROP_UINT8("queues", HGShm, queues, 1),
+	DEFINE_PROP_UINT8("fullview", HGShm, fullview, 0),
 	DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -89,21 +107,26 @@ static size_t get_slice_size(size_t shmsize, int clients)
  * efds are stored indexed by client ID. When running, on
  * the client, index that we need is self index.
  * Storing happens in set_rd_handler.
+ *
+ * One efd is sent per queue of the sender. Only the one for queue 0
+ * asks index 0 for its efds.
  */
-static int send_efd(HGShm *hgshm, int client_index)
+static int send_efd(HGShm *hgshm, int client_index, int queue)
 {
     ivm_pdu_t pdu;
     bzero(&pdu, sizeof(ivm_pdu_t));
     int efd = eventfd(0, 0);
     if (efd <= 0)
         return -1;
-    set_rd_handler(hgshm, efd, client_index);
+    set_rd_handler(hgshm, efd, client_index, queue);
     pdu.index = hgshm->index;
     pdu.efd_type = EFD_MEM_IO;
+    pdu.queue = queue;
+    pdu.queues = hgshm->queues;
     if (hgshm->index == 0) {
         pdu.shmsize = hgshm->size;
         pdu.clients = hgshm->clients;
-    } else {
+    } else if (queue == 0) {
         pdu.needefd = 1; /* Asking index 0 to send efds */
     }
     if (qemu_chr_fe_send_msgfd(hgshm->chardev, efd,
@@ -119,7 +142,10 @@ hgshm_pci_reset(DeviceState *d)
 static void
 hgshm_exit_pci(PCIDevice *pci_dev)
 {
-	DO_UPCAST(HGShm, pci_dev, pci_dev);
+	HGShm *hgshm = DO_UPCAST(HGShm, pci_dev, pci_dev);
+
+	if (msix_present(pci_dev))
+		msix_uninit(pci_dev, &hgshm->bar5, &hgshm->bar5);
 }
 
 static void
@@ -171,15 +197,23 @@ hgshm_iomem_read(void *opaque, hwaddr addr,
 		case HGSHM_IDX_REG:
 			regval = hgshm->registers.idx;
 			break;
+		case HGSHM_QUEUES_REG:
+			regval = hgshm->registers.queues;
+			break;
+		case HGSHM_QPENDING_REG:
+			regval = hgshm->registers.qpending;
+			hgshm->registers.qpending = 0;
+			break;
 	}
 	return (uint64_t)regval;
 }
 
 static void
-notify_explicit(HGShm *hgshm, int index)
+notify_explicit(HGShm *hgshm, int index, int queue)
 {
 	uint64_t value = 1;
-	int efd = event_notifier_get_fd(&hgshm->notifiers[index][EFD_MEM_IO]);
+	int efd = event_notifier_get_fd(
+		&hgshm->notifiers[index][queue][EFD_MEM_IO]);
 	if (efd > 0)
 		if (write(efd, &value, sizeof(value)) < 0)
 		    error_report("Write failed in notify_explicit: %s", hgshm->shmid);
@@ -202,6 +236,8 @@ hgshm_iomem_write(void *opaque, hwaddr addr, uint64_t val,
 		case HGSHM_SHM_SIZE_REG:
 		case HGSHM_SHM_SLICE_SIZE_REG:
 		case HGSHM_IDX_REG:
+		case HGSHM_QUEUES_REG:
+		case HGSHM_QPENDING_REG:
 			break;
 		case HGSHM_USER_IO_NOTIFY_REG:
 		/*
@@ -211,7 +247,7 @@ hgshm_iomem_write(void *opaque, hwaddr addr, uint64_t val,
 		 * write will cause VM exit and qemu will get control here. In
 		 * that case, explicity notify the external program.
 		 */
-			notify_explicit(hgshm, index);
+			notify_explicit(hgshm, index, 0);
 			break;
 		case HGSHM_ISR_REG:
 			hgshm->registers.isr = (uint8_t)val;
@@ -234,6 +270,44 @@ static const MemoryRegionOps hgshm_iomem_ops = {
 		},
 };
 
+static uint64_t
+hgshm_doorbell_read(void *opaque, hwaddr addr,
+	unsigned size)
+{
+	return 0;
+}
+
+static void
+hgshm_doorbell_write(void *opaque, hwaddr addr, uint64_t val,
+	 unsigned size)
+{
+	HGShm *hgshm = (HGShm *)opaque;
+    int index = addr / HGSHM_DOORBELL_STRIDE;
+    int queue = 0;
+
+    if (addr >= HGSHM_QDOORBELL_OFF) {
+        index = (addr - HGSHM_QDOORBELL_OFF) / HGSHM_DOORBELL_STRIDE;
+        queue = index % HGSHM_MAX_QUEUES;
+        index /= HGSHM_MAX_QUEUES;
+    }
+    /*
+     * Same as HGSHM_USER_IO_NOTIFY_REG: normally KVM signals the
+     * event fd directly and we never get here.
+     */
+    if (index < MAX_CLIENTS)
+        notify_explicit(hgshm, index, queue);
+}
+
+static const MemoryRegionOps hgshm_doorbell_ops = {
+	.read = hgshm_doorbell_read,
+	.write = hgshm_doorbell_write,
+	.endianness = DEVICE_LITTLE_ENDIAN,
+	.impl = {
+		.min_access_size = 4,
+		.max_access_size = 4,
+		},
+};
+
 static void
 hgshm_char_event(void *arg, int event)
 { }
@@ -266,14 +340,23 @@ hgshm_char_read(void *arg, const uint8_t *buf, int size)
 	int efd =  qemu_chr_fe_get_msgfd(hgshm->chardev);
     ivm_pdu_t *pdu = (ivm_pdu_t *)buf;
 
-    error_report("efd: %d, index: %d, type: %d, shmsize: %d, clients: %d",
-        efd, pdu->index, pdu->efd_type, (int)pdu->shmsize, pdu->clients);
+    error_report("efd: %d, index: %d, type: %d, shmsize: %d, clients: %d, "
+        "queue: %d/%d", efd, pdu->index, pdu->efd_type, (int)pdu->shmsize,
+        pdu->clients, pdu->queue, pdu->queues);
 
+    if (pdu->queue < 0 || pdu->queue >= HGSHM_MAX_QUEUES) {
+        error_report("Bad queue %d from %d", pdu->queue, pdu->index);
+        close(efd);
+        return;
+    }
     if (pdu->efd_type == EFD_MEM_IO) {
-        if (hgshm->index != 0) {
+        /* The first efd from index 0 carries the sizes */
+        if (hgshm->index != 0 && pdu->queue == 0) {
             hgshm->size = get_slice_size(pdu->shmsize, pdu->clients);
             /* For non-zero index, size = slice_size */
 	        hgshm->registers.shm_slice_size = hgshm->size;
+            hgshm->shmsize = pdu->shmsize;
+            /* Also caps the fullview bar3, see hgshm_init_pci_bh() */
             if (hgshm->registers.shm_slice_size > (MAXSLICESZ)) {
                 printf("Down sizing slice size to 0x%X from 0x%lX\n",
                     MAXSLICESZ, hgshm->size);
@@ -287,15 +370,19 @@ hgshm_char_read(void *arg, const uint8_t *buf, int size)
             }
             hgshm_init_pci_bh(hgshm);
         }
-        register_fd_notifier(hgshm, efd, pdu->index);
+        register_fd_notifier(hgshm, efd, pdu->index, pdu->queue);
     } else if (pdu->efd_type == EFD_RD_HANDLER) {
-        set_rd_handler(hgshm, efd, pdu->index);
+        set_rd_handler(hgshm, efd, pdu->index, pdu->queue);
     }
 
     if (hgshm->index == 0) {
-        if (pdu->needefd && send_efd(hgshm, pdu->index))
-            error_report("Sending EFD to %d failed!", pdu->index);
-    } else {
+        int q;
+
+        for (q = 0; pdu->needefd && q < hgshm->queues; q++)
+            if (send_efd(hgshm, pdu->index, q))
+                error_report("Sending EFD %d to %d failed!", q, pdu->index);
+    } else if (pdu->queue >= pdu->queues - 1) {
+        /* That was the last of index 0's queues */
         qemu_chr_delete(hgshm->chardev);
     }
 }
@@ -330,39 +417,69 @@ static char *get_uuid_str(uint8_t* uuid)
 	return uuid_str;
 }
 
+/*
+ * With MSI-X every queue has its own vector. With INTx the queues share
+ * the line and HGSHM_QPENDING_REG tells the guest which ones fired.
+ */
 static void hgshm_notifier_read(void *opaque)
 {
     handler_arg_t *harg = (handler_arg_t *)opaque;
 	HGShm *hgshm = harg->hgshm;
     int index = harg->notifier_index;
+    int queue = harg->queue;
 
-	event_notifier_test_and_clear(&hgshm->notifiers[index][EFD_RD_HANDLER]);
+	event_notifier_test_and_clear(
+		&hgshm->notifiers[index][queue][EFD_RD_HANDLER]);
+    if (msix_enabled(&hgshm->pci_dev)) {
+        msix_notify(&hgshm->pci_dev, queue);
+        return;
+    }
+    hgshm->registers.qpending |= 1U << queue;
 	update_intr(hgshm, 1);
 }
 
-static void set_rd_handler(HGShm *hgshm, int efd, int index)
+static void set_rd_handler(HGShm *hgshm, int efd, int index, int queue)
 {
     handler_arg_t *harg = malloc(sizeof(handler_arg_t));
+    EventNotifier *n = &hgshm->notifiers[index][queue][EFD_RD_HANDLER];
 
     harg->hgshm = hgshm;
     harg->notifier_index = index;
+    harg->queue = queue;
 
-    if (hgshm->notifiers[index][EFD_RD_HANDLER].rfd > 0) { /* Unregister */
-        qemu_set_fd_handler(hgshm->notifiers[index][EFD_RD_HANDLER].rfd,
-            NULL, NULL, NULL);
+    if (n->rfd > 0) { /* Unregister */
+        qemu_set_fd_handler(n->rfd, NULL, NULL, NULL);
     }
-    hgshm->notifiers[index][EFD_RD_HANDLER].rfd = efd;
+    n->rfd = efd;
     qemu_set_fd_handler(efd, hgshm_notifier_read, NULL, harg);
 }
 
-static void unregister_fd_notifier(HGShm *hgshm, int index)
+/* Offset in bar_doorbell that rings queue of index */
+static hwaddr doorbell_offset(int index, int queue)
+{
+    if (queue == 0)
+        return index * HGSHM_DOORBELL_STRIDE;
+    return HGSHM_QDOORBELL_OFF +
+        (index * HGSHM_MAX_QUEUES + queue) * HGSHM_DOORBELL_STRIDE;
+}
+
+static void unregister_fd_notifier(HGShm *hgshm, int index, int queue)
 {
     uint32_t    reg_offset = HGSHM_USER_IO_NOTIFY_REG + index;
-	memory_region_del_eventfd(&hgshm->bar_iomem, reg_offset,
-		1, true, 1, &hgshm->notifiers[index][EFD_MEM_IO]);
+    EventNotifier *n = &hgshm->notifiers[index][queue][EFD_MEM_IO];
+
+    if (queue == 0)
+	    memory_region_del_eventfd(&hgshm->bar_iomem, reg_offset,
+		    1, true, 1, n);
+    if (hgshm->doorbell) {
+        memory_region_del_eventfd(&hgshm->bar_doorbell,
+            doorbell_offset(index, queue), HGSHM_DOORBELL_STRIDE,
+            false, 0, n);
+    }
 }
 
-static int register_fd_notifier(HGShm *hgshm, int efd, int index)
+static int register_fd_notifier(HGShm *hgshm, int efd, int index,
+    int queue)
 {
 	/*
 	 * memory_region_add_eventfd evenetually calls kvm_set_ioeventfd_pio_word
@@ -373,12 +490,30 @@ static int register_fd_notifier(HGShm *hgshm, int efd, int index)
 	 * signaled by KVM.
 	 */
     uint32_t    reg_offset = HGSHM_USER_IO_NOTIFY_REG + index;
-    if (hgshm->notifiers[index][EFD_MEM_IO].rfd > 0) {
-        unregister_fd_notifier(hgshm, index);
+    EventNotifier *n = &hgshm->notifiers[index][queue][EFD_MEM_IO];
+
+    /* Queues past 0 can only be rung through the doorbell */
+    if (queue != 0 && !hgshm->doorbell) {
+        error_report("No doorbell for queue %d of %d", queue, index);
+        close(efd);
+        return -1;
+    }
+    if (n->rfd > 0) {
+        unregister_fd_notifier(hgshm, index, queue);
+    }
+    n->rfd = efd;
+    if (queue == 0)
+	    memory_region_add_eventfd(&hgshm->bar_iomem, reg_offset,
+		    1, true, 1, n);
+    /*
+     * The doorbell register fires on any value, so the guest only needs
+     * a single 32-bit store without a data match.
+     */
+    if (hgshm->doorbell) {
+        memory_region_add_eventfd(&hgshm->bar_doorbell,
+            doorbell_offset(index, queue), HGSHM_DOORBELL_STRIDE,
+            false, 0, n);
     }
-    hgshm->notifiers[index][EFD_MEM_IO].rfd = efd;
-	memory_region_add_eventfd(&hgshm->bar_iomem, reg_offset,
-		1, true, 1, &hgshm->notifiers[index][EFD_MEM_IO]);
 	return 0;
 }
 
@@ -450,7 +585,48 @@ static int hgshm_init_pci_bh(HGShm *hgshm)
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &hgshm->bar_shmem);
 
-    if (hgshm->index != 0 && hgshm->mapidx >= 0 &&
+    if (hgshm->index != 0 && hgshm->fullview && hgshm->guestmmap &&
+        hgshm->registers.shm_slice_size < MAXSLICESZ &&
+        hgshm->shmsize > hgshm->registers.shm_slice_size) {
+        size_t slicesz = hgshm->registers.shm_slice_size;
+        /* Same MAXSLICESZ cap as the slice, HGSHM_GET_VIEW_SIZE says so */
+        size_t viewsz = (hgshm->shmsize > MAXSLICESZ) ?
+            MAXSLICESZ : hgshm->shmsize;
+
+        /*
+         * KVM takes readonly from the RAM region itself, not from an
+         * alias of it, so the read-only part is its own region backed by
+         * a PROT_READ mapping: KVM maps it read-only and even qemu
+         * cannot write it.
+         */
+        hgshm->shmem_slice_map = mmap(0, slicesz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_LOCKED, fd, 0);
+        hgshm->shmem_view_ro_map = mmap(0, viewsz - slicesz,
+            PROT_READ, MAP_SHARED|MAP_LOCKED, fd, slicesz);
+        if (hgshm->shmem_slice_map == MAP_FAILED ||
+            hgshm->shmem_view_ro_map == MAP_FAILED) {
+            perror("");
+            error_report("Could not map the full view: %s", hgshm->shmid);
+            exit(1);
+        }
+
+        memory_region_init(&hgshm->bar_slice, OBJECT(hgshm), "shmem_view",
+            viewsz);
+        memory_region_init_ram_ptr(&hgshm->view_rw, OBJECT(hgshm),
+            "shmem_view_rw", slicesz, hgshm->shmem_slice_map);
+        memory_region_init_ram_ptr(&hgshm->view_ro, OBJECT(hgshm),
+            "shmem_view_ro", viewsz - slicesz,
+            hgshm->shmem_view_ro_map);
+        memory_region_set_readonly(&hgshm->view_ro, true);
+        memory_region_add_subregion(&hgshm->bar_slice, 0, &hgshm->view_rw);
+        memory_region_add_subregion(&hgshm->bar_slice, slicesz,
+            &hgshm->view_ro);
+
+        pci_register_bar(&hgshm->pci_dev, HSGHM_SLICE_I_BAR,
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
+            &hgshm->bar_slice);
+        set_feature(hgshm, HGSHM_FEATURE_FULL_VIEW);
+    } else if (hgshm->index != 0 && hgshm->mapidx >= 0 &&
         (hgshm->mapidx != hgshm->index) && hgshm->guestmmap) {
 
         uint32_t slicesz = hgshm->registers.shm_slice_size;
@@ -478,6 +654,32 @@ static int hgshm_init_pci_bh(HGShm *hgshm)
 	pci_register_bar(&hgshm->pci_dev, HGSHM_IO_BAR,
         PCI_BASE_ADDRESS_SPACE_IO, &hgshm->bar_iomem);
 
+    /*
+     * bar5: the doorbell pages, then the MSI-X table with one vector per
+     * queue. If MSI-X is missing, or the guest does not enable it, the
+     * queues share INTx.
+     */
+    if (hgshm->doorbell) {
+        int q;
+
+        memory_region_init(&hgshm->bar5, OBJECT(hgshm), "hgshm-bar5",
+            HGSHM_BAR5_SIZE);
+        memory_region_init_io(&hgshm->bar_doorbell, OBJECT(hgshm),
+            &hgshm_doorbell_ops, hgshm, "hgshm-doorbell",
+            HGSHM_QDOORBELL_OFF + HGSHM_DOORBELL_SIZE);
+        memory_region_add_subregion(&hgshm->bar5, 0, &hgshm->bar_doorbell);
+        if (msix_init(&hgshm->pci_dev, hgshm->queues,
+            &hgshm->bar5, HGSHM_DOORBELL_BAR, HGSHM_MSIX_TABLE_OFF,
+            &hgshm->bar5, HGSHM_DOORBELL_BAR, HGSHM_MSIX_PBA_OFF, 0) == 0) {
+            for (q = 0; q < hgshm->queues; q++)
+                msix_vector_use(&hgshm->pci_dev, q);
+        } else {
+            error_report("MSI-X init failed, queues share INTx");
+        }
+        pci_register_bar(&hgshm->pci_dev, HGSHM_DOORBELL_BAR,
+            PCI_BASE_ADDRESS_SPACE_MEMORY, &hgshm->bar5);
+    }
+
 	close(fd);
 	hgshm->pci_dev.config[PCI_INTERRUPT_PIN] = 1; /* interrupt pin A */
     return 0;
@@ -568,6 +770,18 @@ static int hgshm_init_pci(PCIDevice *pci_dev)
         if (hgshm->chardev) {
             error_report("Character dev ignored for nonzero index");
         }
+        if (hgshm->fullview && !hgshm->guestmmap) {
+            error_report("fullview needs guestmmap, ignored");
+            hgshm->fullview = 0;
+        }
+    }
+    if (hgshm->queues < 1 || hgshm->queues > HGSHM_MAX_QUEUES) {
+        error_report("queues should be 1 to %d", HGSHM_MAX_QUEUES);
+        return -1;
+    }
+    if (hgshm->queues > 1 && !hgshm->doorbell) {
+        error_report("More than one queue needs the doorbell, using 1");
+        hgshm->queues = 1;
     }
 
 	hgshm->registers.shm_size = hgshm->size;
@@ -575,6 +789,7 @@ static int hgshm_init_pci(PCIDevice *pci_dev)
 	hgshm->registers.irq = 1;
     /* Remember index */
 	hgshm->registers.idx = hgshm->index;
+	hgshm->registers.queues = hgshm->queues;
     /* Slice size will be populated later for non-zero index VMs */
 	hgshm->registers.shm_slice_size = slice_size;
 
@@ -588,6 +803,9 @@ static int hgshm_init_pci(PCIDevice *pci_dev)
 	if (hgshm->guestmmap)
 		set_feature(hgshm, HGSHM_FEATURE_GUEST_MMAP);
 
+	if (hgshm->doorbell)
+		set_feature(hgshm, HGSHM_FEATURE_DOORBELL | HGSHM_FEATURE_QUEUES);
+
     if (hgshm->chardev) {
         qemu_chr_add_handlers(hgshm->chardev, hgshm_char_can_read,
             hgshm_char_read, hgshm_char_event, hgshm);
@@ -606,9 +824,13 @@ static int hgshm_init_pci(PCIDevice *pci_dev)
          * response contains total shm size and num clients
          * that is required to calculate the slice size
          */
-        if (send_efd(hgshm, hgshm->index)) {
-            error_report("Sending EFD to master failed!");
-            return -1;
+        int q;
+
+        for (q = 0; q < hgshm->queues; q++) {
+            if (send_efd(hgshm, hgshm->index, q)) {
+                error_report("Sending EFD to master failed!");
+                return -1;
+            }
         }
     }
 	free(uuid_str);
@@ -11,6 +11,8 @@
 #define	HGSHM_ISR_REG			    0x50	/* size 1 */
 #define	HGSHM_IRQ_REG			    0x51	/* size 1 */
 #define	HGSHM_IDX_REG			    0x52	/* size 1 */
+#define	HGSHM_QUEUES_REG		    0x53	/* size 1 */
+#define	HGSHM_QPENDING_REG		    0x54	/* size 4, read clears */
 
 #define	HGSHM_ISR_REG_MASK		0xFF
 #define	HGSHM_IRQ_REG_MASK		0xFF
@@ -26,13 +28,42 @@
 #define	UUID_STR_SIZE			37
 
 #define	HGSHM_FEATURE_GUEST_MMAP	0x1
+#define	HGSHM_FEATURE_DOORBELL		0x2
+#define	HGSHM_FEATURE_QUEUES		0x4
+#define	HGSHM_FEATURE_FULL_VIEW		0x8
 #define LOCK_NAME_LEN			64
 
 #define HGSHM_IO_BAR            0
 #define HGSHM_MEM_BAR           1
 #define HSGHM_SLICE_I_BAR       3
+#define HGSHM_DOORBELL_BAR      5
 #define PAGE_SIZE               (4<<10)
 
+/*
+ * Doorbell page: one 32-bit register per client index. A store to
+ * offset (index * HGSHM_DOORBELL_STRIDE) notifies that client. The page
+ * is backed by the same event fds as the PIO notify registers.
+ */
+#define HGSHM_DOORBELL_STRIDE   4
+#define HGSHM_DOORBELL_SIZE     PAGE_SIZE
+
+/*
+ * Queues. Every VM has 'queues' notification queues (1 to
+ * HGSHM_MAX_QUEUES), each with its own event fd and its own MSI-X
+ * vector, so a guest can have one handler per vCPU. Queue 0 is the
+ * doorbell page above and the PIO notify registers. Queue q of client
+ * index is rung by a store to HGSHM_QDOORBELL_OFF + (index *
+ * HGSHM_MAX_QUEUES + q) * HGSHM_DOORBELL_STRIDE in bar5.
+ *
+ * bar5 is a container: doorbell page, queue doorbell page, then the
+ * MSI-X table and PBA, which guests must not map to user space.
+ */
+#define HGSHM_MAX_QUEUES        16
+#define HGSHM_QDOORBELL_OFF     PAGE_SIZE
+#define HGSHM_MSIX_TABLE_OFF    (2 * PAGE_SIZE)
+#define HGSHM_MSIX_PBA_OFF      (3 * PAGE_SIZE)
+#define HGSHM_BAR5_SIZE         (4 * PAGE_SIZE)
+
 /* Efd type */
 #define EFD_RD_HANDLER          0
 #define EFD_MEM_IO              1
@@ -43,6 +74,8 @@ typedef struct {
     int needefd;    /* set when request is from a VM */
     size_t  shmsize; /* Value sent by zero-index VM */
     int     clients; /* Value sent by zero-index VM */
+    int     queue;  /* Queue the efd is for, 0 .. queues - 1 */
+    int     queues; /* Efds the sender sends, one per queue */
 } ivm_pdu_t;
 
 typedef	struct {
@@ -54,7 +87,9 @@ typedef	struct {
 	uint8_t		irq;
 	uint8_t		idx;
 	uint8_t     user_notify[MAX_CLIENTS];
-    char        padding[45];
+	uint8_t		queues;
+	uint32_t	qpending;   /* queues that fired, for INTx */
+    char        padding[40];
 } hgshm_reg_t;
 
 #define	IOMEM_SIZE	(sizeof(hgshm_reg_t))
@@ -64,25 +99,35 @@ typedef struct {
 	CharDriverState *chardev;
 	MemoryRegion	bar_shmem;
 	MemoryRegion	bar_iomem;
+	MemoryRegion	bar_doorbell;   /* doorbell and queue doorbell pages */
+	MemoryRegion	bar5;           /* container, with the MSI-X table */
 	void 		    *shmem_map;
     /* Below 2 fields are used only for non-zero index */
 	MemoryRegion	bar_slice;
 	void 		    *shmem_slice_map;
+    /* fullview: bar_slice holds slice 0 read-write, the rest read-only */
+	MemoryRegion	view_rw;
+	MemoryRegion	view_ro;
+	void 		    *shmem_view_ro_map;
+	size_t		    shmsize;    /* whole region, from index 0 */
 	size_t		    size;
 	char		    *shmid;
 	char		    *sizestr;
 	uint8_t		    unlink;
 	uint8_t		    guestmmap;
+	uint8_t		    doorbell;
+	uint8_t		    queues;
+	uint8_t		    fullview;
 	int             index; /* Self index. 0 for forwarder */
     /* Valid for non-index VM. Index of the the VM whose mem is mapped */
     int             mapidx;
     uint8_t         clients;
 	hgshm_reg_t	    registers;
     /*
-     * Total MAX_CLIENTS, 2 for each.
+     * Total MAX_CLIENTS, HGSHM_MAX_QUEUES each, 2 for each queue.
      * TO_FORWARDER and FROM_FORWARDER
      */
-	EventNotifier	notifiers[MAX_CLIENTS][2];
+	EventNotifier	notifiers[MAX_CLIENTS][HGSHM_MAX_QUEUES][2];
     int             zeroit;
 } HGShm;
 